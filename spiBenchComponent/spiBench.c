@@ -0,0 +1,2182 @@
+#include "legato.h"
+#include "interfaces.h"
+#include "spiLibrary.h"
+#include "spiDirect.h"
+#include "spiWord.h"
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+
+// Benchmarks of spiService, run against its simulator backend (SPI_BACKEND = sim in
+// spiService.adef) so that the results don't depend on the hardware:
+//
+//   app runProc spiBench spiBench -- <benchmark> [arguments]
+//
+// Each benchmark prints a table to stdout.  Checks, such as widths, print the outcome of each case
+// and exit with a failure status if any case fails.
+
+// Clock speed the benchmarks configure the simulated devices for
+#define BENCH_SPEED_HZ 10000000
+// Most buses the multi-bus benchmark drives at once
+#define BENCH_MAX_BUSES 8
+// Size of the buffer holding a simulated device name
+#define BENCH_DEVICE_NAME_BYTES 16
+// Most samples a latency benchmark takes of each case
+#define BENCH_MAX_SAMPLES 100000
+// App restarted by the recovery benchmark
+#define BENCH_SERVICE_APP "spiService"
+// Clock speed of the width checks, slow enough for the wire time to dominate their timing
+#define BENCH_WIDTHS_SPEED_HZ 250000
+// Bytes of each transfer of the width checks
+#define BENCH_WIDTHS_BYTES SPI_MAX_WRITE_SIZE
+// Simulated device whose driver wedges, and the length of the transfers made on it
+#define BENCH_FAULT_DEVICE "simfault0"
+#define BENCH_FAULT_TRANSFER_BYTES 4
+
+// Bytes of the transfers and shared buffer of the API benchmark
+#define BENCH_API_BYTES 16
+#define BENCH_API_BUFFER_BYTES 4096
+// Register of the register file model which the API benchmark reads and writes
+#define BENCH_API_REGISTER 5
+#define BENCH_API_SAMPLE_PERIOD_USECS 1000
+// Command byte and read flag of the register file model
+#define BENCH_REG_READ_FLAG 0x80
+#define BENCH_API_READ_COMMAND (BENCH_REG_READ_FLAG | BENCH_API_REGISTER)
+
+// Simulated flash chip of the flash benchmark, the most it erases and programs, and the command
+// which reads its status register
+#define BENCH_FLASH_DEVICE "simflash0"
+#define BENCH_FLASH_MAX_KIB 1024
+#define BENCH_FLASH_READ_STATUS 0x05
+
+// Bytes written and read by each transfer of the trace benchmark
+#define BENCH_TRACE_BYTES 16
+
+// Most words converted by the word checks, a length which isn't a multiple of any vector width
+#define BENCH_WORDS_MAX 67
+
+// File sealing constants of Linux 3.17, which older C libraries lack
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+// Heading of the tables printed by printLatencies
+#define LATENCY_HEADER "%-24s  p50 (us)  p90 (us)  p99 (us)  max (us)  per sec\n"
+
+#define USECS_PER_SEC 1000000ULL
+
+
+// A benchmark, selected by the first argument
+typedef struct
+{
+    const char* name;
+    const char* usage;         ///< Arguments after the name
+    void (*run)(void);
+} Benchmark_t;
+
+// A thread of the multi-bus benchmark, performing transfers on a handle of its own
+typedef struct
+{
+    char deviceName[BENCH_DEVICE_NAME_BYTES];
+    size_t transfers;          ///< Number of transfers to perform
+    size_t length;             ///< Bytes of each transfer
+    le_sem_Ref_t ready;        ///< Posted once the handle is open
+    le_sem_Ref_t start;        ///< Waited on before the first transfer
+    le_result_t result;
+} BusThread_t;
+
+// State shared by the calls of the API benchmark: a loopback handle with a shared buffer attached,
+// a register file handle with a cached register map, and objects for the calls which need them
+typedef struct
+{
+    spi_DeviceHandleRef_t loop;
+    spi_DeviceHandleRef_t reg;
+    int buffer;                ///< memfd attached to loop as its shared buffer
+    int ring;                  ///< memfd for captures
+    int trace;                 ///< memfd for bus trace exports
+    spi_SamplerHandleRef_t sampler;
+    spi_CaptureHandleRef_t capture;
+    spi_ProgramHandleRef_t program;
+    bool completed;            ///< Set by the handlers of asynchronous transactions
+    le_result_t asyncResult;   ///< Result passed to the handler
+} ApiFixture_t;
+
+// A case of the API benchmark, timing one call or a pair of calls which must go together
+typedef struct
+{
+    const char* name;
+    le_result_t (*call)(ApiFixture_t* fixture);
+    le_result_t (*setup)(ApiFixture_t* fixture);       ///< Run before the case, or NULL
+    void (*teardown)(ApiFixture_t* fixture);           ///< Run after the case, or NULL
+} ApiCase_t;
+
+// The thread of the flash benchmark which uses the flash chip's bus during an erase
+typedef struct
+{
+    le_sem_Ref_t ready;        ///< Posted once the handle is open
+    bool stop;                 ///< Set once the erase has finished
+    uint32_t* samples;         ///< BENCH_MAX_SAMPLES latencies of status reads
+    size_t numSamples;
+    le_result_t result;
+} FlashContender_t;
+
+
+static void benchMultiBus(void);
+static void benchDirect(void);
+static void benchRecovery(void);
+static le_result_t openFaultDevice(spi_DeviceHandleRef_t* handlePtr);
+static void checkWidths(void);
+static void checkWords(void);
+static bool checkWordLength(size_t numWords, uint8_t bits, bool lsbFirst);
+static void packReference(
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t numWords,
+    uint8_t bits,
+    bool lsbFirst);
+static void benchApi(void);
+static void* apiThreadMain(void* context);
+static le_result_t openApiFixture(ApiFixture_t* fixture);
+static void closeApiFixture(ApiFixture_t* fixture);
+static int createSealedBuffer(const char* name, size_t size);
+static void waitForCompletion(ApiFixture_t* fixture);
+static void benchFlash(void);
+static void* flashContenderMain(void* context);
+static void benchTrace(void);
+static void logSegmentBytes(const spiLib_Segment_t* segments, size_t numSegments);
+static void benchRoundTrips(void);
+static le_result_t transferSegment(
+    spi_DeviceHandleRef_t handle,
+    uint32_t flags,
+    uint64_t* elapsedUsecsPtr);
+static void checkResult(const char* name, le_result_t result, le_result_t expected, size_t* failed);
+static uint64_t runBusThreads(
+    size_t numThreads,
+    bool shareBus,
+    size_t transfers,
+    size_t length);
+static void* busThreadMain(void* context);
+static void printLatencies(const char* label, uint32_t* samples, size_t numSamples);
+static int compareSamples(const void* a, const void* b);
+static size_t getArg(size_t index, size_t defaultValue, size_t min, size_t max);
+static uint64_t nowUsecs(void);
+static double kibPerSec(uint64_t bytes, uint64_t usecs);
+static void printUsage(void);
+
+
+static const Benchmark_t benchmarks[] =
+{
+    {
+        "multibus",
+        "[buses] [transfers] [bytes]",
+        benchMultiBus
+    },
+    {
+        "direct",
+        "[transfers]",
+        benchDirect
+    },
+    {
+        "recovery",
+        "[faults]",
+        benchRecovery
+    },
+    {
+        "widths",
+        "",
+        checkWidths
+    },
+    {
+        "words",
+        "",
+        checkWords
+    },
+    {
+        "api",
+        "[calls]",
+        benchApi
+    },
+    {
+        "flash",
+        "[KiB]",
+        benchFlash
+    },
+    {
+        "trace",
+        "[transfers]",
+        benchTrace
+    },
+    {
+        "roundtrips",
+        "[reads] [samples]",
+        benchRoundTrips
+    },
+};
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compares the throughput of full duplex transfers from several threads on handles sharing one
+ * bus with that of the same threads each on a bus of its own.  Transfers on one bus are
+ * serialized, while each bus has a worker thread in the service, so the throughput of separate
+ * buses should grow with their number.
+ */
+//--------------------------------------------------------------------------------------------------
+static void benchMultiBus
+(
+    void
+)
+{
+    const size_t maxBuses = getArg(1, 4, 1, BENCH_MAX_BUSES);
+    const size_t transfers = getArg(2, 200, 1, SIZE_MAX);
+    const size_t length = getArg(3, SPI_MAX_WRITE_SIZE, 1, SPI_MAX_WRITE_SIZE);
+
+    printf("%zu transfers of %zu bytes per thread at %u Hz\n", transfers, length, BENCH_SPEED_HZ);
+    printf("threads  one bus (KiB/s)  bus each (KiB/s)  speedup\n");
+    for (size_t numThreads = 1; numThreads <= maxBuses; numThreads++)
+    {
+        const uint64_t sharedUsecs = runBusThreads(numThreads, true, transfers, length);
+        const uint64_t separateUsecs = runBusThreads(numThreads, false, transfers, length);
+        if (sharedUsecs == 0 || separateUsecs == 0)
+        {
+            printf("%7zu  failed\n", numThreads);
+            return;
+        }
+
+        const uint64_t bytes = (uint64_t)numThreads * transfers * length;
+        printf("%7zu  %15.0f  %16.0f  %7.2f\n",
+               numThreads,
+               kibPerSec(bytes, sharedUsecs),
+               kibPerSec(bytes, separateUsecs),
+               (double)sharedUsecs / separateUsecs);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs threads which each open a simulated loopback device and perform transfers on it, all
+ * starting together.
+ *
+ * @return
+ *      The time from the start to the last thread finishing in microseconds, or 0 if a thread
+ *      failed.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint64_t runBusThreads
+(
+    size_t numThreads,   ///< Number of threads
+    bool shareBus,       ///< All threads use the same device, and so the same bus
+    size_t transfers,    ///< Transfers per thread
+    size_t length        ///< Bytes of each transfer
+)
+{
+    BusThread_t threads[BENCH_MAX_BUSES];
+    le_thread_Ref_t refs[BENCH_MAX_BUSES];
+    le_sem_Ref_t ready = le_sem_Create("BenchReady", 0);
+    le_sem_Ref_t start = le_sem_Create("BenchStart", 0);
+
+    for (size_t i = 0; i < numThreads; i++)
+    {
+        snprintf(threads[i].deviceName, sizeof(threads[i].deviceName), "sim%zu", shareBus ? 0 : i);
+        threads[i].transfers = transfers;
+        threads[i].length = length;
+        threads[i].ready = ready;
+        threads[i].start = start;
+        threads[i].result = LE_FAULT;
+        refs[i] = le_thread_Create(threads[i].deviceName, busThreadMain, &threads[i]);
+        le_thread_SetJoinable(refs[i]);
+        le_thread_Start(refs[i]);
+    }
+    for (size_t i = 0; i < numThreads; i++)
+    {
+        le_sem_Wait(ready);
+    }
+
+    const uint64_t startUsecs = nowUsecs();
+    for (size_t i = 0; i < numThreads; i++)
+    {
+        le_sem_Post(start);
+    }
+    bool failed = false;
+    for (size_t i = 0; i < numThreads; i++)
+    {
+        le_thread_Join(refs[i], NULL);
+        if (threads[i].result != LE_OK)
+        {
+            fprintf(stderr,
+                    "Transfers on %s failed (%s)\n",
+                    threads[i].deviceName,
+                    LE_RESULT_TXT(threads[i].result));
+            failed = true;
+        }
+    }
+    const uint64_t elapsedUsecs = nowUsecs() - startUsecs;
+
+    le_sem_Delete(ready);
+    le_sem_Delete(start);
+    return failed ? 0 : elapsedUsecs;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Main function of a thread of runBusThreads.  Each thread has its own session with the service.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* busThreadMain
+(
+    void* context   ///< BusThread_t
+)
+{
+    BusThread_t* thread = context;
+    uint8_t writeData[SPI_MAX_WRITE_SIZE];
+    uint8_t readData[SPI_MAX_READ_SIZE];
+    memset(writeData, 0xA5, sizeof(writeData));
+
+    spi_ConnectService();
+    spi_DeviceHandleRef_t handle = NULL;
+    le_result_t result = spi_Open(thread->deviceName, &handle);
+    if (result == LE_OK)
+    {
+        result = spi_Configure(handle, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0);
+    }
+    le_sem_Post(thread->ready);
+    le_sem_Wait(thread->start);
+
+    for (size_t i = 0; i < thread->transfers && result == LE_OK; i++)
+    {
+        size_t readDataLength = thread->length;
+        result = spi_WriteReadFD(handle, writeData, thread->length, readData, &readDataLength);
+    }
+
+    if (handle != NULL)
+    {
+        spi_Close(handle);
+    }
+    spi_DisconnectService();
+    thread->result = result;
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compares the latency of register reads through spiService with that of the same reads through
+ * spiDirect in this process.  Both paths run against a simulated loopback device at the same
+ * speed, so the difference is the cost of the IPC round trip and the service's queueing.
+ */
+//--------------------------------------------------------------------------------------------------
+static void benchDirect
+(
+    void
+)
+{
+    static const size_t readLengths[] = { 1, 16, 256 };
+    const size_t transfers = getArg(1, 1000, 1, BENCH_MAX_SAMPLES);
+    uint32_t* samples = calloc(transfers, sizeof(*samples));
+    LE_ASSERT(samples != NULL);
+    const uint8_t command = 0x80;
+    uint8_t readData[SPI_MAX_READ_SIZE];
+
+    // The simulator of this process is independent of the service's, so both can open sim0
+    spiLib_SetBackend(&spiLib_SimBackend);
+    spiDirect_HandleRef_t direct = NULL;
+    spi_DeviceHandleRef_t service = NULL;
+    if (spiDirect_Open("sim0", &direct) != LE_OK ||
+        spiDirect_Configure(direct, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0) != LE_OK ||
+        spi_Open("sim0", &service) != LE_OK ||
+        spi_Configure(service, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0) != LE_OK)
+    {
+        fprintf(stderr, "Couldn't open sim0 both directly and through spiService\n");
+        goto done;
+    }
+
+    printf("%zu reads of a 1 byte command at %u Hz\n", transfers, BENCH_SPEED_HZ);
+    printf(LATENCY_HEADER, "read");
+    for (size_t i = 0; i < NUM_ARRAY_MEMBERS(readLengths); i++)
+    {
+        char label[32];
+        for (size_t t = 0; t < transfers; t++)
+        {
+            size_t readDataLength = readLengths[i];
+            const uint64_t startUsecs = nowUsecs();
+            LE_ASSERT_OK(spi_WriteReadHD(service, &command, 1, readData, &readDataLength));
+            samples[t] = nowUsecs() - startUsecs;
+        }
+        snprintf(label, sizeof(label), "%zu bytes spiService", readLengths[i]);
+        printLatencies(label, samples, transfers);
+
+        for (size_t t = 0; t < transfers; t++)
+        {
+            size_t readDataLength = readLengths[i];
+            const uint64_t startUsecs = nowUsecs();
+            LE_ASSERT_OK(spiDirect_WriteReadHD(direct, &command, 1, readData, &readDataLength));
+            samples[t] = nowUsecs() - startUsecs;
+        }
+        snprintf(label, sizeof(label), "%zu bytes spiDirect", readLengths[i]);
+        printLatencies(label, samples, transfers);
+    }
+
+done:
+    if (service != NULL)
+    {
+        spi_Close(service);
+    }
+    if (direct != NULL)
+    {
+        spiDirect_Close(direct);
+    }
+    free(samples);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compares the outage a wedged driver causes when spiService reopens the device itself with the
+ * outage when the service is restarted instead.  The first is measured from the start of the
+ * transfer which fails until the end of the next one, which succeeds on the reopened device; the
+ * second from the start of the restart until the client has reconnected, reopened and
+ * reconfigured its handle and completed a transfer.
+ */
+//--------------------------------------------------------------------------------------------------
+static void benchRecovery
+(
+    void
+)
+{
+    const size_t faults = getArg(1, 20, 1, BENCH_MAX_SAMPLES);
+    uint32_t* recoverySamples = calloc(faults, sizeof(*recoverySamples));
+    uint32_t* restartSamples = calloc(faults, sizeof(*restartSamples));
+    LE_ASSERT(recoverySamples != NULL && restartSamples != NULL);
+    uint8_t writeData[BENCH_FAULT_TRANSFER_BYTES] = { 0 };
+    uint8_t readData[BENCH_FAULT_TRANSFER_BYTES];
+    size_t readDataLength = sizeof(readData);
+
+    spi_DeviceHandleRef_t handle = NULL;
+    le_result_t result = openFaultDevice(&handle);
+    for (size_t f = 0; f < faults && result == LE_OK; f++)
+    {
+        uint64_t startUsecs;
+        do
+        {
+            startUsecs = nowUsecs();
+            result =
+                spi_WriteReadFD(handle, writeData, sizeof(writeData), readData, &readDataLength);
+        } while (result == LE_OK);
+
+        if (result == LE_FAULT)
+        {
+            result =
+                spi_WriteReadFD(handle, writeData, sizeof(writeData), readData, &readDataLength);
+        }
+        else
+        {
+            result = LE_FAULT;
+        }
+        recoverySamples[f] = nowUsecs() - startUsecs;
+    }
+    if (result != LE_OK)
+    {
+        fprintf(stderr,
+                "spiService didn't recover %s (%s)\n",
+                BENCH_FAULT_DEVICE,
+                LE_RESULT_TXT(result));
+        goto done;
+    }
+
+    for (size_t f = 0; f < faults && result == LE_OK; f++)
+    {
+        const uint64_t startUsecs = nowUsecs();
+        // Closing the session closes the handle
+        spi_DisconnectService();
+        handle = NULL;
+        result = le_appCtrl_Stop(BENCH_SERVICE_APP);
+        if (result == LE_OK)
+        {
+            result = le_appCtrl_Start(BENCH_SERVICE_APP);
+        }
+        spi_ConnectService();
+        if (result == LE_OK)
+        {
+            result = openFaultDevice(&handle);
+        }
+        if (result == LE_OK)
+        {
+            result =
+                spi_WriteReadFD(handle, writeData, sizeof(writeData), readData, &readDataLength);
+        }
+        restartSamples[f] = nowUsecs() - startUsecs;
+    }
+    if (result != LE_OK)
+    {
+        fprintf(stderr, "Couldn't restart %s (%s)\n", BENCH_SERVICE_APP, LE_RESULT_TXT(result));
+        goto done;
+    }
+
+    printf("%zu faults of %s\n", faults, BENCH_FAULT_DEVICE);
+    printf(LATENCY_HEADER, "outage");
+    printLatencies("reopen in spiService", recoverySamples, faults);
+    printLatencies("restart of spiService", restartSamples, faults);
+
+done:
+    if (handle != NULL)
+    {
+        spi_Close(handle);
+    }
+    free(recoverySamples);
+    free(restartSamples);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens and configures a handle of the simulated device which wedges.
+ *
+ * @return
+ *      The result of spi_Open or spi_Configure.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t openFaultDevice
+(
+    spi_DeviceHandleRef_t* handlePtr    ///< [out] Handle, or NULL if it couldn't be opened
+)
+{
+    le_result_t result = spi_Open(BENCH_FAULT_DEVICE, handlePtr);
+    if (result != LE_OK)
+    {
+        *handlePtr = NULL;
+        return result;
+    }
+
+    result = spi_Configure(*handlePtr, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0);
+    if (result != LE_OK)
+    {
+        spi_Close(*handlePtr);
+        *handlePtr = NULL;
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks dual and quad transfers against the simulator: which controllers report the widths,
+ * which segment flags are accepted in which modes, and that more data lines make a transfer
+ * proportionally shorter on the wire.
+ */
+//--------------------------------------------------------------------------------------------------
+static void checkWidths
+(
+    void
+)
+{
+    size_t failed = 0;
+    spi_DeviceHandleRef_t handle = NULL;
+
+    // The register file model's controller has a single data line
+    LE_ASSERT_OK(spi_Open("simreg0", &handle));
+    checkResult(
+        "simreg0 reports no widths",
+        (spi_GetSupportedWidths(handle) == 0) ? LE_OK : LE_FAULT,
+        LE_OK,
+        &failed);
+    checkResult(
+        "simreg0 rejects a quad mode",
+        spi_Configure(handle, SPI_SPI_MODE_0 | SPI_SPI_TX_QUAD, 8, BENCH_WIDTHS_SPEED_HZ, 0),
+        LE_UNSUPPORTED,
+        &failed);
+    spi_Close(handle);
+
+    LE_ASSERT_OK(spi_Open("sim0", &handle));
+    checkResult(
+        "sim0 reports all widths",
+        (spi_GetSupportedWidths(handle) == SPI_SPI_WIDTHS) ? LE_OK : LE_FAULT,
+        LE_OK,
+        &failed);
+
+    // Flags which no mode allows are rejected before reaching the driver
+    LE_ASSERT_OK(spi_Configure(
+        handle, SPI_SPI_MODE_0 | SPI_SPI_WIDTHS, 8, BENCH_WIDTHS_SPEED_HZ, 0));
+    checkResult(
+        "dual and quad on one segment",
+        transferSegment(handle, SPI_SEGMENT_TX | SPI_SEGMENT_TX_DUAL | SPI_SEGMENT_TX_QUAD, NULL),
+        LE_BAD_PARAMETER,
+        &failed);
+    checkResult(
+        "dual transmit on a receive segment",
+        transferSegment(handle, SPI_SEGMENT_RX | SPI_SEGMENT_TX_DUAL, NULL),
+        LE_BAD_PARAMETER,
+        &failed);
+    checkResult(
+        "quad full duplex",
+        transferSegment(handle, SPI_SEGMENT_FD | SPI_SEGMENT_RX_QUAD, NULL),
+        LE_BAD_PARAMETER,
+        &failed);
+
+    // The driver only takes widths the handle's mode enables, and a quad mode enables dual
+    LE_ASSERT_OK(spi_Configure(handle, SPI_SPI_MODE_0, 8, BENCH_WIDTHS_SPEED_HZ, 0));
+    checkResult(
+        "dual transmit in a single mode",
+        transferSegment(handle, SPI_SEGMENT_TX | SPI_SEGMENT_TX_DUAL, NULL),
+        LE_FAULT,
+        &failed);
+    LE_ASSERT_OK(spi_Configure(
+        handle, SPI_SPI_MODE_0 | SPI_SPI_TX_DUAL, 8, BENCH_WIDTHS_SPEED_HZ, 0));
+    checkResult(
+        "dual receive in a dual transmit mode",
+        transferSegment(handle, SPI_SEGMENT_RX | SPI_SEGMENT_RX_DUAL, NULL),
+        LE_FAULT,
+        &failed);
+    checkResult(
+        "quad transmit in a dual transmit mode",
+        transferSegment(handle, SPI_SEGMENT_TX | SPI_SEGMENT_TX_QUAD, NULL),
+        LE_FAULT,
+        &failed);
+    LE_ASSERT_OK(spi_Configure(
+        handle, SPI_SPI_MODE_0 | SPI_SPI_TX_QUAD | SPI_SPI_RX_QUAD, 8, BENCH_WIDTHS_SPEED_HZ, 0));
+    checkResult(
+        "dual transmit in a quad mode",
+        transferSegment(handle, SPI_SEGMENT_TX | SPI_SEGMENT_TX_DUAL, NULL),
+        LE_OK,
+        &failed);
+
+    // Each width should take its share of the single line wire time, give or take the overhead
+    static const struct
+    {
+        const char* name;
+        uint32_t flags;
+        uint64_t lines;
+    }
+    timings[] =
+    {
+        { "dual transmit is twice as fast", SPI_SEGMENT_TX | SPI_SEGMENT_TX_DUAL, 2 },
+        { "quad transmit is four times as fast", SPI_SEGMENT_TX | SPI_SEGMENT_TX_QUAD, 4 },
+        { "dual receive is twice as fast", SPI_SEGMENT_RX | SPI_SEGMENT_RX_DUAL, 2 },
+        { "quad receive is four times as fast", SPI_SEGMENT_RX | SPI_SEGMENT_RX_QUAD, 4 },
+    };
+    uint64_t singleUsecs = 0;
+    LE_ASSERT_OK(transferSegment(handle, SPI_SEGMENT_TX, &singleUsecs));
+    for (size_t i = 0; i < NUM_ARRAY_MEMBERS(timings); i++)
+    {
+        uint64_t usecs = 0;
+        le_result_t result = transferSegment(handle, timings[i].flags, &usecs);
+        if (result == LE_OK)
+        {
+            // Within a quarter of the expected time
+            const uint64_t expectedUsecs = singleUsecs / timings[i].lines;
+            const uint64_t error =
+                (usecs > expectedUsecs) ? (usecs - expectedUsecs) : (expectedUsecs - usecs);
+            result = (4 * error <= expectedUsecs) ? LE_OK : LE_OUT_OF_RANGE;
+        }
+        checkResult(timings[i].name, result, LE_OK, &failed);
+    }
+    spi_Close(handle);
+
+    printf("%zu checks failed\n", failed);
+    if (failed != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a transaction of one segment of BENCH_WIDTHS_BYTES bytes.
+ *
+ * @return
+ *      The result of spi_Transaction.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t transferSegment
+(
+    spi_DeviceHandleRef_t handle,
+    uint32_t flags,                ///< SEGMENT_ flags of the segment
+    uint64_t* elapsedUsecsPtr      ///< [out] Time the call took, or NULL
+)
+{
+    const uint32_t segment[SPI_SEGMENT_WORDS] = { flags, BENCH_WIDTHS_BYTES, 0, 0 };
+    uint8_t writeData[BENCH_WIDTHS_BYTES];
+    uint8_t readData[BENCH_WIDTHS_BYTES];
+    size_t readDataLength = sizeof(readData);
+    memset(writeData, 0x5A, sizeof(writeData));
+
+    const uint64_t startUsecs = nowUsecs();
+    const le_result_t result = spi_Transaction(
+        handle,
+        segment,
+        NUM_ARRAY_MEMBERS(segment),
+        writeData,
+        ((flags & SPI_SEGMENT_TX) != 0) ? sizeof(writeData) : 0,
+        readData,
+        &readDataLength);
+    if (elapsedUsecsPtr != NULL)
+    {
+        *elapsedUsecsPtr = nowUsecs() - startUsecs;
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks the word conversions of the library, whose whole byte words go through the NEON or SSE
+ * kernels the library was built with, against a plain C model which moves one bit at a time.
+ * Every width from 1 to 32 bits is packed and unpacked MSB and LSB first, which for whole byte
+ * words covers the byte swap both on and off, at lengths which leave a tail after the vectors.
+ */
+//--------------------------------------------------------------------------------------------------
+static void checkWords
+(
+    void
+)
+{
+    size_t failed = 0;
+    for (uint8_t bits = 1; bits <= 32; bits++)
+    {
+        for (int lsbFirst = 0; lsbFirst <= 1; lsbFirst++)
+        {
+            static const size_t lengths[] = { 1, 3, 7, 9, 17, 31, 33, BENCH_WORDS_MAX };
+            bool matched = true;
+            for (size_t i = 0; i < NUM_ARRAY_MEMBERS(lengths); i++)
+            {
+                matched = checkWordLength(lengths[i], bits, lsbFirst) && matched;
+            }
+
+            char name[64];
+            snprintf(name,
+                     sizeof(name),
+                     "%u bit words %s first",
+                     (unsigned)bits,
+                     lsbFirst ? "LSB" : "MSB");
+            checkResult(name, matched ? LE_OK : LE_FAULT, LE_OK, &failed);
+        }
+    }
+
+    printf("%zu checks failed\n", failed);
+    if (failed != 0)
+    {
+        exit(EXIT_FAILURE);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Packs and unpacks words of one length, both into separate buffers and in place where the
+ * library allows it, comparing the results with the model.
+ *
+ * @return
+ *      true if every result matched.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool checkWordLength
+(
+    size_t numWords,    ///< Number of words, at most BENCH_WORDS_MAX
+    uint8_t bits,       ///< Bits per word
+    bool lsbFirst       ///< Send the bits of each word LSB first
+)
+{
+    const size_t wordBytes = SPIWORD_BYTES(bits);
+    const size_t packedLength = spiWord_PackedLength(numWords, bits);
+    const uint32_t mask = (bits == 32) ? UINT32_MAX : ((UINT32_C(1) << bits) - 1);
+    uint8_t words[BENCH_WORDS_MAX * 4];
+    uint8_t expected[BENCH_WORDS_MAX * 4];
+    uint8_t packed[BENCH_WORDS_MAX * 4];
+    uint8_t unpacked[BENCH_WORDS_MAX * 4];
+
+    // Words of varied bit patterns, with the bits above the width clear as the library leaves them
+    for (size_t i = 0; i < numWords; i++)
+    {
+        const uint32_t word = ((uint32_t)i * UINT32_C(2654435761) + bits) & mask;
+        if (wordBytes == 1)
+        {
+            words[i] = (uint8_t)word;
+        }
+        else if (wordBytes == 2)
+        {
+            const uint16_t halfWord = (uint16_t)word;
+            memcpy(&words[i * 2], &halfWord, sizeof(halfWord));
+        }
+        else
+        {
+            memcpy(&words[i * 4], &word, sizeof(word));
+        }
+    }
+    packReference(expected, words, numWords, bits, lsbFirst);
+
+    spiWord_Pack(packed, words, numWords, bits, lsbFirst);
+    bool matched = (memcmp(packed, expected, packedLength) == 0);
+    spiWord_Unpack(unpacked, packed, numWords, bits, lsbFirst);
+    matched = matched && (memcmp(unpacked, words, numWords * wordBytes) == 0);
+
+    if (bits == 8 * wordBytes)
+    {
+        memcpy(packed, words, numWords * wordBytes);
+        spiWord_Pack(packed, packed, numWords, bits, lsbFirst);
+        matched = matched && (memcmp(packed, expected, packedLength) == 0);
+        spiWord_Unpack(packed, packed, numWords, bits, lsbFirst);
+        matched = matched && (memcmp(packed, words, numWords * wordBytes) == 0);
+    }
+    return matched;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Packs words into wire bytes one bit at a time, as a model of spiWord_Pack.
+ */
+//--------------------------------------------------------------------------------------------------
+static void packReference
+(
+    uint8_t* dst,        ///< [out] spiWord_PackedLength bytes for the wire
+    const uint8_t* src,  ///< Words as held in a buffer
+    size_t numWords,     ///< Number of words
+    uint8_t bits,        ///< Bits per word
+    bool lsbFirst        ///< Send the bits of each word LSB first
+)
+{
+    const size_t wordBytes = SPIWORD_BYTES(bits);
+    memset(dst, 0, spiWord_PackedLength(numWords, bits));
+    size_t position = 0;
+    for (size_t i = 0; i < numWords; i++)
+    {
+        uint32_t word;
+        if (wordBytes == 1)
+        {
+            word = src[i];
+        }
+        else if (wordBytes == 2)
+        {
+            uint16_t halfWord;
+            memcpy(&halfWord, &src[i * 2], sizeof(halfWord));
+            word = halfWord;
+        }
+        else
+        {
+            memcpy(&word, &src[i * 4], sizeof(word));
+        }
+
+        for (uint8_t b = 0; b < bits; b++, position++)
+        {
+            const unsigned shift = lsbFirst ? b : (bits - 1 - b);
+            if ((word >> shift) & 1)
+            {
+                dst[position / 8] |= (uint8_t)(0x80 >> (position % 8));
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Prints the outcome of a check, counting it if it failed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void checkResult
+(
+    const char* name,          ///< What was checked
+    le_result_t result,        ///< Result obtained
+    le_result_t expected,      ///< Result which passes the check
+    size_t* failed             ///< [in/out] Number of failed checks
+)
+{
+    if (result == expected)
+    {
+        printf("ok    %s\n", name);
+        return;
+    }
+    printf("FAIL  %s: %s instead of %s\n", name, LE_RESULT_TXT(result), LE_RESULT_TXT(expected));
+    (*failed)++;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Times every call of spi.api against the simulator, reporting the latency percentiles of each
+ * and the rate at which it can be called back to back.  Calls which create and destroy an object,
+ * such as StartSampling and StopSampling, are timed as a pair.  The handlers of the asynchronous
+ * calls are called from the event loop, which can't be serviced from inside COMPONENT_INIT, so
+ * the calls are made from a thread of their own.
+ */
+//--------------------------------------------------------------------------------------------------
+static void benchApi
+(
+    void
+)
+{
+    size_t calls = getArg(1, 200, 1, BENCH_MAX_SAMPLES);
+    le_thread_Ref_t thread = le_thread_Create("BenchApi", apiThreadMain, &calls);
+    le_thread_SetJoinable(thread);
+    le_thread_Start(thread);
+    le_thread_Join(thread, NULL);
+}
+
+// Segments and data of a read of the benchmark register from the register file model
+static const uint32_t apiRegisterRead[] =
+{
+    SPI_SEGMENT_TX, 1, 0, 0,
+    SPI_SEGMENT_RX, 1, 0, 0
+};
+static const uint8_t apiRegisterCommand[] = { BENCH_API_READ_COMMAND };
+
+// A program which reads the benchmark register
+static const uint32_t apiProgramCode[] =
+{
+    (SPI_PROG_WRITE << SPI_PROG_OPCODE_SHIFT) | SPI_PROG_HOLD_CS | 1, 0,
+    (SPI_PROG_READ << SPI_PROG_OPCODE_SHIFT) | 1
+};
+
+// A full duplex transfer between the two halves of the shared buffer's first bytes
+static const uint32_t apiSharedSegment[] = { SPI_SEGMENT_FD, BENCH_API_BYTES, 0, 0 };
+
+static le_result_t apiOpenClose(ApiFixture_t* fixture)
+{
+    spi_DeviceHandleRef_t handle;
+    const le_result_t result = spi_Open("sim1", &handle);
+    if (result == LE_OK)
+    {
+        spi_Close(handle);
+    }
+    return result;
+}
+
+static le_result_t apiOpenProfile(ApiFixture_t* fixture)
+{
+    // Times the lookup of a profile which isn't configured
+    spi_DeviceHandleRef_t handle;
+    const le_result_t result = spi_OpenProfile("spiBench", &handle);
+    if (result == LE_OK)
+    {
+        spi_Close(handle);
+    }
+    return (result == LE_NOT_FOUND) ? LE_OK : result;
+}
+
+static le_result_t apiConfigure(ApiFixture_t* fixture)
+{
+    return spi_Configure(fixture->loop, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0);
+}
+
+static le_result_t apiGetConfigureFailures(ApiFixture_t* fixture)
+{
+    spi_GetConfigureFailures(fixture->loop);
+    return LE_OK;
+}
+
+static le_result_t apiGetEmulatedSettings(ApiFixture_t* fixture)
+{
+    spi_GetEmulatedSettings(fixture->loop);
+    return LE_OK;
+}
+
+static le_result_t apiGetSupportedWidths(ApiFixture_t* fixture)
+{
+    spi_GetSupportedWidths(fixture->loop);
+    return LE_OK;
+}
+
+static le_result_t apiSetScheduling(ApiFixture_t* fixture)
+{
+    return spi_SetScheduling(fixture->loop, SPI_DEFAULT_PRIORITY, SPI_DEFAULT_WEIGHT);
+}
+
+static le_result_t apiGetIoctlsAvoided(ApiFixture_t* fixture)
+{
+    spi_GetIoctlsAvoided(fixture->loop);
+    return LE_OK;
+}
+
+static le_result_t apiGetStats(ApiFixture_t* fixture)
+{
+    uint64_t counters[SPI_STAT_COUNTERS];
+    uint64_t queueWait[SPI_STAT_HISTOGRAM_BUCKETS];
+    uint64_t busTime[SPI_STAT_HISTOGRAM_BUCKETS];
+    size_t countersLength = NUM_ARRAY_MEMBERS(counters);
+    size_t queueWaitLength = NUM_ARRAY_MEMBERS(queueWait);
+    size_t busTimeLength = NUM_ARRAY_MEMBERS(busTime);
+    spi_GetStats(fixture->loop,
+                 counters,
+                 &countersLength,
+                 queueWait,
+                 &queueWaitLength,
+                 busTime,
+                 &busTimeLength);
+    return LE_OK;
+}
+
+static le_result_t apiResetStats(ApiFixture_t* fixture)
+{
+    spi_ResetStats(fixture->loop);
+    return LE_OK;
+}
+
+static le_result_t apiGetServiceStats(ApiFixture_t* fixture)
+{
+    uint64_t counters[SPI_STAT_COUNTERS];
+    uint64_t queueWait[SPI_STAT_HISTOGRAM_BUCKETS];
+    uint64_t busTime[SPI_STAT_HISTOGRAM_BUCKETS];
+    size_t countersLength = NUM_ARRAY_MEMBERS(counters);
+    size_t queueWaitLength = NUM_ARRAY_MEMBERS(queueWait);
+    size_t busTimeLength = NUM_ARRAY_MEMBERS(busTime);
+    spi_GetServiceStats(
+        counters, &countersLength, queueWait, &queueWaitLength, busTime, &busTimeLength);
+    return LE_OK;
+}
+
+static le_result_t apiSetBusTrace(ApiFixture_t* fixture)
+{
+    return spi_SetBusTrace(true, SPI_BUS_TRACE_MAX_PAYLOAD);
+}
+
+static void apiStopBusTrace(ApiFixture_t* fixture)
+{
+    spi_SetBusTrace(false, 0);
+}
+
+static le_result_t apiExportBusTrace(ApiFixture_t* fixture)
+{
+    // The descriptor is closed once it has been sent
+    return spi_ExportBusTrace(dup(fixture->trace));
+}
+
+static le_result_t apiWriteReadHD(ApiFixture_t* fixture)
+{
+    uint8_t readData[BENCH_API_BYTES];
+    size_t readDataLength = sizeof(readData);
+    return spi_WriteReadHD(
+        fixture->loop, apiRegisterCommand, 1, readData, &readDataLength);
+}
+
+static le_result_t apiWriteHD(ApiFixture_t* fixture)
+{
+    const uint8_t writeData[BENCH_API_BYTES] = { 0 };
+    return spi_WriteHD(fixture->loop, writeData, sizeof(writeData));
+}
+
+static le_result_t apiReadHD(ApiFixture_t* fixture)
+{
+    uint8_t readData[BENCH_API_BYTES];
+    size_t readDataLength = sizeof(readData);
+    return spi_ReadHD(fixture->loop, readData, &readDataLength);
+}
+
+static le_result_t apiWriteReadFD(ApiFixture_t* fixture)
+{
+    const uint8_t writeData[BENCH_API_BYTES] = { 0 };
+    uint8_t readData[BENCH_API_BYTES];
+    size_t readDataLength = sizeof(readData);
+    return spi_WriteReadFD(
+        fixture->loop, writeData, sizeof(writeData), readData, &readDataLength);
+}
+
+static le_result_t apiTransaction(ApiFixture_t* fixture)
+{
+    uint8_t readData[1];
+    size_t readDataLength = sizeof(readData);
+    return spi_Transaction(
+        fixture->reg,
+        apiRegisterRead,
+        NUM_ARRAY_MEMBERS(apiRegisterRead),
+        apiRegisterCommand,
+        sizeof(apiRegisterCommand),
+        readData,
+        &readDataLength);
+}
+
+static le_result_t apiAttachDetach(ApiFixture_t* fixture)
+{
+    // The loopback handle keeps its buffer, so this attaches one to the register file handle
+    const le_result_t result =
+        spi_AttachSharedBuffer(fixture->reg, dup(fixture->buffer), BENCH_API_BUFFER_BYTES);
+    spi_DetachSharedBuffer(fixture->reg);
+    return result;
+}
+
+static le_result_t apiSharedTransaction(ApiFixture_t* fixture)
+{
+    return spi_SharedTransaction(fixture->loop,
+                                 apiSharedSegment,
+                                 NUM_ARRAY_MEMBERS(apiSharedSegment),
+                                 0,
+                                 BENCH_API_BYTES);
+}
+
+static le_result_t apiSharedStream(ApiFixture_t* fixture)
+{
+    return spi_SharedStream(
+        fixture->loop, SPI_SEGMENT_FD, 0, BENCH_API_BYTES, BENCH_API_BYTES, false);
+}
+
+static le_result_t apiBeginEndBurst(ApiFixture_t* fixture)
+{
+    const le_result_t result = spi_BeginBurst(fixture->loop);
+    if (result != LE_OK)
+    {
+        return result;
+    }
+    return spi_EndBurst(fixture->loop);
+}
+
+static le_result_t apiBeginBurst(ApiFixture_t* fixture)
+{
+    return spi_BeginBurst(fixture->loop);
+}
+
+static void apiEndBurst(ApiFixture_t* fixture)
+{
+    spi_EndBurst(fixture->loop);
+}
+
+static le_result_t apiBurstAppend(ApiFixture_t* fixture)
+{
+    const uint8_t writeData[BENCH_API_BYTES] = { 0 };
+    uint8_t readData[1];
+    size_t readDataLength = 0;
+    return spi_BurstAppend(
+        fixture->loop, SPI_SEGMENT_TX, writeData, sizeof(writeData), readData, &readDataLength);
+}
+
+static le_result_t apiSharedBurstAppend(ApiFixture_t* fixture)
+{
+    return spi_SharedBurstAppend(fixture->loop, SPI_SEGMENT_TX, 0, 0, BENCH_API_BYTES);
+}
+
+static void apiTransactionComplete
+(
+    le_result_t result,
+    const uint8_t* readData,
+    size_t readDataLength,
+    void* context
+)
+{
+    ApiFixture_t* fixture = context;
+    fixture->asyncResult = result;
+    fixture->completed = true;
+}
+
+static void apiSharedTransactionComplete(le_result_t result, void* context)
+{
+    apiTransactionComplete(result, NULL, 0, context);
+}
+
+static le_result_t apiTransactionAsync(ApiFixture_t* fixture)
+{
+    fixture->completed = false;
+    const le_result_t result = spi_TransactionAsync(fixture->reg,
+                                                    apiRegisterRead,
+                                                    NUM_ARRAY_MEMBERS(apiRegisterRead),
+                                                    apiRegisterCommand,
+                                                    sizeof(apiRegisterCommand),
+                                                    apiTransactionComplete,
+                                                    fixture);
+    if (result != LE_OK)
+    {
+        return result;
+    }
+    waitForCompletion(fixture);
+    return fixture->asyncResult;
+}
+
+static le_result_t apiSharedTransactionAsync(ApiFixture_t* fixture)
+{
+    fixture->completed = false;
+    const le_result_t result = spi_SharedTransactionAsync(fixture->loop,
+                                                          apiSharedSegment,
+                                                          NUM_ARRAY_MEMBERS(apiSharedSegment),
+                                                          0,
+                                                          BENCH_API_BYTES,
+                                                          apiSharedTransactionComplete,
+                                                          fixture);
+    if (result != LE_OK)
+    {
+        return result;
+    }
+    waitForCompletion(fixture);
+    return fixture->asyncResult;
+}
+
+static le_result_t apiSetPollBackoff(ApiFixture_t* fixture)
+{
+    return spi_SetPollBackoff(fixture->reg,
+                              SPI_DEFAULT_POLL_SPIN_USECS,
+                              SPI_DEFAULT_POLL_MIN_SLEEP_USECS,
+                              SPI_DEFAULT_POLL_MAX_SLEEP_USECS);
+}
+
+static le_result_t apiPollUntil(ApiFixture_t* fixture)
+{
+    // The register holds its own address, so the first attempt matches
+    uint8_t status;
+    uint32_t elapsedUsecs;
+    return spi_PollUntil(fixture->reg,
+                         apiRegisterCommand,
+                         sizeof(apiRegisterCommand),
+                         0xFF,
+                         BENCH_API_REGISTER,
+                         SPI_MAX_POLL_TIMEOUT_USECS,
+                         &status,
+                         &elapsedUsecs);
+}
+
+static le_result_t apiSetRegisterMap(ApiFixture_t* fixture)
+{
+    return spi_SetRegisterMap(fixture->reg, 1, BENCH_REG_READ_FLAG, 0, NULL, 0, true);
+}
+
+static le_result_t apiReadRegisters(ApiFixture_t* fixture)
+{
+    uint8_t data[1];
+    size_t dataLength = sizeof(data);
+    return spi_ReadRegisters(fixture->reg, BENCH_API_REGISTER, data, &dataLength);
+}
+
+static le_result_t apiWriteRegisters(ApiFixture_t* fixture)
+{
+    // Writes the value the register powers up with, which the other cases rely on
+    const uint8_t data[] = { BENCH_API_REGISTER };
+    return spi_WriteRegisters(fixture->reg, BENCH_API_REGISTER, data, sizeof(data));
+}
+
+static le_result_t apiUpdateBits(ApiFixture_t* fixture)
+{
+    return spi_UpdateBits(fixture->reg, BENCH_API_REGISTER, 0x01, BENCH_API_REGISTER & 0x01);
+}
+
+static le_result_t apiSetBits(ApiFixture_t* fixture)
+{
+    return spi_SetBits(fixture->reg, BENCH_API_REGISTER, BENCH_API_REGISTER & 0x04);
+}
+
+static le_result_t apiClearBits(ApiFixture_t* fixture)
+{
+    return spi_ClearBits(fixture->reg, BENCH_API_REGISTER, ~BENCH_API_REGISTER & 0x02);
+}
+
+static le_result_t apiInvalidateRegisterCache(ApiFixture_t* fixture)
+{
+    spi_InvalidateRegisterCache(fixture->reg);
+    return LE_OK;
+}
+
+static le_result_t apiGetRegisterCacheStats(ApiFixture_t* fixture)
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t savedUsecs;
+    spi_GetRegisterCacheStats(fixture->reg, &hits, &misses, &savedUsecs);
+    return LE_OK;
+}
+
+static le_result_t apiSetFraming(ApiFixture_t* fixture)
+{
+    return spi_SetFraming(fixture->loop, 0, 0, 0, 0, 0, 0, 0, 0);
+}
+
+static le_result_t apiStartSampling(ApiFixture_t* fixture)
+{
+    return spi_StartSampling(fixture->reg,
+                             apiRegisterRead,
+                             NUM_ARRAY_MEMBERS(apiRegisterRead),
+                             apiRegisterCommand,
+                             sizeof(apiRegisterCommand),
+                             BENCH_API_SAMPLE_PERIOD_USECS,
+                             SPI_MAX_SAMPLES_PER_READ,
+                             &fixture->sampler);
+}
+
+static void apiStopSampling(ApiFixture_t* fixture)
+{
+    spi_StopSampling(fixture->sampler);
+}
+
+static le_result_t apiStartStopSampling(ApiFixture_t* fixture)
+{
+    const le_result_t result = apiStartSampling(fixture);
+    if (result == LE_OK)
+    {
+        apiStopSampling(fixture);
+    }
+    return result;
+}
+
+static le_result_t apiReadSamples(ApiFixture_t* fixture)
+{
+    uint64_t timestamps[SPI_MAX_SAMPLES_PER_READ];
+    uint8_t readData[SPI_MAX_SAMPLES_PER_READ];
+    size_t timestampsLength = NUM_ARRAY_MEMBERS(timestamps);
+    size_t readDataLength = sizeof(readData);
+    uint32_t dropped;
+    uint32_t failed;
+    spi_ReadSamples(fixture->sampler,
+                    timestamps,
+                    &timestampsLength,
+                    readData,
+                    &readDataLength,
+                    &dropped,
+                    &failed);
+    return LE_OK;
+}
+
+static le_result_t apiStartCapture(ApiFixture_t* fixture)
+{
+    return spi_StartCapture(fixture->reg,
+                            apiRegisterRead,
+                            NUM_ARRAY_MEMBERS(apiRegisterRead),
+                            apiRegisterCommand,
+                            sizeof(apiRegisterCommand),
+                            BENCH_API_SAMPLE_PERIOD_USECS,
+                            dup(fixture->ring),
+                            BENCH_API_BUFFER_BYTES,
+                            &fixture->capture);
+}
+
+static void apiStopCapture(ApiFixture_t* fixture)
+{
+    spi_StopCapture(fixture->capture);
+}
+
+static le_result_t apiStartStopCapture(ApiFixture_t* fixture)
+{
+    const le_result_t result = apiStartCapture(fixture);
+    if (result == LE_OK)
+    {
+        apiStopCapture(fixture);
+    }
+    return result;
+}
+
+static le_result_t apiGetCaptureStatus(ApiFixture_t* fixture)
+{
+    uint64_t records;
+    uint64_t dropped;
+    uint64_t overruns;
+    uint64_t failed;
+    spi_GetCaptureStatus(fixture->capture, &records, &dropped, &overruns, &failed);
+    return LE_OK;
+}
+
+static le_result_t apiLoadProgram(ApiFixture_t* fixture)
+{
+    return spi_LoadProgram(fixture->reg,
+                           apiProgramCode,
+                           NUM_ARRAY_MEMBERS(apiProgramCode),
+                           apiRegisterCommand,
+                           sizeof(apiRegisterCommand),
+                           &fixture->program);
+}
+
+static void apiDeleteProgram(ApiFixture_t* fixture)
+{
+    spi_DeleteProgram(fixture->program);
+}
+
+static le_result_t apiLoadDeleteProgram(ApiFixture_t* fixture)
+{
+    const le_result_t result = apiLoadProgram(fixture);
+    if (result == LE_OK)
+    {
+        apiDeleteProgram(fixture);
+    }
+    return result;
+}
+
+static le_result_t apiRunProgram(ApiFixture_t* fixture)
+{
+    uint8_t output[1];
+    size_t outputLength = sizeof(output);
+    return spi_RunProgram(fixture->program, output, &outputLength);
+}
+
+static const ApiCase_t apiCases[] =
+{
+    { "Open+Close", apiOpenClose, NULL, NULL },
+    { "OpenProfile", apiOpenProfile, NULL, NULL },
+    { "Configure", apiConfigure, NULL, NULL },
+    { "GetConfigureFailures", apiGetConfigureFailures, NULL, NULL },
+    { "GetEmulatedSettings", apiGetEmulatedSettings, NULL, NULL },
+    { "GetSupportedWidths", apiGetSupportedWidths, NULL, NULL },
+    { "SetScheduling", apiSetScheduling, NULL, NULL },
+    { "GetIoctlsAvoided", apiGetIoctlsAvoided, NULL, NULL },
+    { "GetStats", apiGetStats, NULL, NULL },
+    { "ResetStats", apiResetStats, NULL, NULL },
+    { "GetServiceStats", apiGetServiceStats, NULL, NULL },
+    { "SetBusTrace", apiSetBusTrace, NULL, apiStopBusTrace },
+    { "ExportBusTrace", apiExportBusTrace, apiSetBusTrace, apiStopBusTrace },
+    { "WriteReadHD", apiWriteReadHD, NULL, NULL },
+    { "WriteHD", apiWriteHD, NULL, NULL },
+    { "ReadHD", apiReadHD, NULL, NULL },
+    { "WriteReadFD", apiWriteReadFD, NULL, NULL },
+    { "Transaction", apiTransaction, NULL, NULL },
+    { "Attach+DetachSharedBuffer", apiAttachDetach, NULL, NULL },
+    { "SharedTransaction", apiSharedTransaction, NULL, NULL },
+    { "SharedStream", apiSharedStream, NULL, NULL },
+    { "BeginBurst+EndBurst", apiBeginEndBurst, NULL, NULL },
+    { "BurstAppend", apiBurstAppend, apiBeginBurst, apiEndBurst },
+    { "SharedBurstAppend", apiSharedBurstAppend, apiBeginBurst, apiEndBurst },
+    { "TransactionAsync", apiTransactionAsync, NULL, NULL },
+    { "SharedTransactionAsync", apiSharedTransactionAsync, NULL, NULL },
+    { "SetPollBackoff", apiSetPollBackoff, NULL, NULL },
+    { "PollUntil", apiPollUntil, NULL, NULL },
+    { "SetRegisterMap", apiSetRegisterMap, NULL, NULL },
+    { "ReadRegisters", apiReadRegisters, NULL, NULL },
+    { "WriteRegisters", apiWriteRegisters, NULL, NULL },
+    { "UpdateBits", apiUpdateBits, NULL, NULL },
+    { "SetBits", apiSetBits, NULL, NULL },
+    { "ClearBits", apiClearBits, NULL, NULL },
+    { "InvalidateRegisterCache", apiInvalidateRegisterCache, NULL, NULL },
+    { "GetRegisterCacheStats", apiGetRegisterCacheStats, NULL, NULL },
+    { "SetFraming", apiSetFraming, NULL, NULL },
+    { "Start+StopSampling", apiStartStopSampling, NULL, NULL },
+    { "ReadSamples", apiReadSamples, apiStartSampling, apiStopSampling },
+    { "Start+StopCapture", apiStartStopCapture, NULL, NULL },
+    { "GetCaptureStatus", apiGetCaptureStatus, apiStartCapture, apiStopCapture },
+    { "Load+DeleteProgram", apiLoadDeleteProgram, NULL, NULL },
+    { "RunProgram", apiRunProgram, apiLoadProgram, apiDeleteProgram },
+};
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Main function of the thread of benchApi, which has its own session with the service.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* apiThreadMain
+(
+    void* context   ///< Number of calls of each case
+)
+{
+    const size_t calls = *(const size_t*)context;
+    uint32_t* samples = calloc(calls, sizeof(*samples));
+    LE_ASSERT(samples != NULL);
+
+    spi_ConnectService();
+    ApiFixture_t fixture;
+    if (openApiFixture(&fixture) != LE_OK)
+    {
+        fprintf(stderr, "Couldn't open sim0 and simreg0\n");
+        goto done;
+    }
+
+    printf("%zu calls of each case at %u Hz\n", calls, BENCH_SPEED_HZ);
+    printf(LATENCY_HEADER, "call");
+    for (size_t i = 0; i < NUM_ARRAY_MEMBERS(apiCases); i++)
+    {
+        const ApiCase_t* apiCase = &apiCases[i];
+        le_result_t result = (apiCase->setup != NULL) ? apiCase->setup(&fixture) : LE_OK;
+        if (result == LE_OK)
+        {
+            for (size_t c = 0; c < calls && result == LE_OK; c++)
+            {
+                const uint64_t startUsecs = nowUsecs();
+                result = apiCase->call(&fixture);
+                samples[c] = nowUsecs() - startUsecs;
+            }
+            if (apiCase->teardown != NULL)
+            {
+                apiCase->teardown(&fixture);
+            }
+        }
+
+        if (result == LE_OK)
+        {
+            printLatencies(apiCase->name, samples, calls);
+        }
+        else
+        {
+            printf("%-24s  failed (%s)\n", apiCase->name, LE_RESULT_TXT(result));
+        }
+    }
+
+done:
+    closeApiFixture(&fixture);
+    spi_DisconnectService();
+    free(samples);
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens the handles and creates the buffers used by the API benchmark.
+ *
+ * @return
+ *      LE_OK on success, or the first failure.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t openApiFixture
+(
+    ApiFixture_t* fixture   ///< [out] Fixture to fill in, to be closed even on failure
+)
+{
+    memset(fixture, 0, sizeof(*fixture));
+    fixture->buffer = createSealedBuffer("spiBenchBuffer", BENCH_API_BUFFER_BYTES);
+    fixture->ring = createSealedBuffer("spiBenchRing", BENCH_API_BUFFER_BYTES);
+    fixture->trace = memfd_create("spiBenchTrace", MFD_CLOEXEC);
+    if (fixture->buffer < 0 || fixture->ring < 0 || fixture->trace < 0)
+    {
+        return LE_FAULT;
+    }
+
+    le_result_t result = spi_Open("sim0", &fixture->loop);
+    if (result != LE_OK)
+    {
+        fixture->loop = NULL;
+        return result;
+    }
+    result = spi_Open("simreg0", &fixture->reg);
+    if (result != LE_OK)
+    {
+        fixture->reg = NULL;
+        return result;
+    }
+
+    result = spi_Configure(fixture->loop, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0);
+    if (result == LE_OK)
+    {
+        result = spi_Configure(fixture->reg, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0);
+    }
+    if (result == LE_OK)
+    {
+        result = apiSetRegisterMap(fixture);
+    }
+    if (result == LE_OK)
+    {
+        result = spi_AttachSharedBuffer(
+            fixture->loop, dup(fixture->buffer), BENCH_API_BUFFER_BYTES);
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Closes what openApiFixture opened.  Closing the handles also stops anything started on them.
+ */
+//--------------------------------------------------------------------------------------------------
+static void closeApiFixture
+(
+    ApiFixture_t* fixture
+)
+{
+    if (fixture->loop != NULL)
+    {
+        spi_Close(fixture->loop);
+    }
+    if (fixture->reg != NULL)
+    {
+        spi_Close(fixture->reg);
+    }
+    const int fds[] = { fixture->buffer, fixture->ring, fixture->trace };
+    for (size_t i = 0; i < NUM_ARRAY_MEMBERS(fds); i++)
+    {
+        if (fds[i] >= 0)
+        {
+            close(fds[i]);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Creates a memfd sealed against shrinking, as the service requires of shared buffers and
+ * capture files.
+ *
+ * @return
+ *      The file descriptor, or -1 on failure.
+ */
+//--------------------------------------------------------------------------------------------------
+static int createSealedBuffer
+(
+    const char* name,
+    size_t size
+)
+{
+    const int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Couldn't create %s: %m\n", name);
+        return -1;
+    }
+    if (ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) != 0)
+    {
+        fprintf(stderr, "Couldn't size and seal %s: %m\n", name);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Services the calling thread's event loop until an asynchronous transaction has completed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void waitForCompletion
+(
+    ApiFixture_t* fixture
+)
+{
+    struct pollfd eventFd = { .fd = le_event_GetFd(), .events = POLLIN };
+    while (!fixture->completed)
+    {
+        if (poll(&eventFd, 1, -1) > 0)
+        {
+            while (le_event_ServiceLoop() == LE_OK)
+            {
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Measures the throughput of erasing, programming and reading the simulated flash chip through
+ * spiFlash, and the latency of another handle's transfers on the chip's bus during the erase.
+ * While the chip erases the service polls it a slice at a time, so the other handle's transfers
+ * should wait for no longer than a slice rather than for a whole erase block.
+ */
+//--------------------------------------------------------------------------------------------------
+static void benchFlash
+(
+    void
+)
+{
+    const size_t kib = getArg(1, 256, 4, BENCH_FLASH_MAX_KIB);
+    uint8_t* pattern = malloc(kib * 1024);
+    uint8_t* readback = malloc(kib * 1024);
+    FlashContender_t contender = { .samples = calloc(BENCH_MAX_SAMPLES, sizeof(uint32_t)) };
+    LE_ASSERT(pattern != NULL && readback != NULL && contender.samples != NULL);
+    for (size_t i = 0; i < kib * 1024; i++)
+    {
+        pattern[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+
+    spiFlash_HandleRef_t flash = NULL;
+    le_result_t result = spiFlash_Open(BENCH_FLASH_DEVICE, BENCH_SPEED_HZ, &flash);
+    if (result != LE_OK)
+    {
+        fprintf(stderr, "Couldn't open %s (%s)\n", BENCH_FLASH_DEVICE, LE_RESULT_TXT(result));
+        flash = NULL;
+        goto done;
+    }
+
+    uint8_t jedecId[SPIFLASH_JEDEC_ID_SIZE];
+    size_t jedecIdLength = sizeof(jedecId);
+    uint32_t size;
+    uint32_t pageSize;
+    uint32_t eraseSize;
+    uint8_t readWidth;
+    spiFlash_GetInfo(flash, jedecId, &jedecIdLength, &size, &pageSize, &eraseSize, &readWidth);
+    // The erase must cover whole erase blocks, and the chip can be smaller than the most allowed
+    uint32_t length = (kib * 1024 < size) ? (kib * 1024) : size;
+    length -= length % eraseSize;
+    if (length == 0)
+    {
+        fprintf(stderr, "%s erases %u byte blocks\n", BENCH_FLASH_DEVICE, eraseSize);
+        goto done;
+    }
+
+    contender.ready = le_sem_Create("FlashContenderReady", 0);
+    le_thread_Ref_t thread = le_thread_Create("BenchFlash", flashContenderMain, &contender);
+    le_thread_SetJoinable(thread);
+    le_thread_Start(thread);
+    le_sem_Wait(contender.ready);
+
+    uint64_t startUsecs = nowUsecs();
+    result = spiFlash_Erase(flash, 0, length);
+    if (result == LE_OK)
+    {
+        result = spiFlash_Sync(flash);
+    }
+    const uint64_t eraseUsecs = nowUsecs() - startUsecs;
+    __atomic_store_n(&contender.stop, true, __ATOMIC_RELEASE);
+    le_thread_Join(thread, NULL);
+    le_sem_Delete(contender.ready);
+    if (result != LE_OK || contender.result != LE_OK)
+    {
+        fprintf(stderr,
+                "Erase failed (%s), transfers during it %s\n",
+                LE_RESULT_TXT(result),
+                LE_RESULT_TXT(contender.result));
+        goto done;
+    }
+
+    startUsecs = nowUsecs();
+    for (uint32_t offset = 0; offset < length && result == LE_OK; offset += SPIFLASH_MAX_DATA_SIZE)
+    {
+        const size_t chunk = (length - offset < SPIFLASH_MAX_DATA_SIZE) ?
+            (length - offset) : SPIFLASH_MAX_DATA_SIZE;
+        result = spiFlash_Program(flash, offset, &pattern[offset], chunk);
+    }
+    if (result == LE_OK)
+    {
+        result = spiFlash_Sync(flash);
+    }
+    const uint64_t programUsecs = nowUsecs() - startUsecs;
+    if (result != LE_OK)
+    {
+        fprintf(stderr, "Program failed (%s)\n", LE_RESULT_TXT(result));
+        goto done;
+    }
+
+    startUsecs = nowUsecs();
+    for (uint32_t offset = 0; offset < length && result == LE_OK; offset += SPIFLASH_MAX_DATA_SIZE)
+    {
+        size_t chunk = (length - offset < SPIFLASH_MAX_DATA_SIZE) ?
+            (length - offset) : SPIFLASH_MAX_DATA_SIZE;
+        result = spiFlash_Read(flash, offset, &readback[offset], &chunk);
+    }
+    const uint64_t readUsecs = nowUsecs() - startUsecs;
+    if (result != LE_OK || memcmp(pattern, readback, length) != 0)
+    {
+        fprintf(stderr, "Read failed (%s) or didn't match\n", LE_RESULT_TXT(result));
+        goto done;
+    }
+
+    printf("%u KiB of flash %02X %02X %02X with %u byte pages, x%u reads at %u Hz\n",
+           length / 1024,
+           jedecId[0],
+           jedecId[1],
+           jedecId[2],
+           pageSize,
+           readWidth,
+           BENCH_SPEED_HZ);
+    printf("operation  time (ms)    KiB/s\n");
+    printf("erase      %9.1f  %7.0f\n", eraseUsecs / 1000.0, kibPerSec(length, eraseUsecs));
+    printf("program    %9.1f  %7.0f\n", programUsecs / 1000.0, kibPerSec(length, programUsecs));
+    printf("read       %9.1f  %7.0f\n", readUsecs / 1000.0, kibPerSec(length, readUsecs));
+    printf(LATENCY_HEADER, "during erase");
+    printLatencies("status read", contender.samples, contender.numSamples);
+
+done:
+    if (flash != NULL)
+    {
+        spiFlash_Close(flash);
+    }
+    free(pattern);
+    free(readback);
+    free(contender.samples);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Main function of the thread of benchFlash which reads the flash chip's status register through
+ * a handle of its own until told to stop.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* flashContenderMain
+(
+    void* context   ///< FlashContender_t
+)
+{
+    FlashContender_t* contender = context;
+    const uint8_t readStatus[] = { BENCH_FLASH_READ_STATUS };
+
+    spi_ConnectService();
+    spi_DeviceHandleRef_t handle = NULL;
+    contender->result = spi_Open(BENCH_FLASH_DEVICE, &handle);
+    if (contender->result == LE_OK)
+    {
+        contender->result = spi_Configure(handle, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0);
+    }
+    le_sem_Post(contender->ready);
+
+    while (contender->result == LE_OK &&
+           contender->numSamples < BENCH_MAX_SAMPLES &&
+           !__atomic_load_n(&contender->stop, __ATOMIC_ACQUIRE))
+    {
+        uint8_t status;
+        size_t statusLength = sizeof(status);
+        const uint64_t startUsecs = nowUsecs();
+        contender->result =
+            spi_WriteReadHD(handle, readStatus, sizeof(readStatus), &status, &statusLength);
+        contender->samples[contender->numSamples++] = nowUsecs() - startUsecs;
+    }
+
+    if (handle != NULL)
+    {
+        spi_Close(handle);
+    }
+    spi_DisconnectService();
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Measures what tracing adds to the latency of a transfer.  The baseline is the per-byte LE_DEBUG
+ * logging of the payload which the library did on every transfer before it had a trace.  The
+ * transfer trace of this process's library is then stepped through its levels around spiDirect
+ * transfers of a three segment message, with the lines captured in the ring so that the cost of
+ * the log isn't included.  The service's
+ * bus trace is then switched off and on around spiService transfers, and left off.
+ */
+//--------------------------------------------------------------------------------------------------
+static void benchTrace
+(
+    void
+)
+{
+    static const struct
+    {
+        const char* label;
+        spiLib_TraceLevel_t level;
+    }
+    levels[] =
+    {
+        { "spiDirect trace off", SPILIB_TRACE_OFF },
+        { "spiDirect summary", SPILIB_TRACE_SUMMARY },
+        { "spiDirect payload", SPILIB_TRACE_PAYLOAD }
+    };
+    const size_t transfers = getArg(1, 1000, 1, BENCH_MAX_SAMPLES);
+    uint32_t* samples = calloc(transfers, sizeof(*samples));
+    LE_ASSERT(samples != NULL);
+    const uint8_t command = 0x80;
+    uint8_t writeData[BENCH_TRACE_BYTES] = { 0 };
+    uint8_t readData[BENCH_TRACE_BYTES];
+    const spiLib_Segment_t segments[] =
+    {
+        { .txBuf = &command, .length = 1 },
+        { .txBuf = writeData, .length = sizeof(writeData) },
+        { .rxBuf = readData, .length = sizeof(readData) }
+    };
+
+    // The simulator of this process is independent of the service's, so both can open sim0
+    spiLib_SetBackend(&spiLib_SimBackend);
+    spiDirect_HandleRef_t direct = NULL;
+    spi_DeviceHandleRef_t service = NULL;
+    if (spiDirect_Open("sim0", &direct) != LE_OK ||
+        spiDirect_Configure(direct, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0) != LE_OK ||
+        spi_Open("sim0", &service) != LE_OK ||
+        spi_Configure(service, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0) != LE_OK)
+    {
+        fprintf(stderr, "Couldn't open sim0 both directly and through spiService\n");
+        goto done;
+    }
+
+    printf("%zu transfers of %zu segments at %u Hz\n",
+           transfers,
+           NUM_ARRAY_MEMBERS(segments),
+           BENCH_SPEED_HZ);
+    printf(LATENCY_HEADER, "transfer");
+    spiLib_SetTraceLevel(SPILIB_TRACE_OFF);
+    for (size_t t = 0; t < transfers; t++)
+    {
+        const uint64_t startUsecs = nowUsecs();
+        logSegmentBytes(segments, NUM_ARRAY_MEMBERS(segments));
+        LE_ASSERT_OK(spiDirect_Transfer(direct, segments, NUM_ARRAY_MEMBERS(segments)));
+        samples[t] = nowUsecs() - startUsecs;
+    }
+    printLatencies("baseline per-byte debug", samples, transfers);
+
+    spiLib_SetTraceCapture(true);
+    for (size_t i = 0; i < NUM_ARRAY_MEMBERS(levels); i++)
+    {
+        spiLib_SetTraceLevel(levels[i].level);
+        for (size_t t = 0; t < transfers; t++)
+        {
+            const uint64_t startUsecs = nowUsecs();
+            LE_ASSERT_OK(spiDirect_Transfer(direct, segments, NUM_ARRAY_MEMBERS(segments)));
+            samples[t] = nowUsecs() - startUsecs;
+        }
+        printLatencies(levels[i].label, samples, transfers);
+    }
+    spiLib_SetTraceLevel(SPILIB_TRACE_OFF);
+    spiLib_SetTraceCapture(false);
+
+    for (int enabled = 0; enabled <= 1; enabled++)
+    {
+        const le_result_t result =
+            spi_SetBusTrace(enabled, enabled ? SPI_BUS_TRACE_MAX_PAYLOAD : 0);
+        if (result != LE_OK)
+        {
+            fprintf(stderr, "Couldn't switch the bus trace (%s)\n", LE_RESULT_TXT(result));
+            goto done;
+        }
+        for (size_t t = 0; t < transfers; t++)
+        {
+            size_t readDataLength = sizeof(readData);
+            const uint64_t startUsecs = nowUsecs();
+            LE_ASSERT_OK(spi_WriteReadFD(
+                service, writeData, sizeof(writeData), readData, &readDataLength));
+            samples[t] = nowUsecs() - startUsecs;
+        }
+        printLatencies(
+            enabled ? "spiService bus trace on" : "spiService bus trace off", samples, transfers);
+    }
+    spi_SetBusTrace(false, 0);
+
+done:
+    if (service != NULL)
+    {
+        spi_Close(service);
+    }
+    if (direct != NULL)
+    {
+        spiDirect_Close(direct);
+    }
+    free(samples);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Logs the payload of a message one byte per LE_DEBUG, as the library did around each transfer
+ * before it had a trace.
+ */
+//--------------------------------------------------------------------------------------------------
+static void logSegmentBytes
+(
+    const spiLib_Segment_t* segments,   ///< Segments of the message
+    size_t numSegments                  ///< Number of entries in segments
+)
+{
+    for (size_t s = 0; s < numSegments; s++)
+    {
+        const uint8_t* data = (segments[s].txBuf != NULL) ? segments[s].txBuf : segments[s].rxBuf;
+        LE_DEBUG("Transferring this message...len: %zu", segments[s].length);
+        for (size_t i = 0; i < segments[s].length; i++)
+        {
+            LE_DEBUG("%.2X ", data[i]);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Compares a sample made of several register reads performed as chained spi_WriteReadHD calls,
+ * one IPC round trip each, with the same sample performed as one spi_Transaction.  Chip select is
+ * released between the reads of the transaction as it is between the chained calls.
+ */
+//--------------------------------------------------------------------------------------------------
+static void benchRoundTrips
+(
+    void
+)
+{
+    const size_t accesses = getArg(1, 8, 1, SPI_MAX_SEGMENTS / 2);
+    const size_t samples = getArg(2, 1000, 1, BENCH_MAX_SAMPLES);
+    uint32_t* chainedSamples = calloc(samples, sizeof(*chainedSamples));
+    uint32_t* transactionSamples = calloc(samples, sizeof(*transactionSamples));
+    LE_ASSERT(chainedSamples != NULL && transactionSamples != NULL);
+
+    uint8_t commands[SPI_MAX_SEGMENTS / 2];
+    uint32_t descriptors[SPI_MAX_SEGMENT_WORDS];
+    for (size_t a = 0; a < accesses; a++)
+    {
+        commands[a] = BENCH_REG_READ_FLAG | a;
+        uint32_t* command = &descriptors[2 * a * SPI_SEGMENT_WORDS];
+        uint32_t* value = &command[SPI_SEGMENT_WORDS];
+        command[0] = SPI_SEGMENT_TX;
+        command[1] = 1;
+        command[2] = 0;
+        command[3] = 0;
+        // Releases chip select after each read but the last, which the message's end releases
+        value[0] = SPI_SEGMENT_RX | ((a + 1 < accesses) ? SPI_SEGMENT_CS_CHANGE : 0);
+        value[1] = 1;
+        value[2] = 0;
+        value[3] = 0;
+    }
+    uint8_t chainedValues[SPI_MAX_SEGMENTS / 2];
+    uint8_t transactionValues[SPI_MAX_SEGMENTS / 2];
+
+    spi_DeviceHandleRef_t handle = NULL;
+    le_result_t result = spi_Open("simreg0", &handle);
+    if (result != LE_OK)
+    {
+        handle = NULL;
+    }
+    else
+    {
+        result = spi_Configure(handle, SPI_SPI_MODE_0, 8, BENCH_SPEED_HZ, 0);
+    }
+
+    for (size_t s = 0; s < samples && result == LE_OK; s++)
+    {
+        uint64_t startUsecs = nowUsecs();
+        for (size_t a = 0; a < accesses && result == LE_OK; a++)
+        {
+            size_t valueLength = 1;
+            result = spi_WriteReadHD(handle, &commands[a], 1, &chainedValues[a], &valueLength);
+        }
+        chainedSamples[s] = nowUsecs() - startUsecs;
+
+        if (result == LE_OK)
+        {
+            size_t valuesLength = accesses;
+            startUsecs = nowUsecs();
+            result = spi_Transaction(handle,
+                                     descriptors,
+                                     2 * accesses * SPI_SEGMENT_WORDS,
+                                     commands,
+                                     accesses,
+                                     transactionValues,
+                                     &valuesLength);
+            transactionSamples[s] = nowUsecs() - startUsecs;
+        }
+    }
+    if (result != LE_OK || memcmp(chainedValues, transactionValues, accesses) != 0)
+    {
+        fprintf(stderr, "Reads of simreg0 failed (%s) or differed\n", LE_RESULT_TXT(result));
+        goto done;
+    }
+
+    printf("%zu samples of %zu register reads at %u Hz\n", samples, accesses, BENCH_SPEED_HZ);
+    printf("round trips per sample: %zu chained, 1 as a transaction, %zu saved\n",
+           accesses,
+           accesses - 1);
+    printf(LATENCY_HEADER, "sample");
+    printLatencies("chained WriteReadHD", chainedSamples, samples);
+    printLatencies("one Transaction", transactionSamples, samples);
+
+done:
+    if (handle != NULL)
+    {
+        spi_Close(handle);
+    }
+    free(chainedSamples);
+    free(transactionSamples);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Prints the percentiles of a set of latencies on one line, under LATENCY_HEADER, followed by the
+ * throughput of the cases back to back.  The samples are sorted in place.
+ */
+//--------------------------------------------------------------------------------------------------
+static void printLatencies
+(
+    const char* label,     ///< Name of the case measured
+    uint32_t* samples,     ///< Latencies in microseconds
+    size_t numSamples      ///< Number of samples, at least one
+)
+{
+    uint64_t totalUsecs = 0;
+    for (size_t i = 0; i < numSamples; i++)
+    {
+        totalUsecs += samples[i];
+    }
+
+    qsort(samples, numSamples, sizeof(*samples), compareSamples);
+    printf("%-24s  %8u  %8u  %8u  %8u  %7.0f\n",
+           label,
+           samples[(numSamples * 50) / 100],
+           samples[(numSamples * 90) / 100],
+           samples[(numSamples * 99) / 100],
+           samples[numSamples - 1],
+           (totalUsecs == 0) ? 0.0 : ((double)numSamples * USECS_PER_SEC) / totalUsecs);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Orders latencies for qsort.
+ *
+ * @return
+ *      Negative, zero or positive as a is less than, equal to or greater than b.
+ */
+//--------------------------------------------------------------------------------------------------
+static int compareSamples
+(
+    const void* a,
+    const void* b
+)
+{
+    const uint32_t first = *(const uint32_t*)a;
+    const uint32_t second = *(const uint32_t*)b;
+    return (first > second) - (first < second);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets a numeric argument of the benchmark, exiting if it is malformed or out of range.
+ *
+ * @return
+ *      The argument, or defaultValue if it wasn't given.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t getArg
+(
+    size_t index,        ///< Index of the argument, the benchmark's name being 0
+    size_t defaultValue, ///< Value if there are fewer arguments
+    size_t min,          ///< Smallest value accepted
+    size_t max           ///< Largest value accepted
+)
+{
+    if (index >= le_arg_NumArgs())
+    {
+        return defaultValue;
+    }
+
+    const char* arg = le_arg_GetArg(index);
+    char* end;
+    errno = 0;
+    const unsigned long long value = strtoull(arg, &end, 0);
+    if (errno != 0 || end == arg || *end != '\0' || value < min || value > max)
+    {
+        fprintf(stderr, "Argument %zu (%s) must be from %zu to %zu\n", index, arg, min, max);
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)value;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the monotonic time.
+ *
+ * @return
+ *      The time in microseconds.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint64_t nowUsecs
+(
+    void
+)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * USECS_PER_SEC) + ((uint64_t)now.tv_nsec / 1000);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Converts a number of bytes transferred in a time into a throughput.
+ *
+ * @return
+ *      The throughput in KiB per second.
+ */
+//--------------------------------------------------------------------------------------------------
+static double kibPerSec
+(
+    uint64_t bytes,
+    uint64_t usecs
+)
+{
+    return ((double)bytes * USECS_PER_SEC) / (1024.0 * usecs);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Lists the benchmarks and their arguments.
+ */
+//--------------------------------------------------------------------------------------------------
+static void printUsage
+(
+    void
+)
+{
+    fprintf(stderr, "Usage: spiBench <benchmark> [arguments]\n");
+    for (size_t i = 0; i < NUM_ARRAY_MEMBERS(benchmarks); i++)
+    {
+        fprintf(stderr, "    %s %s\n", benchmarks[i].name, benchmarks[i].usage);
+    }
+}
+
+COMPONENT_INIT
+{
+    if (le_arg_NumArgs() < 1)
+    {
+        printUsage();
+        exit(EXIT_FAILURE);
+    }
+
+    const char* name = le_arg_GetArg(0);
+    for (size_t i = 0; i < NUM_ARRAY_MEMBERS(benchmarks); i++)
+    {
+        if (strcmp(name, benchmarks[i].name) == 0)
+        {
+            benchmarks[i].run();
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    fprintf(stderr, "Unknown benchmark %s\n", name);
+    printUsage();
+    exit(EXIT_FAILURE);
+}
@@ -0,0 +1,605 @@
+#include "legato.h"
+#include "spiLibrary.h"
+#include "spiDirect.h"
+
+// Size of the buffer holding a device path
+#define DEVICE_PATH_BYTES 256
+// Dual and quad mode bits of spidev.h, SPI_WIDTHS in spi.api
+#define WIDTH_MODES 0xF00
+
+
+// An open device file, shared by all of the process's handles on it.  The mutex serializes the
+// handles' transfers, each with the configuration applied before it.
+typedef struct
+{
+    le_dls_Link_t link;        ///< Link in the list of open devices
+    int fd;
+    ino_t inode;
+    uint32_t widthModes;       ///< Dual and quad modes the controller supports, probed at open
+    spiLib_Config_t config;    ///< Configuration currently applied to the device
+    le_mutex_Ref_t mutex;
+    size_t numHandles;         ///< Number of open handles on the device
+} Device_t;
+
+// A handle on a device.  The fields other than device and owner are protected by the device's
+// mutex.
+typedef struct
+{
+    Device_t* device;
+    le_thread_Ref_t owner;     ///< Thread which opened the handle
+    spiDirect_HandleRef_t ref;
+    spiLib_Config_t config;    ///< Configuration requested for the handle
+    spiLib_Config_t goodConfig;  ///< Last configuration which applied without error
+    uint32_t configureFailures;  ///< SPILIB_CONFIG_ bits of settings which failed since Configure
+    uint32_t emulatedSettings;   ///< SPILIB_CONFIG_ bits of settings done in software
+    uint64_t ioctlsAvoided;    ///< Configuration ioctls skipped because the setting was unchanged
+} Handle_t;
+
+
+static Handle_t* lookupHandle(spiDirect_HandleRef_t ref);
+static Handle_t* acquireDevice(spiDirect_HandleRef_t ref);
+static void releaseDevice(Handle_t* handle);
+static le_result_t applyConfig(Handle_t* handle);
+static le_result_t openDevice(const char* devicePath, ino_t inode, Device_t** devicePtr);
+static Device_t* findDeviceWithInode(ino_t inode);
+
+static struct
+{
+    // Protects the list of devices and the map of handles
+    le_mutex_Ref_t mutex;
+    // Memory pool for allocating devices
+    le_mem_PoolRef_t devicePool;
+    // Devices opened by at least one handle
+    le_dls_List_t devices;
+    // Memory pool for allocating handles
+    le_mem_PoolRef_t handlePool;
+    // A map of safe references to handles
+    le_ref_MapRef_t handleRefMap;
+} g;
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens an SPI device for the calling thread.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the device name string is bad
+ *      - LE_NOT_FOUND if the SPI device file could not be found
+ *      - LE_NOT_PERMITTED if the SPI device file can't be opened for read/write
+ *      - LE_BUSY if spiService or another process is using the device
+ *      - LE_FAULT for non-specific failures
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiDirect_Open
+(
+    const char* deviceName,          ///< [in] Name of the device file.  Do not include the "/dev/"
+                                     ///  prefix.
+    spiDirect_HandleRef_t* handlePtr ///< [out] Handle for passing to the other spiDirect functions
+)
+{
+    *handlePtr = NULL;
+
+    char devicePath[DEVICE_PATH_BYTES];
+    const int snprintfResult = snprintf(devicePath, sizeof(devicePath), "/dev/%s", deviceName);
+    if (snprintfResult > (sizeof(devicePath) - 1))
+    {
+        LE_ERROR("deviceName argument is too long (%s)", deviceName);
+        return LE_BAD_PARAMETER;
+    }
+    if (snprintfResult < 0)
+    {
+        LE_ERROR("String formatting error");
+        return LE_FAULT;
+    }
+
+    struct stat deviceFileStat;
+    if (spiLib_Stat(devicePath, &deviceFileStat) != 0)
+    {
+        if (errno == ENOENT)
+        {
+            return LE_NOT_FOUND;
+        }
+        else if (errno == EACCES)
+        {
+            return LE_NOT_PERMITTED;
+        }
+        return LE_FAULT;
+    }
+
+    le_mutex_Lock(g.mutex);
+    le_result_t result = LE_OK;
+    Device_t* device = findDeviceWithInode(deviceFileStat.st_ino);
+    if (device == NULL)
+    {
+        result = openDevice(devicePath, deviceFileStat.st_ino, &device);
+    }
+    if (result == LE_OK)
+    {
+        device->numHandles++;
+
+        Handle_t* handle = le_mem_ForceAlloc(g.handlePool);
+        handle->device = device;
+        handle->owner = le_thread_GetCurrent();
+        handle->config.valid = false;
+        handle->goodConfig.valid = false;
+        handle->configureFailures = 0;
+        handle->emulatedSettings = 0;
+        handle->ioctlsAvoided = 0;
+        handle->ref = le_ref_CreateRef(g.handleRefMap, handle);
+        *handlePtr = handle->ref;
+    }
+    le_mutex_Unlock(g.mutex);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Closes a handle.  The device file, and with it the device's lock, is closed once no handle of
+ * the process has it open.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiDirect_Close
+(
+    spiDirect_HandleRef_t ref  ///< Handle to close
+)
+{
+    Handle_t* handle = lookupHandle(ref);
+    Device_t* device = handle->device;
+
+    le_mutex_Lock(g.mutex);
+    le_ref_DeleteRef(g.handleRefMap, ref);
+    le_mem_Release(handle);
+
+    device->numHandles--;
+    if (device->numHandles == 0)
+    {
+        if (spiLib_Close(device->fd) != 0)
+        {
+            LE_WARN("Couldn't close the fd cleanly: (%m)");
+        }
+        le_dls_Remove(&g.devices, &device->link);
+        le_mutex_Delete(device->mutex);
+        le_mem_Release(device);
+    }
+    le_mutex_Unlock(g.mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Configures an SPI device for this handle, as spi_Configure does.  Only the settings which differ
+ * from the configuration currently applied to the device are written.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the mode has bits which spidev doesn't define
+ *      - LE_UNSUPPORTED if the mode has dual or quad bits which the controller doesn't support
+ *      - LE_FAULT if the driver rejected a setting
+ *
+ * @note
+ *      On failure the handle keeps its last configuration which applied without error, and
+ *      spiDirect_GetConfigureFailures tells which settings failed.  Bits per word and LSB first
+ *      which the controller rejects are done in software rather than failing, as reported by
+ *      spiDirect_GetEmulatedSettings.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiDirect_Configure
+(
+    spiDirect_HandleRef_t ref,  ///< Handle for the SPI master to configure
+    int mode,                   ///< Mode options as defined in spidev.h
+    uint8_t bits,               ///< Bits per word
+    uint32_t speed,             ///< Maximum clock speed (Hz)
+    int msb                     ///< 0 to transfer words MSB first or 1 for LSB first
+)
+{
+    if ((mode & ~(0xFF | WIDTH_MODES)) != 0)
+    {
+        LE_ERROR("Invalid SPI mode 0x%x", mode);
+        return LE_BAD_PARAMETER;
+    }
+
+    Handle_t* handle = acquireDevice(ref);
+    le_result_t result = LE_OK;
+    const uint32_t unsupported = mode & WIDTH_MODES & ~handle->device->widthModes;
+    if (unsupported != 0)
+    {
+        LE_ERROR("Controller doesn't support modes 0x%x", unsupported);
+        handle->configureFailures = SPILIB_CONFIG_MODE;
+        result = LE_UNSUPPORTED;
+    }
+    else
+    {
+        handle->config.valid = true;
+        handle->config.mode = mode;
+        handle->config.bits = bits;
+        handle->config.speed = speed;
+        handle->config.msb = msb;
+        handle->configureFailures = 0;
+        result = applyConfig(handle);
+    }
+    releaseDevice(handle);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the settings which failed to apply since the handle was last configured.
+ *
+ * @return
+ *      Any of SPILIB_CONFIG_MODE, SPILIB_CONFIG_BITS, SPILIB_CONFIG_SPEED and
+ *      SPILIB_CONFIG_LSB_FIRST.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiDirect_GetConfigureFailures
+(
+    spiDirect_HandleRef_t ref  ///< Handle to query
+)
+{
+    Handle_t* handle = acquireDevice(ref);
+    const uint32_t failures = handle->configureFailures;
+    releaseDevice(handle);
+    return failures;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the settings of the handle's configuration which the controller rejected and which are
+ * done in software instead.
+ *
+ * @return
+ *      Any of SPILIB_CONFIG_BITS and SPILIB_CONFIG_LSB_FIRST.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiDirect_GetEmulatedSettings
+(
+    spiDirect_HandleRef_t ref  ///< Handle to query
+)
+{
+    Handle_t* handle = acquireDevice(ref);
+    const uint32_t emulated = handle->emulatedSettings;
+    releaseDevice(handle);
+    return emulated;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the dual and quad modes which the controller of a handle's device supports.
+ *
+ * @return
+ *      The supported modes out of SPI_TX_DUAL, SPI_TX_QUAD, SPI_RX_DUAL and SPI_RX_QUAD of
+ *      spidev.h.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiDirect_GetSupportedWidths
+(
+    spiDirect_HandleRef_t ref  ///< Handle to query
+)
+{
+    return lookupHandle(ref)->device->widthModes;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * SPI Half Duplex Write followed by Half Duplex Read
+ *
+ * @return
+ *      LE_OK on success or LE_FAULT on failure.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiDirect_WriteReadHD
+(
+    spiDirect_HandleRef_t ref,  ///< Handle for the SPI master to perform the write-read on
+    const uint8_t* writeData,   ///< Tx command/address being sent to slave
+    size_t writeDataLength,     ///< Number of bytes in tx message
+    uint8_t* readData,          ///< Rx response from slave
+    size_t* readDataLength      ///< Number of bytes in rx message
+)
+{
+    Handle_t* handle = acquireDevice(ref);
+    applyConfig(handle);
+    const le_result_t result = spiLib_WriteReadHD(
+        handle->device->fd, writeData, writeDataLength, readData, readDataLength);
+    releaseDevice(handle);
+    return (result == LE_OK) ? LE_OK : LE_FAULT;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * SPI Write for Half Duplex Communication
+ *
+ * @return
+ *      LE_OK on success or LE_FAULT on failure.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiDirect_WriteHD
+(
+    spiDirect_HandleRef_t ref,  ///< Handle for the SPI master to perform the write on
+    const uint8_t* writeData,   ///< Tx data being sent to slave
+    size_t writeDataLength      ///< Number of bytes in tx message
+)
+{
+    Handle_t* handle = acquireDevice(ref);
+    applyConfig(handle);
+    const le_result_t result = spiLib_WriteHD(handle->device->fd, writeData, writeDataLength);
+    releaseDevice(handle);
+    return (result == LE_OK) ? LE_OK : LE_FAULT;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * SPI Write and Read for Full Duplex Communication
+ *
+ * @return
+ *      LE_OK on success or LE_FAULT on failure.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiDirect_WriteReadFD
+(
+    spiDirect_HandleRef_t ref,  ///< Handle for the SPI master to perform the write-read on
+    const uint8_t* writeData,   ///< Tx data being sent to slave
+    uint8_t* readData,          ///< Rx data received from slave
+    size_t dataLength           ///< Number of bytes in both readData and writeData
+)
+{
+    Handle_t* handle = acquireDevice(ref);
+    applyConfig(handle);
+    const le_result_t result =
+        spiLib_WriteReadFD(handle->device->fd, writeData, readData, dataLength);
+    releaseDevice(handle);
+    return (result == LE_OK) ? LE_OK : LE_FAULT;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * SPI Read for Half Duplex Communication
+ *
+ * @return
+ *      LE_OK on success or LE_FAULT on failure.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiDirect_ReadHD
+(
+    spiDirect_HandleRef_t ref,  ///< Handle for the SPI master to perform the read on
+    uint8_t* readData,          ///< Rx data received from slave
+    size_t* readDataLength      ///< Number of bytes in rx message
+)
+{
+    Handle_t* handle = acquireDevice(ref);
+    applyConfig(handle);
+    const le_result_t result = spiLib_ReadHD(handle->device->fd, readData, readDataLength);
+    releaseDevice(handle);
+    return (result == LE_OK) ? LE_OK : LE_FAULT;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs a list of segments as one SPI message.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the message is too large for the driver
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiDirect_Transfer
+(
+    spiDirect_HandleRef_t ref,          ///< Handle for the SPI master to perform the message on
+    const spiLib_Segment_t* segments,   ///< Segments of the message
+    size_t numSegments                  ///< Number of segments
+)
+{
+    Handle_t* handle = acquireDevice(ref);
+    applyConfig(handle);
+    const le_result_t result = spiLib_Transfer(handle->device->fd, segments, numSegments);
+    releaseDevice(handle);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Looks up a handle and checks that the calling thread owns it.  Using a handle which is invalid
+ * or owned by another thread is fatal, as it is for clients of spiService.
+ *
+ * @return
+ *      The handle.
+ */
+//--------------------------------------------------------------------------------------------------
+static Handle_t* lookupHandle
+(
+    spiDirect_HandleRef_t ref
+)
+{
+    le_mutex_Lock(g.mutex);
+    Handle_t* handle = le_ref_Lookup(g.handleRefMap, ref);
+    le_mutex_Unlock(g.mutex);
+
+    LE_FATAL_IF(handle == NULL, "Failed to lookup device from handle!");
+    LE_FATAL_IF(
+        handle->owner != le_thread_GetCurrent(),
+        "Cannot use handle as it is not owned by the calling thread");
+    return handle;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Looks up a handle and takes its device for the calling thread.
+ *
+ * @return
+ *      The handle, whose device must be released with releaseDevice.
+ */
+//--------------------------------------------------------------------------------------------------
+static Handle_t* acquireDevice
+(
+    spiDirect_HandleRef_t ref
+)
+{
+    Handle_t* handle = lookupHandle(ref);
+    le_mutex_Lock(handle->device->mutex);
+    return handle;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Lets other handles use a device taken by acquireDevice.
+ */
+//--------------------------------------------------------------------------------------------------
+static void releaseDevice
+(
+    Handle_t* handle
+)
+{
+    le_mutex_Unlock(handle->device->mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Applies the handle's configuration to its device, which the caller must have acquired.  If any
+ * setting fails, the handle goes back to its last configuration which applied without error.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if a setting failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t applyConfig
+(
+    Handle_t* handle
+)
+{
+    if (!handle->config.valid)
+    {
+        return LE_OK;
+    }
+
+    Device_t* device = handle->device;
+    const uint32_t failed =
+        spiLib_ApplyConfig(device->fd, &device->config, &handle->config, &handle->ioctlsAvoided);
+    if (failed == 0)
+    {
+        handle->goodConfig = handle->config;
+        handle->emulatedSettings = device->config.emulated;
+        return LE_OK;
+    }
+
+    LE_ERROR("Configuration settings 0x%x failed, restoring the last good configuration", failed);
+    handle->configureFailures |= failed;
+    handle->config = handle->goodConfig;
+    if (handle->config.valid &&
+        spiLib_ApplyConfig(
+            device->fd, &device->config, &handle->config, &handle->ioctlsAvoided) != 0)
+    {
+        LE_ERROR("Couldn't restore the last good configuration");
+    }
+    return LE_FAULT;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens a device file which no handle of the process has open yet, and takes its lock.  Must be
+ * called with the mutex held.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_FOUND if the SPI device file could not be found
+ *      - LE_NOT_PERMITTED if the SPI device file can't be opened for read/write
+ *      - LE_BUSY if spiService or another process is using the device
+ *      - LE_FAULT for non-specific failures
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t openDevice
+(
+    const char* devicePath,   ///< Path of the device file
+    ino_t inode,              ///< Inode of the device file
+    Device_t** devicePtr      ///< [out] The opened device, with no handles
+)
+{
+    const int fd = spiLib_Open(devicePath, O_RDWR);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return LE_NOT_FOUND;
+        }
+        else if (errno == EACCES)
+        {
+            return LE_NOT_PERMITTED;
+        }
+        return LE_FAULT;
+    }
+
+    const le_result_t lockResult = spiLib_Lock(fd);
+    if (lockResult != LE_OK)
+    {
+        LE_ERROR("%s is in use by another process", devicePath);
+        spiLib_Close(fd);
+        return lockResult;
+    }
+
+    Device_t* device = le_mem_ForceAlloc(g.devicePool);
+    device->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+    device->fd = fd;
+    device->inode = inode;
+    device->widthModes = spiLib_ProbeModes(fd, WIDTH_MODES);
+    device->config.valid = false;
+    device->mutex = le_mutex_CreateNonRecursive("SPI Direct Device");
+    device->numHandles = 0;
+    le_dls_Queue(&g.devices, &device->link);
+
+    *devicePtr = device;
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Searches for an open device with the given inode.  Must be called with the mutex held.
+ *
+ * @return
+ *      Device with the given inode or NULL if a matching device was not found.
+ */
+//--------------------------------------------------------------------------------------------------
+static Device_t* findDeviceWithInode
+(
+    ino_t inode
+)
+{
+    le_dls_Link_t* link = le_dls_Peek(&g.devices);
+    while (link != NULL)
+    {
+        Device_t* device = CONTAINER_OF(link, Device_t, link);
+        if (device->inode == inode)
+        {
+            return device;
+        }
+        link = le_dls_PeekNext(&g.devices, link);
+    }
+    return NULL;
+}
+
+
+COMPONENT_INIT
+{
+    g.mutex = le_mutex_CreateNonRecursive("SPI Direct");
+    g.devicePool = le_mem_CreatePool("SPI Direct Devices", sizeof(Device_t));
+    g.devices = (le_dls_List_t)LE_DLS_LIST_INIT;
+    g.handlePool = le_mem_CreatePool("SPI Direct Handles", sizeof(Handle_t));
+    const size_t maxExpectedHandles = 8;
+    g.handleRefMap = le_ref_CreateMap("SPI direct handles", maxExpectedHandles);
+}
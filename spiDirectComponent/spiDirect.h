@@ -0,0 +1,61 @@
+#ifndef SPI_DIRECT_H
+#define SPI_DIRECT_H
+
+#include "legato.h"
+#include "spiLibrary.h"
+
+// In-process access to SPI devices for trusted apps, for which the IPC round trip to spiService
+// would cost more than the transfers themselves.  Handles work as spiService handles do: each
+// has its own configuration, applied to the device before its transfers whenever another handle
+// changed it, and belongs to the thread which opened it.  A device is used either by spiService
+// or by one process through this library, never both; whichever opens it first holds an advisory
+// lock on it until its last handle is closed.
+
+typedef struct spiDirect_Handle* spiDirect_HandleRef_t;
+
+LE_SHARED le_result_t spiDirect_Open(const char* deviceName, spiDirect_HandleRef_t* handle);
+
+LE_SHARED void spiDirect_Close(spiDirect_HandleRef_t handle);
+
+LE_SHARED le_result_t spiDirect_Configure(
+    spiDirect_HandleRef_t handle,
+    int mode,
+    uint8_t bits,
+    uint32_t speed,
+    int msb);
+
+LE_SHARED uint32_t spiDirect_GetConfigureFailures(spiDirect_HandleRef_t handle);
+
+LE_SHARED uint32_t spiDirect_GetEmulatedSettings(spiDirect_HandleRef_t handle);
+
+LE_SHARED uint32_t spiDirect_GetSupportedWidths(spiDirect_HandleRef_t handle);
+
+LE_SHARED le_result_t spiDirect_WriteReadHD(
+    spiDirect_HandleRef_t handle,
+    const uint8_t* writeData,
+    size_t writeDataLength,
+    uint8_t* readData,
+    size_t* readDataLength);
+
+LE_SHARED le_result_t spiDirect_WriteHD(
+    spiDirect_HandleRef_t handle,
+    const uint8_t* writeData,
+    size_t writeDataLength);
+
+LE_SHARED le_result_t spiDirect_WriteReadFD(
+    spiDirect_HandleRef_t handle,
+    const uint8_t* writeData,
+    uint8_t* readData,
+    size_t dataLength);
+
+LE_SHARED le_result_t spiDirect_ReadHD(
+    spiDirect_HandleRef_t handle,
+    uint8_t* readData,
+    size_t* readDataLength);
+
+LE_SHARED le_result_t spiDirect_Transfer(
+    spiDirect_HandleRef_t handle,
+    const spiLib_Segment_t* segments,
+    size_t numSegments);
+
+#endif  // SPI_DIRECT_H
@@ -0,0 +1,13 @@
+#ifndef SPI_IOC_H
+#define SPI_IOC_H
+
+// spidev ioctl definitions, shared by the spidev backend and the simulator which decodes them
+#include <sys/ioctl.h>
+#include <linux/types.h>
+#include <linux/spi/spidev.h>
+#ifdef SPI_IOC_MAGIC
+#undef SPI_IOC_MAGIC
+#define SPI_IOC_MAGIC 'l'
+#endif
+
+#endif  // SPI_IOC_H
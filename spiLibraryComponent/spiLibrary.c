@@ -1,338 +1,1394 @@
 #include "legato.h"
 #include "spiLibrary.h"
-#include <sys/ioctl.h>
-#include <linux/types.h>
-#include <linux/spi/spidev.h>
-#ifdef SPI_IOC_MAGIC
-#undef SPI_IOC_MAGIC
-#define SPI_IOC_MAGIC 'l'
-#endif
+#include "spiTrace.h"
+#include "spiIoc.h"
+#include "spiSim.h"
+#include "spiWord.h"
+#include <time.h>
+#include <sys/file.h>
+
+// spidev module parameter holding the largest message the driver accepts
+#define SPIDEV_BUFSIZ_PATH "/sys/module/spidev/parameters/bufsiz"
+// spidev's default bufsiz, used when the module parameter can't be read
+#define SPIDEV_DEFAULT_BUFSIZ 4096
+// Number of devices which may have their words converted in software at once
+#define SPILIB_MAX_SOFT_FORMATS 16
+
+// Conversion of the words of a device's transfers in software, set by spiLib_SetSoftFormat
+typedef struct
+{
+    bool used;
+    int fd;
+    uint8_t bits;              ///< Bits per word the device appears to have
+    bool lsbFirst;             ///< The device appears to send words LSB first
+    uint8_t* scratch;          ///< Holds the wire data of the device's transfers
+} SoftFormat_t;
+
+
+static int spidevStat(const char* path, struct stat* buf);
+static int spidevOpen(const char* path, int flags);
+static int spidevClose(int fd);
+static int spidevIoctl(int fd, unsigned long request, void* arg);
+static int spidevFlock(int fd, int operation);
+static uint32_t emulateWords(int fd, const spiLib_Config_t* wanted, uint32_t* failed);
+static int sendMessage(int fd, struct spi_ioc_transfer* tr, unsigned numTransfers);
+static int deliverMessage(int fd, struct spi_ioc_transfer* tr, unsigned numTransfers);
+static int sendSoftMessage(
+    int fd,
+    const SoftFormat_t* format,
+    const struct spi_ioc_transfer* tr,
+    unsigned numTransfers);
+static SoftFormat_t* findSoftFormat(int fd);
+static size_t readMaxMessageSize(void);
+
+// Backend which passes every operation to the kernel spidev driver
+const spiLib_Backend_t spiLib_SpidevBackend =
+{
+    .name = "spidev",
+    .stat = spidevStat,
+    .open = spidevOpen,
+    .close = spidevClose,
+    .ioctl = spidevIoctl,
+    .flock = spidevFlock
+};
+
+static struct
+{
+    // Backend performing all device operations
+    const spiLib_Backend_t* backend;
+    // Protects the software formats
+    le_mutex_Ref_t mutex;
+    // Devices whose words are converted in software
+    SoftFormat_t softFormats[SPILIB_MAX_SOFT_FORMATS];
+    // Number of used softFormats, read without the mutex to skip the search when there are none
+    size_t numSoftFormats;
+    // Memory pool for allocating the scratch buffers of software formats
+    le_mem_PoolRef_t scratchPool;
+    // Largest message the spidev driver accepts, which is also the size of each scratch buffer.
+    // Read once when the library is initialized, so threads can read it without locking.
+    size_t maxMessageSize;
+} g = { .backend = &spiLib_SpidevBackend };
+
+// errno of the calling thread's last message, or 0 if it succeeded
+static __thread int messageErrno;
 
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Configures the SPI bus for use with a specific device.
+ * Selects the backend used for all devices.  Must be called before any device is opened.
  */
 //--------------------------------------------------------------------------------------------------
-void spiLib_Configure
+void spiLib_SetBackend
 (
-    int fd,         ///< name of device file. dont pass */dev* prefix
-    int mode,       ///< Mode options for the bus as defined in spidev.h.  TODO: Perhaps we should
-                    ///  consider redefining the mode options in spiLibrary.h because we should be
-                    ///  abstracting away the underlying spidev.h
-    uint8_t bits,   ///< bits per word
-    uint32_t speed, ///< max speed (Hz)
-    int msb         ///< set as 0 for MSB as first byte or 1 for LSB as first byte
+    const spiLib_Backend_t* backend  ///< spiLib_SpidevBackend or spiLib_SimBackend
 )
 {
-    LE_DEBUG("Running the configure library call");
+    LE_INFO("Using the %s SPI backend", backend->name);
+    g.backend = backend;
+}
 
-    int ret;
 
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_WR_MODE, &mode)) < 0),
-        "SPI modeset failed with error %d: %d (%m)",
-        ret,
-        errno);
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_RD_MODE, &mode)) < 0),
-        "SPI modeget failed with error %d: %d (%m)",
-        ret,
-        errno);
-
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits)) < 0),
-        "SPI bitset failed with error %d : %d (%m)",
-        ret,
-        errno);
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits)) < 0),
-        "SPI bitget failed with error %d : %d (%m)",
-        ret,
-        errno);
-
-
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed)) < 0),
-        "SPI speedset failed with error %d : %d (%m)",
-        ret,
-        errno);
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed)) < 0),
-        "SPI speedget failed with error %d : %d (%m)",
-        ret,
-        errno);
-
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_WR_LSB_FIRST, &msb)) < 0),
-        "SPI MSB/LSB write failed with error %d : %d (%m)",
-        ret,
-        errno);
-    LE_FATAL_IF(
-        ((ret = ioctl(fd, SPI_IOC_RD_LSB_FIRST, &msb)) < 0),
-        "SPI MSB/LSB read failed  with error %d : %d (%m)",
-        ret,
-        errno);
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the status of a device file through the current backend.
+ *
+ * @return
+ *      0 on success or -1 with errno set, as stat(2).
+ */
+//--------------------------------------------------------------------------------------------------
+int spiLib_Stat
+(
+    const char* path,     ///< Path of the device file
+    struct stat* buf      ///< [out] Status of the device file
+)
+{
+    return g.backend->stat(path, buf);
+}
 
 
-    LE_DEBUG("mode is :%d ", mode);
-    LE_DEBUG(" speed is :%d ", speed);
-    LE_DEBUG(" Bit is :%d ", bits);
-    LE_DEBUG("The setup for MSB is :%d", msb);
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens a device file through the current backend.
+ *
+ * @return
+ *      A file descriptor for the other spiLib functions or -1 with errno set, as open(2).
+ */
+//--------------------------------------------------------------------------------------------------
+int spiLib_Open
+(
+    const char* path,     ///< Path of the device file
+    int flags             ///< Flags as for open(2)
+)
+{
+    return g.backend->open(path, flags);
 }
 
 
-/**-----------------------------------------------------------------------------------------------
- * Performs SPI WriteRead Half Duplex. You can send send Read command/ address of data to read.
+//--------------------------------------------------------------------------------------------------
+/**
+ * Closes a device opened with spiLib_Open.
  *
  * @return
- *      - LE_OK
- *      - LE_FAULT
- *
- * @note
- *      Some devices do not support this mode. Check the data sheet of the device.
+ *      0 on success or -1 with errno set, as close(2).
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spiLib_WriteReadHD
+int spiLib_Close
 (
-    int fd,                   ///< open file descriptor of SPI port
-    const uint8_t* writeData, ///< tx command/address being sent to slave
-    size_t writeDataLength,   ///< number of bytes in tx message
-    uint8_t* readData,        ///< rx response from slave
-    size_t* readDataLength    ///< number of bytes in rx message
+    int fd                ///< File descriptor returned by spiLib_Open
 )
 {
-    int transferResult;
-    le_result_t result;
+    spiLib_SetSoftFormat(fd, 8, false);
+    return g.backend->close(fd);
+}
 
-    struct spi_ioc_transfer tr[] =
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Takes the advisory lock which gives a process exclusive use of a device, so that spiService
+ * and clients using the library directly never drive the same device at once.  The lock is
+ * released when the file descriptor is closed.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BUSY if another open of the device holds the lock
+ *      - LE_FAULT if the lock couldn't be taken
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_Lock
+(
+    int fd                ///< File descriptor returned by spiLib_Open
+)
+{
+    if (g.backend->flock(fd, LOCK_EX | LOCK_NB) != 0)
     {
+        if (errno == EWOULDBLOCK)
         {
-            .tx_buf = (unsigned long)writeData,
-            .rx_buf = (unsigned long)NULL,
-            .len = writeDataLength,
-            // .delay_usecs = delay_out,
-            .cs_change = 0
-        },
-        {
-            .tx_buf = (unsigned long)NULL,
-            .rx_buf = (unsigned long)readData,
-            .len = *readDataLength,
-            // .delay_usecs = delay_in,
-            .cs_change = 0
+            return LE_BUSY;
         }
-    };
-
-    LE_DEBUG("Transmitting this message...len:%zu", writeDataLength);
-
-    for (size_t i = 0; i < writeDataLength; i++)
-    {
-        LE_DEBUG("%.2X ", writeData[i]);
+        LE_ERROR("Couldn't lock device: (%m)");
+        return LE_FAULT;
     }
+    return LE_OK;
+}
 
-    transferResult = ioctl(fd, SPI_IOC_MESSAGE(2), tr);
 
-    if (transferResult < 1)
-    {
-        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
-        LE_ERROR("can't send spi message");
-        result = LE_FAULT;
-    }
-    else
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets the SPI mode of a device.  Modes with dual or quad bits, which don't fit in the 8 bit mode
+ * ioctls, are set with the 32 bit ones.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the driver rejected the mode
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_SetMode
+(
+    int fd,         ///< Open file descriptor of SPI port
+    int mode        ///< Mode options for the bus as defined in spidev.h
+)
+{
+    int ret;
+    const bool wide = (mode & ~0xFF) != 0;
+
+    if ((ret = g.backend->ioctl(fd, wide ? SPI_IOC_WR_MODE32 : SPI_IOC_WR_MODE, &mode)) < 0)
     {
-        LE_DEBUG("Successful transmission with success %d", transferResult);
-        result = LE_OK;
+        LE_ERROR("SPI modeset failed with error %d: %d (%m)", ret, errno);
+        return LE_FAULT;
     }
-
-    LE_DEBUG("Received message...");
-    for (size_t i = 0; i < *readDataLength; i++)
+    if ((ret = g.backend->ioctl(fd, wide ? SPI_IOC_RD_MODE32 : SPI_IOC_RD_MODE, &mode)) < 0)
     {
-        LE_DEBUG("%.2X ", readData[i]);
+        LE_ERROR("SPI modeget failed with error %d: %d (%m)", ret, errno);
+        return LE_FAULT;
     }
 
-    return result;
+    LE_DEBUG("mode is :%d ", mode);
+    return LE_OK;
 }
 
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Performs SPI Write Half Duplex.  You can send send Write command/ address of data to write/data
- * to write.
+ * Sets the default number of bits per word of a device.
  *
  * @return
- *      - LE_OK
- *      - LE_FAULT
- *
- * @note
- *      Some devices do not support this mode. Check the data sheet of the device.
+ *      - LE_OK on success
+ *      - LE_FAULT if the driver rejected the setting
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spiLib_WriteHD
+le_result_t spiLib_SetBitsPerWord
 (
-    int fd,                   ///< Open file descriptor of SPI port
-    const uint8_t* writeData, ///< Command/address being sent to slave
-    size_t writeDataLength    ///< Number of bytes in tx message
+    int fd,         ///< Open file descriptor of SPI port
+    uint8_t bits    ///< bits per word
 )
 {
-    int transferResult;
-    le_result_t result;
+    int ret;
 
-    struct spi_ioc_transfer tr[] =
+    if ((ret = g.backend->ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits)) < 0)
     {
-        {
-            .tx_buf = (unsigned long)writeData,
-            .rx_buf = (unsigned long)NULL,
-            .len = writeDataLength,
-            // .delay_usecs = delay_out,
-            .cs_change = 0
-        }
-    };
-
-
-    LE_DEBUG("Transferring this message...len: %zu", writeDataLength);
-    for (size_t i = 0; i < writeDataLength; i++)
+        LE_ERROR("SPI bitset failed with error %d : %d (%m)", ret, errno);
+        return LE_FAULT;
+    }
+    if ((ret = g.backend->ioctl(fd, SPI_IOC_RD_BITS_PER_WORD, &bits)) < 0)
     {
-        LE_DEBUG("%.2X ", writeData[i]);
+        LE_ERROR("SPI bitget failed with error %d : %d (%m)", ret, errno);
+        return LE_FAULT;
     }
 
-    transferResult = ioctl(fd, SPI_IOC_MESSAGE(1), tr);
-    if (transferResult < 1)
+    LE_DEBUG(" Bit is :%d ", bits);
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets the default maximum clock speed of a device.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the driver rejected the setting
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_SetSpeed
+(
+    int fd,         ///< Open file descriptor of SPI port
+    uint32_t speed  ///< max speed (Hz)
+)
+{
+    int ret;
+
+    if ((ret = g.backend->ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed)) < 0)
     {
-        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
-        LE_ERROR("can't send spi message");
-        result = LE_FAULT;
+        LE_ERROR("SPI speedset failed with error %d : %d (%m)", ret, errno);
+        return LE_FAULT;
     }
-    else
+    if ((ret = g.backend->ioctl(fd, SPI_IOC_RD_MAX_SPEED_HZ, &speed)) < 0)
     {
-        LE_DEBUG("%d", transferResult);
-        result = LE_OK;
+        LE_ERROR("SPI speedget failed with error %d : %d (%m)", ret, errno);
+        return LE_FAULT;
     }
 
-    return result;
+    LE_DEBUG(" speed is :%d ", speed);
+    return LE_OK;
 }
 
 
-/**-----------------------------------------------------------------------------------------------
- * Performs SPI WriteRead Full Duplex. You can send send Read command/ address of data to read.
+//--------------------------------------------------------------------------------------------------
+/**
+ * Selects whether a device transfers words MSB or LSB first.
  *
  * @return
- *      - LE_OK
- *      - LE_FAULT
- *
- * @note
- *      Some devices do not support this mode. Check the data sheet of the device.
+ *      - LE_OK on success
+ *      - LE_FAULT if the driver rejected the setting
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spiLib_WriteReadFD
+le_result_t spiLib_SetLsbFirst
 (
-    int fd,                   ///< open file descriptor of SPI port
-    const uint8_t* writeData, ///< tx command/address being sent to slave
-    uint8_t* readData,        ///< rx response from slave
-    size_t dataLength         ///< number of bytes in tx message
+    int fd,         ///< Open file descriptor of SPI port
+    int msb         ///< set as 0 for MSB as first byte or 1 for LSB as first byte
 )
 {
-    int transferResult;
-    le_result_t result;
+    int ret;
 
-    struct spi_ioc_transfer tr[] =
+    if ((ret = g.backend->ioctl(fd, SPI_IOC_WR_LSB_FIRST, &msb)) < 0)
     {
-        {
-            .tx_buf = (unsigned long)writeData,
-            .rx_buf = (unsigned long)readData,
-            .len = dataLength,
-            // .delay_usecs = delay_out,
-            .cs_change = 0
-        },
-    };
-
-    LE_DEBUG("Transmitting this message...len:%zu", dataLength);
-
-    for (size_t i = 0; i < dataLength; i++)
+        LE_ERROR("SPI MSB/LSB write failed with error %d : %d (%m)", ret, errno);
+        return LE_FAULT;
+    }
+    if ((ret = g.backend->ioctl(fd, SPI_IOC_RD_LSB_FIRST, &msb)) < 0)
     {
-        LE_DEBUG("%.2X ", writeData[i]);
+        LE_ERROR("SPI MSB/LSB read failed  with error %d : %d (%m)", ret, errno);
+        return LE_FAULT;
     }
 
-    transferResult = ioctl(fd, SPI_IOC_MESSAGE(1), tr);
+    LE_DEBUG("The setup for MSB is :%d", msb);
+    return LE_OK;
+}
 
-    if (transferResult < 1)
-    {
-        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
 
-       LE_ERROR("can't send spi message");
-        result = LE_FAULT;
+//--------------------------------------------------------------------------------------------------
+/**
+ * Finds which of the given mode bits the controller of a device supports.  The bits are set on
+ * the device and read back, since the kernel drops dual and quad bits the controller lacks rather
+ * than rejecting them, and the device's mode is then restored.
+ *
+ * @return
+ *      The bits of modes which the controller kept, or 0 if the driver predates 32 bit modes.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiLib_ProbeModes
+(
+    int fd,         ///< Open file descriptor of SPI port
+    uint32_t modes  ///< Mode bits to probe, such as SPI_TX_DUAL
+)
+{
+    uint32_t current;
+    if (g.backend->ioctl(fd, SPI_IOC_RD_MODE32, &current) < 0)
+    {
+        LE_WARN("Driver doesn't support 32 bit modes: %m");
+        return 0;
     }
-    else
+
+    uint32_t probed = current | modes;
+    if (g.backend->ioctl(fd, SPI_IOC_WR_MODE32, &probed) < 0 ||
+        g.backend->ioctl(fd, SPI_IOC_RD_MODE32, &probed) < 0)
     {
-        LE_DEBUG("Successful transmission with success %d", transferResult);
-        result = LE_OK;
+        LE_WARN("Failed to probe modes 0x%x: %m", modes);
+        probed = 0;
     }
 
-    LE_DEBUG("Received message...");
-    for (size_t i = 0; i < dataLength; i++)
+    if (g.backend->ioctl(fd, SPI_IOC_WR_MODE32, &current) < 0)
     {
-        LE_DEBUG("%.2X ", readData[i]);
+        // The mode is written again before the device is used
+        LE_ERROR("Failed to restore SPI mode 0x%x: %d (%m)", current, errno);
     }
 
-    return result;
+    LE_DEBUG("Controller supports 0x%x of modes 0x%x", probed & modes, modes);
+    return probed & modes;
 }
 
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Performs SPI Read.  You can send send Write command/ address of data to write/data to write.
+ * Configures the SPI bus for use with a specific device.  Every setting is attempted even if an
+ * earlier one fails.
  *
  * @return
- *      - LE_OK
- *      - LE_FAULT
- *
- * @note
- *      Some devices do not support this mode. Check the data sheet of the device.
+ *      - LE_OK on success
+ *      - LE_FAULT if the driver rejected any of the settings
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spiLib_ReadHD
+le_result_t spiLib_Configure
 (
-    int fd,                   ///< Open file descriptor of SPI port
-    uint8_t* readData,        ///< Data being sent by slave
-    size_t* readDataLength    ///< Number of bytes in rx message
+    int fd,         ///< name of device file. dont pass */dev* prefix
+    int mode,       ///< Mode options for the bus as defined in spidev.h.  TODO: Perhaps we should
+                    ///  consider redefining the mode options in spiLibrary.h because we should be
+                    ///  abstracting away the underlying spidev.h
+    uint8_t bits,   ///< bits per word
+    uint32_t speed, ///< max speed (Hz)
+    int msb         ///< set as 0 for MSB as first byte or 1 for LSB as first byte
 )
 {
-    int transferResult;
-    le_result_t result;
-
-    struct spi_ioc_transfer tr[] =
-    {
-        {
-            .tx_buf = (unsigned long)NULL,
-            .rx_buf = (unsigned long)readData,
-            .len = *readDataLength,
-            // .delay_usecs = delay_out,
-            .cs_change = 0
-        }
-    };
+    LE_DEBUG("Running the configure library call");
 
-    transferResult = ioctl(fd, SPI_IOC_MESSAGE(1), tr);
-    if (transferResult < 1)
+    le_result_t result = spiLib_SetMode(fd, mode);
+    if (spiLib_SetBitsPerWord(fd, bits) != LE_OK)
     {
-        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
-        LE_ERROR("can't receive spi message");
         result = LE_FAULT;
     }
-    else
+    if (spiLib_SetSpeed(fd, speed) != LE_OK)
     {
-        LE_DEBUG("%d", transferResult);
-        result = LE_OK;
+        result = LE_FAULT;
     }
-    LE_DEBUG("Received message...");
-    for (size_t i = 0; i < *readDataLength; i++)
+    if (spiLib_SetLsbFirst(fd, msb) != LE_OK)
     {
-        LE_DEBUG("%.2X ", readData[i]);
+        result = LE_FAULT;
     }
-
     return result;
 }
 
 
-COMPONENT_INIT
-{
+//--------------------------------------------------------------------------------------------------
+/**
+ * Applies a configuration to a device, writing only the settings which differ from those already
+ * applied.  Devices shared by several users keep track of what is applied, so that switching
+ * between users with the same configuration costs no ioctls.
+ *
+ * @return
+ *      The SPILIB_CONFIG_ bits of the settings which failed, or 0 on success.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiLib_ApplyConfig
+(
+    int fd,                         ///< Open file descriptor of SPI port
+    spiLib_Config_t* applied,       ///< [in/out] Configuration currently applied to the device
+    const spiLib_Config_t* wanted,  ///< Configuration to apply
+    uint64_t* ioctlsAvoided         ///< [in/out] Incremented by the ioctls skipped
+)
+{
+    uint32_t failed = 0;
+    // While words are converted in software the device runs 8 bit MSB first words, so changing
+    // either setting means writing both
+    const bool soft = applied->valid && (applied->emulated != 0);
+    const bool writeBits = !applied->valid || applied->bits != wanted->bits ||
+                           (soft && applied->msb != wanted->msb);
+    const bool writeMsb = !applied->valid || applied->msb != wanted->msb ||
+                          (soft && applied->bits != wanted->bits);
+
+    if (!applied->valid || applied->mode != wanted->mode)
+    {
+        if (spiLib_SetMode(fd, wanted->mode) != LE_OK)
+        {
+            failed |= SPILIB_CONFIG_MODE;
+        }
+    }
+    else
+    {
+        *ioctlsAvoided += SPILIB_IOCTLS_PER_SETTING;
+    }
+
+    if (writeBits)
+    {
+        if (spiLib_SetBitsPerWord(fd, wanted->bits) != LE_OK)
+        {
+            failed |= SPILIB_CONFIG_BITS;
+        }
+    }
+    else
+    {
+        *ioctlsAvoided += SPILIB_IOCTLS_PER_SETTING;
+    }
+
+    if (!applied->valid || applied->speed != wanted->speed)
+    {
+        if (spiLib_SetSpeed(fd, wanted->speed) != LE_OK)
+        {
+            failed |= SPILIB_CONFIG_SPEED;
+        }
+    }
+    else
+    {
+        *ioctlsAvoided += SPILIB_IOCTLS_PER_SETTING;
+    }
+
+    if (writeMsb)
+    {
+        if (spiLib_SetLsbFirst(fd, wanted->msb) != LE_OK)
+        {
+            failed |= SPILIB_CONFIG_LSB_FIRST;
+        }
+    }
+    else
+    {
+        *ioctlsAvoided += SPILIB_IOCTLS_PER_SETTING;
+    }
+
+    uint32_t emulated = applied->valid ? applied->emulated : 0;
+    if (writeBits || writeMsb)
+    {
+        emulated = emulateWords(fd, wanted, &failed);
+    }
+
+    *applied = *wanted;
+    // What a failed setting left on the device is unknown, so write everything next time
+    applied->valid = (failed == 0);
+    applied->emulated = emulated;
+    return failed;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Makes the transfers of a device convert their data in software, so that a device running 8 bit
+ * MSB first words behaves as one with the given bits per word and bit order.  spiLib_ApplyConfig
+ * does this for settings the controller rejects.  Each transfer must hold whole words; if its
+ * words don't fill the last byte on the wire, the byte is padded with zero bits, which the slave
+ * sees as extra clocks.  Must not be called during a transfer on the device.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NO_MEMORY if too many devices have their words converted
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_SetSoftFormat
+(
+    int fd,         ///< Open file descriptor of SPI port
+    uint8_t bits,   ///< Bits per word, up to 32; 0 means 8
+    bool lsbFirst   ///< Send words LSB first
+)
+{
+    LE_ASSERT(bits <= 32);
+    if (bits == 0)
+    {
+        bits = 8;
+    }
+
+    le_result_t result = LE_OK;
+    le_mutex_Lock(g.mutex);
+    SoftFormat_t* format = findSoftFormat(fd);
+    if (bits == 8 && !lsbFirst)
+    {
+        // The controller's own words need no conversion
+        if (format != NULL)
+        {
+            le_mem_Release(format->scratch);
+            format->used = false;
+            __atomic_store_n(&g.numSoftFormats, g.numSoftFormats - 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; format == NULL && i < SPILIB_MAX_SOFT_FORMATS; i++)
+        {
+            if (!g.softFormats[i].used)
+            {
+                format = &g.softFormats[i];
+                format->used = true;
+                format->fd = fd;
+                format->scratch = le_mem_ForceAlloc(g.scratchPool);
+                __atomic_store_n(&g.numSoftFormats, g.numSoftFormats + 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (format != NULL)
+        {
+            format->bits = bits;
+            format->lsbFirst = lsbFirst;
+        }
+        else
+        {
+            LE_ERROR("Too many devices with words converted in software");
+            result = LE_NO_MEMORY;
+        }
+    }
+    le_mutex_Unlock(g.mutex);
+    return result;
+}
+
+
+/**-----------------------------------------------------------------------------------------------
+ * Performs SPI WriteRead Half Duplex. You can send send Read command/ address of data to read.
+ *
+ * @return
+ *      - LE_OK
+ *      - LE_FAULT
+ *
+ * @note
+ *      Some devices do not support this mode. Check the data sheet of the device.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_WriteReadHD
+(
+    int fd,                   ///< open file descriptor of SPI port
+    const uint8_t* writeData, ///< tx command/address being sent to slave
+    size_t writeDataLength,   ///< number of bytes in tx message
+    uint8_t* readData,        ///< rx response from slave
+    size_t* readDataLength    ///< number of bytes in rx message
+)
+{
+    int transferResult;
+    le_result_t result;
+
+    struct spi_ioc_transfer tr[] =
+    {
+        {
+            .tx_buf = (unsigned long)writeData,
+            .rx_buf = (unsigned long)NULL,
+            .len = writeDataLength,
+            // .delay_usecs = delay_out,
+            .cs_change = 0
+        },
+        {
+            .tx_buf = (unsigned long)NULL,
+            .rx_buf = (unsigned long)readData,
+            .len = *readDataLength,
+            // .delay_usecs = delay_in,
+            .cs_change = 0
+        }
+    };
+
+    transferResult = sendMessage(fd, tr, 2);
+
+    if (transferResult < 1)
+    {
+        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
+        LE_ERROR("can't send spi message");
+        result = LE_FAULT;
+    }
+    else
+    {
+        LE_DEBUG("Successful transmission with success %d", transferResult);
+        result = LE_OK;
+    }
+
+    SPI_TRACE_TRANSFER(
+        "WriteReadHD", writeData, writeDataLength, readData, *readDataLength, result);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs SPI Write Half Duplex.  You can send send Write command/ address of data to write/data
+ * to write.
+ *
+ * @return
+ *      - LE_OK
+ *      - LE_FAULT
+ *
+ * @note
+ *      Some devices do not support this mode. Check the data sheet of the device.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_WriteHD
+(
+    int fd,                   ///< Open file descriptor of SPI port
+    const uint8_t* writeData, ///< Command/address being sent to slave
+    size_t writeDataLength    ///< Number of bytes in tx message
+)
+{
+    int transferResult;
+    le_result_t result;
+
+    struct spi_ioc_transfer tr[] =
+    {
+        {
+            .tx_buf = (unsigned long)writeData,
+            .rx_buf = (unsigned long)NULL,
+            .len = writeDataLength,
+            // .delay_usecs = delay_out,
+            .cs_change = 0
+        }
+    };
+
+    transferResult = sendMessage(fd, tr, 1);
+    if (transferResult < 1)
+    {
+        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
+        LE_ERROR("can't send spi message");
+        result = LE_FAULT;
+    }
+    else
+    {
+        LE_DEBUG("%d", transferResult);
+        result = LE_OK;
+    }
+
+    SPI_TRACE_TRANSFER("WriteHD", writeData, writeDataLength, NULL, 0, result);
+
+    return result;
+}
+
+
+/**-----------------------------------------------------------------------------------------------
+ * Performs SPI WriteRead Full Duplex. You can send send Read command/ address of data to read.
+ *
+ * @return
+ *      - LE_OK
+ *      - LE_FAULT
+ *
+ * @note
+ *      Some devices do not support this mode. Check the data sheet of the device.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_WriteReadFD
+(
+    int fd,                   ///< open file descriptor of SPI port
+    const uint8_t* writeData, ///< tx command/address being sent to slave
+    uint8_t* readData,        ///< rx response from slave
+    size_t dataLength         ///< number of bytes in tx message
+)
+{
+    int transferResult;
+    le_result_t result;
+
+    struct spi_ioc_transfer tr[] =
+    {
+        {
+            .tx_buf = (unsigned long)writeData,
+            .rx_buf = (unsigned long)readData,
+            .len = dataLength,
+            // .delay_usecs = delay_out,
+            .cs_change = 0
+        },
+    };
+
+    transferResult = sendMessage(fd, tr, 1);
+
+    if (transferResult < 1)
+    {
+        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
+
+       LE_ERROR("can't send spi message");
+        result = LE_FAULT;
+    }
+    else
+    {
+        LE_DEBUG("Successful transmission with success %d", transferResult);
+        result = LE_OK;
+    }
+
+    SPI_TRACE_TRANSFER("WriteReadFD", writeData, dataLength, readData, dataLength, result);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs SPI Read.  You can send send Write command/ address of data to write/data to write.
+ *
+ * @return
+ *      - LE_OK
+ *      - LE_FAULT
+ *
+ * @note
+ *      Some devices do not support this mode. Check the data sheet of the device.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_ReadHD
+(
+    int fd,                   ///< Open file descriptor of SPI port
+    uint8_t* readData,        ///< Data being sent by slave
+    size_t* readDataLength    ///< Number of bytes in rx message
+)
+{
+    int transferResult;
+    le_result_t result;
+
+    struct spi_ioc_transfer tr[] =
+    {
+        {
+            .tx_buf = (unsigned long)NULL,
+            .rx_buf = (unsigned long)readData,
+            .len = *readDataLength,
+            // .delay_usecs = delay_out,
+            .cs_change = 0
+        }
+    };
+
+    transferResult = sendMessage(fd, tr, 1);
+    if (transferResult < 1)
+    {
+        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
+        LE_ERROR("can't receive spi message");
+        result = LE_FAULT;
+    }
+    else
+    {
+        LE_DEBUG("%d", transferResult);
+        result = LE_OK;
+    }
+    SPI_TRACE_TRANSFER("ReadHD", NULL, 0, readData, *readDataLength, result);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a sequence of segments as a single SPI message.  Chip select stays asserted between
+ * segments unless a segment requests a chip select change.
+ *
+ * @return
+ *      - LE_OK
+ *      - LE_OUT_OF_RANGE if there are more than SPILIB_MAX_SEGMENTS segments or the message is
+ *        larger than the spidev driver accepts
+ *      - LE_FAULT
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_Transfer
+(
+    int fd,                            ///< Open file descriptor of SPI port
+    const spiLib_Segment_t* segments,  ///< Segments to perform in order
+    size_t numSegments                 ///< Number of entries in segments
+)
+{
+    if (numSegments == 0)
+    {
+        return LE_OK;
+    }
+    if (numSegments > SPILIB_MAX_SEGMENTS)
+    {
+        LE_ERROR("Too many segments in transfer (%zu)", numSegments);
+        return LE_OUT_OF_RANGE;
+    }
+
+    struct spi_ioc_transfer tr[SPILIB_MAX_SEGMENTS];
+    memset(tr, 0, numSegments * sizeof(tr[0]));
+    size_t totalLength = 0;
+    for (size_t i = 0; i < numSegments; i++)
+    {
+        totalLength += segments[i].length;
+        tr[i].tx_buf = (unsigned long)segments[i].txBuf;
+        tr[i].rx_buf = (unsigned long)segments[i].rxBuf;
+        tr[i].len = segments[i].length;
+        tr[i].speed_hz = segments[i].speedHz;
+        tr[i].delay_usecs = segments[i].delayUsecs;
+        tr[i].bits_per_word = segments[i].bitsPerWord;
+        tr[i].tx_nbits = segments[i].txNbits;
+        tr[i].rx_nbits = segments[i].rxNbits;
+        tr[i].cs_change = segments[i].csChange ? 1 : 0;
+    }
+
+    if (totalLength > spiLib_GetMaxMessageSize())
+    {
+        LE_ERROR(
+            "Message of %zu bytes exceeds the spidev limit of %zu bytes",
+            totalLength,
+            spiLib_GetMaxMessageSize());
+        return LE_OUT_OF_RANGE;
+    }
+
+    le_result_t result = LE_OK;
+    const int transferResult = sendMessage(fd, tr, numSegments);
+    if (transferResult < 0)
+    {
+        LE_ERROR("Transfer failed with error %d : %d (%m)", transferResult, errno);
+        result = LE_FAULT;
+    }
+
+    SPI_TRACE_SEGMENTS("Transfer", segments, numSegments, result);
+
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the largest message, in bytes, that the spidev driver accepts in one SPI_IOC_MESSAGE.  The
+ * driver's bufsiz module parameter is read when the library is initialized.
+ *
+ * @return
+ *      The maximum message size in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+size_t spiLib_GetMaxMessageSize
+(
+    void
+)
+{
+    return g.maxMessageSize;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads the spidev driver's bufsiz module parameter.
+ *
+ * @return
+ *      The maximum message size in bytes, or SPIDEV_DEFAULT_BUFSIZ if it can't be read.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t readMaxMessageSize
+(
+    void
+)
+{
+    unsigned long bufsiz = 0;
+    FILE* file = fopen(SPIDEV_BUFSIZ_PATH, "r");
+    if (file != NULL)
+    {
+        if (fscanf(file, "%lu", &bufsiz) != 1)
+        {
+            bufsiz = 0;
+        }
+        fclose(file);
+    }
+
+    if (bufsiz == 0)
+    {
+        LE_WARN(
+            "Couldn't read %s, assuming %d byte messages",
+            SPIDEV_BUFSIZ_PATH,
+            SPIDEV_DEFAULT_BUFSIZ);
+        bufsiz = SPIDEV_DEFAULT_BUFSIZ;
+    }
+    return bufsiz;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the errno with which the calling thread's last SPI_IOC_MESSAGE failed.  Lets a caller tell
+ * a fault of the device or driver from a message the driver rejected, after logging or other
+ * calls have overwritten errno.
+ *
+ * @return
+ *      The errno of the last message sent by the calling thread, or 0 if it succeeded.
+ */
+//--------------------------------------------------------------------------------------------------
+int spiLib_GetMessageErrno
+(
+    void
+)
+{
+    return messageErrno;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Streams an arbitrary amount of data by splitting it into back to back messages of at most
+ * maxChunkSize bytes.  When holdCs is set, chip select is left asserted between the chunks so the
+ * slave sees one continuous transfer, and released by an empty message if a chunk fails.
+ *
+ * @return
+ *      - LE_OK
+ *      - LE_BAD_PARAMETER if neither buffer is given or maxChunkSize is 0
+ *      - LE_FAULT
+ *
+ * @note
+ *      Keeping chip select asserted between messages is a hint to the controller driver and only
+ *      holds if no other device on the bus is accessed before the stream completes.
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_Stream
+(
+    int fd,                   ///< Open file descriptor of SPI port
+    const uint8_t* writeData, ///< Data to transmit or NULL to receive only
+    uint8_t* readData,        ///< Buffer for received data or NULL to transmit only
+    size_t length,            ///< Number of bytes to transfer
+    size_t maxChunkSize,      ///< Largest number of bytes to transfer in one message
+    bool holdCs               ///< Keep chip select asserted between chunks
+)
+{
+    if ((writeData == NULL && readData == NULL) || maxChunkSize == 0)
+    {
+        return LE_BAD_PARAMETER;
+    }
+
+    size_t offset = 0;
+    while (offset < length)
+    {
+        const size_t chunkSize = (length - offset < maxChunkSize) ? (length - offset) : maxChunkSize;
+        const bool lastChunk = (offset + chunkSize == length);
+        struct spi_ioc_transfer tr =
+        {
+            .tx_buf = (unsigned long)(writeData != NULL ? &writeData[offset] : NULL),
+            .rx_buf = (unsigned long)(readData != NULL ? &readData[offset] : NULL),
+            .len = chunkSize,
+            // On the last transfer of a message cs_change asks the controller to leave chip
+            // select asserted until the next message.
+            .cs_change = (holdCs && !lastChunk) ? 1 : 0
+        };
+
+        const int transferResult = sendMessage(fd, &tr, 1);
+        if (transferResult < 0)
+        {
+            LE_ERROR(
+                "Stream transfer failed at offset %zu with error %d : %d (%m)",
+                offset,
+                transferResult,
+                errno);
+            if (holdCs)
+            {
+                // Chip select may still be asserted from the previous chunk; an empty transfer
+                // without cs_change ends the message with it released.  The errno of the failed
+                // chunk is kept for spiLib_GetMessageErrno.
+                const int chunkErrno = messageErrno;
+                struct spi_ioc_transfer release = { .len = 0, .cs_change = 0 };
+                if (sendMessage(fd, &release, 1) < 0)
+                {
+                    LE_ERROR("Failed to release chip select after stream error (%m)");
+                }
+                messageErrno = chunkErrno;
+            }
+            SPI_TRACE_TRANSFER(
+                "Stream",
+                writeData,
+                writeData != NULL ? offset : 0,
+                readData,
+                readData != NULL ? offset : 0,
+                LE_FAULT);
+            return LE_FAULT;
+        }
+        offset += chunkSize;
+    }
+
+    SPI_TRACE_TRANSFER(
+        "Stream",
+        writeData,
+        writeData != NULL ? length : 0,
+        readData,
+        readData != NULL ? length : 0,
+        LE_OK);
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Repeatedly sends a command and reads the status byte which follows it, until the status ANDed
+ * with mask equals expected or the timeout expires.  Attempts are spaced out according to the
+ * backoff, so that a device which becomes ready quickly is noticed quickly while one which takes
+ * longer doesn't cost an attempt every few microseconds.  Only the final attempt is traced.
+ *
+ * @return
+ *      - LE_OK once the status matched
+ *      - LE_TIMEOUT if it didn't match before the timeout
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_PollUntil
+(
+    int fd,                          ///< Open file descriptor of SPI port
+    const uint8_t* command,          ///< Command which makes the device return its status
+    size_t commandLength,            ///< Number of bytes in command; may be 0
+    uint8_t mask,                    ///< Status bits to compare
+    uint8_t expected,                ///< Value of the masked status bits when ready
+    uint32_t timeoutUsecs,           ///< Time to keep polling for
+    const spiLib_Backoff_t* backoff, ///< Spacing of the attempts
+    uint8_t* status,                 ///< [out] Status read by the last attempt
+    uint32_t* elapsedUsecs,          ///< [out] Time from the first attempt until the last finished
+    uint32_t* attempts               ///< [out] Number of attempts made
+)
+{
+    struct spi_ioc_transfer tr[2] =
+    {
+        { .tx_buf = (unsigned long)command, .len = commandLength },
+        { .rx_buf = (unsigned long)status, .len = 1 }
+    };
+    // Without a command the status is simply read
+    struct spi_ioc_transfer* const firstTransfer = (commandLength == 0) ? &tr[1] : &tr[0];
+    const unsigned numTransfers = (commandLength == 0) ? 1 : 2;
+
+    const le_clk_Time_t start = le_clk_GetRelativeTime();
+    uint32_t sleepUsecs = backoff->minSleepUsecs;
+    le_result_t result;
+    *attempts = 0;
+    while (true)
+    {
+        (*attempts)++;
+        const int transferResult = sendMessage(fd, firstTransfer, numTransfers);
+        const le_clk_Time_t elapsed = le_clk_Sub(le_clk_GetRelativeTime(), start);
+        *elapsedUsecs = (elapsed.sec * 1000000) + elapsed.usec;
+        if (transferResult < 0)
+        {
+            LE_ERROR("Poll transfer failed with error %d : %d (%m)", transferResult, errno);
+            result = LE_FAULT;
+            break;
+        }
+        if ((*status & mask) == expected)
+        {
+            result = LE_OK;
+            break;
+        }
+        if (*elapsedUsecs >= timeoutUsecs)
+        {
+            result = LE_TIMEOUT;
+            break;
+        }
+
+        if (*elapsedUsecs >= backoff->spinUsecs)
+        {
+            // Never sleep past the timeout, so that the last attempt is made just as it expires
+            const uint32_t remainingUsecs = timeoutUsecs - *elapsedUsecs;
+            const uint32_t napUsecs = (sleepUsecs < remainingUsecs) ? sleepUsecs : remainingUsecs;
+            struct timespec nap =
+            {
+                .tv_sec = napUsecs / 1000000,
+                .tv_nsec = (napUsecs % 1000000) * 1000
+            };
+            while (nanosleep(&nap, &nap) == -1 && errno == EINTR)
+            {
+            }
+            sleepUsecs = (sleepUsecs < backoff->maxSleepUsecs / 2) ?
+                (sleepUsecs * 2) : backoff->maxSleepUsecs;
+        }
+    }
+
+    SPI_TRACE_TRANSFER("PollUntil", command, commandLength, status, 1, result);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * stat operation of the spidev backend.
+ */
+//--------------------------------------------------------------------------------------------------
+static int spidevStat
+(
+    const char* path,
+    struct stat* buf
+)
+{
+    return stat(path, buf);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * open operation of the spidev backend.
+ */
+//--------------------------------------------------------------------------------------------------
+static int spidevOpen
+(
+    const char* path,
+    int flags
+)
+{
+    return open(path, flags);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * close operation of the spidev backend.
+ */
+//--------------------------------------------------------------------------------------------------
+static int spidevClose
+(
+    int fd
+)
+{
+    return close(fd);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * ioctl operation of the spidev backend.
+ */
+//--------------------------------------------------------------------------------------------------
+static int spidevIoctl
+(
+    int fd,
+    unsigned long request,
+    void* arg
+)
+{
+    return ioctl(fd, request, arg);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * flock operation of the spidev backend.
+ */
+//--------------------------------------------------------------------------------------------------
+static int spidevFlock
+(
+    int fd,
+    int operation
+)
+{
+    return flock(fd, operation);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Converts the words of a device's transfers in software if the controller rejected its bits per
+ * word or bit order, running the device with 8 bit MSB first words instead.  Settings done in
+ * software are cleared from failed.
+ *
+ * @return
+ *      The SPILIB_CONFIG_BITS and SPILIB_CONFIG_LSB_FIRST bits of the settings done in software.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t emulateWords
+(
+    int fd,                         ///< Open file descriptor of SPI port
+    const spiLib_Config_t* wanted,  ///< Configuration being applied
+    uint32_t* failed                ///< [in/out] SPILIB_CONFIG_ bits of the settings which failed
+)
+{
+    const uint32_t wordSettings = SPILIB_CONFIG_BITS | SPILIB_CONFIG_LSB_FIRST;
+    if ((*failed & wordSettings) == 0 ||
+        wanted->bits > 32 ||
+        spiLib_SetBitsPerWord(fd, 8) != LE_OK ||
+        spiLib_SetLsbFirst(fd, 0) != LE_OK ||
+        spiLib_SetSoftFormat(fd, wanted->bits, wanted->msb != 0) != LE_OK)
+    {
+        spiLib_SetSoftFormat(fd, 8, false);
+        return 0;
+    }
+
+    const uint32_t emulated = ((wanted->bits != 8 && wanted->bits != 0) ? SPILIB_CONFIG_BITS : 0) |
+                              ((wanted->msb != 0) ? SPILIB_CONFIG_LSB_FIRST : 0);
+    LE_INFO("Controller rejected settings 0x%x, converting words in software", *failed);
+    *failed &= ~wordSettings;
+    return emulated;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends a message to a device and records it in the bus trace if that is enabled.
+ *
+ * @return
+ *      The result of the SPI_IOC_MESSAGE ioctl.
+ */
+//--------------------------------------------------------------------------------------------------
+static int sendMessage
+(
+    int fd,                          ///< Open file descriptor of SPI port
+    struct spi_ioc_transfer* tr,     ///< Transfers of the message
+    unsigned numTransfers            ///< Number of entries in tr
+)
+{
+    if (!SPI_TRACE_BUS_ENABLED())
+    {
+        const int result = deliverMessage(fd, tr, numTransfers);
+        messageErrno = (result < 0) ? errno : 0;
+        return result;
+    }
+
+    uint8_t txData[SPILIB_BUS_TRACE_MAX_PAYLOAD];
+    const size_t txLength = spiTrace_CopyTx(tr, numTransfers, txData);
+    const uint64_t startUsecs = spiTrace_NowUsecs();
+    const int result = deliverMessage(fd, tr, numTransfers);
+    messageErrno = (result < 0) ? errno : 0;
+    spiTrace_Message(
+        tr, numTransfers, txData, txLength, startUsecs, (result < 0) ? -messageErrno : result);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends a message to a device, converting its words in software if the device has a software
+ * format.
+ *
+ * @return
+ *      The result of the SPI_IOC_MESSAGE ioctl.
+ */
+//--------------------------------------------------------------------------------------------------
+static int deliverMessage
+(
+    int fd,                          ///< Open file descriptor of SPI port
+    struct spi_ioc_transfer* tr,     ///< Transfers of the message
+    unsigned numTransfers            ///< Number of entries in tr
+)
+{
+    if (__atomic_load_n(&g.numSoftFormats, __ATOMIC_RELAXED) != 0)
+    {
+        // spiLib_SetSoftFormat may free the entry or give it to another device once the mutex is
+        // released, so the format is copied and its scratch buffer referenced while it is held
+        SoftFormat_t format;
+        le_mutex_Lock(g.mutex);
+        const SoftFormat_t* found = findSoftFormat(fd);
+        if (found != NULL)
+        {
+            format = *found;
+            le_mem_AddRef(format.scratch);
+        }
+        le_mutex_Unlock(g.mutex);
+        if (found != NULL)
+        {
+            const int result = sendSoftMessage(fd, &format, tr, numTransfers);
+            const int savedErrno = errno;
+            le_mem_Release(format.scratch);
+            errno = savedErrno;
+            return result;
+        }
+    }
+    return g.backend->ioctl(fd, SPI_IOC_MESSAGE(numTransfers), tr);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends a message with its words packed into 8 bit words in the format's scratch buffer, and
+ * unpacks the received words into the receive buffers.
+ *
+ * @return
+ *      The result of the SPI_IOC_MESSAGE ioctl, or -1 with errno set to EINVAL if a transfer
+ *      doesn't hold whole words or EMSGSIZE if the message is too large.
+ */
+//--------------------------------------------------------------------------------------------------
+static int sendSoftMessage
+(
+    int fd,                              ///< Open file descriptor of SPI port
+    const SoftFormat_t* format,          ///< Software format of the device
+    const struct spi_ioc_transfer* tr,   ///< Transfers of the message
+    unsigned numTransfers                ///< Number of entries in tr
+)
+{
+    if (numTransfers > SPILIB_MAX_SEGMENTS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct spi_ioc_transfer wire[SPILIB_MAX_SEGMENTS];
+    size_t offset = 0;
+    for (unsigned i = 0; i < numTransfers; i++)
+    {
+        const uint8_t bits = (tr[i].bits_per_word != 0) ? tr[i].bits_per_word : format->bits;
+        const size_t wordBytes = SPIWORD_BYTES(bits);
+        if (bits > 32 || (tr[i].len % wordBytes) != 0)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        const size_t numWords = tr[i].len / wordBytes;
+        const size_t wireLength = spiWord_PackedLength(numWords, bits);
+        if (offset + wireLength > g.maxMessageSize)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        // Full duplex transfers send and receive through the same bytes of the scratch buffer
+        uint8_t* wireData = &format->scratch[offset];
+        wire[i] = tr[i];
+        if (tr[i].tx_buf != 0)
+        {
+            spiWord_Pack(
+                wireData,
+                (const uint8_t*)(uintptr_t)tr[i].tx_buf,
+                numWords,
+                bits,
+                format->lsbFirst);
+            wire[i].tx_buf = (unsigned long)wireData;
+        }
+        if (tr[i].rx_buf != 0)
+        {
+            wire[i].rx_buf = (unsigned long)wireData;
+        }
+        wire[i].len = wireLength;
+        // The device's own 8 bit words
+        wire[i].bits_per_word = 0;
+        offset += wireLength;
+    }
+
+    const int result = g.backend->ioctl(fd, SPI_IOC_MESSAGE(numTransfers), wire);
+    if (result >= 0)
+    {
+        for (unsigned i = 0; i < numTransfers; i++)
+        {
+            if (tr[i].rx_buf != 0)
+            {
+                const uint8_t bits =
+                    (tr[i].bits_per_word != 0) ? tr[i].bits_per_word : format->bits;
+                spiWord_Unpack(
+                    (uint8_t*)(uintptr_t)tr[i].rx_buf,
+                    (const uint8_t*)(uintptr_t)wire[i].rx_buf,
+                    tr[i].len / SPIWORD_BYTES(bits),
+                    bits,
+                    format->lsbFirst);
+            }
+        }
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Searches for the software format of a device.  Must be called with the mutex held.
+ *
+ * @return
+ *      The device's software format or NULL if its words aren't converted.
+ */
+//--------------------------------------------------------------------------------------------------
+static SoftFormat_t* findSoftFormat
+(
+    int fd
+)
+{
+    for (size_t i = 0; i < SPILIB_MAX_SOFT_FORMATS; i++)
+    {
+        if (g.softFormats[i].used && g.softFormats[i].fd == fd)
+        {
+            return &g.softFormats[i];
+        }
+    }
+    return NULL;
+}
+
+
+COMPONENT_INIT
+{
     LE_DEBUG("spiLibraryComponent initializing");
+
+    g.mutex = le_mutex_CreateNonRecursive("SPI Library");
+    g.maxMessageSize = readMaxMessageSize();
+    g.scratchPool = le_mem_CreatePool("SPI Word Scratch", g.maxMessageSize);
+
+    spiTrace_Init();
+    spiSim_Init();
 }
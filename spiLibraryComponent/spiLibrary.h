@@ -3,8 +3,126 @@
 
 #include "interfaces.h"
 #include "legato.h"
+#include <sys/stat.h>
 
-LE_SHARED void spiLib_Configure(int fd, int mode, uint8_t bits, uint32_t speed, int msb);
+// Maximum number of segments that can be combined into one SPI message
+#define SPILIB_MAX_SEGMENTS 32
+
+// One segment of an SPI message.  Either buffer may be NULL for a receive-only or transmit-only
+// segment.  Zero for speedHz or bitsPerWord uses the value configured for the device.  txNbits and
+// rxNbits give the number of data lines used in each direction: 2 or 4 for dual or quad transfers,
+// which the device must be configured for, and 0 or 1 for ordinary single line transfers.
+typedef struct
+{
+    const uint8_t* txBuf;
+    uint8_t* rxBuf;
+    size_t length;
+    uint32_t speedHz;
+    uint16_t delayUsecs;
+    uint8_t bitsPerWord;
+    uint8_t txNbits;
+    uint8_t rxNbits;
+    bool csChange;
+} spiLib_Segment_t;
+
+// Set to 0 to compile out all payload dumping from the trace
+#ifndef SPILIB_PAYLOAD_TRACE
+#define SPILIB_PAYLOAD_TRACE 1
+#endif
+
+// How much detail is traced for each transfer
+typedef enum
+{
+    SPILIB_TRACE_OFF,      ///< Nothing is traced
+    SPILIB_TRACE_SUMMARY,  ///< One line per transfer with the lengths and result
+    SPILIB_TRACE_PAYLOAD   ///< As SUMMARY, plus a hex dump of the start of the payload
+} spiLib_TraceLevel_t;
+
+// Bus trace, with the values of spi.api's BUS_TRACE_ defines: the ring holds the most recent
+// messages, each record describing the first segments of a message and the first payload bytes
+// of each direction.  spiLib_ExportBusTrace writes the records as pcap packets of the link type.
+#define SPILIB_BUS_TRACE_RING_RECORDS 512
+#define SPILIB_BUS_TRACE_MAX_SEGMENTS 8
+#define SPILIB_BUS_TRACE_MAX_PAYLOAD 16
+#define SPILIB_BUS_TRACE_RECORD_SIZE 168
+#define SPILIB_BUS_TRACE_LINKTYPE 147
+
+// Number of ioctls each of the spiLib_Set* functions issues (a write and a read back)
+#define SPILIB_IOCTLS_PER_SETTING 2
+
+// Settings reported as failed by spiLib_ApplyConfig, with the values of spi.api's CONFIG_ defines
+#define SPILIB_CONFIG_MODE 0x1
+#define SPILIB_CONFIG_BITS 0x2
+#define SPILIB_CONFIG_SPEED 0x4
+#define SPILIB_CONFIG_LSB_FIRST 0x8
+
+// Bus configuration of a device
+typedef struct
+{
+    bool valid;                ///< False until a configuration has been given
+    int mode;
+    uint8_t bits;
+    uint32_t speed;
+    int msb;
+    uint32_t emulated;         ///< SPILIB_CONFIG_ bits done in software, set by spiLib_ApplyConfig
+} spiLib_Config_t;
+
+// Spacing of the attempts of spiLib_PollUntil.  Attempts follow each other immediately for the
+// first spinUsecs, and are then separated by sleeps which start at minSleepUsecs and double after
+// each attempt up to maxSleepUsecs.
+typedef struct
+{
+    uint32_t spinUsecs;
+    uint32_t minSleepUsecs;
+    uint32_t maxSleepUsecs;
+} spiLib_Backoff_t;
+
+// Operations used to reach SPI devices.  Each has the semantics of the system call of the same
+// name, returning -1 and setting errno on failure.  spiLib_SpidevBackend uses the kernel spidev
+// driver and spiLib_SimBackend an in-process simulator of spidev and some slave devices.
+typedef struct
+{
+    const char* name;
+    int (*stat)(const char* path, struct stat* buf);
+    int (*open)(const char* path, int flags);
+    int (*close)(int fd);
+    int (*ioctl)(int fd, unsigned long request, void* arg);
+    int (*flock)(int fd, int operation);
+} spiLib_Backend_t;
+
+LE_SHARED extern const spiLib_Backend_t spiLib_SpidevBackend;
+
+LE_SHARED extern const spiLib_Backend_t spiLib_SimBackend;
+
+LE_SHARED void spiLib_SetBackend(const spiLib_Backend_t* backend);
+
+LE_SHARED int spiLib_Stat(const char* path, struct stat* buf);
+
+LE_SHARED int spiLib_Open(const char* path, int flags);
+
+LE_SHARED int spiLib_Close(int fd);
+
+LE_SHARED le_result_t spiLib_Lock(int fd);
+
+LE_SHARED le_result_t spiLib_Configure(int fd, int mode, uint8_t bits, uint32_t speed, int msb);
+
+LE_SHARED le_result_t spiLib_SetMode(int fd, int mode);
+
+LE_SHARED le_result_t spiLib_SetBitsPerWord(int fd, uint8_t bits);
+
+LE_SHARED le_result_t spiLib_SetSpeed(int fd, uint32_t speed);
+
+LE_SHARED le_result_t spiLib_SetLsbFirst(int fd, int msb);
+
+LE_SHARED uint32_t spiLib_ApplyConfig(
+    int fd,
+    spiLib_Config_t* applied,
+    const spiLib_Config_t* wanted,
+    uint64_t* ioctlsAvoided);
+
+LE_SHARED le_result_t spiLib_SetSoftFormat(int fd, uint8_t bits, bool lsbFirst);
+
+LE_SHARED uint32_t spiLib_ProbeModes(int fd, uint32_t modes);
 
 LE_SHARED le_result_t spiLib_WriteReadHD(
     int fd,
@@ -23,4 +141,45 @@ LE_SHARED le_result_t spiLib_WriteReadFD(
 
 LE_SHARED le_result_t spiLib_ReadHD(int fd, uint8_t* readData, size_t* readDataLength);
 
+LE_SHARED le_result_t spiLib_Transfer(
+    int fd,
+    const spiLib_Segment_t* segments,
+    size_t numSegments);
+
+LE_SHARED size_t spiLib_GetMaxMessageSize(void);
+
+LE_SHARED int spiLib_GetMessageErrno(void);
+
+LE_SHARED le_result_t spiLib_Stream(
+    int fd,
+    const uint8_t* writeData,
+    uint8_t* readData,
+    size_t length,
+    size_t maxChunkSize,
+    bool holdCs);
+
+LE_SHARED le_result_t spiLib_PollUntil(
+    int fd,
+    const uint8_t* command,
+    size_t commandLength,
+    uint8_t mask,
+    uint8_t expected,
+    uint32_t timeoutUsecs,
+    const spiLib_Backoff_t* backoff,
+    uint8_t* status,
+    uint32_t* elapsedUsecs,
+    uint32_t* attempts);
+
+LE_SHARED void spiLib_SetTraceLevel(spiLib_TraceLevel_t level);
+
+LE_SHARED void spiLib_SetTraceCapture(bool capture);
+
+LE_SHARED void spiLib_DumpTrace(void);
+
+LE_SHARED le_result_t spiLib_SetBusTrace(bool enable, uint8_t payloadBytes);
+
+LE_SHARED void spiLib_SetTraceTag(uint32_t tag, uint64_t enqueueUsecs);
+
+LE_SHARED le_result_t spiLib_ExportBusTrace(int fd);
+
 #endif  // SPI_LIBRARY_H
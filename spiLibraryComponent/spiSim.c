@@ -0,0 +1,860 @@
+#include "legato.h"
+#include "spiLibrary.h"
+#include "spiIoc.h"
+#include "spiSim.h"
+#include <time.h>
+#include <sys/file.h>
+
+// Simulated device files are /dev/sim*.  Those named /dev/simreg* model a register file,
+// /dev/simflash* a NOR flash chip, /dev/simfault* a loopback device whose driver wedges and all
+// others a loopback device.
+#define SIM_PATH_PREFIX "/dev/sim"
+#define SIM_REGFILE_PATH_PREFIX "/dev/simreg"
+#define SIM_FLASH_PATH_PREFIX "/dev/simflash"
+#define SIM_FAULT_PATH_PREFIX "/dev/simfault"
+// Messages a /dev/simfault* descriptor performs before every further message on it fails with EIO
+#define SIM_FAULT_MESSAGES 100
+// Number of simulated device descriptors which may be open at once.  spiService opens two per
+// device, one of them to hold the lock.
+#define SIM_MAX_DEVICES 32
+// File descriptors of simulated devices start here, well clear of real file descriptors
+#define SIM_FD_BASE 0x40000000
+// Clock speed of a device until one is configured
+#define SIM_DEFAULT_SPEED_HZ 1000000
+// Time taken by the driver to start a message, independent of its length
+#define SIM_MESSAGE_OVERHEAD_NSECS 15000
+// Time chip select is asserted before the first clock edge and held after the last
+#define SIM_CS_SETUP_NSECS 200
+#define SIM_CS_HOLD_NSECS 200
+// Waits shorter than this are timed by spinning rather than sleeping, for accuracy
+#define SIM_SPIN_NSECS 50000
+// Registers of the register file model, addressed by the low 7 bits of the command byte
+#define SIM_REGISTERS 128
+// Command byte flag of the register file model selecting a read
+#define SIM_REGFILE_READ 0x80
+// Mode bits a device accepts, and the dual and quad ones which the controllers of all but the
+// register file model support.  Like spidev, unsupported dual and quad bits are dropped when set.
+#define SIM_WIDTH_MODES (SPI_TX_DUAL | SPI_TX_QUAD | SPI_RX_DUAL | SPI_RX_QUAD)
+#define SIM_VALID_MODES (0xFFu | SIM_WIDTH_MODES)
+
+// The flash model is a 1 MiB chip with 256 byte pages, 4, 32 and 64 KiB erase blocks and 3 byte
+// addresses, and describes itself in SFDP
+#define SIM_FLASH_SIZE (1024 * 1024)
+#define SIM_FLASH_PAGE_SIZE 256
+#define SIM_FLASH_ADDRESS_BYTES 3
+#define SIM_FLASH_WRITE_ENABLE 0x06
+#define SIM_FLASH_READ_STATUS 0x05
+#define SIM_FLASH_READ_JEDEC_ID 0x9F
+#define SIM_FLASH_READ_SFDP 0x5A
+#define SIM_FLASH_READ 0x03
+#define SIM_FLASH_FAST_READ 0x0B
+#define SIM_FLASH_READ_DUAL 0x3B
+#define SIM_FLASH_READ_QUAD 0x6B
+#define SIM_FLASH_PAGE_PROGRAM 0x02
+#define SIM_FLASH_ERASE_4K 0x20
+#define SIM_FLASH_ERASE_32K 0x52
+#define SIM_FLASH_ERASE_64K 0xD8
+#define SIM_FLASH_STATUS_BUSY 0x01
+#define SIM_FLASH_STATUS_WRITE_ENABLED 0x02
+// Typical program and erase times of such a chip
+#define SIM_FLASH_PROGRAM_NSECS 700000ULL
+#define SIM_FLASH_ERASE_4K_NSECS 45000000ULL
+#define SIM_FLASH_ERASE_32K_NSECS 120000000ULL
+#define SIM_FLASH_ERASE_64K_NSECS 150000000ULL
+
+#define NSECS_PER_SEC 1000000000ULL
+
+// Slave device modelled by a simulated device file
+typedef enum
+{
+    MODEL_LOOPBACK,   ///< MISO wired to MOSI
+    MODEL_REGFILE,    ///< Register file: a command byte with SIM_REGFILE_READ and a 7 bit address,
+                      ///  then data to or from consecutive registers
+    MODEL_FLASH       ///< SPI NOR flash chip
+} Model_t;
+
+// A simulated device file.  A device is only accessed by the thread performing I/O on it, apart
+// from open and close which are serialized by the mutex.
+typedef struct
+{
+    bool open;
+    ino_t inode;            ///< Inode of the device file, shared by all opens of the same path
+    bool locked;            ///< This open holds the device's advisory lock
+    Model_t model;
+    bool wedges;            ///< Messages fail after SIM_FAULT_MESSAGES until the device is reopened
+    size_t messages;        ///< Messages performed on this open
+    uint32_t mode;
+    uint8_t bitsPerWord;
+    uint32_t speedHz;
+    uint8_t lsbFirst;
+    bool csActive;          ///< Chip select left asserted at the end of the last message
+    bool commandSeen;       ///< The register file has received the command byte of this frame
+    bool reading;           ///< The register file command of this frame is a read
+    uint8_t address;        ///< Register file address of the next data byte
+    uint8_t registers[SIM_REGISTERS];
+    uint8_t* flash;         ///< Contents of the flash model, SIM_FLASH_SIZE bytes
+    uint8_t opcode;         ///< Flash command of this frame, or 0 if it is being ignored
+    size_t frameBytes;      ///< Bytes the flash has received in this frame
+    uint32_t flashAddress;  ///< Flash address of the next data byte
+    bool writeEnabled;      ///< Flash write enable latch
+    uint64_t busyUntilNsecs;  ///< When the flash's last program or erase finishes
+} SimDevice_t;
+
+// JEDEC ID of the flash model: Winbond W25Q80
+static const uint8_t simFlashJedecId[] = { 0xEF, 0x40, 0x14 };
+
+// SFDP tables of the flash model as little endian words: the SFDP header, one parameter header,
+// and at byte 0x80 a JESD216B basic flash parameter table with 1-1-2 and 1-1-4 fast reads and no
+// quad enable bit
+static const uint32_t simFlashSfdp[] =
+{
+    0x50444653, 0xFF000106, 0x10010600, 0xFF000080,
+    [32] =
+    0xFFF12005, 0x007FFFFF, 0x6B08EB44, 0xBB803B08,
+    0xFFFFFFEE, 0xFFFFFFFF, 0xFFFFFFFF, 0x520F200C,
+    0x0000D810, 0x00000000, 0x00000080, 0x00000000,
+    0x00000000, 0x00000000, 0x00000000, 0x00000000
+};
+
+
+static int simStat(const char* path, struct stat* buf);
+static int simOpen(const char* path, int flags);
+static int simClose(int fd);
+static int simIoctl(int fd, unsigned long request, void* arg);
+static int simFlock(int fd, int operation);
+static int performMessage(SimDevice_t* device, const struct spi_ioc_transfer* tr, size_t count);
+static bool nbitsSupported(uint8_t nbits, uint32_t mode, uint32_t dualMode, uint32_t quadMode);
+static void startFrame(SimDevice_t* device);
+static void endFrame(SimDevice_t* device, uint64_t endNsecs);
+static uint8_t exchangeByte(SimDevice_t* device, uint8_t mosi);
+static uint8_t exchangeFlashByte(SimDevice_t* device, uint8_t mosi);
+static void endFlashFrame(SimDevice_t* device, uint64_t endNsecs);
+static bool isFlashBusy(const SimDevice_t* device);
+static SimDevice_t* lookupDevice(int fd);
+static void waitUntil(uint64_t deadlineNsecs);
+static uint64_t nowNsecs(void);
+
+// Backend which simulates spidev and the slave devices in-process, including the time transfers
+// take at the configured clock speed
+const spiLib_Backend_t spiLib_SimBackend =
+{
+    .name = "simulator",
+    .stat = simStat,
+    .open = simOpen,
+    .close = simClose,
+    .ioctl = simIoctl,
+    .flock = simFlock
+};
+
+static struct
+{
+    // Serializes opening and closing devices
+    le_mutex_Ref_t mutex;
+    // Simulated devices, indexed by file descriptor less SIM_FD_BASE
+    SimDevice_t devices[SIM_MAX_DEVICES];
+    // Memory pool for the contents of flash models
+    le_mem_PoolRef_t flashPool;
+} g;
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * stat operation of the simulator.  Every /dev/sim* path exists, and paths with the same name
+ * have the same inode.
+ */
+//--------------------------------------------------------------------------------------------------
+static int simStat
+(
+    const char* path,
+    struct stat* buf
+)
+{
+    if (strncmp(path, SIM_PATH_PREFIX, strlen(SIM_PATH_PREFIX)) != 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    // FNV-1a hash of the path
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char* c = path; *c != '\0'; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+
+    memset(buf, 0, sizeof(*buf));
+    buf->st_ino = (ino_t)hash;
+    buf->st_mode = S_IFCHR | 0666;
+    return 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * open operation of the simulator.
+ */
+//--------------------------------------------------------------------------------------------------
+static int simOpen
+(
+    const char* path,
+    int flags
+)
+{
+    struct stat fileStat;
+    if (simStat(path, &fileStat) != 0)
+    {
+        return -1;
+    }
+
+    le_mutex_Lock(g.mutex);
+    int fd = -1;
+    for (size_t i = 0; i < SIM_MAX_DEVICES; i++)
+    {
+        SimDevice_t* device = &g.devices[i];
+        if (!device->open)
+        {
+            memset(device, 0, sizeof(*device));
+            device->open = true;
+            device->inode = fileStat.st_ino;
+            device->model = MODEL_LOOPBACK;
+            if (strncmp(path, SIM_REGFILE_PATH_PREFIX, strlen(SIM_REGFILE_PATH_PREFIX)) == 0)
+            {
+                device->model = MODEL_REGFILE;
+            }
+            else if (strncmp(path, SIM_FLASH_PATH_PREFIX, strlen(SIM_FLASH_PATH_PREFIX)) == 0)
+            {
+                // Every open starts with an erased chip
+                device->model = MODEL_FLASH;
+                device->flash = le_mem_ForceAlloc(g.flashPool);
+                memset(device->flash, 0xFF, SIM_FLASH_SIZE);
+            }
+            else if (strncmp(path, SIM_FAULT_PATH_PREFIX, strlen(SIM_FAULT_PATH_PREFIX)) == 0)
+            {
+                device->wedges = true;
+            }
+            device->bitsPerWord = 8;
+            device->speedHz = SIM_DEFAULT_SPEED_HZ;
+            // Registers power up holding their own address, so reads can be checked
+            for (size_t r = 0; r < SIM_REGISTERS; r++)
+            {
+                device->registers[r] = r;
+            }
+            fd = SIM_FD_BASE + i;
+            break;
+        }
+    }
+    le_mutex_Unlock(g.mutex);
+
+    if (fd < 0)
+    {
+        errno = EMFILE;
+    }
+    return fd;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * close operation of the simulator.
+ */
+//--------------------------------------------------------------------------------------------------
+static int simClose
+(
+    int fd
+)
+{
+    SimDevice_t* device = lookupDevice(fd);
+    if (device == NULL)
+    {
+        return -1;
+    }
+
+    le_mutex_Lock(g.mutex);
+    if (device->flash != NULL)
+    {
+        le_mem_Release(device->flash);
+        device->flash = NULL;
+    }
+    device->open = false;
+    le_mutex_Unlock(g.mutex);
+    return 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * ioctl operation of the simulator.  Supports the spidev settings and SPI_IOC_MESSAGE.
+ */
+//--------------------------------------------------------------------------------------------------
+static int simIoctl
+(
+    int fd,
+    unsigned long request,
+    void* arg
+)
+{
+    SimDevice_t* device = lookupDevice(fd);
+    if (device == NULL)
+    {
+        return -1;
+    }
+
+    switch (request)
+    {
+        case SPI_IOC_WR_MODE:
+            // The 8 bit mode has no room for the dual and quad bits, so clears them
+            device->mode = *(const uint8_t*)arg;
+            return 0;
+        case SPI_IOC_RD_MODE:
+            *(uint8_t*)arg = device->mode & 0xFF;
+            return 0;
+        case SPI_IOC_WR_MODE32:
+            if ((*(const uint32_t*)arg & ~SIM_VALID_MODES) != 0)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            device->mode = *(const uint32_t*)arg;
+            if (device->model == MODEL_REGFILE)
+            {
+                device->mode &= ~SIM_WIDTH_MODES;
+            }
+            return 0;
+        case SPI_IOC_RD_MODE32:
+            *(uint32_t*)arg = device->mode;
+            return 0;
+        case SPI_IOC_WR_BITS_PER_WORD:
+            device->bitsPerWord = (*(const uint8_t*)arg == 0) ? 8 : *(const uint8_t*)arg;
+            return 0;
+        case SPI_IOC_RD_BITS_PER_WORD:
+            *(uint8_t*)arg = device->bitsPerWord;
+            return 0;
+        case SPI_IOC_WR_MAX_SPEED_HZ:
+            if (*(const uint32_t*)arg == 0)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            device->speedHz = *(const uint32_t*)arg;
+            return 0;
+        case SPI_IOC_RD_MAX_SPEED_HZ:
+            *(uint32_t*)arg = device->speedHz;
+            return 0;
+        case SPI_IOC_WR_LSB_FIRST:
+            device->lsbFirst = *(const uint8_t*)arg;
+            return 0;
+        case SPI_IOC_RD_LSB_FIRST:
+            *(uint8_t*)arg = device->lsbFirst;
+            return 0;
+        default:
+            break;
+    }
+
+    if (_IOC_TYPE(request) == SPI_IOC_MAGIC &&
+        _IOC_NR(request) == _IOC_NR(SPI_IOC_MESSAGE(1)) &&
+        _IOC_DIR(request) == _IOC_WRITE &&
+        (_IOC_SIZE(request) % sizeof(struct spi_ioc_transfer)) == 0)
+    {
+        return performMessage(
+            device, arg, _IOC_SIZE(request) / sizeof(struct spi_ioc_transfer));
+    }
+
+    errno = ENOTTY;
+    return -1;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * flock operation of the simulator.  Only exclusive locks are supported, and since the simulated
+ * devices are private to the process, an attempt to take a lock held by another open fails at
+ * once whether or not LOCK_NB is given.
+ */
+//--------------------------------------------------------------------------------------------------
+static int simFlock
+(
+    int fd,
+    int operation
+)
+{
+    SimDevice_t* device = lookupDevice(fd);
+    if (device == NULL)
+    {
+        return -1;
+    }
+
+    int result = 0;
+    le_mutex_Lock(g.mutex);
+    if ((operation & LOCK_UN) != 0)
+    {
+        device->locked = false;
+    }
+    else if ((operation & LOCK_EX) == 0)
+    {
+        errno = EINVAL;
+        result = -1;
+    }
+    else
+    {
+        for (size_t i = 0; i < SIM_MAX_DEVICES; i++)
+        {
+            const SimDevice_t* other = &g.devices[i];
+            if (other != device && other->open && other->locked && other->inode == device->inode)
+            {
+                errno = EWOULDBLOCK;
+                result = -1;
+                break;
+            }
+        }
+        if (result == 0)
+        {
+            device->locked = true;
+        }
+    }
+    le_mutex_Unlock(g.mutex);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs an SPI message against the device model and waits for as long as the message would
+ * take on the wire.
+ *
+ * @return
+ *      The number of bytes transferred or -1 with errno set, as spidev.
+ */
+//--------------------------------------------------------------------------------------------------
+static int performMessage
+(
+    SimDevice_t* device,
+    const struct spi_ioc_transfer* tr,
+    size_t count
+)
+{
+    const uint64_t start = nowNsecs();
+
+    if (device->wedges && device->messages >= SIM_FAULT_MESSAGES)
+    {
+        errno = EIO;
+        return -1;
+    }
+    device->messages++;
+
+    size_t totalLength = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        totalLength += tr[i].len;
+        if (tr[i].bits_per_word > 32 ||
+            !nbitsSupported(tr[i].tx_nbits, device->mode, SPI_TX_DUAL, SPI_TX_QUAD) ||
+            !nbitsSupported(tr[i].rx_nbits, device->mode, SPI_RX_DUAL, SPI_RX_QUAD))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    if (totalLength > spiLib_GetMaxMessageSize())
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint64_t duration = SIM_MESSAGE_OVERHEAD_NSECS;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!device->csActive)
+        {
+            startFrame(device);
+            device->csActive = true;
+            duration += SIM_CS_SETUP_NSECS;
+        }
+
+        const uint32_t speedHz = (tr[i].speed_hz != 0) ? tr[i].speed_hz : device->speedHz;
+        const uint8_t bits =
+            (tr[i].bits_per_word != 0) ? tr[i].bits_per_word : device->bitsPerWord;
+        const size_t bytesPerWord = (bits <= 8) ? 1 : ((bits <= 16) ? 2 : 4);
+        // Each clock moves as many bits as the transfer has data lines
+        uint8_t lines = (tr[i].tx_buf != 0 && tr[i].tx_nbits > 1) ? tr[i].tx_nbits : 1;
+        if (tr[i].rx_buf != 0 && tr[i].rx_nbits > lines)
+        {
+            lines = tr[i].rx_nbits;
+        }
+        duration += ((uint64_t)(tr[i].len / bytesPerWord) * bits * NSECS_PER_SEC) /
+                    ((uint64_t)speedHz * lines);
+        duration += (uint64_t)tr[i].delay_usecs * 1000;
+
+        const uint8_t* txBuf = (const uint8_t*)(uintptr_t)tr[i].tx_buf;
+        uint8_t* rxBuf = (uint8_t*)(uintptr_t)tr[i].rx_buf;
+        for (size_t j = 0; j < tr[i].len; j++)
+        {
+            const uint8_t miso = exchangeByte(device, (txBuf != NULL) ? txBuf[j] : 0);
+            if (rxBuf != NULL)
+            {
+                rxBuf[j] = miso;
+            }
+        }
+
+        // cs_change ends the frame after a transfer within the message, but keeps chip select
+        // asserted into the next message after the last transfer
+        const bool lastTransfer = (i == count - 1);
+        if (lastTransfer ? !tr[i].cs_change : tr[i].cs_change)
+        {
+            device->csActive = false;
+            duration += SIM_CS_HOLD_NSECS;
+            endFrame(device, start + duration);
+        }
+    }
+
+    waitUntil(start + duration);
+    return totalLength;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks the number of data lines of one direction of a transfer against the device mode, as
+ * spi_setup does.
+ *
+ * @return
+ *      true if the device can transfer with that many lines.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool nbitsSupported
+(
+    uint8_t nbits,          ///< tx_nbits or rx_nbits of the transfer
+    uint32_t mode,          ///< Mode of the device
+    uint32_t dualMode,      ///< SPI_TX_DUAL or SPI_RX_DUAL
+    uint32_t quadMode       ///< SPI_TX_QUAD or SPI_RX_QUAD
+)
+{
+    switch (nbits)
+    {
+        case 0:
+        case 1:
+            return true;
+        case 2:
+            return (mode & (dualMode | quadMode)) != 0;
+        case 4:
+            return (mode & quadMode) != 0;
+        default:
+            return false;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Resets the device model when chip select is asserted.
+ */
+//--------------------------------------------------------------------------------------------------
+static void startFrame
+(
+    SimDevice_t* device
+)
+{
+    device->commandSeen = false;
+    device->reading = false;
+    device->frameBytes = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Lets the device model act on a frame when chip select is released.
+ */
+//--------------------------------------------------------------------------------------------------
+static void endFrame
+(
+    SimDevice_t* device,
+    uint64_t endNsecs       ///< When chip select is released
+)
+{
+    if (device->model == MODEL_FLASH)
+    {
+        endFlashFrame(device, endNsecs);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Clocks one byte through the device model.
+ *
+ * @return
+ *      The byte the slave drives on MISO.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint8_t exchangeByte
+(
+    SimDevice_t* device,
+    uint8_t mosi            ///< Byte the master drives on MOSI
+)
+{
+    if (device->model == MODEL_LOOPBACK)
+    {
+        return mosi;
+    }
+    if (device->model == MODEL_FLASH)
+    {
+        return exchangeFlashByte(device, mosi);
+    }
+
+    if (!device->commandSeen)
+    {
+        device->commandSeen = true;
+        device->reading = (mosi & SIM_REGFILE_READ) != 0;
+        device->address = mosi & (SIM_REGISTERS - 1);
+        return 0;
+    }
+
+    uint8_t miso = 0;
+    if (device->reading)
+    {
+        miso = device->registers[device->address];
+    }
+    else
+    {
+        device->registers[device->address] = mosi;
+    }
+    device->address = (device->address + 1) & (SIM_REGISTERS - 1);
+    return miso;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Clocks one byte through the flash model.  Commands take effect as they are clocked in, apart
+ * from write enable, program and erase, which take effect when chip select is released.
+ *
+ * @return
+ *      The byte the flash drives on MISO.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint8_t exchangeFlashByte
+(
+    SimDevice_t* device,
+    uint8_t mosi            ///< Byte the master drives on MOSI
+)
+{
+    const size_t index = device->frameBytes++;
+    if (index == 0)
+    {
+        // A busy chip ignores everything but reading its status
+        device->opcode = (isFlashBusy(device) && mosi != SIM_FLASH_READ_STATUS) ? 0 : mosi;
+        device->flashAddress = 0;
+        return 0xFF;
+    }
+
+    switch (device->opcode)
+    {
+        case SIM_FLASH_READ_STATUS:
+            return (isFlashBusy(device) ? SIM_FLASH_STATUS_BUSY : 0) |
+                   (device->writeEnabled ? SIM_FLASH_STATUS_WRITE_ENABLED : 0);
+        case SIM_FLASH_READ_JEDEC_ID:
+            return (index <= sizeof(simFlashJedecId)) ? simFlashJedecId[index - 1] : 0xFF;
+        case SIM_FLASH_READ:
+        case SIM_FLASH_FAST_READ:
+        case SIM_FLASH_READ_DUAL:
+        case SIM_FLASH_READ_QUAD:
+        case SIM_FLASH_READ_SFDP:
+        case SIM_FLASH_PAGE_PROGRAM:
+            break;
+        default:
+            return 0xFF;
+    }
+
+    // Address, most significant byte first, then dummy bytes
+    if (index <= SIM_FLASH_ADDRESS_BYTES)
+    {
+        device->flashAddress = (device->flashAddress << 8) | mosi;
+        return 0xFF;
+    }
+    const size_t dummyBytes =
+        (device->opcode == SIM_FLASH_READ || device->opcode == SIM_FLASH_PAGE_PROGRAM) ? 0 : 1;
+    if (index <= SIM_FLASH_ADDRESS_BYTES + dummyBytes)
+    {
+        return 0xFF;
+    }
+
+    const uint32_t address = device->flashAddress;
+    switch (device->opcode)
+    {
+        case SIM_FLASH_READ_SFDP:
+            device->flashAddress++;
+            return (address < 4 * NUM_ARRAY_MEMBERS(simFlashSfdp)) ?
+                   ((simFlashSfdp[address / 4] >> (8 * (address % 4))) & 0xFF) : 0xFF;
+        case SIM_FLASH_PAGE_PROGRAM:
+            // Programming only clears bits, and wraps around within the page
+            if (device->writeEnabled)
+            {
+                device->flash[address % SIM_FLASH_SIZE] &= mosi;
+            }
+            device->flashAddress = (address & ~(SIM_FLASH_PAGE_SIZE - 1)) |
+                                   ((address + 1) & (SIM_FLASH_PAGE_SIZE - 1));
+            return 0xFF;
+        default:
+            device->flashAddress++;
+            return device->flash[address % SIM_FLASH_SIZE];
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Completes a flash command when chip select is released.  A program or erase which was started
+ * keeps the flash busy for as long as a real chip typically takes.
+ */
+//--------------------------------------------------------------------------------------------------
+static void endFlashFrame
+(
+    SimDevice_t* device,
+    uint64_t endNsecs       ///< When chip select is released
+)
+{
+    uint32_t eraseSize = 0;
+    uint64_t busyNsecs;
+    switch (device->opcode)
+    {
+        case SIM_FLASH_WRITE_ENABLE:
+            device->writeEnabled = true;
+            return;
+        case SIM_FLASH_PAGE_PROGRAM:
+            busyNsecs = SIM_FLASH_PROGRAM_NSECS;
+            break;
+        case SIM_FLASH_ERASE_4K:
+            eraseSize = 4 * 1024;
+            busyNsecs = SIM_FLASH_ERASE_4K_NSECS;
+            break;
+        case SIM_FLASH_ERASE_32K:
+            eraseSize = 32 * 1024;
+            busyNsecs = SIM_FLASH_ERASE_32K_NSECS;
+            break;
+        case SIM_FLASH_ERASE_64K:
+            eraseSize = 64 * 1024;
+            busyNsecs = SIM_FLASH_ERASE_64K_NSECS;
+            break;
+        default:
+            return;
+    }
+
+    // Programs need data after the address and erases exactly the address
+    const size_t addressedBytes = 1 + SIM_FLASH_ADDRESS_BYTES;
+    if (!device->writeEnabled ||
+        (eraseSize == 0 && device->frameBytes <= addressedBytes) ||
+        (eraseSize != 0 && device->frameBytes != addressedBytes))
+    {
+        return;
+    }
+    if (eraseSize != 0)
+    {
+        const uint32_t start = (device->flashAddress % SIM_FLASH_SIZE) & ~(eraseSize - 1);
+        memset(&device->flash[start], 0xFF, eraseSize);
+    }
+    device->writeEnabled = false;
+    device->busyUntilNsecs = endNsecs + busyNsecs;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks whether the flash model is still programming or erasing.
+ *
+ * @return
+ *      true if it is busy.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool isFlashBusy
+(
+    const SimDevice_t* device
+)
+{
+    return nowNsecs() < device->busyUntilNsecs;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the simulated device with the given file descriptor.
+ *
+ * @return
+ *      The device or NULL with errno set to EBADF.
+ */
+//--------------------------------------------------------------------------------------------------
+static SimDevice_t* lookupDevice
+(
+    int fd
+)
+{
+    if (fd < SIM_FD_BASE ||
+        fd >= SIM_FD_BASE + SIM_MAX_DEVICES ||
+        !g.devices[fd - SIM_FD_BASE].open)
+    {
+        errno = EBADF;
+        return NULL;
+    }
+    return &g.devices[fd - SIM_FD_BASE];
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Waits until a point on the monotonic clock.  Most of the wait is slept, and the end of it spun,
+ * so that microsecond transfers are timed accurately.
+ */
+//--------------------------------------------------------------------------------------------------
+static void waitUntil
+(
+    uint64_t deadlineNsecs
+)
+{
+    if (deadlineNsecs > nowNsecs() + SIM_SPIN_NSECS)
+    {
+        const uint64_t wake = deadlineNsecs - SIM_SPIN_NSECS;
+        const struct timespec wakeTime =
+        {
+            .tv_sec = wake / NSECS_PER_SEC,
+            .tv_nsec = wake % NSECS_PER_SEC
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wakeTime, NULL) == EINTR)
+        {
+        }
+    }
+
+    while (nowNsecs() < deadlineNsecs)
+    {
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the monotonic time.
+ *
+ * @return
+ *      Nanoseconds since an arbitrary point in the past.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint64_t nowNsecs
+(
+    void
+)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * NSECS_PER_SEC) + now.tv_nsec;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes the simulator.  Must be called before the simulator backend is used.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiSim_Init
+(
+    void
+)
+{
+    g.mutex = le_mutex_CreateNonRecursive("SPI Simulator");
+    g.flashPool = le_mem_CreatePool("SPI Simulator Flash", SIM_FLASH_SIZE);
+}
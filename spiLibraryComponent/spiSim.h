@@ -0,0 +1,8 @@
+#ifndef SPI_SIM_H
+#define SPI_SIM_H
+
+#include "spiLibrary.h"
+
+void spiSim_Init(void);
+
+#endif  // SPI_SIM_H
@@ -0,0 +1,606 @@
+#include "legato.h"
+#include "spiLibrary.h"
+#include "spiTrace.h"
+
+// Number of payload bytes of each direction included in a trace line
+#define TRACE_MAX_PAYLOAD_BYTES 32
+// Longest trace line: the fixed text plus three characters per traced payload byte
+#define TRACE_LINE_SIZE (96 + (2 * 3 * TRACE_MAX_PAYLOAD_BYTES))
+// Characters of the operation kept in the name of a segment's trace line
+#define TRACE_LABEL_OPERATION_CHARS 24
+// Size of the name of a segment's trace line, e.g. "Transfer 12/32": the operation and two counts
+// of up to 20 digits
+#define TRACE_LABEL_SIZE (TRACE_LABEL_OPERATION_CHARS + 2 * 20 + 3)
+// Number of lines kept by the capture ring
+#define TRACE_RING_LINES 64
+// Segment flags of bus trace records, with the values of spi.api's SEGMENT_ flags
+#define BUS_SEGMENT_TX 0x01
+#define BUS_SEGMENT_RX 0x02
+#define BUS_SEGMENT_CS_CHANGE 0x04
+#define BUS_SEGMENT_TX_DUAL 0x10
+#define BUS_SEGMENT_TX_QUAD 0x20
+#define BUS_SEGMENT_RX_DUAL 0x40
+#define BUS_SEGMENT_RX_QUAD 0x80
+// pcap file header fields for microsecond timestamps
+#define PCAP_MAGIC 0xA1B2C3D4
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+
+// A segment of a message in a bus trace record
+typedef struct
+{
+    uint32_t length;
+    uint32_t speedHz;          ///< 0 for the device setting
+    uint16_t delayUsecs;
+    uint8_t bitsPerWord;       ///< 0 for the device setting
+    uint8_t flags;             ///< BUS_SEGMENT_ flags
+} BusSegment_t;
+
+// A message recorded by the bus trace, exported as is.  Its layout is given in spi.api.
+typedef struct
+{
+    uint64_t enqueueUsecs;     ///< When the request was queued, 0 if it wasn't
+    uint64_t startUsecs;
+    uint64_t endUsecs;
+    uint32_t tag;              ///< Set by spiLib_SetTraceTag, 0 if not set
+    int32_t result;            ///< Bytes transferred, or -errno
+    uint32_t length;           ///< Bytes of all the segments
+    uint8_t numSegments;       ///< Segments of the message, which may exceed those described
+    uint8_t txLength;          ///< Bytes of txData kept
+    uint8_t rxLength;          ///< Bytes of rxData kept
+    uint8_t reserved;
+    BusSegment_t segments[SPILIB_BUS_TRACE_MAX_SEGMENTS];
+    uint8_t txData[SPILIB_BUS_TRACE_MAX_PAYLOAD];
+    uint8_t rxData[SPILIB_BUS_TRACE_MAX_PAYLOAD];
+} BusRecord_t;
+
+// A slot of the bus trace ring.  The sequence is 2n + 1 while the nth record is written into the
+// slot and 2n + 2 once it is complete, so that readers can tell a record which changed under
+// them.
+typedef struct
+{
+    uint64_t sequence;
+    BusRecord_t record;
+} BusSlot_t;
+
+// Record header of a pcap file
+typedef struct
+{
+    uint32_t tsSec;
+    uint32_t tsUsec;
+    uint32_t inclLen;
+    uint32_t origLen;
+} PcapRecordHeader_t;
+
+spiLib_TraceLevel_t spiTrace_Level = SPILIB_TRACE_OFF;
+bool spiTrace_BusEnabled = false;
+
+// Request performed by the calling thread, set by spiLib_SetTraceTag
+static __thread uint32_t threadTag;
+static __thread uint64_t threadEnqueueUsecs;
+
+static struct
+{
+    // Store captured lines in the ring rather than sending them to the log
+    bool capture;
+    // Serializes access to the ring
+    le_mutex_Ref_t mutex;
+    // Ring of the most recent captured lines
+    char ring[TRACE_RING_LINES][TRACE_LINE_SIZE];
+    // Index of the next line of the ring to write
+    size_t next;
+    // Number of valid lines in the ring
+    size_t count;
+    // Memory pool for allocating the bus trace ring
+    le_mem_PoolRef_t busRingPool;
+    // Ring of the most recent messages, allocated when the bus trace is first enabled
+    BusSlot_t* busRing;
+    // Number of records ever started in the bus trace ring
+    uint64_t busHead;
+    // Number of records before the first which spiLib_ExportBusTrace hasn't written
+    uint64_t busExported;
+    // Payload bytes of each direction kept in bus trace records
+    uint8_t busPayloadBytes;
+    // Wall clock time at the start of the monotonic clock, added to record times for pcap
+    // timestamps.  Taken once at init, so a later change of the wall clock doesn't reorder them.
+    uint64_t wallClockOffsetUsecs;
+} g;
+
+
+#if SPILIB_PAYLOAD_TRACE
+//--------------------------------------------------------------------------------------------------
+/**
+ * Appends a hex dump of at most TRACE_MAX_PAYLOAD_BYTES of data to a trace line.
+ *
+ * @return
+ *      The new length of the line.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t appendHex
+(
+    char* line,          ///< Line to append to
+    size_t lineLength,   ///< Current length of the line
+    const uint8_t* data, ///< Data to dump
+    size_t dataLength    ///< Number of bytes in data
+)
+{
+    static const char hexDigits[] = "0123456789ABCDEF";
+
+    const size_t dumpLength =
+        (dataLength < TRACE_MAX_PAYLOAD_BYTES) ? dataLength : TRACE_MAX_PAYLOAD_BYTES;
+    for (size_t i = 0; i < dumpLength && lineLength + 4 < TRACE_LINE_SIZE; i++)
+    {
+        line[lineLength++] = ' ';
+        line[lineLength++] = hexDigits[data[i] >> 4];
+        line[lineLength++] = hexDigits[data[i] & 0x0F];
+    }
+    if (dumpLength < dataLength && lineLength + 4 < TRACE_LINE_SIZE)
+    {
+        memcpy(&line[lineLength], " ..", 3);
+        lineLength += 3;
+    }
+    line[lineLength] = '\0';
+
+    return lineLength;
+}
+#endif
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Formats a single line describing a transfer and sends it to the log or the capture ring.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiTrace_Transfer
+(
+    const char* operation, ///< Name of the operation performed
+    const uint8_t* txData, ///< Transmitted data or NULL
+    size_t txLength,       ///< Number of bytes transmitted
+    const uint8_t* rxData, ///< Received data or NULL
+    size_t rxLength,       ///< Number of bytes received
+    le_result_t result     ///< Outcome of the transfer
+)
+{
+    char line[TRACE_LINE_SIZE];
+    int length = snprintf(
+        line,
+        sizeof(line),
+        "%s tx %zu rx %zu %s",
+        operation,
+        txLength,
+        rxLength,
+        LE_RESULT_TXT(result));
+    if (length < 0)
+    {
+        return;
+    }
+    size_t lineLength = ((size_t)length < sizeof(line)) ? (size_t)length : sizeof(line) - 1;
+
+#if SPILIB_PAYLOAD_TRACE
+    if (__atomic_load_n(&spiTrace_Level, __ATOMIC_RELAXED) >= SPILIB_TRACE_PAYLOAD)
+    {
+        if (txData != NULL && txLength > 0 && lineLength + 5 < sizeof(line))
+        {
+            memcpy(&line[lineLength], " >", 3);
+            lineLength = appendHex(line, lineLength + 2, txData, txLength);
+        }
+        if (rxData != NULL && rxLength > 0 && result == LE_OK && lineLength + 5 < sizeof(line))
+        {
+            memcpy(&line[lineLength], " <", 3);
+            lineLength = appendHex(line, lineLength + 2, rxData, rxLength);
+        }
+    }
+#endif
+
+    if (!g.capture)
+    {
+        LE_INFO("%s", line);
+        return;
+    }
+
+    le_mutex_Lock(g.mutex);
+    memcpy(g.ring[g.next], line, lineLength + 1);
+    g.next = (g.next + 1) % TRACE_RING_LINES;
+    if (g.count < TRACE_RING_LINES)
+    {
+        g.count++;
+    }
+    le_mutex_Unlock(g.mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Traces a message of several segments, one line per segment so that none of them is left out.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiTrace_Segments
+(
+    const char* operation,            ///< Name of the operation performed
+    const spiLib_Segment_t* segments, ///< Segments of the message
+    size_t numSegments,               ///< Number of entries in segments
+    le_result_t result                ///< Outcome of the message
+)
+{
+    for (size_t i = 0; i < numSegments; i++)
+    {
+        char label[TRACE_LABEL_SIZE];
+        snprintf(label,
+                 sizeof(label),
+                 "%.*s %zu/%zu",
+                 TRACE_LABEL_OPERATION_CHARS,
+                 operation,
+                 i + 1,
+                 numSegments);
+        spiTrace_Transfer(
+            label,
+            segments[i].txBuf,
+            (segments[i].txBuf != NULL) ? segments[i].length : 0,
+            segments[i].rxBuf,
+            (segments[i].rxBuf != NULL) ? segments[i].length : 0,
+            result);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets how much detail is traced for each transfer.  Payload dumps are only available when the
+ * library is built with SPILIB_PAYLOAD_TRACE enabled.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiLib_SetTraceLevel
+(
+    spiLib_TraceLevel_t level  ///< New trace level
+)
+{
+    __atomic_store_n(&spiTrace_Level, level, __ATOMIC_RELAXED);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Selects whether trace lines are kept in an in-memory ring instead of being logged.  Capturing
+ * avoids the cost of the log for every transfer; the ring is written out by spiLib_DumpTrace.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiLib_SetTraceCapture
+(
+    bool capture  ///< true to capture into the ring, false to log
+)
+{
+    g.capture = capture;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes the contents of the capture ring to the log, oldest line first, and empties it.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiLib_DumpTrace
+(
+    void
+)
+{
+    le_mutex_Lock(g.mutex);
+    size_t index = (g.next + TRACE_RING_LINES - g.count) % TRACE_RING_LINES;
+    LE_INFO("SPI trace: %zu captured transfers", g.count);
+    for (size_t i = 0; i < g.count; i++)
+    {
+        LE_INFO("%s", g.ring[index]);
+        index = (index + 1) % TRACE_RING_LINES;
+    }
+    g.count = 0;
+    le_mutex_Unlock(g.mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the time used by the bus trace, which is that of le_clk_GetRelativeTime.
+ *
+ * @return
+ *      The time in microseconds.
+ */
+//--------------------------------------------------------------------------------------------------
+uint64_t spiTrace_NowUsecs
+(
+    void
+)
+{
+    const le_clk_Time_t now = le_clk_GetRelativeTime();
+    return ((uint64_t)now.sec * 1000000) + now.usec;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Copies the first bytes a message sends, as many as the bus trace keeps, before the message is
+ * sent.  A full duplex transfer may receive into the buffer it sends from, so the bytes sent are
+ * gone once the ioctl returns.
+ *
+ * @return
+ *      The number of bytes copied.
+ */
+//--------------------------------------------------------------------------------------------------
+size_t spiTrace_CopyTx
+(
+    const struct spi_ioc_transfer* tr, ///< Transfers of the message
+    unsigned numTransfers,             ///< Number of entries in tr
+    uint8_t* txData                    ///< [out] SPILIB_BUS_TRACE_MAX_PAYLOAD bytes for the copy
+)
+{
+    const size_t payloadBytes = __atomic_load_n(&g.busPayloadBytes, __ATOMIC_RELAXED);
+    size_t txLength = 0;
+    for (unsigned i = 0; i < numTransfers && txLength < payloadBytes; i++)
+    {
+        if (tr[i].tx_buf != 0)
+        {
+            const size_t room = payloadBytes - txLength;
+            const size_t n = (tr[i].len < room) ? tr[i].len : room;
+            memcpy(&txData[txLength], (const void*)(uintptr_t)tr[i].tx_buf, n);
+            txLength += n;
+        }
+    }
+    return txLength;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records a message in the bus trace ring.  Writers claim slots with an atomic increment and
+ * never wait, so several bus workers may record at once.  Preserves errno.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiTrace_Message
+(
+    const struct spi_ioc_transfer* tr, ///< Transfers of the message
+    unsigned numTransfers,             ///< Number of entries in tr
+    const uint8_t* txData,             ///< First bytes sent, copied by spiTrace_CopyTx
+    size_t txLength,                   ///< Number of bytes in txData
+    uint64_t startUsecs,               ///< When the ioctl was started
+    int result                         ///< Bytes transferred, or -errno
+)
+{
+    const int savedErrno = errno;
+    const uint64_t endUsecs = spiTrace_NowUsecs();
+    BusSlot_t* ring = __atomic_load_n(&g.busRing, __ATOMIC_ACQUIRE);
+    if (ring == NULL)
+    {
+        errno = savedErrno;
+        return;
+    }
+
+    const uint64_t index = __atomic_fetch_add(&g.busHead, 1, __ATOMIC_RELAXED);
+    BusSlot_t* slot = &ring[index % SPILIB_BUS_TRACE_RING_RECORDS];
+    __atomic_store_n(&slot->sequence, (2 * index) + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    BusRecord_t* record = &slot->record;
+    memset(record, 0, sizeof(*record));
+    record->enqueueUsecs = threadEnqueueUsecs;
+    record->startUsecs = startUsecs;
+    record->endUsecs = endUsecs;
+    record->tag = threadTag;
+    record->result = result;
+    record->numSegments = (numTransfers < UINT8_MAX) ? numTransfers : UINT8_MAX;
+    memcpy(record->txData, txData, txLength);
+    record->txLength = txLength;
+
+    const size_t payloadBytes = __atomic_load_n(&g.busPayloadBytes, __ATOMIC_RELAXED);
+    for (unsigned i = 0; i < numTransfers; i++)
+    {
+        record->length += tr[i].len;
+        if (i < SPILIB_BUS_TRACE_MAX_SEGMENTS)
+        {
+            BusSegment_t* segment = &record->segments[i];
+            segment->length = tr[i].len;
+            segment->speedHz = tr[i].speed_hz;
+            segment->delayUsecs = tr[i].delay_usecs;
+            segment->bitsPerWord = tr[i].bits_per_word;
+            segment->flags = (tr[i].tx_buf != 0 ? BUS_SEGMENT_TX : 0) |
+                             (tr[i].rx_buf != 0 ? BUS_SEGMENT_RX : 0) |
+                             (tr[i].cs_change ? BUS_SEGMENT_CS_CHANGE : 0) |
+                             (tr[i].tx_nbits == 2 ? BUS_SEGMENT_TX_DUAL : 0) |
+                             (tr[i].tx_nbits == 4 ? BUS_SEGMENT_TX_QUAD : 0) |
+                             (tr[i].rx_nbits == 2 ? BUS_SEGMENT_RX_DUAL : 0) |
+                             (tr[i].rx_nbits == 4 ? BUS_SEGMENT_RX_QUAD : 0);
+        }
+
+        // The first bytes received, across segments
+        if (tr[i].rx_buf != 0 && result >= 0 && record->rxLength < payloadBytes)
+        {
+            const size_t room = payloadBytes - record->rxLength;
+            const size_t n = (tr[i].len < room) ? tr[i].len : room;
+            memcpy(&record->rxData[record->rxLength], (const void*)(uintptr_t)tr[i].rx_buf, n);
+            record->rxLength += n;
+        }
+    }
+
+    __atomic_store_n(&slot->sequence, (2 * index) + 2, __ATOMIC_RELEASE);
+    errno = savedErrno;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts or stops recording every message in the bus trace ring.  The ring is allocated the
+ * first time the trace is enabled, and keeps its records while the trace is stopped.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if payloadBytes is above SPILIB_BUS_TRACE_MAX_PAYLOAD
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_SetBusTrace
+(
+    bool enable,           ///< true to record messages
+    uint8_t payloadBytes   ///< Bytes of each direction of the payload to keep
+)
+{
+    if (payloadBytes > SPILIB_BUS_TRACE_MAX_PAYLOAD)
+    {
+        return LE_OUT_OF_RANGE;
+    }
+
+    le_mutex_Lock(g.mutex);
+    if (enable && g.busRing == NULL)
+    {
+        BusSlot_t* ring = le_mem_ForceAlloc(g.busRingPool);
+        memset(ring, 0, sizeof(BusSlot_t) * SPILIB_BUS_TRACE_RING_RECORDS);
+        __atomic_store_n(&g.busRing, ring, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&g.busPayloadBytes, payloadBytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&spiTrace_BusEnabled, enable, __ATOMIC_RELAXED);
+    le_mutex_Unlock(g.mutex);
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets the request which the calling thread's following messages belong to, as recorded in the
+ * bus trace.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiLib_SetTraceTag
+(
+    uint32_t tag,           ///< Identifies the requester, or 0 to clear it
+    uint64_t enqueueUsecs   ///< When the request was queued, on le_clk_GetRelativeTime's clock,
+                            ///  or 0
+)
+{
+    threadTag = tag;
+    threadEnqueueUsecs = enqueueUsecs;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes all or part of a buffer to a file, carrying on after partial writes.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the write failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t writeAll
+(
+    int fd,
+    const void* data,
+    size_t length
+)
+{
+    const uint8_t* next = data;
+    while (length > 0)
+    {
+        const ssize_t written = write(fd, next, length);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            LE_ERROR("Couldn't write the bus trace (%m)");
+            return LE_FAULT;
+        }
+        next += written;
+        length -= written;
+    }
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes the bus trace records made since the last export to a file in pcap format, oldest first.
+ * Each record is a packet of link type SPILIB_BUS_TRACE_LINKTYPE, timestamped with the wall clock
+ * time of the start of its message.  Records which were overwritten, or were being written, are
+ * left out.  Recording carries on during the export.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the file couldn't be written
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiLib_ExportBusTrace
+(
+    int fd    ///< File to write, at its current offset
+)
+{
+    const uint32_t fileHeader[] =
+    {
+        PCAP_MAGIC,
+        PCAP_VERSION_MAJOR | (PCAP_VERSION_MINOR << 16),
+        0,
+        0,
+        sizeof(BusRecord_t),
+        SPILIB_BUS_TRACE_LINKTYPE
+    };
+
+    le_mutex_Lock(g.mutex);
+    le_result_t result = writeAll(fd, fileHeader, sizeof(fileHeader));
+    const BusSlot_t* ring = g.busRing;
+    const uint64_t head = __atomic_load_n(&g.busHead, __ATOMIC_ACQUIRE);
+    uint64_t index = g.busExported;
+    if (head - index > SPILIB_BUS_TRACE_RING_RECORDS)
+    {
+        index = head - SPILIB_BUS_TRACE_RING_RECORDS;
+    }
+    size_t exported = 0;
+    for (; ring != NULL && index < head && result == LE_OK; index++)
+    {
+        const BusSlot_t* slot = &ring[index % SPILIB_BUS_TRACE_RING_RECORDS];
+        const uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence != (2 * index) + 2)
+        {
+            continue;
+        }
+        struct
+        {
+            PcapRecordHeader_t header;
+            BusRecord_t record;
+        } packet;
+        packet.record = slot->record;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != sequence)
+        {
+            continue;
+        }
+        const uint64_t timestampUsecs = packet.record.startUsecs + g.wallClockOffsetUsecs;
+        packet.header.tsSec = timestampUsecs / 1000000;
+        packet.header.tsUsec = timestampUsecs % 1000000;
+        packet.header.inclLen = sizeof(packet.record);
+        packet.header.origLen = sizeof(packet.record);
+        result = writeAll(fd, &packet, sizeof(packet));
+        exported++;
+    }
+    g.busExported = index;
+    le_mutex_Unlock(g.mutex);
+
+    LE_INFO("SPI bus trace: exported %zu records", exported);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes the trace facility.  Must be called before any transfer is traced.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiTrace_Init
+(
+    void
+)
+{
+    g.mutex = le_mutex_CreateNonRecursive("SpiTraceRing");
+    // The record layout is part of the exported format
+    LE_ASSERT(sizeof(BusRecord_t) == SPILIB_BUS_TRACE_RECORD_SIZE);
+    g.busRingPool =
+        le_mem_CreatePool("SPI Bus Trace", sizeof(BusSlot_t) * SPILIB_BUS_TRACE_RING_RECORDS);
+
+    const le_clk_Time_t wallClock = le_clk_GetAbsoluteTime();
+    g.wallClockOffsetUsecs =
+        ((uint64_t)wallClock.sec * 1000000) + wallClock.usec - spiTrace_NowUsecs();
+}
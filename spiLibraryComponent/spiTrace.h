@@ -0,0 +1,67 @@
+#ifndef SPI_TRACE_H
+#define SPI_TRACE_H
+
+#include "spiLibrary.h"
+#include "spiIoc.h"
+
+// Current runtime trace level.  Only to be read through SPI_TRACE_TRANSFER and SPI_TRACE_SEGMENTS.
+extern spiLib_TraceLevel_t spiTrace_Level;
+
+// Whether the bus trace is recording.  Only to be read through SPI_TRACE_BUS_ENABLED.
+extern bool spiTrace_BusEnabled;
+
+void spiTrace_Init(void);
+
+uint64_t spiTrace_NowUsecs(void);
+
+size_t spiTrace_CopyTx(
+    const struct spi_ioc_transfer* tr,
+    unsigned numTransfers,
+    uint8_t* txData);
+
+void spiTrace_Message(
+    const struct spi_ioc_transfer* tr,
+    unsigned numTransfers,
+    const uint8_t* txData,
+    size_t txLength,
+    uint64_t startUsecs,
+    int result);
+
+void spiTrace_Transfer(
+    const char* operation,
+    const uint8_t* txData,
+    size_t txLength,
+    const uint8_t* rxData,
+    size_t rxLength,
+    le_result_t result);
+
+void spiTrace_Segments(
+    const char* operation,
+    const spiLib_Segment_t* segments,
+    size_t numSegments,
+    le_result_t result);
+
+// Traces a transfer.  The level check is done inline so a disabled trace costs one comparison.
+#define SPI_TRACE_TRANSFER(operation, txData, txLength, rxData, rxLength, result)             \
+    do                                                                                         \
+    {                                                                                          \
+        if (__atomic_load_n(&spiTrace_Level, __ATOMIC_RELAXED) != SPILIB_TRACE_OFF)            \
+        {                                                                                      \
+            spiTrace_Transfer((operation), (txData), (txLength), (rxData), (rxLength), (result)); \
+        }                                                                                      \
+    } while (0)
+
+// Traces each segment of a message, with the same inline level check as SPI_TRACE_TRANSFER
+#define SPI_TRACE_SEGMENTS(operation, segments, numSegments, result)                           \
+    do                                                                                         \
+    {                                                                                          \
+        if (__atomic_load_n(&spiTrace_Level, __ATOMIC_RELAXED) != SPILIB_TRACE_OFF)            \
+        {                                                                                      \
+            spiTrace_Segments((operation), (segments), (numSegments), (result));               \
+        }                                                                                      \
+    } while (0)
+
+// Whether messages should be recorded in the bus trace, which costs one load when it is disabled
+#define SPI_TRACE_BUS_ENABLED() __atomic_load_n(&spiTrace_BusEnabled, __ATOMIC_RELAXED)
+
+#endif  // SPI_TRACE_H
@@ -0,0 +1,372 @@
+#include "legato.h"
+#include "spiWord.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define HOST_IS_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+// Every byte with its bits in reverse order
+#define REVERSE2(n) n, n + 2 * 64, n + 1 * 64, n + 3 * 64
+#define REVERSE4(n) REVERSE2(n), REVERSE2(n + 2 * 16), REVERSE2(n + 1 * 16), REVERSE2(n + 3 * 16)
+#define REVERSE6(n) REVERSE4(n), REVERSE4(n + 2 * 4), REVERSE4(n + 1 * 4), REVERSE4(n + 3 * 4)
+static const uint8_t ReversedBytes[256] = { REVERSE6(0), REVERSE6(2), REVERSE6(1), REVERSE6(3) };
+
+#if (defined(__ARM_NEON) && !defined(__aarch64__)) || defined(__SSSE3__)
+// Every nibble with its bits in reverse order, for table lookups 16 bytes at a time
+static const uint8_t ReversedNibbles[16] =
+{
+    0x0, 0x8, 0x4, 0xC, 0x2, 0xA, 0x6, 0xE, 0x1, 0x9, 0x5, 0xD, 0x3, 0xB, 0x7, 0xF
+};
+#endif
+
+
+static uint32_t readWord(const uint8_t* src, size_t wordBytes);
+static void writeWord(uint8_t* dst, uint32_t word, size_t wordBytes);
+static uint32_t reverseWord(uint32_t word, uint8_t bits);
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reverses the order of the bits within each byte.  dst may be the same buffer as src.
+ *
+ * @note
+ *      SSE2 has no byte shuffle to look the nibbles up with, so a build targeting SSE2 but not
+ *      SSSE3 has no vector bit reverse and reverses every byte in the scalar loop.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWord_ReverseBits
+(
+    uint8_t* dst,        ///< [out] Reversed bytes
+    const uint8_t* src,  ///< Bytes to reverse
+    size_t length        ///< Number of bytes
+)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    for (; i + 16 <= length; i += 16)
+    {
+        vst1q_u8(&dst[i], vrbitq_u8(vld1q_u8(&src[i])));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x8x2_t table = { { vld1_u8(&ReversedNibbles[0]), vld1_u8(&ReversedNibbles[8]) } };
+    const uint8x8_t lowMask = vdup_n_u8(0x0F);
+    for (; i + 8 <= length; i += 8)
+    {
+        const uint8x8_t bytes = vld1_u8(&src[i]);
+        const uint8x8_t low = vtbl2_u8(table, vand_u8(bytes, lowMask));
+        const uint8x8_t high = vtbl2_u8(table, vshr_n_u8(bytes, 4));
+        vst1_u8(&dst[i], vorr_u8(vshl_n_u8(low, 4), high));
+    }
+#elif defined(__SSSE3__)
+    const __m128i table = _mm_loadu_si128((const __m128i*)ReversedNibbles);
+    const __m128i lowMask = _mm_set1_epi8(0x0F);
+    for (; i + 16 <= length; i += 16)
+    {
+        const __m128i bytes = _mm_loadu_si128((const __m128i*)&src[i]);
+        const __m128i low = _mm_shuffle_epi8(table, _mm_and_si128(bytes, lowMask));
+        const __m128i high =
+            _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi16(bytes, 4), lowMask));
+        _mm_storeu_si128((__m128i*)&dst[i], _mm_or_si128(_mm_slli_epi16(low, 4), high));
+    }
+#endif
+    for (; i < length; i++)
+    {
+        dst[i] = ReversedBytes[src[i]];
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Swaps the byte order of 16 bit words.  dst may be the same buffer as src.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWord_Swap16
+(
+    uint8_t* dst,        ///< [out] Swapped words
+    const uint8_t* src,  ///< Words to swap
+    size_t numWords      ///< Number of words
+)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 8 <= numWords; i += 8)
+    {
+        vst1q_u8(&dst[i * 2], vrev16q_u8(vld1q_u8(&src[i * 2])));
+    }
+#elif defined(__SSE2__)
+    for (; i + 8 <= numWords; i += 8)
+    {
+        const __m128i words = _mm_loadu_si128((const __m128i*)&src[i * 2]);
+        const __m128i swapped = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128((__m128i*)&dst[i * 2], swapped);
+    }
+#endif
+    for (; i < numWords; i++)
+    {
+        const uint8_t first = src[i * 2];
+        dst[i * 2] = src[i * 2 + 1];
+        dst[i * 2 + 1] = first;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Swaps the byte order of 32 bit words.  dst may be the same buffer as src.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWord_Swap32
+(
+    uint8_t* dst,        ///< [out] Swapped words
+    const uint8_t* src,  ///< Words to swap
+    size_t numWords      ///< Number of words
+)
+{
+    size_t i = 0;
+#if defined(__ARM_NEON)
+    for (; i + 4 <= numWords; i += 4)
+    {
+        vst1q_u8(&dst[i * 4], vrev32q_u8(vld1q_u8(&src[i * 4])));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= numWords; i += 4)
+    {
+        const __m128i words = _mm_loadu_si128((const __m128i*)&src[i * 4]);
+        // Swap the bytes of each half, then the halves of each word
+        const __m128i halves = _mm_or_si128(_mm_slli_epi16(words, 8), _mm_srli_epi16(words, 8));
+        _mm_storeu_si128(
+            (__m128i*)&dst[i * 4],
+            _mm_shufflehi_epi16(_mm_shufflelo_epi16(halves, 0xB1), 0xB1));
+    }
+#endif
+    for (; i < numWords; i++)
+    {
+        uint32_t word;
+        memcpy(&word, &src[i * 4], sizeof(word));
+        word = __builtin_bswap32(word);
+        memcpy(&dst[i * 4], &word, sizeof(word));
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the number of bytes which words take on the wire.
+ *
+ * @return
+ *      The number of bytes, the last of which may be partly padding.
+ */
+//--------------------------------------------------------------------------------------------------
+size_t spiWord_PackedLength
+(
+    size_t numWords,  ///< Number of words
+    uint8_t bits      ///< Bits per word
+)
+{
+    return ((numWords * bits) + 7) / 8;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Packs words from a buffer into the bytes sent on the wire with 8 bit words, so that the slave
+ * sees the same bits as if the controller sent words of the given size itself.  The last byte is
+ * padded with zeros if the words don't fill it.  dst may be the same buffer as src.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWord_Pack
+(
+    uint8_t* dst,        ///< [out] spiWord_PackedLength bytes for the wire
+    const uint8_t* src,  ///< Words as held in a buffer
+    size_t numWords,     ///< Number of words
+    uint8_t bits,        ///< Bits per word, from 1 to 32
+    bool lsbFirst        ///< Send the bits of each word LSB first
+)
+{
+    LE_ASSERT(bits >= 1 && bits <= 32);
+    const size_t wordBytes = SPIWORD_BYTES(bits);
+
+    // Words of whole bytes only need their bytes put in wire order: most significant first, or
+    // least significant first with the bits of each byte reversed
+    if (bits == 8 * wordBytes)
+    {
+        const bool swap = (lsbFirst == HOST_IS_BIG_ENDIAN);
+        if (swap && wordBytes == 2)
+        {
+            spiWord_Swap16(dst, src, numWords);
+        }
+        else if (swap && wordBytes == 4)
+        {
+            spiWord_Swap32(dst, src, numWords);
+        }
+        else if (dst != src)
+        {
+            memmove(dst, src, numWords * wordBytes);
+        }
+        if (lsbFirst)
+        {
+            spiWord_ReverseBits(dst, dst, numWords * wordBytes);
+        }
+        return;
+    }
+
+    // The bytes written never get ahead of the words read, so this works in place
+    const uint32_t mask = (1u << bits) - 1;
+    uint64_t pending = 0;
+    unsigned pendingBits = 0;
+    size_t out = 0;
+    for (size_t i = 0; i < numWords; i++)
+    {
+        uint32_t word = readWord(&src[i * wordBytes], wordBytes) & mask;
+        if (lsbFirst)
+        {
+            word = reverseWord(word, bits);
+        }
+        pending = (pending << bits) | word;
+        pendingBits += bits;
+        while (pendingBits >= 8)
+        {
+            pendingBits -= 8;
+            dst[out++] = (uint8_t)(pending >> pendingBits);
+        }
+    }
+    if (pendingBits > 0)
+    {
+        dst[out] = (uint8_t)(pending << (8 - pendingBits));
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Unpacks the bytes received on the wire with 8 bit words into words in a buffer, as the
+ * controller would have received them with words of the given size.  dst must not overlap src
+ * unless the words are of 8, 16 or 32 bits, in which case dst may be the same buffer as src.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWord_Unpack
+(
+    uint8_t* dst,        ///< [out] Words as held in a buffer
+    const uint8_t* src,  ///< spiWord_PackedLength bytes from the wire
+    size_t numWords,     ///< Number of words
+    uint8_t bits,        ///< Bits per word, from 1 to 32
+    bool lsbFirst        ///< The bits of each word were sent LSB first
+)
+{
+    LE_ASSERT(bits >= 1 && bits <= 32);
+    const size_t wordBytes = SPIWORD_BYTES(bits);
+
+    // Reversing bits and swapping bytes undo themselves, so whole byte words unpack as they pack
+    if (bits == 8 * wordBytes)
+    {
+        spiWord_Pack(dst, src, numWords, bits, lsbFirst);
+        return;
+    }
+
+    const uint32_t mask = (1u << bits) - 1;
+    uint64_t pending = 0;
+    unsigned pendingBits = 0;
+    size_t in = 0;
+    for (size_t i = 0; i < numWords; i++)
+    {
+        while (pendingBits < bits)
+        {
+            pending = (pending << 8) | src[in++];
+            pendingBits += 8;
+        }
+        pendingBits -= bits;
+        uint32_t word = (uint32_t)(pending >> pendingBits) & mask;
+        if (lsbFirst)
+        {
+            word = reverseWord(word, bits);
+        }
+        writeWord(&dst[i * wordBytes], word, wordBytes);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads a word held in host byte order.
+ *
+ * @return
+ *      The word.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t readWord
+(
+    const uint8_t* src,  ///< Word to read
+    size_t wordBytes     ///< 1, 2 or 4
+)
+{
+    if (wordBytes == 1)
+    {
+        return src[0];
+    }
+    if (wordBytes == 2)
+    {
+        uint16_t word;
+        memcpy(&word, src, sizeof(word));
+        return word;
+    }
+    uint32_t word;
+    memcpy(&word, src, sizeof(word));
+    return word;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes a word in host byte order.
+ */
+//--------------------------------------------------------------------------------------------------
+static void writeWord
+(
+    uint8_t* dst,      ///< [out] Where to write the word
+    uint32_t word,     ///< Word to write
+    size_t wordBytes   ///< 1, 2 or 4
+)
+{
+    if (wordBytes == 1)
+    {
+        dst[0] = (uint8_t)word;
+    }
+    else if (wordBytes == 2)
+    {
+        const uint16_t halfWord = (uint16_t)word;
+        memcpy(dst, &halfWord, sizeof(halfWord));
+    }
+    else
+    {
+        memcpy(dst, &word, sizeof(word));
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reverses the order of the low bits of a word.
+ *
+ * @return
+ *      The word with its bits reversed.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t reverseWord
+(
+    uint32_t word,   ///< Word to reverse
+    uint8_t bits     ///< Number of low bits in the word, from 1 to 32
+)
+{
+    const uint32_t reversed = ((uint32_t)ReversedBytes[word & 0xFF] << 24) |
+                              ((uint32_t)ReversedBytes[(word >> 8) & 0xFF] << 16) |
+                              ((uint32_t)ReversedBytes[(word >> 16) & 0xFF] << 8) |
+                              ReversedBytes[word >> 24];
+    return reversed >> (32 - bits);
+}
@@ -0,0 +1,37 @@
+#ifndef SPI_WORD_H
+#define SPI_WORD_H
+
+#include "legato.h"
+
+// Conversions between words as spidev holds them in buffers and the bits on the wire, for
+// controllers which can't transfer a word size or bit order themselves.  A word of 1 to 8 bits
+// occupies 1 byte of a buffer, 9 to 16 bits 2 bytes and 17 to 32 bits 4 bytes, in host byte
+// order with the word in the low bits.  The kernels use NEON or SSE when the compiler targets
+// them, and plain C otherwise.
+
+// Bytes a word of the given number of bits occupies in a buffer
+#define SPIWORD_BYTES(bits) (((bits) <= 8) ? 1 : (((bits) <= 16) ? 2 : 4))
+
+LE_SHARED void spiWord_ReverseBits(uint8_t* dst, const uint8_t* src, size_t length);
+
+LE_SHARED void spiWord_Swap16(uint8_t* dst, const uint8_t* src, size_t numWords);
+
+LE_SHARED void spiWord_Swap32(uint8_t* dst, const uint8_t* src, size_t numWords);
+
+LE_SHARED size_t spiWord_PackedLength(size_t numWords, uint8_t bits);
+
+LE_SHARED void spiWord_Pack(
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t numWords,
+    uint8_t bits,
+    bool lsbFirst);
+
+LE_SHARED void spiWord_Unpack(
+    uint8_t* dst,
+    const uint8_t* src,
+    size_t numWords,
+    uint8_t bits,
+    bool lsbFirst);
+
+#endif  // SPI_WORD_H
@@ -0,0 +1,359 @@
+#include "legato.h"
+#include "spiCapture.h"
+#include <sys/mman.h>
+
+// File sealing constants of Linux 3.17, which older C libraries lack
+#ifndef F_GET_SEALS
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+#define CAPTURE_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define CAPTURE_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+// Header at the start of a capture file, laid out as documented in spi.api.  The reader only
+// writes consumed; everything else is written by the capture.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t slotSize;              ///< Bytes per record slot, including the record header
+    uint32_t numSlots;
+    uint32_t dataSize;              ///< Bytes of data in each record
+    uint64_t written;               ///< Records stored so far; record n is in slot n % numSlots
+    uint64_t consumed;              ///< Records the reader has finished with
+    uint64_t dropped;
+    uint64_t overruns;
+    uint64_t failed;
+    uint64_t reserved;
+} FileHeader_t;
+
+// Header at the start of each record slot
+typedef struct
+{
+    uint64_t timestamp;             ///< Monotonic time in microseconds the record was taken at
+    uint32_t sequence;              ///< Number of the period the record was taken in
+    uint32_t length;                ///< Bytes of data following the header
+} RecordHeader_t;
+
+// Takes records from a repeating timer and stores them in a ring of slots in a memory mapped
+// file, which a reader consumes without any call into the service.  A record is never written
+// over before the reader has consumed it; records due while the ring is full are dropped instead.
+typedef struct spiCapture
+{
+    uint8_t* mapping;
+    size_t mappingSize;
+    FileHeader_t* header;           ///< Start of the mapping
+    size_t dataSize;
+    size_t slotSize;
+    size_t numSlots;
+    spiCapture_TakeFunc_t take;
+    void* context;                  ///< Passed to take
+    le_timer_Ref_t timer;           ///< Set while the capture is started
+    uint32_t periodUsecs;
+    uint64_t nextDueUsecs;          ///< When the next record is due
+    uint32_t sequence;              ///< Sequence number of the next record
+    // Only changed by the thread taking records, but read from any thread
+    uint64_t written;
+    uint64_t dropped;               ///< Records not taken because the ring was full
+    uint64_t overruns;              ///< Periods missed because a record was taken too late
+    uint64_t failed;                ///< Records which couldn't be taken
+} Capture_t;
+
+
+static void timerExpired(le_timer_Ref_t timer);
+static void publishCounters(Capture_t* capture);
+static uint64_t monotonicUsecs(void);
+
+static struct
+{
+    // Memory pool for allocating captures
+    le_mem_PoolRef_t capturePool;
+} g;
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Creates a stopped capture into a file and initializes the file's header.  The file is mapped
+ * for the lifetime of the capture, so the caller may close its descriptor afterwards.  It must be
+ * a memfd sealed with F_SEAL_SHRINK, since records written into a mapping of a file which has
+ * since been truncated would fault.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the file isn't sealed against shrinking or is smaller than fileSize
+ *      - LE_OUT_OF_RANGE if fileSize doesn't leave room for at least one record
+ *      - LE_FAULT if the file couldn't be mapped
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiCapture_Create
+(
+    int fd,                      ///< File to store the records in
+    size_t fileSize,             ///< Bytes of the file to use
+    size_t dataSize,             ///< Bytes of data in each record
+    spiCapture_TakeFunc_t take,  ///< Takes each record
+    void* context,               ///< Passed to take
+    spiCapture_Ref_t* capturePtr ///< [out] The new capture
+)
+{
+    LE_ASSERT(dataSize > 0);
+    *capturePtr = NULL;
+
+    // Keep the records 8 byte aligned so that their timestamps can be read directly
+    const size_t slotSize = (SPICAPTURE_RECORD_HEADER_SIZE + dataSize + 7) & ~(size_t)7;
+    if (fileSize < SPICAPTURE_HEADER_SIZE + slotSize ||
+        (fileSize - SPICAPTURE_HEADER_SIZE) / slotSize > UINT32_MAX)
+    {
+        LE_ERROR("Capture file of %zu bytes can't hold records of %zu bytes", fileSize, dataSize);
+        return LE_OUT_OF_RANGE;
+    }
+
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0)
+    {
+        LE_ERROR("Capture file must be a memfd sealed with F_SEAL_SHRINK");
+        return LE_BAD_PARAMETER;
+    }
+
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0)
+    {
+        LE_ERROR("Couldn't stat capture file: (%m)");
+        return LE_FAULT;
+    }
+    if (fileStat.st_size < 0 || (uintmax_t)fileStat.st_size < fileSize)
+    {
+        LE_ERROR(
+            "Capture file of %jd bytes can't provide %zu bytes",
+            (intmax_t)fileStat.st_size,
+            fileSize);
+        return LE_BAD_PARAMETER;
+    }
+
+    void* mapping = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        LE_ERROR("Couldn't map capture file: (%m)");
+        return LE_FAULT;
+    }
+
+    Capture_t* capture = le_mem_ForceAlloc(g.capturePool);
+    capture->mapping = mapping;
+    capture->mappingSize = fileSize;
+    capture->header = mapping;
+    capture->dataSize = dataSize;
+    capture->slotSize = slotSize;
+    capture->numSlots = (fileSize - SPICAPTURE_HEADER_SIZE) / slotSize;
+    capture->take = take;
+    capture->context = context;
+    capture->timer = NULL;
+    capture->periodUsecs = 0;
+    capture->nextDueUsecs = 0;
+    capture->sequence = 0;
+    capture->written = 0;
+    capture->dropped = 0;
+    capture->overruns = 0;
+    capture->failed = 0;
+
+    memset(capture->header, 0, SPICAPTURE_HEADER_SIZE);
+    capture->header->slotSize = slotSize;
+    capture->header->numSlots = capture->numSlots;
+    capture->header->dataSize = dataSize;
+    // A reader seeing the magic can rely on the rest of the header
+    __atomic_store_n(&capture->header->magic, SPICAPTURE_MAGIC, __ATOMIC_RELEASE);
+
+    *capturePtr = capture;
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts taking a record every period.  The records are taken on the calling thread, which must
+ * be running an event loop.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiCapture_Start
+(
+    spiCapture_Ref_t capture,  ///< Capture to start
+    uint32_t periodUsecs       ///< Time between records
+)
+{
+    LE_ASSERT(capture->timer == NULL && periodUsecs > 0);
+
+    const le_clk_Time_t interval =
+    {
+        .sec = periodUsecs / 1000000,
+        .usec = periodUsecs % 1000000
+    };
+    capture->periodUsecs = periodUsecs;
+    capture->nextDueUsecs = monotonicUsecs() + periodUsecs;
+    capture->timer = le_timer_Create("SPI Capture");
+    LE_ASSERT_OK(le_timer_SetInterval(capture->timer, interval));
+    // Repeat until stopped
+    LE_ASSERT_OK(le_timer_SetRepeat(capture->timer, 0));
+    LE_ASSERT_OK(le_timer_SetContextPtr(capture->timer, capture));
+    LE_ASSERT_OK(le_timer_SetHandler(capture->timer, timerExpired));
+    LE_ASSERT_OK(le_timer_Start(capture->timer));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops taking records.  Must be called on the thread which started the capture.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiCapture_Stop
+(
+    spiCapture_Ref_t capture  ///< Capture to stop
+)
+{
+    if (capture->timer != NULL)
+    {
+        le_timer_Delete(capture->timer);
+        capture->timer = NULL;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a stopped capture and unmaps its file.  Records already stored stay in the file.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiCapture_Delete
+(
+    spiCapture_Ref_t capture  ///< Capture to delete
+)
+{
+    LE_ASSERT(capture->timer == NULL);
+    munmap(capture->mapping, capture->mappingSize);
+    le_mem_Release(capture);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the progress of a capture.  May be called from any thread.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiCapture_GetStatus
+(
+    spiCapture_Ref_t capture,  ///< Capture to query
+    uint64_t* records,         ///< [out] Records stored in the file
+    uint64_t* dropped,         ///< [out] Records not taken because the ring was full
+    uint64_t* overruns,        ///< [out] Periods missed because records were taken too late
+    uint64_t* failed           ///< [out] Records which couldn't be taken
+)
+{
+    *records = CAPTURE_LOAD(capture->written);
+    *dropped = CAPTURE_LOAD(capture->dropped);
+    *overruns = CAPTURE_LOAD(capture->overruns);
+    *failed = CAPTURE_LOAD(capture->failed);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Takes a record into the next free slot of the ring, or drops it if the reader hasn't consumed
+ * any slot.
+ */
+//--------------------------------------------------------------------------------------------------
+static void timerExpired
+(
+    le_timer_Ref_t timer
+)
+{
+    Capture_t* capture = le_timer_GetContextPtr(timer);
+    const uint64_t now = monotonicUsecs();
+
+    // Whole periods which went by while the thread was busy elsewhere are lost.  Their sequence
+    // numbers are skipped so that the reader sees the gap.
+    uint64_t missed = 0;
+    if (now >= capture->nextDueUsecs + capture->periodUsecs)
+    {
+        missed = (now - capture->nextDueUsecs) / capture->periodUsecs;
+        CAPTURE_ADD(capture->overruns, missed);
+    }
+    capture->nextDueUsecs += (missed + 1) * capture->periodUsecs;
+    capture->sequence += missed;
+    const uint32_t sequence = capture->sequence++;
+
+    // The reader may have left consumed at anything, so only trust it up to the records written
+    const uint64_t consumed = __atomic_load_n(&capture->header->consumed, __ATOMIC_ACQUIRE);
+    const uint64_t unread = (consumed < capture->written) ? (capture->written - consumed) : 0;
+    if (unread >= capture->numSlots)
+    {
+        CAPTURE_ADD(capture->dropped, 1);
+        publishCounters(capture);
+        return;
+    }
+
+    uint8_t* slot = &capture->mapping[SPICAPTURE_HEADER_SIZE +
+                                      (capture->written % capture->numSlots) * capture->slotSize];
+    const le_result_t result =
+        capture->take(capture->context, &slot[SPICAPTURE_RECORD_HEADER_SIZE]);
+    if (result != LE_OK)
+    {
+        CAPTURE_ADD(capture->failed, 1);
+        publishCounters(capture);
+        return;
+    }
+
+    RecordHeader_t* record = (RecordHeader_t*)slot;
+    record->timestamp = now;
+    record->sequence = sequence;
+    record->length = capture->dataSize;
+    CAPTURE_ADD(capture->written, 1);
+    publishCounters(capture);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Copies the counters into the file header.  The count of records written is stored last, so
+ * that a reader which sees it also sees the records it covers.
+ */
+//--------------------------------------------------------------------------------------------------
+static void publishCounters
+(
+    Capture_t* capture
+)
+{
+    FileHeader_t* header = capture->header;
+    __atomic_store_n(&header->dropped, capture->dropped, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->overruns, capture->overruns, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->failed, capture->failed, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->written, capture->written, __ATOMIC_RELEASE);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the monotonic time.
+ *
+ * @return
+ *      Microseconds since an arbitrary point in the past.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint64_t monotonicUsecs
+(
+    void
+)
+{
+    const le_clk_Time_t now = le_clk_GetRelativeTime();
+    return ((uint64_t)now.sec * 1000000) + now.usec;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes the capture module.  Must be called before any other spiCapture function.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiCapture_Init
+(
+    void
+)
+{
+    g.capturePool = le_mem_CreatePool("SPI Captures", sizeof(Capture_t));
+}
@@ -0,0 +1,42 @@
+#ifndef SPI_CAPTURE_H
+#define SPI_CAPTURE_H
+
+#include "legato.h"
+
+// Bytes at the start of a capture file before the first record slot
+#define SPICAPTURE_HEADER_SIZE 64
+// Bytes at the start of each record before its data
+#define SPICAPTURE_RECORD_HEADER_SIZE 16
+// Identifies a capture file; "SPIC" when read as bytes
+#define SPICAPTURE_MAGIC 0x43495053
+
+typedef struct spiCapture* spiCapture_Ref_t;
+
+// Takes one record of the capture's data size straight into the given slot of the capture file.
+// Called on the thread which started the capture.
+typedef le_result_t (*spiCapture_TakeFunc_t)(void* context, uint8_t* data);
+
+le_result_t spiCapture_Create(
+    int fd,
+    size_t fileSize,
+    size_t dataSize,
+    spiCapture_TakeFunc_t take,
+    void* context,
+    spiCapture_Ref_t* capture);
+
+void spiCapture_Start(spiCapture_Ref_t capture, uint32_t periodUsecs);
+
+void spiCapture_Stop(spiCapture_Ref_t capture);
+
+void spiCapture_Delete(spiCapture_Ref_t capture);
+
+void spiCapture_GetStatus(
+    spiCapture_Ref_t capture,
+    uint64_t* records,
+    uint64_t* dropped,
+    uint64_t* overruns,
+    uint64_t* failed);
+
+void spiCapture_Init(void);
+
+#endif  // SPI_CAPTURE_H
@@ -0,0 +1,311 @@
+#include "legato.h"
+#include "spiFrame.h"
+
+
+static uint32_t reflect(uint32_t value, uint8_t bits);
+static size_t countBadFrames(const spiFrame_t* frame, const uint8_t* data, size_t length);
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes a framing which doesn't check received data.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFrame_Init
+(
+    spiFrame_t* frame   ///< Framing to initialize
+)
+{
+    frame->crcWidth = 0;
+    frame->frameLength = 0;
+    frame->skipLength = 0;
+    frame->retries = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets the CRC and layout of the frames, and builds the tables of the CRC kernel.  The CRC is
+ * described as in the Rocksoft model: polynomial, init and xorOut are given MSB first without the
+ * top bit of the polynomial, even for reflected CRCs.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the width isn't 0, 8, 16 or 32, a frame doesn't have room for its
+ *        CRC or there are too many retries
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiFrame_Configure
+(
+    spiFrame_t* frame,      ///< Framing to configure
+    uint8_t crcWidth,       ///< 8, 16 or 32 bits, or 0 to stop checking received data
+    uint32_t polynomial,    ///< CRC polynomial
+    uint32_t init,          ///< Register before the first byte
+    uint32_t xorOut,        ///< XORed into the register after the last byte
+    uint32_t flags,         ///< SPIFRAME_CRC_ flags
+    size_t frameLength,     ///< Bytes of each frame including its CRC, or 0 for a single frame
+    size_t skipLength,      ///< Bytes at the start of the received data which aren't framed
+    uint8_t retries         ///< Times to repeat a transfer whose frames fail their check
+)
+{
+    if (crcWidth == 0)
+    {
+        spiFrame_Init(frame);
+        return LE_OK;
+    }
+    if ((crcWidth != 8 && crcWidth != 16 && crcWidth != 32) ||
+        (flags & ~(SPIFRAME_CRC_REFLECTED | SPIFRAME_CRC_LITTLE_ENDIAN)) != 0 ||
+        (frameLength != 0 && frameLength <= crcWidth / 8) ||
+        retries > SPIFRAME_MAX_RETRIES)
+    {
+        LE_ERROR(
+            "Invalid framing: %u bit CRC, flags 0x%x, %zu byte frames, %u retries",
+            crcWidth,
+            flags,
+            frameLength,
+            retries);
+        return LE_BAD_PARAMETER;
+    }
+
+    frame->crcWidth = crcWidth;
+    frame->reflected = (flags & SPIFRAME_CRC_REFLECTED) != 0;
+    frame->littleEndian = (flags & SPIFRAME_CRC_LITTLE_ENDIAN) != 0;
+    frame->xorOut = xorOut;
+    frame->frameLength = frameLength;
+    frame->skipLength = skipLength;
+    frame->retries = retries;
+
+    // Table 0 holds the register after one byte, and each further table the register after one
+    // more byte of zeros, so that a word of input is processed with one lookup per byte
+    const uint8_t shift = 32 - crcWidth;
+    if (frame->reflected)
+    {
+        const uint32_t reflectedPolynomial = reflect(polynomial, crcWidth);
+        frame->init = reflect(init, crcWidth);
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 1) ? ((crc >> 1) ^ reflectedPolynomial) : (crc >> 1);
+            }
+            frame->tables[0][i] = crc;
+        }
+        for (size_t slice = 1; slice < SPIFRAME_SLICES; slice++)
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                const uint32_t crc = frame->tables[slice - 1][i];
+                frame->tables[slice][i] = (crc >> 8) ^ frame->tables[0][crc & 0xFF];
+            }
+        }
+    }
+    else
+    {
+        const uint32_t alignedPolynomial = polynomial << shift;
+        frame->init = init << shift;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i << 24;
+            for (int bit = 0; bit < 8; bit++)
+            {
+                crc = (crc & 0x80000000) ? ((crc << 1) ^ alignedPolynomial) : (crc << 1);
+            }
+            frame->tables[0][i] = crc;
+        }
+        for (size_t slice = 1; slice < SPIFRAME_SLICES; slice++)
+        {
+            for (uint32_t i = 0; i < 256; i++)
+            {
+                const uint32_t crc = frame->tables[slice - 1][i];
+                frame->tables[slice][i] = (crc << 8) ^ frame->tables[0][crc >> 24];
+            }
+        }
+    }
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks that received data of the given length is made of whole frames.
+ *
+ * @return
+ *      - LE_OK if it is, or if received data isn't checked
+ *      - LE_BAD_PARAMETER otherwise
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiFrame_CheckLayout
+(
+    const spiFrame_t* frame,  ///< Framing of the device
+    size_t length             ///< Bytes to be received
+)
+{
+    if (frame->crcWidth == 0)
+    {
+        return LE_OK;
+    }
+
+    const size_t crcBytes = frame->crcWidth / 8;
+    if (length <= frame->skipLength + crcBytes ||
+        (frame->frameLength != 0 && ((length - frame->skipLength) % frame->frameLength) != 0))
+    {
+        LE_ERROR("%zu bytes of received data aren't whole frames", length);
+        return LE_BAD_PARAMETER;
+    }
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Computes the CRC of some data, four bytes at a time.
+ *
+ * @return
+ *      The CRC.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiFrame_Crc
+(
+    const spiFrame_t* frame,  ///< Framing giving the CRC
+    const uint8_t* data,      ///< Data to compute the CRC of
+    size_t length             ///< Bytes of data
+)
+{
+    const uint32_t (*tables)[256] = frame->tables;
+    uint32_t crc = frame->init;
+    if (frame->reflected)
+    {
+        for (; length >= 4; data += 4, length -= 4)
+        {
+            crc ^= (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                   ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+            crc = tables[3][crc & 0xFF] ^ tables[2][(crc >> 8) & 0xFF] ^
+                  tables[1][(crc >> 16) & 0xFF] ^ tables[0][crc >> 24];
+        }
+        for (; length > 0; data++, length--)
+        {
+            crc = (crc >> 8) ^ tables[0][(crc ^ *data) & 0xFF];
+        }
+    }
+    else
+    {
+        for (; length >= 4; data += 4, length -= 4)
+        {
+            crc ^= ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+                   ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+            crc = tables[3][crc >> 24] ^ tables[2][(crc >> 16) & 0xFF] ^
+                  tables[1][(crc >> 8) & 0xFF] ^ tables[0][crc & 0xFF];
+        }
+        for (; length > 0; data++, length--)
+        {
+            crc = (crc << 8) ^ tables[0][(crc >> 24) ^ *data];
+        }
+        crc >>= 32 - frame->crcWidth;
+    }
+
+    const uint32_t mask = (frame->crcWidth == 32) ? UINT32_MAX : ((1u << frame->crcWidth) - 1);
+    return (crc ^ frame->xorOut) & mask;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks the frames of the data received by a transfer, and counts the frames which failed.
+ * Called after every attempt of the transfer, it tells whether to make another.
+ *
+ * @return
+ *      True if the transfer should be repeated.  Once the retries are used up, *result is set to
+ *      LE_FORMAT_ERROR if frames still fail.
+ */
+//--------------------------------------------------------------------------------------------------
+bool spiFrame_CheckReceived
+(
+    const spiFrame_t* frame,  ///< Framing of the device
+    spiStats_t* stats,        ///< Counters to update
+    const uint8_t* data,      ///< Data received by the transfer
+    size_t length,            ///< Bytes of data
+    uint32_t* attempts,       ///< [in/out] Attempts made before this one, 0 for the first
+    le_result_t* result       ///< [in/out] Result of the transfer
+)
+{
+    if (frame->crcWidth == 0 || *result != LE_OK)
+    {
+        return false;
+    }
+
+    const size_t badFrames = countBadFrames(frame, data, length);
+    const bool retry = (badFrames != 0 && *attempts < frame->retries);
+    spiStats_RecordFrameCheck(stats, badFrames, retry);
+    if (badFrames != 0 && !retry)
+    {
+        LE_WARN("%zu frames failed their CRC after %u attempts", badFrames, *attempts + 1);
+        *result = LE_FORMAT_ERROR;
+    }
+    (*attempts)++;
+    return retry;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reverses the order of the low bits of a value.
+ *
+ * @return
+ *      The value with its low bits reversed.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint32_t reflect
+(
+    uint32_t value,   ///< Value to reflect
+    uint8_t bits      ///< Number of low bits to reflect
+)
+{
+    uint32_t reflected = 0;
+    for (uint8_t i = 0; i < bits; i++)
+    {
+        reflected = (reflected << 1) | ((value >> i) & 1);
+    }
+    return reflected;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Counts the frames whose CRC doesn't match their data.
+ *
+ * @return
+ *      The number of bad frames.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t countBadFrames
+(
+    const spiFrame_t* frame,  ///< Framing of the device
+    const uint8_t* data,      ///< Data received, which spiFrame_CheckLayout accepted
+    size_t length             ///< Bytes of data
+)
+{
+    const size_t crcBytes = frame->crcWidth / 8;
+    data += frame->skipLength;
+    length -= frame->skipLength;
+    const size_t frameLength = (frame->frameLength != 0) ? frame->frameLength : length;
+
+    size_t badFrames = 0;
+    for (size_t offset = 0; offset + frameLength <= length; offset += frameLength)
+    {
+        const uint8_t* payload = &data[offset];
+        const size_t payloadLength = frameLength - crcBytes;
+        uint32_t expected = 0;
+        for (size_t i = 0; i < crcBytes; i++)
+        {
+            const uint32_t byte = payload[payloadLength + i];
+            expected = frame->littleEndian ? (expected | (byte << (8 * i))) :
+                                             ((expected << 8) | byte);
+        }
+        if (spiFrame_Crc(frame, payload, payloadLength) != expected)
+        {
+            badFrames++;
+        }
+    }
+    return badFrames;
+}
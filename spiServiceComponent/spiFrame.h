@@ -0,0 +1,58 @@
+#ifndef SPI_FRAME_H
+#define SPI_FRAME_H
+
+#include "legato.h"
+#include "spiStats.h"
+
+// Flags of spiFrame_Configure, with the values of spi.api's FRAME_ defines
+#define SPIFRAME_CRC_REFLECTED 0x1
+#define SPIFRAME_CRC_LITTLE_ENDIAN 0x2
+// Most times a transfer is repeated because its frames failed their check
+#define SPIFRAME_MAX_RETRIES 16
+// Number of bytes processed at a time by the CRC kernel, each through a table of its own
+#define SPIFRAME_SLICES 4
+
+// How a device frames the data it sends: after skipLength bytes, frames of frameLength bytes each
+// end with a CRC of the bytes before it.  The CRC is computed on a 32 bit register, with the CRC
+// in its top bits or, when reflected, its bottom bits, so that every width shares the slice-by-4
+// kernel.  A framing is only used by the worker thread of its device's bus.  All fields are
+// private to spiFrame.c.
+typedef struct
+{
+    uint8_t crcWidth;           ///< 8, 16 or 32, or 0 if received data isn't checked
+    bool reflected;
+    bool littleEndian;          ///< The CRC is stored least significant byte first
+    uint32_t init;              ///< Register before the first byte
+    uint32_t xorOut;
+    size_t frameLength;         ///< Bytes of each frame including its CRC, or 0 for a single frame
+    size_t skipLength;          ///< Bytes at the start of the received data which aren't framed
+    uint8_t retries;
+    uint32_t tables[SPIFRAME_SLICES][256];
+} spiFrame_t;
+
+void spiFrame_Init(spiFrame_t* frame);
+
+le_result_t spiFrame_Configure(
+    spiFrame_t* frame,
+    uint8_t crcWidth,
+    uint32_t polynomial,
+    uint32_t init,
+    uint32_t xorOut,
+    uint32_t flags,
+    size_t frameLength,
+    size_t skipLength,
+    uint8_t retries);
+
+le_result_t spiFrame_CheckLayout(const spiFrame_t* frame, size_t length);
+
+uint32_t spiFrame_Crc(const spiFrame_t* frame, const uint8_t* data, size_t length);
+
+bool spiFrame_CheckReceived(
+    const spiFrame_t* frame,
+    spiStats_t* stats,
+    const uint8_t* data,
+    size_t length,
+    uint32_t* attempts,
+    le_result_t* result);
+
+#endif  // SPI_FRAME_H
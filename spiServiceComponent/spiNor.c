@@ -0,0 +1,887 @@
+#include "legato.h"
+#include "interfaces.h"
+#include "spiNor.h"
+
+// Commands which SPI NOR flash chips have in common
+#define NOR_CMD_WRITE_ENABLE         0x06
+#define NOR_CMD_READ_STATUS          0x05
+#define NOR_CMD_READ_STATUS_2        0x35
+#define NOR_CMD_READ_JEDEC_ID        0x9F
+#define NOR_CMD_READ_SFDP            0x5A
+#define NOR_CMD_FAST_READ            0x0B
+#define NOR_CMD_PAGE_PROGRAM         0x02
+#define NOR_CMD_ENTER_4BYTE_ADDRESS  0xB7
+#define NOR_CMD_SECTOR_ERASE         0x20
+#define NOR_CMD_BLOCK_ERASE          0xD8
+
+#define NOR_STATUS_BUSY              0x01
+// Quad enable bits, in status register 1 or 2 depending on the chip
+#define NOR_STATUS_QUAD_ENABLE       0x40
+#define NOR_STATUS_2_QUAD_ENABLE     0x02
+
+// Geometry assumed for chips without SFDP, whose size comes from their JEDEC ID
+#define NOR_DEFAULT_PAGE_SIZE        256
+#define NOR_DEFAULT_SECTOR_SIZE      4096
+#define NOR_DEFAULT_BLOCK_SIZE       65536
+// Largest chip which 3 byte addresses reach
+#define NOR_3BYTE_ADDRESS_LIMIT      (16 * 1024 * 1024)
+// Opcode, 4 address bytes and up to 4 bytes of mode and dummy clocks
+#define NOR_MAX_HEADER_BYTES         9
+
+// Longest a page program and an erase may take, well above datasheet maximums
+#define NOR_PROGRAM_TIMEOUT_USECS    10000
+#define NOR_ERASE_TIMEOUT_USECS      4000000
+// Longest one request polls a busy chip before handing the bus to the requests queued behind it
+#define NOR_POLL_SLICE_USECS         2000
+
+// "SFDP" read as a little endian word
+#define SFDP_SIGNATURE               0x50444653
+#define SFDP_HEADER_BYTES            8
+#define SFDP_PARAMETER_HEADER_BYTES  8
+#define SFDP_DUMMY_BYTES             1
+// Dwords of the basic flash parameter table which are used, and the fewest any revision has
+#define SFDP_BFPT_DWORDS             16
+#define SFDP_BFPT_MIN_DWORDS         9
+
+// Fields of the basic flash parameter table, by zero based dword
+#define BFPT_FAST_READ_112           (1u << 16)   // dword 0
+#define BFPT_FAST_READ_114           (1u << 22)   // dword 0
+#define BFPT_ADDRESS_BYTES(dw)       (((dw) >> 17) & 0x3)
+#define BFPT_ADDRESS_3               0
+#define BFPT_ADDRESS_3_OR_4          1
+#define BFPT_ADDRESS_4               2
+#define BFPT_PAGE_SIZE_SHIFT(dw)     (((dw) >> 4) & 0xF)  // dword 10
+#define BFPT_QUAD_ENABLE(dw)         (((dw) >> 20) & 0x7) // dword 14
+
+// Polls for page programs spin through their typical time, while erases sleep from the start
+static const spiLib_Backoff_t programBackoff =
+{
+    .spinUsecs = 100,
+    .minSleepUsecs = 50,
+    .maxSleepUsecs = 200
+};
+static const spiLib_Backoff_t eraseBackoff =
+{
+    .spinUsecs = 0,
+    .minSleepUsecs = 1000,
+    .maxSleepUsecs = 10000
+};
+
+
+static le_result_t readSfdp(
+    spiNor_t* nor,
+    int fd,
+    spiStats_t* stats,
+    uint32_t widthModes,
+    bool* fourByteCapable);
+static bool useRead(spiNor_t* nor, uint16_t fields, uint8_t width);
+static bool isQuadEnabled(int fd, spiStats_t* stats, uint8_t requirement);
+static le_result_t readSfdpBytes(
+    int fd,
+    spiStats_t* stats,
+    uint32_t address,
+    uint8_t* data,
+    size_t length);
+static le_result_t startWrite(
+    spiNor_t* nor,
+    int fd,
+    spiStats_t* stats,
+    const uint8_t* header,
+    size_t headerLength,
+    const uint8_t* data,
+    size_t length);
+static size_t encodeHeader(
+    uint8_t* header,
+    uint8_t opcode,
+    uint32_t address,
+    uint8_t addressBytes,
+    uint8_t dummyBytes);
+static le_result_t transfer(
+    int fd,
+    spiStats_t* stats,
+    const spiLib_Segment_t* segments,
+    size_t numSegments);
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes the state of a device's chip, with no program or erase in progress.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiNor_InitState
+(
+    spiNor_State_t* state   ///< State to initialize
+)
+{
+    memset(state, 0, sizeof(*state));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Identifies a flash chip and works out how to access it.  The geometry and read commands are
+ * taken from the chip's SFDP tables, or default to those of common 4 KiB sector chips if it has
+ * none.  Reads use the widest of the chip's 1-1-2 and 1-1-4 fast reads which the controller
+ * supports, with quad reads only used when the chip's quad enable bit is already set, since it is
+ * non-volatile and left to provisioning.  Chips over 16 MiB are switched to 4 byte addresses.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_UNSUPPORTED if no flash chip answers or its tables can't be used
+ *      - LE_WOULD_BLOCK if the chip is still busy with a program or erase through another handle
+ *      - LE_TIMEOUT if the chip stayed busy with a program or erase through another handle
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiNor_Probe
+(
+    spiNor_t* nor,          ///< [out] The probed chip
+    spiNor_State_t* state,  ///< Program or erase in progress on the device, shared by its chips
+    int fd,
+    spiStats_t* stats,
+    uint32_t widthModes     ///< SPI_RX_DUAL and SPI_RX_QUAD if the device is configured for them
+)
+{
+    memset(nor, 0, sizeof(*nor));
+    nor->state = state;
+
+    // A chip busy with a write through another handle doesn't answer commands
+    const le_result_t readyResult = spiNor_WaitReady(nor, fd, stats);
+    if (readyResult != LE_OK)
+    {
+        return readyResult;
+    }
+
+    uint8_t header[NOR_MAX_HEADER_BYTES];
+    const size_t headerLength = encodeHeader(header, NOR_CMD_READ_JEDEC_ID, 0, 0, 0);
+    const spiLib_Segment_t segments[] =
+    {
+        { .txBuf = header, .length = headerLength },
+        { .rxBuf = nor->jedecId, .length = SPINOR_JEDEC_ID_BYTES }
+    };
+    if (transfer(fd, stats, segments, NUM_ARRAY_MEMBERS(segments)) != LE_OK)
+    {
+        return LE_FAULT;
+    }
+    if ((nor->jedecId[0] == 0x00 || nor->jedecId[0] == 0xFF) &&
+        nor->jedecId[1] == nor->jedecId[0] &&
+        nor->jedecId[2] == nor->jedecId[0])
+    {
+        LE_ERROR("No flash chip answered the JEDEC ID command");
+        return LE_UNSUPPORTED;
+    }
+
+    // Most vendors encode the size as a power of two in the last byte of the ID
+    const uint8_t sizeShift = nor->jedecId[2];
+    nor->size = (sizeShift >= 16 && sizeShift < 32) ? (1u << sizeShift) : 0;
+    nor->pageSize = NOR_DEFAULT_PAGE_SIZE;
+    nor->addressBytes = 3;
+    nor->readOpcode = NOR_CMD_FAST_READ;
+    nor->readDummyBytes = 1;
+    nor->readWidth = 1;
+    nor->eraseTypes[0].opcode = NOR_CMD_SECTOR_ERASE;
+    nor->eraseTypes[0].size = NOR_DEFAULT_SECTOR_SIZE;
+    nor->eraseTypes[1].opcode = NOR_CMD_BLOCK_ERASE;
+    nor->eraseTypes[1].size = NOR_DEFAULT_BLOCK_SIZE;
+    nor->numEraseTypes = 2;
+    bool fourByteCapable = true;
+
+    const le_result_t sfdpResult = readSfdp(nor, fd, stats, widthModes, &fourByteCapable);
+    if (sfdpResult == LE_NOT_FOUND)
+    {
+        LE_INFO("Flash has no SFDP tables, using default geometry");
+    }
+    else if (sfdpResult != LE_OK)
+    {
+        return sfdpResult;
+    }
+    if (nor->size == 0)
+    {
+        LE_ERROR(
+            "Can't tell the size of flash %02X %02X %02X",
+            nor->jedecId[0],
+            nor->jedecId[1],
+            nor->jedecId[2]);
+        return LE_UNSUPPORTED;
+    }
+
+    if (nor->size > NOR_3BYTE_ADDRESS_LIMIT && nor->addressBytes == 3)
+    {
+        if (!fourByteCapable)
+        {
+            LE_WARN("Flash only takes 3 byte addresses, using its first 16 MiB");
+            nor->size = NOR_3BYTE_ADDRESS_LIMIT;
+        }
+        else
+        {
+            const size_t enterLength =
+                encodeHeader(header, NOR_CMD_ENTER_4BYTE_ADDRESS, 0, 0, 0);
+            if (startWrite(nor, fd, stats, header, enterLength, NULL, 0) != LE_OK)
+            {
+                return LE_FAULT;
+            }
+            // Entering the address mode doesn't make the chip busy
+            nor->state->busy = false;
+            nor->addressBytes = 4;
+        }
+    }
+
+    LE_INFO(
+        "Flash %02X %02X %02X: %u bytes, %u byte pages, %u byte sectors, x%u reads",
+        nor->jedecId[0],
+        nor->jedecId[1],
+        nor->jedecId[2],
+        nor->size,
+        nor->pageSize,
+        nor->eraseTypes[0].size,
+        nor->readWidth);
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the size of a chip in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiNor_GetSize
+(
+    const spiNor_t* nor
+)
+{
+    return nor->size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the size of a chip's program pages in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiNor_GetPageSize
+(
+    const spiNor_t* nor
+)
+{
+    return nor->pageSize;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the size of a chip's smallest erase block in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+uint32_t spiNor_GetEraseSize
+(
+    const spiNor_t* nor
+)
+{
+    return nor->eraseTypes[0].size;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the number of data lines a chip's reads use.
+ */
+//--------------------------------------------------------------------------------------------------
+uint8_t spiNor_GetReadWidth
+(
+    const spiNor_t* nor
+)
+{
+    return nor->readWidth;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets a chip's JEDEC ID.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiNor_GetJedecId
+(
+    const spiNor_t* nor,
+    uint8_t* jedecId        ///< [out] SPINOR_JEDEC_ID_BYTES bytes
+)
+{
+    memcpy(jedecId, nor->jedecId, SPINOR_JEDEC_ID_BYTES);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Polls for the last program or erase started on a chip to finish, for no longer than
+ * NOR_POLL_SLICE_USECS.  An erase can take seconds, so a caller which gets LE_WOULD_BLOCK should
+ * call again from a later request rather than hold the bus for the whole of it.
+ *
+ * @return
+ *      - LE_OK once the chip is idle
+ *      - LE_WOULD_BLOCK if it is still busy but may yet finish in time
+ *      - LE_TIMEOUT if it stayed busy for longer than the operation can take
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiNor_WaitReady
+(
+    spiNor_t* nor,
+    int fd,
+    spiStats_t* stats
+)
+{
+    spiNor_State_t* state = nor->state;
+    if (!state->busy)
+    {
+        return LE_OK;
+    }
+
+    // Once the deadline has passed the chip still gets one last poll
+    const uint64_t nowUsecs = spiStats_NowUsecs();
+    const uint64_t remainingUsecs =
+        (nowUsecs < state->busyDeadlineUsecs) ? (state->busyDeadlineUsecs - nowUsecs) : 0;
+    const bool lastSlice = (remainingUsecs <= NOR_POLL_SLICE_USECS);
+
+    const uint8_t readStatus = NOR_CMD_READ_STATUS;
+    uint8_t status;
+    uint32_t elapsedUsecs;
+    uint32_t attempts;
+    const le_result_t result = spiLib_PollUntil(
+        fd,
+        &readStatus,
+        sizeof(readStatus),
+        NOR_STATUS_BUSY,
+        0,
+        lastSlice ? remainingUsecs : NOR_POLL_SLICE_USECS,
+        state->busyBackoff,
+        &status,
+        &elapsedUsecs,
+        &attempts);
+    spiStats_RecordPoll(stats, attempts, sizeof(readStatus), elapsedUsecs, result);
+    if (result == LE_TIMEOUT && !lastSlice)
+    {
+        return LE_WOULD_BLOCK;
+    }
+    if (result != LE_OK)
+    {
+        // Still busy as far as we know, so the next request waits again
+        LE_ERROR("Flash didn't become ready: %s", LE_RESULT_TXT(result));
+        return result;
+    }
+
+    state->busy = false;
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads from a chip with its fastest read command, in as few messages as the driver allows.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the data runs past the end of the chip
+ *      - LE_WOULD_BLOCK if the chip is still busy with an earlier program or erase, and nothing
+ *        has been read
+ *      - LE_TIMEOUT if the chip stayed busy with an earlier program or erase
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiNor_Read
+(
+    spiNor_t* nor,
+    int fd,
+    size_t maxMessageSize,  ///< Largest message the driver accepts
+    spiStats_t* stats,
+    uint32_t address,
+    uint8_t* data,          ///< [out] Data read
+    size_t length           ///< Bytes to read
+)
+{
+    if (address > nor->size || length > nor->size - address)
+    {
+        return LE_OUT_OF_RANGE;
+    }
+
+    le_result_t result = spiNor_WaitReady(nor, fd, stats);
+    size_t offset = 0;
+    while (result == LE_OK && offset < length)
+    {
+        uint8_t header[NOR_MAX_HEADER_BYTES];
+        const size_t headerLength = encodeHeader(
+            header, nor->readOpcode, address + offset, nor->addressBytes, nor->readDummyBytes);
+        const size_t maxChunk = maxMessageSize - headerLength;
+        const size_t chunk = (length - offset < maxChunk) ? (length - offset) : maxChunk;
+        const spiLib_Segment_t segments[] =
+        {
+            { .txBuf = header, .length = headerLength },
+            { .rxBuf = &data[offset], .length = chunk, .rxNbits = nor->readWidth }
+        };
+        result = transfer(fd, stats, segments, NUM_ARRAY_MEMBERS(segments));
+        offset += chunk;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Programs data into erased flash.  The data is split at page boundaries, and each page is
+ * programmed by one message which enables writes and then sends the page program command, after
+ * waiting for the page before it to finish.  The last page is left to finish in the background.
+ *
+ * @return
+ *      - LE_OK once the last page has been started
+ *      - LE_OUT_OF_RANGE if the data runs past the end of the chip
+ *      - LE_WOULD_BLOCK if a page was still being programmed at the end of a poll, in which case
+ *        the rest of the data is to be programmed by calling again
+ *      - LE_TIMEOUT if a page didn't finish in time
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiNor_Program
+(
+    spiNor_t* nor,
+    int fd,
+    size_t maxMessageSize,  ///< Largest message the driver accepts
+    spiStats_t* stats,
+    uint32_t address,
+    const uint8_t* data,    ///< Data to program
+    size_t length,          ///< Bytes to program
+    size_t* programmed      ///< [out] Bytes whose pages were started
+)
+{
+    *programmed = 0;
+    if (address > nor->size || length > nor->size - address)
+    {
+        return LE_OUT_OF_RANGE;
+    }
+
+    size_t offset = 0;
+    while (offset < length)
+    {
+        const le_result_t readyResult = spiNor_WaitReady(nor, fd, stats);
+        if (readyResult != LE_OK)
+        {
+            *programmed = offset;
+            return readyResult;
+        }
+
+        uint8_t header[NOR_MAX_HEADER_BYTES];
+        const size_t headerLength =
+            encodeHeader(header, NOR_CMD_PAGE_PROGRAM, address + offset, nor->addressBytes, 0);
+        // Pages larger than a message are programmed a piece at a time, which NOR flash allows
+        const size_t pageRemaining = nor->pageSize - ((address + offset) % nor->pageSize);
+        const size_t maxChunk = maxMessageSize - headerLength - 1;
+        size_t chunk = (length - offset < pageRemaining) ? (length - offset) : pageRemaining;
+        chunk = (chunk < maxChunk) ? chunk : maxChunk;
+
+        const le_result_t result =
+            startWrite(nor, fd, stats, header, headerLength, &data[offset], chunk);
+        if (result != LE_OK)
+        {
+            return result;
+        }
+        nor->state->busyDeadlineUsecs = spiStats_NowUsecs() + NOR_PROGRAM_TIMEOUT_USECS;
+        nor->state->busyBackoff = &programBackoff;
+        offset += chunk;
+    }
+    *programmed = length;
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts erasing the largest block which begins at an address and fits in a range, after waiting
+ * for any earlier program or erase to finish.  Erasing a range one block per call lets the caller
+ * serve other requests while the chip erases.
+ *
+ * @return
+ *      - LE_OK once the erase has been started
+ *      - LE_BAD_PARAMETER if the range isn't aligned to the smallest erase block or is empty
+ *      - LE_OUT_OF_RANGE if the range runs past the end of the chip
+ *      - LE_WOULD_BLOCK if the chip is still busy with an earlier program or erase
+ *      - LE_TIMEOUT if the chip stayed busy with an earlier program or erase
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiNor_EraseNext
+(
+    spiNor_t* nor,
+    int fd,
+    spiStats_t* stats,
+    uint32_t address,       ///< Start of the range still to erase
+    uint32_t length,        ///< Bytes still to erase
+    uint32_t* erasedLength  ///< [out] Size of the block being erased
+)
+{
+    *erasedLength = 0;
+    const uint32_t eraseSize = nor->eraseTypes[0].size;
+    if (length == 0 || (address % eraseSize) != 0 || (length % eraseSize) != 0)
+    {
+        return LE_BAD_PARAMETER;
+    }
+    if (address > nor->size || length > nor->size - address)
+    {
+        return LE_OUT_OF_RANGE;
+    }
+
+    const le_result_t readyResult = spiNor_WaitReady(nor, fd, stats);
+    if (readyResult != LE_OK)
+    {
+        return readyResult;
+    }
+
+    const spiNor_EraseType_t* type = &nor->eraseTypes[0];
+    for (size_t i = 1; i < nor->numEraseTypes; i++)
+    {
+        if ((address % nor->eraseTypes[i].size) == 0 && nor->eraseTypes[i].size <= length)
+        {
+            type = &nor->eraseTypes[i];
+        }
+    }
+
+    uint8_t header[NOR_MAX_HEADER_BYTES];
+    const size_t headerLength = encodeHeader(header, type->opcode, address, nor->addressBytes, 0);
+    const le_result_t result = startWrite(nor, fd, stats, header, headerLength, NULL, 0);
+    if (result != LE_OK)
+    {
+        return result;
+    }
+    nor->state->busyDeadlineUsecs = spiStats_NowUsecs() + NOR_ERASE_TIMEOUT_USECS;
+    nor->state->busyBackoff = &eraseBackoff;
+    *erasedLength = type->size;
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads the chip's SFDP header and basic flash parameter table, and takes its size, address
+ * width, erase types, page size and fast read commands from them.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_FOUND if the chip has no usable SFDP tables
+ *      - LE_UNSUPPORTED if the chip is larger than 4 GiB
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t readSfdp
+(
+    spiNor_t* nor,
+    int fd,
+    spiStats_t* stats,
+    uint32_t widthModes,    ///< SPI_RX_DUAL and SPI_RX_QUAD if the device is configured for them
+    bool* fourByteCapable   ///< [out] The chip can switch to 4 byte addresses
+)
+{
+    // The first parameter header always describes the basic flash parameter table
+    uint8_t header[SFDP_HEADER_BYTES + SFDP_PARAMETER_HEADER_BYTES];
+    if (readSfdpBytes(fd, stats, 0, header, sizeof(header)) != LE_OK)
+    {
+        return LE_FAULT;
+    }
+    const uint32_t signature =
+        header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t)header[3] << 24);
+    const uint8_t* parameterHeader = &header[SFDP_HEADER_BYTES];
+    const size_t tableDwords = parameterHeader[3];
+    if (signature != SFDP_SIGNATURE || tableDwords < SFDP_BFPT_MIN_DWORDS)
+    {
+        return LE_NOT_FOUND;
+    }
+    const uint32_t tableAddress =
+        parameterHeader[4] | (parameterHeader[5] << 8) | (parameterHeader[6] << 16);
+
+    uint8_t raw[SFDP_BFPT_DWORDS * 4];
+    const size_t numDwords = (tableDwords < SFDP_BFPT_DWORDS) ? tableDwords : SFDP_BFPT_DWORDS;
+    if (readSfdpBytes(fd, stats, tableAddress, raw, numDwords * 4) != LE_OK)
+    {
+        return LE_FAULT;
+    }
+    uint32_t bfpt[SFDP_BFPT_DWORDS] = { 0 };
+    for (size_t i = 0; i < numDwords; i++)
+    {
+        bfpt[i] = raw[4 * i] | (raw[4 * i + 1] << 8) | (raw[4 * i + 2] << 16) |
+                  ((uint32_t)raw[4 * i + 3] << 24);
+    }
+
+    // Density is in bits: one less than the count, or a power of two if the top bit is set
+    const uint64_t bits = ((bfpt[1] & 0x80000000) == 0) ? ((uint64_t)bfpt[1] + 1) :
+                          (((bfpt[1] & 0x7FFFFFFF) < 64) ? (1ULL << (bfpt[1] & 0x7FFFFFFF)) : 0);
+    if (bits == 0 || bits / 8 > UINT32_MAX)
+    {
+        LE_ERROR("Flash density 0x%08x is unsupported", bfpt[1]);
+        return LE_UNSUPPORTED;
+    }
+    nor->size = bits / 8;
+
+    switch (BFPT_ADDRESS_BYTES(bfpt[0]))
+    {
+        case BFPT_ADDRESS_3:
+            *fourByteCapable = false;
+            break;
+        case BFPT_ADDRESS_4:
+            nor->addressBytes = 4;
+            break;
+        case BFPT_ADDRESS_3_OR_4:
+        default:
+            break;
+    }
+
+    // Erase types are (size as a power of two, opcode) byte pairs in dwords 7 and 8, with a
+    // size of zero for unused types
+    size_t numEraseTypes = 0;
+    spiNor_EraseType_t eraseTypes[SPINOR_MAX_ERASE_TYPES] = { { 0 } };
+    for (size_t i = 0; i < SPINOR_MAX_ERASE_TYPES; i++)
+    {
+        const uint16_t pair = (bfpt[7 + i / 2] >> (16 * (i % 2))) & 0xFFFF;
+        const uint8_t sizeShift = pair & 0xFF;
+        if (sizeShift == 0 || sizeShift >= 32)
+        {
+            continue;
+        }
+        // Insertion sort, smallest first
+        size_t j = numEraseTypes++;
+        while (j > 0 && eraseTypes[j - 1].size > (1u << sizeShift))
+        {
+            eraseTypes[j] = eraseTypes[j - 1];
+            j--;
+        }
+        eraseTypes[j].opcode = pair >> 8;
+        eraseTypes[j].size = 1u << sizeShift;
+    }
+    if (numEraseTypes > 0)
+    {
+        memcpy(nor->eraseTypes, eraseTypes, sizeof(eraseTypes));
+        nor->numEraseTypes = numEraseTypes;
+    }
+
+    // Page size and quad enable requirements were added by JESD216A
+    if (numDwords > 10)
+    {
+        nor->pageSize = 1u << BFPT_PAGE_SIZE_SHIFT(bfpt[10]);
+    }
+    const bool quadUsable = (widthModes & SPI_SPI_RX_QUAD) != 0 &&
+                            (bfpt[0] & BFPT_FAST_READ_114) != 0 &&
+                            numDwords > 14 &&
+                            isQuadEnabled(fd, stats, BFPT_QUAD_ENABLE(bfpt[14]));
+    const bool dualUsable = (widthModes & (SPI_SPI_RX_DUAL | SPI_SPI_RX_QUAD)) != 0 &&
+                            (bfpt[0] & BFPT_FAST_READ_112) != 0;
+    const bool quadChosen = quadUsable && useRead(nor, bfpt[2] >> 16, 4);
+    if (!quadChosen && dualUsable)
+    {
+        useRead(nor, bfpt[3] & 0xFFFF, 2);
+    }
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Switches a chip's reads to a fast read command described by SFDP.
+ *
+ * @return
+ *      false if the command's mode and dummy clocks aren't a whole number of bytes, so it can't be
+ *      used and the current read command is kept.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool useRead
+(
+    spiNor_t* nor,
+    uint16_t fields,        ///< Dummy clocks in bits 0-4, mode clocks in 5-7 and opcode in 8-15
+    uint8_t width           ///< Data lines of the command
+)
+{
+    const uint8_t clocks = (fields & 0x1F) + ((fields >> 5) & 0x7);
+    const uint8_t opcode = fields >> 8;
+    // The address is sent on one line, so each dummy byte is 8 clocks
+    if ((clocks % 8) != 0 || opcode == 0x00 || opcode == 0xFF)
+    {
+        return false;
+    }
+    nor->readOpcode = opcode;
+    nor->readDummyBytes = clocks / 8;
+    nor->readWidth = width;
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks whether a chip's quad enable bit is set, for the requirement its SFDP table gives.
+ *
+ * @return
+ *      true if quad reads can be used without writing the chip's status registers.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool isQuadEnabled
+(
+    int fd,
+    spiStats_t* stats,
+    uint8_t requirement     ///< Quad enable requirements field of the table
+)
+{
+    uint8_t opcode;
+    uint8_t bit;
+    switch (requirement)
+    {
+        case 0:
+            // No quad enable bit
+            return true;
+        case 2:
+            opcode = NOR_CMD_READ_STATUS;
+            bit = NOR_STATUS_QUAD_ENABLE;
+            break;
+        case 4:
+        case 5:
+            opcode = NOR_CMD_READ_STATUS_2;
+            bit = NOR_STATUS_2_QUAD_ENABLE;
+            break;
+        default:
+            // Status register 2 can't be read on its own, or the bit is elsewhere
+            return false;
+    }
+
+    uint8_t status = 0;
+    const spiLib_Segment_t segments[] =
+    {
+        { .txBuf = &opcode, .length = 1 },
+        { .rxBuf = &status, .length = 1 }
+    };
+    if (transfer(fd, stats, segments, NUM_ARRAY_MEMBERS(segments)) != LE_OK ||
+        (status & bit) == 0)
+    {
+        LE_INFO("Flash quad enable bit is clear, using dual reads");
+        return false;
+    }
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads from a chip's SFDP tables.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t readSfdpBytes
+(
+    int fd,
+    spiStats_t* stats,
+    uint32_t address,       ///< Address within the tables
+    uint8_t* data,          ///< [out] Data read
+    size_t length
+)
+{
+    uint8_t header[NOR_MAX_HEADER_BYTES];
+    const size_t headerLength =
+        encodeHeader(header, NOR_CMD_READ_SFDP, address, 3, SFDP_DUMMY_BYTES);
+    const spiLib_Segment_t segments[] =
+    {
+        { .txBuf = header, .length = headerLength },
+        { .rxBuf = data, .length = length }
+    };
+    return transfer(fd, stats, segments, NUM_ARRAY_MEMBERS(segments));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends write enable followed by a program or erase command as one message, with chip select
+ * released between them, and marks the chip busy.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t startWrite
+(
+    spiNor_t* nor,
+    int fd,
+    spiStats_t* stats,
+    const uint8_t* header,  ///< Command and address
+    size_t headerLength,
+    const uint8_t* data,    ///< Data to program, or NULL
+    size_t length
+)
+{
+    const uint8_t writeEnable = NOR_CMD_WRITE_ENABLE;
+    const spiLib_Segment_t segments[] =
+    {
+        { .txBuf = &writeEnable, .length = sizeof(writeEnable), .csChange = true },
+        { .txBuf = header, .length = headerLength },
+        { .txBuf = data, .length = length }
+    };
+    const size_t numSegments = (data != NULL) ? 3 : 2;
+    const le_result_t result = transfer(fd, stats, segments, numSegments);
+    if (result == LE_OK)
+    {
+        nor->state->busy = true;
+    }
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Encodes a command: the opcode, the address most significant byte first, and dummy bytes.
+ *
+ * @return
+ *      Length of the command in bytes.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t encodeHeader
+(
+    uint8_t* header,        ///< [out] Buffer of NOR_MAX_HEADER_BYTES
+    uint8_t opcode,
+    uint32_t address,
+    uint8_t addressBytes,   ///< 0, 3 or 4
+    uint8_t dummyBytes
+)
+{
+    header[0] = opcode;
+    for (size_t i = 0; i < addressBytes; i++)
+    {
+        header[1 + i] = (address >> (8 * (addressBytes - 1 - i))) & 0xFF;
+    }
+    memset(&header[1 + addressBytes], 0xFF, dummyBytes);
+    return 1 + addressBytes + dummyBytes;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a message and counts it in the handle's statistics.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t transfer
+(
+    int fd,
+    spiStats_t* stats,
+    const spiLib_Segment_t* segments,
+    size_t numSegments
+)
+{
+    size_t txBytes = 0;
+    size_t rxBytes = 0;
+    for (size_t i = 0; i < numSegments; i++)
+    {
+        txBytes += (segments[i].txBuf != NULL) ? segments[i].length : 0;
+        rxBytes += (segments[i].rxBuf != NULL) ? segments[i].length : 0;
+    }
+
+    const le_result_t result =
+        (spiLib_Transfer(fd, segments, numSegments) == LE_OK) ? LE_OK : LE_FAULT;
+    spiStats_CountTransfer(stats, SPISTATS_TRANSACTION, txBytes, rxBytes, result);
+    return result;
+}
@@ -0,0 +1,93 @@
+#ifndef SPI_NOR_H
+#define SPI_NOR_H
+
+#include "legato.h"
+#include "spiLibrary.h"
+#include "spiStats.h"
+
+#define SPINOR_JEDEC_ID_BYTES 3
+// Most erase types a chip can describe in SFDP
+#define SPINOR_MAX_ERASE_TYPES 4
+
+// An erase command and the size of the block it erases
+typedef struct
+{
+    uint8_t opcode;
+    uint32_t size;
+} spiNor_EraseType_t;
+
+// The program or erase in progress on a chip.  It belongs to the device rather than to a probed
+// chip, so that every handle which probed the chip waits for the writes of the others.  Only used
+// by the worker thread of the device's bus.  All fields are private to spiNor.c.
+typedef struct
+{
+    bool busy;                           ///< A program or erase may still be in progress
+    uint64_t busyDeadlineUsecs;          ///< When the program or erase must have finished by
+    const spiLib_Backoff_t* busyBackoff; ///< Spacing of the polls for it to finish
+} spiNor_State_t;
+
+// A probed SPI NOR flash chip.  A chip is only used by the worker thread of its device's bus.
+// All fields are private to spiNor.c.
+typedef struct
+{
+    uint8_t jedecId[SPINOR_JEDEC_ID_BYTES];
+    uint32_t size;
+    uint32_t pageSize;
+    uint8_t addressBytes;
+    uint8_t readOpcode;
+    uint8_t readDummyBytes;
+    uint8_t readWidth;                   ///< Data lines used by reads
+    spiNor_EraseType_t eraseTypes[SPINOR_MAX_ERASE_TYPES];  ///< Smallest first
+    size_t numEraseTypes;
+    spiNor_State_t* state;               ///< Shared by the device's probed chips
+} spiNor_t;
+
+void spiNor_InitState(spiNor_State_t* state);
+
+le_result_t spiNor_Probe(
+    spiNor_t* nor,
+    spiNor_State_t* state,
+    int fd,
+    spiStats_t* stats,
+    uint32_t widthModes);
+
+uint32_t spiNor_GetSize(const spiNor_t* nor);
+
+uint32_t spiNor_GetPageSize(const spiNor_t* nor);
+
+uint32_t spiNor_GetEraseSize(const spiNor_t* nor);
+
+uint8_t spiNor_GetReadWidth(const spiNor_t* nor);
+
+void spiNor_GetJedecId(const spiNor_t* nor, uint8_t* jedecId);
+
+le_result_t spiNor_WaitReady(spiNor_t* nor, int fd, spiStats_t* stats);
+
+le_result_t spiNor_Read(
+    spiNor_t* nor,
+    int fd,
+    size_t maxMessageSize,
+    spiStats_t* stats,
+    uint32_t address,
+    uint8_t* data,
+    size_t length);
+
+le_result_t spiNor_Program(
+    spiNor_t* nor,
+    int fd,
+    size_t maxMessageSize,
+    spiStats_t* stats,
+    uint32_t address,
+    const uint8_t* data,
+    size_t length,
+    size_t* programmed);
+
+le_result_t spiNor_EraseNext(
+    spiNor_t* nor,
+    int fd,
+    spiStats_t* stats,
+    uint32_t address,
+    uint32_t length,
+    uint32_t* erasedLength);
+
+#endif  // SPI_NOR_H
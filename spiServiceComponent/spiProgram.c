@@ -0,0 +1,586 @@
+#include "legato.h"
+#include "interfaces.h"
+#include "spiLibrary.h"
+#include "spiProgram.h"
+#include <time.h>
+
+#define OPCODE(word) ((word) >> SPI_PROG_OPCODE_SHIFT)
+#define OPERAND(word) ((word) & SPI_PROG_OPERAND_MASK)
+#define COMPARE_MASK(operand) (((operand) >> SPI_PROG_COMPARE_MASK_SHIFT) & 0xFF)
+#define COMPARE_VALUE(operand) ((operand) & 0xFF)
+
+// Iterations still to run of a LOOP instruction which has been reached
+typedef struct
+{
+    size_t pc;                  ///< Word index of the LOOP instruction
+    uint32_t remaining;         ///< Further times to jump back
+} LoopCounter_t;
+
+// State of a running program
+typedef struct
+{
+    const spiProgram_t* program;
+    int fd;
+    spiStats_t* stats;
+    spiLib_Segment_t segments[SPI_MAX_SEGMENTS];  ///< Transfers of the current chip select chain
+    size_t numSegments;
+    uint8_t* output;
+    size_t outputCapacity;
+    size_t outputLength;        ///< Bytes of output claimed by the transfers so far
+    size_t receivedLength;      ///< Bytes of output received by completed messages
+    uint8_t lastByte;           ///< Last byte received, which the jumps compare
+    LoopCounter_t loops[SPI_MAX_PROGRAM_LOOPS];
+    size_t numLoops;
+    uint64_t deadlineUsecs;     ///< Time by which the run must end
+} Run_t;
+
+
+static size_t instructionWords(uint32_t opcode);
+static bool isTransfer(uint32_t opcode);
+static le_result_t checkData(
+    const spiProgram_t* program,
+    size_t pc,
+    uint32_t offset,
+    uint32_t length);
+static le_result_t queueTransfer(Run_t* run, const uint32_t* instruction);
+static le_result_t poll(Run_t* run, const uint32_t* instruction);
+static size_t loop(Run_t* run, size_t pc, const uint32_t* instruction);
+static le_result_t sleepUsecs(const Run_t* run, uint32_t usecs);
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Validates a program and copies it.  Everything which can be checked without running the
+ * program is checked here, so that running it only fails because of the device.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the program is malformed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiProgram_Load
+(
+    spiProgram_t* program,  ///< [out] Program to load
+    const uint32_t* code,   ///< Instructions as documented in spi.api
+    size_t numWords,        ///< Number of words in code
+    const uint8_t* data,    ///< Bytes transmitted by the instructions
+    size_t dataLength       ///< Number of bytes in data
+)
+{
+    if (numWords == 0 || numWords > SPI_MAX_PROGRAM_WORDS || dataLength > SPI_MAX_PROGRAM_DATA)
+    {
+        LE_ERROR("Program of %zu words and %zu bytes of data is too large", numWords, dataLength);
+        return LE_BAD_PARAMETER;
+    }
+    memcpy(program->code, code, numWords * sizeof(code[0]));
+    program->numWords = numWords;
+    if (dataLength > 0)
+    {
+        memcpy(program->data, data, dataLength);
+    }
+    program->dataLength = dataLength;
+    program->cost = 0;
+
+    // First pass: decode each instruction and check its operands, marking where instructions start
+    uint32_t starts[SPI_MAX_PROGRAM_WORDS / 32] = { 0 };
+    size_t chainLength = 0;
+    size_t numLoops = 0;
+    for (size_t pc = 0; pc < numWords; pc += instructionWords(OPCODE(code[pc])))
+    {
+        const uint32_t* instruction = &code[pc];
+        const uint32_t opcode = OPCODE(instruction[0]);
+        const uint32_t operand = OPERAND(instruction[0]);
+        const size_t words = instructionWords(opcode);
+        if (words == 0)
+        {
+            LE_ERROR("Invalid opcode %u at word %zu", opcode, pc);
+            return LE_BAD_PARAMETER;
+        }
+        if (words > numWords - pc)
+        {
+            LE_ERROR("Instruction at word %zu is truncated", pc);
+            return LE_BAD_PARAMETER;
+        }
+        starts[pc / 32] |= 1u << (pc % 32);
+
+        const bool holdCs = (instruction[0] & SPI_PROG_HOLD_CS) != 0;
+        if (holdCs && !isTransfer(opcode))
+        {
+            LE_ERROR("Only transfers can hold chip select (word %zu)", pc);
+            return LE_BAD_PARAMETER;
+        }
+        if (!isTransfer(opcode) && chainLength != 0)
+        {
+            LE_ERROR("Chip select is held into a non-transfer instruction at word %zu", pc);
+            return LE_BAD_PARAMETER;
+        }
+
+        switch (opcode)
+        {
+            case SPI_PROG_WRITE:
+            case SPI_PROG_READ:
+            case SPI_PROG_FULL_DUPLEX:
+                if (operand == 0 || operand > SPI_MAX_READ_SIZE)
+                {
+                    LE_ERROR("Transfer length %u at word %zu is out of range", operand, pc);
+                    return LE_BAD_PARAMETER;
+                }
+                if (opcode != SPI_PROG_READ &&
+                    checkData(program, pc, instruction[1], operand) != LE_OK)
+                {
+                    return LE_BAD_PARAMETER;
+                }
+                chainLength = holdCs ? (chainLength + 1) : 0;
+                if (chainLength >= SPI_MAX_SEGMENTS)
+                {
+                    LE_ERROR("Chip select is held for too many transfers at word %zu", pc);
+                    return LE_BAD_PARAMETER;
+                }
+                program->cost += operand;
+                break;
+
+            case SPI_PROG_DELAY:
+                if (operand > SPI_MAX_PROGRAM_DELAY_USECS)
+                {
+                    LE_ERROR("Delay of %u usecs at word %zu is too long", operand, pc);
+                    return LE_BAD_PARAMETER;
+                }
+                break;
+
+            case SPI_PROG_POLL:
+                if (checkData(program, pc, instruction[1], operand) != LE_OK)
+                {
+                    return LE_BAD_PARAMETER;
+                }
+                if (instruction[2] > UINT16_MAX ||
+                    instruction[3] > SPI_MAX_PROGRAM_DELAY_USECS ||
+                    instruction[4] == 0 ||
+                    instruction[4] > SPI_MAX_PROGRAM_POLL_ATTEMPTS)
+                {
+                    LE_ERROR("Poll at word %zu has an invalid comparison, interval or count", pc);
+                    return LE_BAD_PARAMETER;
+                }
+                program->cost += operand + 1;
+                break;
+
+            case SPI_PROG_LOOP:
+                if (operand == 0 || instruction[1] > pc)
+                {
+                    LE_ERROR("Loop at word %zu must run at least once and jump backwards", pc);
+                    return LE_BAD_PARAMETER;
+                }
+                if (++numLoops > SPI_MAX_PROGRAM_LOOPS)
+                {
+                    LE_ERROR("Program has more than %d loops", SPI_MAX_PROGRAM_LOOPS);
+                    return LE_BAD_PARAMETER;
+                }
+                break;
+
+            case SPI_PROG_JUMP_EQ:
+            case SPI_PROG_JUMP_NE:
+                if (operand > UINT16_MAX || instruction[1] > numWords)
+                {
+                    LE_ERROR("Jump at word %zu has an invalid comparison or target", pc);
+                    return LE_BAD_PARAMETER;
+                }
+                break;
+        }
+    }
+    if (chainLength != 0)
+    {
+        LE_ERROR("Program ends while holding chip select");
+        return LE_BAD_PARAMETER;
+    }
+
+    // Second pass: jumps must land on an instruction or just past the last one
+    for (size_t pc = 0; pc < numWords; pc += instructionWords(OPCODE(code[pc])))
+    {
+        const uint32_t opcode = OPCODE(code[pc]);
+        if (opcode == SPI_PROG_LOOP || opcode == SPI_PROG_JUMP_EQ || opcode == SPI_PROG_JUMP_NE)
+        {
+            const uint32_t target = code[pc + 1];
+            if (target < numWords && (starts[target / 32] & (1u << (target % 32))) == 0)
+            {
+                LE_ERROR("Jump at word %zu lands inside an instruction", pc);
+                return LE_BAD_PARAMETER;
+            }
+        }
+    }
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the number of bytes one pass through a program transfers, ignoring loops and jumps.
+ *
+ * @return
+ *      The bytes transferred.
+ */
+//--------------------------------------------------------------------------------------------------
+size_t spiProgram_GetCost
+(
+    const spiProgram_t* program     ///< Loaded program
+)
+{
+    return program->cost;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs a program.  Must be called on the worker thread of the device's bus, which keeps other
+ * transfers off the bus until the program ends, so the run is limited to
+ * SPI_MAX_PROGRAM_RUN_USECS.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OVERFLOW if the program received more than fits in the output buffer
+ *      - LE_TIMEOUT if a poll ran out of attempts, the program ran for more than
+ *        SPI_MAX_PROGRAM_STEPS instructions or past its deadline
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiProgram_Run
+(
+    const spiProgram_t* program,    ///< Loaded program
+    int fd,                         ///< Open file descriptor of the device
+    spiStats_t* stats,              ///< Statistics to count bus transfers in
+    uint8_t* output,                ///< [out] Bytes received by reads and full duplex transfers
+    size_t* outputLength            ///< Capacity of output on input, bytes received on output
+)
+{
+    Run_t run =
+    {
+        .program = program,
+        .fd = fd,
+        .stats = stats,
+        .output = output,
+        .outputCapacity = *outputLength,
+        .deadlineUsecs = spiStats_NowUsecs() + SPI_MAX_PROGRAM_RUN_USECS
+    };
+
+    le_result_t result = LE_OK;
+    size_t steps = 0;
+    size_t pc = 0;
+    while (result == LE_OK && pc < program->numWords)
+    {
+        if (++steps > SPI_MAX_PROGRAM_STEPS)
+        {
+            LE_ERROR("Program ran for more than %d steps", SPI_MAX_PROGRAM_STEPS);
+            result = LE_TIMEOUT;
+            break;
+        }
+        if (spiStats_NowUsecs() > run.deadlineUsecs)
+        {
+            LE_ERROR("Program ran for more than %d usecs", SPI_MAX_PROGRAM_RUN_USECS);
+            result = LE_TIMEOUT;
+            break;
+        }
+
+        const uint32_t* instruction = &program->code[pc];
+        const uint32_t opcode = OPCODE(instruction[0]);
+        const uint32_t operand = OPERAND(instruction[0]);
+        size_t next = pc + instructionWords(opcode);
+        switch (opcode)
+        {
+            case SPI_PROG_WRITE:
+            case SPI_PROG_READ:
+            case SPI_PROG_FULL_DUPLEX:
+                result = queueTransfer(&run, instruction);
+                break;
+
+            case SPI_PROG_DELAY:
+                result = sleepUsecs(&run, operand);
+                break;
+
+            case SPI_PROG_POLL:
+                result = poll(&run, instruction);
+                break;
+
+            case SPI_PROG_LOOP:
+                next = loop(&run, pc, instruction);
+                break;
+
+            case SPI_PROG_JUMP_EQ:
+            case SPI_PROG_JUMP_NE:
+            {
+                const bool equal =
+                    (run.lastByte & COMPARE_MASK(operand)) == COMPARE_VALUE(operand);
+                if (equal == (opcode == SPI_PROG_JUMP_EQ))
+                {
+                    next = instruction[1];
+                }
+                break;
+            }
+        }
+        pc = next;
+    }
+
+    *outputLength = run.receivedLength;
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the length of an instruction.
+ *
+ * @return
+ *      The number of words, or 0 if the opcode is invalid.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t instructionWords
+(
+    uint32_t opcode
+)
+{
+    switch (opcode)
+    {
+        case SPI_PROG_READ:
+        case SPI_PROG_DELAY:
+            return 1;
+
+        case SPI_PROG_WRITE:
+        case SPI_PROG_FULL_DUPLEX:
+        case SPI_PROG_LOOP:
+        case SPI_PROG_JUMP_EQ:
+        case SPI_PROG_JUMP_NE:
+            return 2;
+
+        case SPI_PROG_POLL:
+            return 5;
+
+        default:
+            return 0;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks whether an instruction moves data on the bus as part of a chip select chain.
+ *
+ * @return
+ *      true for the write, read and full duplex instructions.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool isTransfer
+(
+    uint32_t opcode
+)
+{
+    return opcode == SPI_PROG_WRITE || opcode == SPI_PROG_READ || opcode == SPI_PROG_FULL_DUPLEX;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks that the data transmitted by an instruction is within the program's data.
+ *
+ * @return
+ *      - LE_OK if it is
+ *      - LE_BAD_PARAMETER otherwise
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t checkData
+(
+    const spiProgram_t* program,
+    size_t pc,          ///< Word index of the instruction, for the log
+    uint32_t offset,
+    uint32_t length
+)
+{
+    if (offset > program->dataLength || length > program->dataLength - offset)
+    {
+        LE_ERROR("Instruction at word %zu overruns the program data", pc);
+        return LE_BAD_PARAMETER;
+    }
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Adds a transfer instruction to the current chip select chain, and performs the chain as one
+ * message if the instruction ends it.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OVERFLOW if the output buffer is full
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t queueTransfer
+(
+    Run_t* run,
+    const uint32_t* instruction
+)
+{
+    const uint32_t opcode = OPCODE(instruction[0]);
+    const uint32_t length = OPERAND(instruction[0]);
+    const bool receives = (opcode != SPI_PROG_WRITE);
+
+    if (receives && length > run->outputCapacity - run->outputLength)
+    {
+        LE_ERROR("Program output doesn't fit in %zu bytes", run->outputCapacity);
+        run->numSegments = 0;
+        return LE_OVERFLOW;
+    }
+
+    spiLib_Segment_t* segment = &run->segments[run->numSegments++];
+    memset(segment, 0, sizeof(*segment));
+    segment->txBuf = (opcode != SPI_PROG_READ) ? &run->program->data[instruction[1]] : NULL;
+    segment->rxBuf = receives ? &run->output[run->outputLength] : NULL;
+    segment->length = length;
+    run->outputLength += receives ? length : 0;
+
+    if ((instruction[0] & SPI_PROG_HOLD_CS) != 0)
+    {
+        return LE_OK;
+    }
+
+    const le_result_t result =
+        (spiLib_Transfer(run->fd, run->segments, run->numSegments) == LE_OK) ? LE_OK : LE_FAULT;
+    size_t txBytes = 0;
+    size_t rxBytes = 0;
+    for (size_t i = 0; i < run->numSegments; i++)
+    {
+        txBytes += (run->segments[i].txBuf != NULL) ? run->segments[i].length : 0;
+        rxBytes += (run->segments[i].rxBuf != NULL) ? run->segments[i].length : 0;
+    }
+    spiStats_CountTransfer(run->stats, SPISTATS_TRANSACTION, txBytes, rxBytes, result);
+    if (result == LE_OK && rxBytes > 0)
+    {
+        run->lastByte = run->output[run->outputLength - 1];
+        run->receivedLength = run->outputLength;
+    }
+    run->numSegments = 0;
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends a command and reads one byte back until the byte matches, waiting between attempts.  The
+ * byte read becomes the last byte received but isn't stored in the output.
+ *
+ * @return
+ *      - LE_OK once the byte matches
+ *      - LE_TIMEOUT if it didn't match within the allowed attempts or the program's deadline
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t poll
+(
+    Run_t* run,
+    const uint32_t* instruction
+)
+{
+    const uint32_t commandLength = OPERAND(instruction[0]);
+    const uint32_t compare = instruction[2];
+    const uint32_t intervalUsecs = instruction[3];
+    const uint32_t attempts = instruction[4];
+
+    uint8_t status;
+    spiLib_Segment_t segments[2] =
+    {
+        { .txBuf = &run->program->data[instruction[1]], .length = commandLength },
+        { .rxBuf = &status, .length = 1 }
+    };
+    // A poll without a command just reads
+    const size_t firstSegment = (commandLength == 0) ? 1 : 0;
+
+    for (uint32_t attempt = 0; attempt < attempts; attempt++)
+    {
+        if (attempt > 0 && sleepUsecs(run, intervalUsecs) != LE_OK)
+        {
+            return LE_TIMEOUT;
+        }
+        const le_result_t result = (spiLib_Transfer(
+            run->fd, &segments[firstSegment], NUM_ARRAY_MEMBERS(segments) - firstSegment) == LE_OK)
+            ? LE_OK : LE_FAULT;
+        spiStats_CountTransfer(run->stats, SPISTATS_TRANSACTION, commandLength, 1, result);
+        if (result != LE_OK)
+        {
+            return result;
+        }
+        run->lastByte = status;
+        if ((status & COMPARE_MASK(compare)) == COMPARE_VALUE(compare))
+        {
+            return LE_OK;
+        }
+    }
+    return LE_TIMEOUT;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a LOOP instruction.  Each LOOP instruction has its own counter, which starts when the
+ * instruction is first reached and is discarded when the loop finishes, so that an inner loop
+ * runs its full count on every pass of an outer one.
+ *
+ * @return
+ *      Word index of the next instruction to run.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t loop
+(
+    Run_t* run,
+    size_t pc,                      ///< Word index of the LOOP instruction
+    const uint32_t* instruction
+)
+{
+    size_t i = 0;
+    while (i < run->numLoops && run->loops[i].pc != pc)
+    {
+        i++;
+    }
+    if (i == run->numLoops)
+    {
+        // The body has run once by the time the loop is reached.  Validation limits the number of
+        // LOOP instructions, so there is always a free counter.
+        run->loops[i].pc = pc;
+        run->loops[i].remaining = OPERAND(instruction[0]) - 1;
+        run->numLoops++;
+    }
+
+    if (run->loops[i].remaining == 0)
+    {
+        run->loops[i] = run->loops[--run->numLoops];
+        return pc + instructionWords(SPI_PROG_LOOP);
+    }
+    run->loops[i].remaining--;
+    return instruction[1];
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sleeps for a number of microseconds, holding the bus, unless that would take the run past its
+ * deadline.
+ *
+ * @return
+ *      - LE_OK once the time has passed
+ *      - LE_TIMEOUT without sleeping if the run would end too late
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t sleepUsecs
+(
+    const Run_t* run,
+    uint32_t usecs
+)
+{
+    if (spiStats_NowUsecs() + usecs > run->deadlineUsecs)
+    {
+        LE_ERROR("Program would run for more than %d usecs", SPI_MAX_PROGRAM_RUN_USECS);
+        return LE_TIMEOUT;
+    }
+
+    struct timespec remaining = { .tv_sec = usecs / 1000000, .tv_nsec = (usecs % 1000000) * 1000 };
+    while (nanosleep(&remaining, &remaining) == -1 && errno == EINTR)
+    {
+    }
+    return LE_OK;
+}
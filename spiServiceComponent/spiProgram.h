@@ -0,0 +1,36 @@
+#ifndef SPI_PROGRAM_H
+#define SPI_PROGRAM_H
+
+#include "legato.h"
+#include "interfaces.h"
+#include "spiStats.h"
+
+// A validated micro-sequence program, in the instruction format documented in spi.api.  A loaded
+// program is never modified, so it may be run any number of times.  All fields are private to
+// spiProgram.c.
+typedef struct
+{
+    uint32_t code[SPI_MAX_PROGRAM_WORDS];
+    size_t numWords;
+    uint8_t data[SPI_MAX_PROGRAM_DATA];
+    size_t dataLength;
+    size_t cost;                ///< Bytes one pass through the code transfers, for scheduling
+} spiProgram_t;
+
+le_result_t spiProgram_Load(
+    spiProgram_t* program,
+    const uint32_t* code,
+    size_t numWords,
+    const uint8_t* data,
+    size_t dataLength);
+
+size_t spiProgram_GetCost(const spiProgram_t* program);
+
+le_result_t spiProgram_Run(
+    const spiProgram_t* program,
+    int fd,
+    spiStats_t* stats,
+    uint8_t* output,
+    size_t* outputLength);
+
+#endif  // SPI_PROGRAM_H
@@ -0,0 +1,564 @@
+#include "legato.h"
+#include "spiLibrary.h"
+#include "spiRegmap.h"
+
+// Counters read by other threads are updated with relaxed atomics, as in spiStats.c
+#define REGMAP_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define REGMAP_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
+
+static le_result_t transfer(
+    spiRegmap_t* map,
+    int fd,
+    spiStats_t* stats,
+    uint32_t command,
+    const uint8_t* txData,
+    uint8_t* rxData,
+    size_t length);
+static void setFormat(
+    spiRegmap_t* map,
+    uint8_t addressBytes,
+    uint32_t readFlag,
+    uint32_t writeFlag);
+static bool hasCacheFormat(const spiRegmap_t* map);
+static void clearCache(spiRegmap_Cache_t* cache);
+static bool isCacheable(const spiRegmap_t* map, uint32_t address);
+static bool isCached(const spiRegmap_t* map, uint32_t address);
+static void storeCached(spiRegmap_t* map, uint32_t address, uint8_t value);
+static void dropCached(spiRegmap_t* map, uint32_t address);
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes the register cache of a device, holding no values and used by no map.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiRegmap_InitCache
+(
+    spiRegmap_Cache_t* cache    ///< Cache to initialize
+)
+{
+    memset(cache, 0, sizeof(*cache));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes a register map with the default command format and the cache disabled.  The
+ * device's cache isn't touched, so this may be called on any thread.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiRegmap_Init
+(
+    spiRegmap_t* map,           ///< Register map to initialize
+    spiRegmap_Cache_t* cache    ///< Register cache of the device, shared by all of its maps
+)
+{
+    memset(map, 0, sizeof(*map));
+    map->cache = cache;
+    setFormat(
+        map,
+        SPIREGMAP_DEFAULT_ADDRESS_BYTES,
+        SPIREGMAP_DEFAULT_READ_FLAG,
+        SPIREGMAP_DEFAULT_WRITE_FLAG);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops a register map using its device's cache, so that the other maps may change its format.
+ * Must be called before a map with the cache enabled is discarded.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiRegmap_Release
+(
+    spiRegmap_t* map    ///< Register map to release
+)
+{
+    if (map->cacheEnabled)
+    {
+        map->cache->numMaps--;
+        map->cacheEnabled = false;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Describes the registers of a device.  The values cached for the device are discarded, since the
+ * handle may have written registers without the map.  A map with the cache enabled must have the
+ * same command format and volatile ranges as the device's other maps with the cache enabled, as
+ * they share the cached values.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the address width is unsupported, a flag doesn't fit in the command
+ *        or a range is malformed
+ *      - LE_NOT_PERMITTED if the cache is enabled and another map caches the device's registers
+ *        with a different format or volatile ranges
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiRegmap_Configure
+(
+    spiRegmap_t* map,                           ///< Register map to configure
+    uint8_t addressBytes,                       ///< Bytes of address in each command
+    uint32_t readFlag,                          ///< ORed into the command of reads
+    uint32_t writeFlag,                         ///< ORed into the command of writes
+    const spiRegmap_Range_t* volatileRanges,    ///< Registers which must never be cached
+    size_t numVolatileRanges,                   ///< Number of entries in volatileRanges
+    bool cacheEnabled                           ///< Cache the other registers
+)
+{
+    if (addressBytes == 0 || addressBytes > SPIREGMAP_MAX_ADDRESS_BYTES)
+    {
+        LE_ERROR("Register addresses of %u bytes are not supported", addressBytes);
+        return LE_BAD_PARAMETER;
+    }
+    const uint32_t commandMask =
+        (addressBytes == 4) ? UINT32_MAX : ((UINT32_C(1) << (8 * addressBytes)) - 1);
+    if ((readFlag & ~commandMask) != 0 || (writeFlag & ~commandMask) != 0)
+    {
+        LE_ERROR("Register command flags don't fit in %u bytes", addressBytes);
+        return LE_BAD_PARAMETER;
+    }
+    if (numVolatileRanges > SPIREGMAP_MAX_VOLATILE_RANGES)
+    {
+        LE_ERROR("Too many volatile register ranges (%zu)", numVolatileRanges);
+        return LE_BAD_PARAMETER;
+    }
+    for (size_t i = 0; i < numVolatileRanges; i++)
+    {
+        if (volatileRanges[i].first > volatileRanges[i].last)
+        {
+            LE_ERROR("Volatile register range %zu is empty", i);
+            return LE_BAD_PARAMETER;
+        }
+    }
+
+    spiRegmap_Cache_t* cache = map->cache;
+    const size_t otherMaps = cache->numMaps - (map->cacheEnabled ? 1 : 0);
+    if (cacheEnabled && otherMaps > 0 &&
+        (cache->addressBytes != addressBytes ||
+         cache->readFlag != readFlag ||
+         cache->writeFlag != writeFlag ||
+         cache->numVolatileRanges != numVolatileRanges ||
+         (numVolatileRanges > 0 &&
+          memcmp(cache->volatileRanges,
+                 volatileRanges,
+                 numVolatileRanges * sizeof(volatileRanges[0])) != 0)))
+    {
+        LE_ERROR("Another handle caches the device's registers with a different register map");
+        return LE_NOT_PERMITTED;
+    }
+
+    setFormat(map, addressBytes, readFlag, writeFlag);
+    spiRegmap_Release(map);
+    if (cacheEnabled)
+    {
+        cache->numMaps++;
+        cache->addressBytes = addressBytes;
+        cache->readFlag = readFlag;
+        cache->writeFlag = writeFlag;
+        if (numVolatileRanges > 0)
+        {
+            memcpy(cache->volatileRanges,
+                   volatileRanges,
+                   numVolatileRanges * sizeof(volatileRanges[0]));
+        }
+        cache->numVolatileRanges = numVolatileRanges;
+        map->cacheEnabled = true;
+    }
+    spiRegmap_Invalidate(map);
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads consecutive registers.  If every register is cached the read is served from the cache,
+ * otherwise all of them are read from the device and the cacheable ones are cached.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the registers go beyond the largest address
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiRegmap_Read
+(
+    spiRegmap_t* map,       ///< Register map of the device
+    int fd,                 ///< Open file descriptor of the device
+    spiStats_t* stats,      ///< Statistics to count bus transfers in
+    uint32_t address,       ///< Address of the first register
+    uint8_t* data,          ///< [out] Register values
+    size_t length           ///< Number of registers to read
+)
+{
+    if (length == 0)
+    {
+        return LE_OK;
+    }
+    if (address > map->maxAddress || length - 1 > map->maxAddress - address)
+    {
+        return LE_OUT_OF_RANGE;
+    }
+
+    bool allCached = map->cacheEnabled;
+    bool anyCacheable = false;
+    for (size_t i = 0; i < length; i++)
+    {
+        allCached = allCached && isCacheable(map, address + i) && isCached(map, address + i);
+        anyCacheable = anyCacheable || isCacheable(map, address + i);
+    }
+
+    if (allCached)
+    {
+        memcpy(data, &map->cache->values[address], length);
+        REGMAP_ADD(map->hits, 1);
+        // Charge the hit what a read of this size has cost on average
+        if (map->busBytes != 0)
+        {
+            REGMAP_ADD(
+                map->savedUsecs,
+                (map->busUsecs * (map->addressBytes + length)) / map->busBytes);
+        }
+        return LE_OK;
+    }
+
+    const uint64_t startUsecs = spiStats_NowUsecs();
+    const le_result_t result =
+        transfer(map, fd, stats, address | map->readFlag, NULL, data, length);
+    if (result != LE_OK)
+    {
+        return result;
+    }
+    map->busUsecs += spiStats_NowUsecs() - startUsecs;
+    map->busBytes += map->addressBytes + length;
+
+    if (anyCacheable)
+    {
+        REGMAP_ADD(map->misses, 1);
+        for (size_t i = 0; i < length; i++)
+        {
+            if (isCacheable(map, address + i))
+            {
+                storeCached(map, address + i, data[i]);
+            }
+        }
+    }
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes consecutive registers.  The write always goes to the device, and updates the cached
+ * values of cacheable registers once it has succeeded.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the registers go beyond the largest address
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiRegmap_Write
+(
+    spiRegmap_t* map,       ///< Register map of the device
+    int fd,                 ///< Open file descriptor of the device
+    spiStats_t* stats,      ///< Statistics to count bus transfers in
+    uint32_t address,       ///< Address of the first register
+    const uint8_t* data,    ///< Values to write
+    size_t length           ///< Number of registers to write
+)
+{
+    if (length == 0)
+    {
+        return LE_OK;
+    }
+    if (address > map->maxAddress || length - 1 > map->maxAddress - address)
+    {
+        return LE_OUT_OF_RANGE;
+    }
+
+    const le_result_t result =
+        transfer(map, fd, stats, address | map->writeFlag, data, NULL, length);
+    if (!hasCacheFormat(map))
+    {
+        // The address may name other registers in the format of the maps which cache
+        clearCache(map->cache);
+        return result;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+        // The device's value is unknown after a failed write
+        if (result == LE_OK && isCacheable(map, address + i))
+        {
+            storeCached(map, address + i, data[i]);
+        }
+        else
+        {
+            dropCached(map, address + i);
+        }
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Changes the bits of a register selected by a mask, reading it and writing it back without
+ * anything else on the bus in between as long as the caller is the bus's worker thread.  The read
+ * is served from the device's cache when the register is cached, which holds the value last
+ * written through any of the device's handles, and the write is skipped when the bits already
+ * have the requested value.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the register is beyond the largest address
+ *      - LE_FAULT if a transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiRegmap_UpdateBits
+(
+    spiRegmap_t* map,       ///< Register map of the device
+    int fd,                 ///< Open file descriptor of the device
+    spiStats_t* stats,      ///< Statistics to count bus transfers in
+    uint32_t address,       ///< Address of the register
+    uint8_t mask,           ///< Bits to change
+    uint8_t value           ///< New values of the bits in mask; other bits are ignored
+)
+{
+    uint8_t oldValue;
+    const le_result_t result = spiRegmap_Read(map, fd, stats, address, &oldValue, 1);
+    if (result != LE_OK)
+    {
+        return result;
+    }
+
+    const uint8_t newValue = (oldValue & ~mask) | (value & mask);
+    if (newValue == oldValue)
+    {
+        return LE_OK;
+    }
+    return spiRegmap_Write(map, fd, stats, address, &newValue, 1);
+}
+
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Discards all of the register values cached for the map's device, whichever handle cached them.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiRegmap_Invalidate
+(
+    spiRegmap_t* map    ///< Register map to invalidate
+)
+{
+    clearCache(map->cache);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the cache counters.  May be called from any thread.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiRegmap_GetCacheStats
+(
+    const spiRegmap_t* map,     ///< Register map to query
+    uint64_t* hits,             ///< [out] Reads served from the cache
+    uint64_t* misses,           ///< [out] Reads of cacheable registers which went to the device
+    uint64_t* savedUsecs        ///< [out] Estimated bus time saved by the hits
+)
+{
+    *hits = REGMAP_LOAD(map->hits);
+    *misses = REGMAP_LOAD(map->misses);
+    *savedUsecs = REGMAP_LOAD(map->savedUsecs);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends a command followed by a data phase as one message.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the transfer failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t transfer
+(
+    spiRegmap_t* map,
+    int fd,
+    spiStats_t* stats,
+    uint32_t command,       ///< Address ORed with the read or write flag
+    const uint8_t* txData,  ///< Data to write, or NULL for a read
+    uint8_t* rxData,        ///< Buffer for the data read, or NULL for a write
+    size_t length           ///< Bytes of data
+)
+{
+    uint8_t commandBytes[SPIREGMAP_MAX_ADDRESS_BYTES];
+    for (size_t i = 0; i < map->addressBytes; i++)
+    {
+        commandBytes[i] = (command >> (8 * (map->addressBytes - 1 - i))) & 0xFF;
+    }
+
+    const spiLib_Segment_t segments[] =
+    {
+        { .txBuf = commandBytes, .length = map->addressBytes },
+        { .txBuf = txData, .rxBuf = rxData, .length = length }
+    };
+    const le_result_t result =
+        (spiLib_Transfer(fd, segments, NUM_ARRAY_MEMBERS(segments)) == LE_OK) ? LE_OK : LE_FAULT;
+    spiStats_CountTransfer(
+        stats,
+        SPISTATS_TRANSACTION,
+        map->addressBytes + ((txData != NULL) ? length : 0),
+        (rxData != NULL) ? length : 0,
+        result);
+    return result;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets the command format of a map.
+ */
+//--------------------------------------------------------------------------------------------------
+static void setFormat
+(
+    spiRegmap_t* map,
+    uint8_t addressBytes,   ///< Bytes of address in each command, already checked
+    uint32_t readFlag,      ///< ORed into the command of reads, already checked
+    uint32_t writeFlag      ///< ORed into the command of writes, already checked
+)
+{
+    const uint32_t commandMask =
+        (addressBytes == 4) ? UINT32_MAX : ((UINT32_C(1) << (8 * addressBytes)) - 1);
+    map->addressBytes = addressBytes;
+    map->readFlag = readFlag;
+    map->writeFlag = writeFlag;
+    // Addresses must stay clear of the lowest flag bit
+    const uint32_t flags = readFlag | writeFlag;
+    map->maxAddress = (flags == 0) ? commandMask : ((flags & (~flags + 1)) - 1);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks whether a map addresses registers as the maps which use the device's cache do.
+ *
+ * @return
+ *      true if no map uses the cache or the map's command format is the cache's.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool hasCacheFormat
+(
+    const spiRegmap_t* map
+)
+{
+    const spiRegmap_Cache_t* cache = map->cache;
+    return cache->numMaps == 0 ||
+           (map->addressBytes == cache->addressBytes &&
+            map->readFlag == cache->readFlag &&
+            map->writeFlag == cache->writeFlag);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Discards every value of a cache.
+ */
+//--------------------------------------------------------------------------------------------------
+static void clearCache
+(
+    spiRegmap_Cache_t* cache
+)
+{
+    memset(cache->valid, 0, sizeof(cache->valid));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks whether a register may be cached.
+ *
+ * @return
+ *      true if caching is enabled, the register is within the cache and it isn't volatile.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool isCacheable
+(
+    const spiRegmap_t* map,
+    uint32_t address
+)
+{
+    if (!map->cacheEnabled || address >= SPIREGMAP_CACHE_SIZE)
+    {
+        return false;
+    }
+    const spiRegmap_Cache_t* cache = map->cache;
+    for (size_t i = 0; i < cache->numVolatileRanges; i++)
+    {
+        if (address >= cache->volatileRanges[i].first && address <= cache->volatileRanges[i].last)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks whether a register's value is in the cache.
+ *
+ * @return
+ *      true if the register is cached.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool isCached
+(
+    const spiRegmap_t* map,
+    uint32_t address
+)
+{
+    return address < SPIREGMAP_CACHE_SIZE &&
+           (map->cache->valid[address / 32] & (1u << (address % 32)));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stores a register's value in the cache.  The register must be cacheable.
+ */
+//--------------------------------------------------------------------------------------------------
+static void storeCached
+(
+    spiRegmap_t* map,
+    uint32_t address,
+    uint8_t value
+)
+{
+    map->cache->values[address] = value;
+    map->cache->valid[address / 32] |= 1u << (address % 32);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Removes a register's value from the cache, if it is there.
+ */
+//--------------------------------------------------------------------------------------------------
+static void dropCached
+(
+    spiRegmap_t* map,
+    uint32_t address
+)
+{
+    if (address < SPIREGMAP_CACHE_SIZE)
+    {
+        map->cache->valid[address / 32] &= ~(1u << (address % 32));
+    }
+}
+
@@ -0,0 +1,109 @@
+#ifndef SPI_REGMAP_H
+#define SPI_REGMAP_H
+
+#include "legato.h"
+#include "spiStats.h"
+
+// Widest register address, in bytes
+#define SPIREGMAP_MAX_ADDRESS_BYTES 4
+// Most volatile ranges a register map can have
+#define SPIREGMAP_MAX_VOLATILE_RANGES 8
+// Registers below this address can be cached
+#define SPIREGMAP_CACHE_SIZE 256
+// Defaults for a handle which hasn't described its registers: a seven bit address in one byte,
+// with the top bit set for reads
+#define SPIREGMAP_DEFAULT_ADDRESS_BYTES 1
+#define SPIREGMAP_DEFAULT_READ_FLAG 0x80
+#define SPIREGMAP_DEFAULT_WRITE_FLAG 0x00
+
+// An inclusive range of register addresses
+typedef struct
+{
+    uint32_t first;
+    uint32_t last;
+} spiRegmap_Range_t;
+
+// Register values of a device, shared by the register maps of all of its handles so that a write
+// through one handle is seen by reads through the others.  The maps which cache all have the
+// command format and volatile ranges kept here, so a value cached through one is valid for all.
+// Only used by the worker thread of the device's bus.  All fields are private to spiRegmap.c.
+typedef struct
+{
+    uint8_t values[SPIREGMAP_CACHE_SIZE];
+    uint32_t valid[SPIREGMAP_CACHE_SIZE / 32];  ///< Bitmap of the cached values
+    size_t numMaps;             ///< Maps with the cache enabled
+    uint8_t addressBytes;       ///< Command format of the maps with the cache enabled
+    uint32_t readFlag;
+    uint32_t writeFlag;
+    spiRegmap_Range_t volatileRanges[SPIREGMAP_MAX_VOLATILE_RANGES];
+    size_t numVolatileRanges;
+} spiRegmap_Cache_t;
+
+// How a handle accesses a register-mapped device.  Each access is a command of addressBytes bytes
+// holding the address, most significant byte first, ORed with readFlag or writeFlag, followed by
+// the data of consecutive registers.  A register map is only used by the worker thread of its
+// device's bus, apart from the counters, which are read with atomic loads.  All fields are
+// private to spiRegmap.c.
+typedef struct
+{
+    uint8_t addressBytes;
+    uint32_t readFlag;
+    uint32_t writeFlag;
+    uint32_t maxAddress;        ///< Largest address which doesn't overlap the flags
+    bool cacheEnabled;          ///< Counted in the cache's numMaps
+    spiRegmap_Cache_t* cache;   ///< Cache of the device, shared with its other handles' maps
+    uint64_t hits;              ///< Reads served entirely from the cache
+    uint64_t misses;            ///< Reads of cacheable registers which went to the device
+    uint64_t savedUsecs;        ///< Estimated bus time saved by hits
+    uint64_t busUsecs;          ///< Bus time taken by reads, for estimating savedUsecs
+    uint64_t busBytes;          ///< Bytes moved by reads, for estimating savedUsecs
+} spiRegmap_t;
+
+void spiRegmap_InitCache(spiRegmap_Cache_t* cache);
+
+void spiRegmap_Init(spiRegmap_t* map, spiRegmap_Cache_t* cache);
+
+void spiRegmap_Release(spiRegmap_t* map);
+
+le_result_t spiRegmap_Configure(
+    spiRegmap_t* map,
+    uint8_t addressBytes,
+    uint32_t readFlag,
+    uint32_t writeFlag,
+    const spiRegmap_Range_t* volatileRanges,
+    size_t numVolatileRanges,
+    bool cacheEnabled);
+
+le_result_t spiRegmap_Read(
+    spiRegmap_t* map,
+    int fd,
+    spiStats_t* stats,
+    uint32_t address,
+    uint8_t* data,
+    size_t length);
+
+le_result_t spiRegmap_Write(
+    spiRegmap_t* map,
+    int fd,
+    spiStats_t* stats,
+    uint32_t address,
+    const uint8_t* data,
+    size_t length);
+
+le_result_t spiRegmap_UpdateBits(
+    spiRegmap_t* map,
+    int fd,
+    spiStats_t* stats,
+    uint32_t address,
+    uint8_t mask,
+    uint8_t value);
+
+void spiRegmap_Invalidate(spiRegmap_t* map);
+
+void spiRegmap_GetCacheStats(
+    const spiRegmap_t* map,
+    uint64_t* hits,
+    uint64_t* misses,
+    uint64_t* savedUsecs);
+
+#endif  // SPI_REGMAP_H
@@ -0,0 +1,248 @@
+#include "legato.h"
+#include "spiSampler.h"
+
+// Takes samples from a repeating timer and buffers them, with the time each was taken, in a ring
+// until they are read.  The timer runs on the thread which starts the sampler while samples are
+// read from any thread.
+typedef struct spiSampler
+{
+    size_t sampleSize;
+    size_t capacity;                ///< Number of samples the ring holds
+    spiSampler_TakeFunc_t take;
+    void* context;                  ///< Passed to take
+    le_timer_Ref_t timer;           ///< Set while the sampler is started
+    // Protects the ring and the counters below
+    le_mutex_Ref_t mutex;
+    size_t head;                    ///< Ring index the next sample is stored at
+    size_t count;                   ///< Number of samples in the ring
+    uint32_t dropped;               ///< Samples overwritten since the last read
+    uint32_t failed;                ///< Samples which couldn't be taken since the last read
+    uint64_t timestamps[SPISAMPLER_MAX_SAMPLES];
+    uint8_t data[SPISAMPLER_BUFFER_BYTES];
+} Sampler_t;
+
+
+static void timerExpired(le_timer_Ref_t timer);
+static uint64_t monotonicUsecs(void);
+
+static struct
+{
+    // Memory pool for allocating samplers
+    le_mem_PoolRef_t samplerPool;
+} g;
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Creates a stopped sampler.
+ *
+ * @return
+ *      The new sampler.
+ */
+//--------------------------------------------------------------------------------------------------
+spiSampler_Ref_t spiSampler_Create
+(
+    size_t sampleSize,           ///< Bytes per sample; at most SPISAMPLER_MAX_SAMPLE_SIZE
+    size_t capacity,             ///< Samples to buffer; at most SPISAMPLER_MAX_SAMPLES and at most
+                                 ///  SPISAMPLER_BUFFER_BYTES of data
+    spiSampler_TakeFunc_t take,  ///< Takes each sample
+    void* context                ///< Passed to take
+)
+{
+    LE_ASSERT(sampleSize > 0 && sampleSize <= SPISAMPLER_MAX_SAMPLE_SIZE);
+    LE_ASSERT(capacity > 0 && capacity <= SPISAMPLER_MAX_SAMPLES);
+    LE_ASSERT(capacity * sampleSize <= SPISAMPLER_BUFFER_BYTES);
+
+    Sampler_t* sampler = le_mem_ForceAlloc(g.samplerPool);
+    sampler->sampleSize = sampleSize;
+    sampler->capacity = capacity;
+    sampler->take = take;
+    sampler->context = context;
+    sampler->timer = NULL;
+    sampler->mutex = le_mutex_CreateNonRecursive("SPI Sampler");
+    sampler->head = 0;
+    sampler->count = 0;
+    sampler->dropped = 0;
+    sampler->failed = 0;
+    return sampler;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts taking a sample every period.  The samples are taken on the calling thread, which must
+ * be running an event loop.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiSampler_Start
+(
+    spiSampler_Ref_t sampler,  ///< Sampler to start
+    uint32_t periodUsecs       ///< Time between samples
+)
+{
+    LE_ASSERT(sampler->timer == NULL && periodUsecs > 0);
+
+    const le_clk_Time_t interval =
+    {
+        .sec = periodUsecs / 1000000,
+        .usec = periodUsecs % 1000000
+    };
+    sampler->timer = le_timer_Create("SPI Sampler");
+    LE_ASSERT_OK(le_timer_SetInterval(sampler->timer, interval));
+    // Repeat until stopped
+    LE_ASSERT_OK(le_timer_SetRepeat(sampler->timer, 0));
+    LE_ASSERT_OK(le_timer_SetContextPtr(sampler->timer, sampler));
+    LE_ASSERT_OK(le_timer_SetHandler(sampler->timer, timerExpired));
+    LE_ASSERT_OK(le_timer_Start(sampler->timer));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops taking samples.  Must be called on the thread which started the sampler.  Samples
+ * already buffered can still be read.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiSampler_Stop
+(
+    spiSampler_Ref_t sampler  ///< Sampler to stop
+)
+{
+    if (sampler->timer != NULL)
+    {
+        le_timer_Delete(sampler->timer);
+        sampler->timer = NULL;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a stopped sampler and any samples it still holds.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiSampler_Delete
+(
+    spiSampler_Ref_t sampler  ///< Sampler to delete
+)
+{
+    LE_ASSERT(sampler->timer == NULL);
+    le_mutex_Delete(sampler->mutex);
+    le_mem_Release(sampler);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Removes buffered samples, oldest first, and collects the counts of samples lost since the
+ * previous read.
+ *
+ * @return
+ *      Number of samples read.
+ */
+//--------------------------------------------------------------------------------------------------
+size_t spiSampler_Read
+(
+    spiSampler_Ref_t sampler,  ///< Sampler to read from
+    uint64_t* timestamps,      ///< [out] Monotonic time in microseconds each sample was taken at
+    uint8_t* data,             ///< [out] Samples, back to back
+    size_t maxSamples,         ///< Room in timestamps and data, in samples
+    uint32_t* dropped,         ///< [out] Samples overwritten because the buffer was full
+    uint32_t* failed           ///< [out] Samples which couldn't be taken
+)
+{
+    le_mutex_Lock(sampler->mutex);
+
+    const size_t numSamples = (sampler->count < maxSamples) ? sampler->count : maxSamples;
+    size_t tail = (sampler->head + sampler->capacity - sampler->count) % sampler->capacity;
+    for (size_t i = 0; i < numSamples; i++)
+    {
+        timestamps[i] = sampler->timestamps[tail];
+        memcpy(&data[i * sampler->sampleSize],
+               &sampler->data[tail * sampler->sampleSize],
+               sampler->sampleSize);
+        tail = (tail + 1) % sampler->capacity;
+    }
+    sampler->count -= numSamples;
+
+    *dropped = sampler->dropped;
+    *failed = sampler->failed;
+    sampler->dropped = 0;
+    sampler->failed = 0;
+
+    le_mutex_Unlock(sampler->mutex);
+
+    return numSamples;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Takes a sample and adds it to the ring, overwriting the oldest sample if the ring is full.
+ */
+//--------------------------------------------------------------------------------------------------
+static void timerExpired
+(
+    le_timer_Ref_t timer
+)
+{
+    Sampler_t* sampler = le_timer_GetContextPtr(timer);
+
+    // Take the sample outside the lock so that readers are never held up by the bus
+    uint8_t sample[SPISAMPLER_MAX_SAMPLE_SIZE];
+    const uint64_t timestamp = monotonicUsecs();
+    const le_result_t result = sampler->take(sampler->context, sample);
+
+    le_mutex_Lock(sampler->mutex);
+    if (result != LE_OK)
+    {
+        sampler->failed++;
+    }
+    else
+    {
+        sampler->timestamps[sampler->head] = timestamp;
+        memcpy(&sampler->data[sampler->head * sampler->sampleSize], sample, sampler->sampleSize);
+        sampler->head = (sampler->head + 1) % sampler->capacity;
+        if (sampler->count == sampler->capacity)
+        {
+            sampler->dropped++;
+        }
+        else
+        {
+            sampler->count++;
+        }
+    }
+    le_mutex_Unlock(sampler->mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the monotonic time.
+ *
+ * @return
+ *      Microseconds since an arbitrary point in the past.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint64_t monotonicUsecs
+(
+    void
+)
+{
+    const le_clk_Time_t now = le_clk_GetRelativeTime();
+    return ((uint64_t)now.sec * 1000000) + now.usec;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes the sampler module.  Must be called before any other spiSampler function.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiSampler_Init
+(
+    void
+)
+{
+    g.samplerPool = le_mem_CreatePool("SPI Samplers", sizeof(Sampler_t));
+}
@@ -0,0 +1,41 @@
+#ifndef SPI_SAMPLER_H
+#define SPI_SAMPLER_H
+
+#include "legato.h"
+
+// Largest sample a sampler can hold
+#define SPISAMPLER_MAX_SAMPLE_SIZE 64
+// Most samples a sampler can buffer
+#define SPISAMPLER_MAX_SAMPLES 1024
+// Bytes of sample data a sampler can buffer, limiting the capacity of samplers with large samples
+#define SPISAMPLER_BUFFER_BYTES 16384
+
+typedef struct spiSampler* spiSampler_Ref_t;
+
+// Takes one sample of the sampler's sample size into the given buffer.  Called on the thread
+// which started the sampler.
+typedef le_result_t (*spiSampler_TakeFunc_t)(void* context, uint8_t* sample);
+
+spiSampler_Ref_t spiSampler_Create(
+    size_t sampleSize,
+    size_t capacity,
+    spiSampler_TakeFunc_t take,
+    void* context);
+
+void spiSampler_Start(spiSampler_Ref_t sampler, uint32_t periodUsecs);
+
+void spiSampler_Stop(spiSampler_Ref_t sampler);
+
+void spiSampler_Delete(spiSampler_Ref_t sampler);
+
+size_t spiSampler_Read(
+    spiSampler_Ref_t sampler,
+    uint64_t* timestamps,
+    uint8_t* data,
+    size_t maxSamples,
+    uint32_t* dropped,
+    uint32_t* failed);
+
+void spiSampler_Init(void);
+
+#endif  // SPI_SAMPLER_H
@@ -1,26 +1,545 @@
 #include "legato.h"
 #include "interfaces.h"
 #include "spiLibrary.h"
+#include "spiWorker.h"
+#include "spiSampler.h"
+#include "spiCapture.h"
+#include "spiStats.h"
+#include "spiRegmap.h"
+#include "spiProgram.h"
+#include "spiNor.h"
+#include "spiFrame.h"
+#include <sys/mman.h>
 
+// File sealing constants of Linux 3.17, which older C libraries lack
+#ifndef F_GET_SEALS
+#define F_GET_SEALS (1024 + 10)
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+// Maximum number of asynchronous requests that may be queued by one handle
+#define MAX_QUEUED_REQUESTS 16
+// Scheduling cost of a request on top of the bytes it transfers, reflecting the fixed overhead of
+// an ioctl
+#define REQUEST_OVERHEAD_COST 32
+// Size of the buffer holding a bus name
+#define BUS_NAME_BYTES 32
+// Size of the buffer holding a device path
+#define DEVICE_PATH_BYTES 256
+// Size of the buffer holding a profile name
+#define PROFILE_NAME_BYTES 64
+// Maximum number of writes in the init sequence of a profile
+#define PROFILE_MAX_INIT_WRITES 8
+// Bytes of client data a request holds in each direction, enough for any spi or spiFlash call
+#define REQUEST_DATA_BYTES SPIFLASH_MAX_DATA_SIZE
+// Bits of a segment descriptor's flags word which spi.api defines
+#define SEGMENT_KNOWN_FLAGS                                                                \
+    (SPI_SEGMENT_FD | SPI_SEGMENT_CS_CHANGE | SPI_SEGMENT_TX_DUAL | SPI_SEGMENT_TX_QUAD |  \
+     SPI_SEGMENT_RX_DUAL | SPI_SEGMENT_RX_QUAD | (0xFFu << SPI_SEGMENT_BITS_SHIFT))
+
+// An SPI controller.  The devices on a bus share one worker thread, so transfers to devices on
+// the same bus are serialized while transfers on different buses run in parallel.
+typedef struct
+{
+    le_dls_Link_t link;        ///< Link in the list of buses
+    char name[BUS_NAME_BYTES];
+    spiWorker_Ref_t worker;    ///< Thread performing all I/O on the bus
+    size_t numDevices;         ///< Number of open devices on the bus
+} Bus_t;
+
+// An open device file, shared by all of the clients which have opened it.  Apart from the fields
+// set at open, the state of a device is only modified by the worker thread of its bus, so no
+// locking is required.
 typedef struct
 {
-    int fd;
+    le_dls_Link_t link;        ///< Link in the list of open devices
+    char path[DEVICE_PATH_BYTES];
+    int fd;                    ///< Replaced by the worker when the device is recovered
+    int lockFd;                ///< Holds the device's advisory lock, and is never replaced
     ino_t inode;
-    le_msg_SessionRef_t owningSession;
+    size_t maxMessageSize;     ///< Largest message the driver accepts for this device
+    uint32_t widthModes;       ///< SPI_WIDTHS modes the controller supports, probed at open
+    spiLib_Config_t config;    ///< Configuration currently applied to the device
+    spiRegmap_Cache_t registerCache;  ///< Register values cached by the handles' register maps
+    spiNor_State_t norState;   ///< Program or erase in progress, shared by the flash handles
+    Bus_t* bus;                ///< Bus the device is attached to
+    size_t numClients;         ///< Number of open handles on the device
 } Device_t;
 
+// A client's handle on a device.  Each handle has its own configuration, which is applied to the
+// device whenever the bus switches to a request from the handle, and its own request queue.
+typedef struct
+{
+    Device_t* device;
+    le_msg_SessionRef_t owningSession;
+    spiLib_Config_t config;    ///< Configuration requested by the client
+    spiLib_Config_t goodConfig;  ///< Last configuration which applied without error
+    uint32_t configureFailures;  ///< SPI_CONFIG_ bits of settings which failed since Configure
+    uint32_t emulatedSettings;   ///< SPI_CONFIG_ bits of settings done in software
+    uint8_t* sharedBuffer;     ///< Client memory mapped by AttachSharedBuffer or NULL.  Only
+                               ///  used by the main thread; requests hold pointers into it.
+    size_t sharedBufferSize;
+    uint64_t ioctlsAvoided;    ///< Configuration ioctls skipped because the setting was unchanged
+    spiWorker_Flow_t flow;     ///< Queue of the client's requests on the bus worker
+    le_dls_List_t subscriptions;  ///< Samplers started on the handle
+    le_dls_List_t captures;    ///< Captures started on the handle
+    spiStats_t stats;          ///< Updated by the bus worker only
+    spiRegmap_t regmap;        ///< How the handle accesses the device's registers
+    spiFrame_t frame;          ///< How received data is framed, and the CRC checking it
+    le_dls_List_t programs;    ///< Micro-sequence programs loaded for the handle
+    spiLib_Backoff_t pollBackoff;  ///< Spacing of the attempts of polls
+    le_timer_Ref_t burstTimer; ///< Idle timer of the handle's burst, set while one is in progress
+    bool burstExpired;         ///< The burst was ended for being idle and the client isn't told yet
+    uint32_t traceTag;         ///< Identifies the handle's messages in the bus trace
+    bool closing;              ///< Closed, and only waiting for its queued requests to complete
+} Client_t;
+
+// A periodic transaction started by spi_StartSampling.  The segments and buffers are only used
+// by the bus worker thread, which takes the samples.
+typedef struct
+{
+    le_dls_Link_t link;        ///< Link in the handle's list of subscriptions
+    Client_t* client;
+    spi_SamplerHandleRef_t ref;
+    spiSampler_Ref_t sampler;
+    uint32_t periodUsecs;
+    spiLib_Segment_t segments[SPI_MAX_SEGMENTS];
+    size_t numSegments;
+    size_t sampleSize;         ///< Bytes received by the transaction
+    uint8_t writeData[SPI_MAX_WRITE_SIZE];
+    uint8_t readData[SPI_MAX_SAMPLE_SIZE];
+} Subscription_t;
+
+// A capture started by spi_StartCapture.  The segments are parsed against readData, whose only
+// use is to locate the bytes each segment receives within a record.
+typedef struct
+{
+    le_dls_Link_t link;        ///< Link in the handle's list of captures
+    Client_t* client;
+    spi_CaptureHandleRef_t ref;
+    spiCapture_Ref_t capture;
+    uint32_t periodUsecs;
+    spiLib_Segment_t segments[SPI_MAX_SEGMENTS];
+    size_t numSegments;
+    uint8_t writeData[SPI_MAX_WRITE_SIZE];
+    uint8_t readData[SPI_MAX_READ_SIZE];
+} Capture_t;
+
+// A micro-sequence program loaded by spi_LoadProgram
+typedef struct
+{
+    le_dls_Link_t link;        ///< Link in the handle's list of programs
+    Client_t* client;
+    spi_ProgramHandleRef_t ref;
+    spiProgram_t program;
+} Program_t;
+
+// A flash chip opened by spiFlash_Open.  The handle has a client of its own, which isn't in the
+// map of spi handles.
+typedef struct
+{
+    Client_t* client;
+    spiFlash_HandleRef_t ref;  ///< Created at open, but only returned once the chip is probed
+    spiNor_t nor;              ///< Only used by the bus worker thread once probed
+} Flash_t;
+
+typedef struct Request Request_t;
+
+// An operation performed on the worker thread of a device's bus by runOnWorker
+typedef le_result_t (*Operation_t)(Client_t* client, void* args);
+
+// Sends the reply to a request once its operation has been performed.  Runs on the main thread.
+typedef void (*Respond_t)(Request_t* request);
+
+// Sends the reply of a spi call which returns nothing but a result
+typedef void (*ResultRespond_t)(spi_ServerCmdRef_t cmdRef, le_result_t result);
+
+// Arguments of configureOperation
+typedef struct
+{
+    int mode;
+    uint8_t bits;
+    uint32_t speed;
+    int msb;
+} ConfigureArgs_t;
+
+// Arguments of the fixed format transfer operations
+typedef struct
+{
+    const uint8_t* writeData;
+    size_t writeDataLength;
+    uint8_t* readData;
+    size_t* readDataLength;
+} TransferArgs_t;
+
+// Arguments of transactionOperation
+typedef struct
+{
+    const spiLib_Segment_t* segments;
+    size_t numSegments;
+} TransactionArgs_t;
+
+// Arguments of streamOperation
+typedef struct
+{
+    const uint8_t* writeData;
+    uint8_t* readData;
+    size_t length;
+    bool holdCs;
+} StreamArgs_t;
+
+// Arguments of unmapSharedBufferOperation
+typedef struct
+{
+    uint8_t* mapping;
+    size_t size;
+} SharedBufferArgs_t;
+
+// Arguments of setRegisterMapOperation
+typedef struct
+{
+    uint8_t addressBytes;
+    uint32_t readFlag;
+    uint32_t writeFlag;
+    spiRegmap_Range_t volatileRanges[SPI_MAX_VOLATILE_RANGES];
+    size_t numVolatileRanges;
+    bool cache;
+} RegisterMapArgs_t;
+
+// Arguments of setFramingOperation
+typedef struct
+{
+    uint8_t crcWidth;
+    uint32_t polynomial;
+    uint32_t init;
+    uint32_t xorOut;
+    uint32_t flags;
+    size_t frameLength;
+    size_t skipLength;
+    uint8_t retries;
+} FramingArgs_t;
+
+// Arguments of the register access operations
+typedef struct
+{
+    uint32_t address;
+    uint8_t* data;
+    size_t length;
+} RegistersArgs_t;
+
+// Arguments of updateBitsOperation
+typedef struct
+{
+    uint32_t address;
+    uint8_t mask;
+    uint8_t value;
+} UpdateBitsArgs_t;
+
+// Arguments of pollOperation
+typedef struct
+{
+    const uint8_t* command;
+    size_t commandLength;
+    uint8_t mask;
+    uint8_t expected;
+    uint32_t timeoutUsecs;
+    uint8_t* status;
+    uint32_t* elapsedUsecs;
+} PollArgs_t;
+
+// Arguments of runProgramOperation
+typedef struct
+{
+    const spiProgram_t* program;
+    uint8_t* output;
+    size_t* outputLength;
+} RunProgramArgs_t;
+
+// A transaction queued by spi_TransactionAsync or spi_SharedTransactionAsync.  The data is copied
+// into the request so that the client's IPC buffers can be released as soon as it is queued.
+typedef struct
+{
+    spiWorker_Job_t job;
+    spi_DeviceHandleRef_t handle;
+    Client_t* client;
+    spiLib_Segment_t segments[SPI_MAX_SEGMENTS];
+    size_t numSegments;
+    size_t readDataLength;
+    le_result_t result;
+    uint64_t submitUsecs;      ///< When the request was submitted, for the statistics
+    spi_TransactionCompleteHandlerFunc_t handler;              ///< Set for TransactionAsync
+    spi_SharedTransactionCompleteHandlerFunc_t sharedHandler;  ///< Set for SharedTransactionAsync
+    void* context;
+    uint8_t writeData[SPI_MAX_WRITE_SIZE];
+    uint8_t readData[SPI_MAX_READ_SIZE];
+} AsyncRequest_t;
+
+// Arguments of the flash operations
+typedef struct
+{
+    Flash_t* flash;
+    uint32_t address;
+    const uint8_t* writeData;
+    uint8_t* readData;
+    size_t length;
+    uint32_t erasedLength;     ///< [out] Size of the block flashEraseOperation started erasing
+    size_t programmedLength;   ///< [out] Bytes whose pages flashProgramOperation started
+} FlashArgs_t;
+
+// A call whose reply waits for an operation on the worker thread of the device's bus.  The main
+// thread goes on serving other clients while the request waits and runs, and sends the reply from
+// the request's respond function once it is done.  Data sent by the client is copied into the
+// request, since IPC buffers only last as long as the call's handler.
+struct Request
+{
+    spiWorker_Job_t job;
+    Client_t* client;
+    Operation_t operation;
+    void* args;                ///< Arguments for the operation, usually in params
+    le_result_t result;
+    uint64_t submitUsecs;      ///< When the request was submitted, for the statistics
+    bool usesBus;              ///< A failure of the operation may be a fault of the device
+    bool queued;               ///< Submitted and not completed yet
+    Respond_t respond;         ///< Sends the reply, or NULL if there is none to send
+    ResultRespond_t respondResult;  ///< Reply of requests which respondWithResult answers
+    void* cmdRef;              ///< Call to reply to, or NULL for requests the service makes itself
+    void* context;             ///< Object the respond function finishes with
+    union
+    {
+        ConfigureArgs_t configure;
+        TransferArgs_t transfer;
+        TransactionArgs_t transaction;
+        StreamArgs_t stream;
+        SharedBufferArgs_t sharedBuffer;
+        RegisterMapArgs_t registerMap;
+        FramingArgs_t framing;
+        RegistersArgs_t registers;
+        UpdateBitsArgs_t updateBits;
+        PollArgs_t poll;
+        spiLib_Backoff_t backoff;
+        RunProgramArgs_t runProgram;
+        FlashArgs_t flash;
+    } params;
+    spiLib_Segment_t segments[SPI_MAX_SEGMENTS];
+    size_t readDataLength;     ///< Bytes of readData to receive, then to return
+    uint8_t status;            ///< Last status read by a poll
+    uint32_t elapsedUsecs;     ///< Time a poll took
+    uint8_t writeData[REQUEST_DATA_BYTES];
+    uint8_t readData[REQUEST_DATA_BYTES];
+};
+
+// A device profile read from the configuration tree at startup.  The profile's own handle keeps
+// the device open and configured, and spi_OpenProfile gives clients handles with its
+// configuration.
+typedef struct
+{
+    le_dls_Link_t link;        ///< Link in the list of profiles
+    char name[PROFILE_NAME_BYTES];
+    char deviceName[DEVICE_PATH_BYTES];
+    Client_t* client;          ///< Handle owned by the service, NULL if the device isn't open
+    spiWorker_Job_t job;       ///< Prepares the device on the bus worker
+    ConfigureArgs_t config;
+    uint8_t initData[PROFILE_MAX_INIT_WRITES][SPI_MAX_WRITE_SIZE];
+    size_t initLengths[PROFILE_MAX_INIT_WRITES];
+    size_t numInitWrites;
+    le_result_t result;        ///< LE_BUSY until the device is prepared, then the outcome.  Only
+                               ///  accessed on the main thread.
+    le_result_t prepareResult; ///< Outcome of preparing the device on the bus worker, published
+                               ///  to result by completeProfile
+} Profile_t;
 
-static bool isDeviceOwnedByCaller(const Device_t* handle);
-static Device_t const* findDeviceWithInode(ino_t inode);
+
+static le_result_t openClient(
+    const char* deviceName,
+    le_msg_SessionRef_t session,
+    Client_t** clientPtr);
+static void closeHandle(spi_DeviceHandleRef_t handle, Client_t* client, void* cmdRef);
+static void closeClient(Request_t* request);
+static void releaseClient(Client_t* client);
+static le_result_t openDevice(
+    const char* devicePath,
+    const char* deviceName,
+    ino_t inode,
+    Device_t** devicePtr);
+static bool isClientOwnedByCaller(const Client_t* client);
+static Request_t* newRequest(Client_t* client, void* cmdRef, Respond_t respond);
+static Request_t* newResultRequest(
+    Client_t* client,
+    spi_ServerCmdRef_t cmdRef,
+    ResultRespond_t respondResult);
+static void runOnWorker(Request_t* request, Operation_t operation, void* args, size_t cost);
+static void runHousekeepingOnWorker(Request_t* request, Operation_t operation, void* args);
+static void submitRequest(
+    Request_t* request,
+    Operation_t operation,
+    void* args,
+    size_t cost,
+    bool usesBus);
+static void updateBits(
+    spi_ServerCmdRef_t cmdRef,
+    ResultRespond_t respondResult,
+    spi_DeviceHandleRef_t handle,
+    uint32_t address,
+    uint8_t mask,
+    uint8_t value);
+static void runRequest(spiWorker_Job_t* job);
+static void completeRequest(spiWorker_Job_t* job);
+static void completeRefusedRequest(void* param1, void* param2);
+static void finishRequest(Request_t* request);
+static size_t receivedLength(const Request_t* request);
+static void respondWithResult(Request_t* request);
+static void respondClose(Request_t* request);
+static void respondWriteReadHD(Request_t* request);
+static void respondWriteReadFD(Request_t* request);
+static void respondReadHD(Request_t* request);
+static void respondTransaction(Request_t* request);
+static void respondBurstAppend(Request_t* request);
+static void respondPollUntil(Request_t* request);
+static void respondReadRegisters(Request_t* request);
+static void respondInvalidateRegisterCache(Request_t* request);
+static void respondStopSampling(Request_t* request);
+static void respondStopCapture(Request_t* request);
+static void respondRunProgram(Request_t* request);
+static void respondDeleteProgram(Request_t* request);
+static void respondFlashConfigured(Request_t* request);
+static void respondFlashProbed(Request_t* request);
+static void respondFlashClose(Request_t* request);
+static void respondFlashRead(Request_t* request);
+static void respondFlashProgram(Request_t* request);
+static void respondFlashErase(Request_t* request);
+static void respondFlashSync(Request_t* request);
+static le_result_t configureOperation(Client_t* client, void* args);
+static le_result_t writeReadHDOperation(Client_t* client, void* args);
+static le_result_t writeHDOperation(Client_t* client, void* args);
+static le_result_t writeReadFDOperation(Client_t* client, void* args);
+static le_result_t readHDOperation(Client_t* client, void* args);
+static le_result_t transactionOperation(Client_t* client, void* args);
+static le_result_t streamOperation(Client_t* client, void* args);
+static le_result_t beginBurstOperation(Client_t* client, void* args);
+static le_result_t burstAppendOperation(Client_t* client, void* args);
+static le_result_t endBurstOperation(Client_t* client, void* args);
+static le_result_t checkBurst(Client_t* client);
+static le_result_t endBurst(Client_t* client);
+static void burstIdleTimerExpired(le_timer_Ref_t timer);
+static le_result_t unmapSharedBufferOperation(Client_t* client, void* args);
+static le_result_t closeOperation(Client_t* client, void* args);
+static le_result_t barrierOperation(Client_t* client, void* args);
+static le_result_t setPollBackoffOperation(Client_t* client, void* args);
+static le_result_t setRegisterMapOperation(Client_t* client, void* args);
+static le_result_t readRegistersOperation(Client_t* client, void* args);
+static le_result_t writeRegistersOperation(Client_t* client, void* args);
+static le_result_t updateBitsOperation(Client_t* client, void* args);
+static le_result_t pollOperation(Client_t* client, void* args);
+static le_result_t invalidateRegisterCacheOperation(Client_t* client, void* args);
+static le_result_t setFramingOperation(Client_t* client, void* args);
+static le_result_t startSamplingOperation(Client_t* client, void* args);
+static le_result_t stopSamplingOperation(Client_t* client, void* args);
+static le_result_t startCaptureOperation(Client_t* client, void* args);
+static le_result_t stopCaptureOperation(Client_t* client, void* args);
+static le_result_t runProgramOperation(Client_t* client, void* args);
+static le_result_t flashProbeOperation(Client_t* client, void* args);
+static le_result_t flashReadOperation(Client_t* client, void* args);
+static le_result_t flashProgramOperation(Client_t* client, void* args);
+static le_result_t flashEraseOperation(Client_t* client, void* args);
+static le_result_t flashSyncOperation(Client_t* client, void* args);
+static Flash_t* lookupFlash(spiFlash_HandleRef_t handle);
+static bool retryFlashOperation(Request_t* request, Operation_t operation, size_t cost);
+static void closeFlash(Flash_t* flash, spiFlash_ServerCmdRef_t cmdRef);
+static le_result_t takeSample(void* context, uint8_t* sample);
+static void deleteSubscription(Subscription_t* subscription, spi_ServerCmdRef_t cmdRef);
+static le_result_t takeCaptureRecord(void* context, uint8_t* data);
+static void deleteCapture(Capture_t* capture, spi_ServerCmdRef_t cmdRef);
+static void deleteProgram(Program_t* program, spi_ServerCmdRef_t cmdRef);
+static le_result_t submitAsync(Client_t* client, AsyncRequest_t* request, size_t cost);
+static void runAsyncRequest(spiWorker_Job_t* job);
+static void completeAsyncRequest(spiWorker_Job_t* job);
+static le_result_t parseSegments(
+    const uint32_t* descriptors,
+    size_t descriptorsLength,
+    const uint8_t* writeData,
+    size_t* writeDataLength,
+    uint8_t* readData,
+    size_t* readDataLength,
+    spiLib_Segment_t* segments,
+    size_t* numSegments);
+static le_result_t transferResult(le_result_t libResult);
+static le_result_t applyConfig(Client_t* client);
+static void recoverDevice(Client_t* client);
+static uint8_t segmentNbits(uint32_t flags, uint32_t dualFlag, uint32_t quadFlag);
+static size_t segmentBytes(const spiLib_Segment_t* segments, size_t numSegments);
+static void countSegments(
+    Client_t* client,
+    spiStats_TransferType_t type,
+    const spiLib_Segment_t* segments,
+    size_t numSegments,
+    le_result_t result);
+static void exportStats(
+    const spiStats_t* stats,
+    size_t peakQueueDepth,
+    uint64_t* counters,
+    size_t* countersLength,
+    uint64_t* queueWait,
+    size_t* queueWaitLength,
+    uint64_t* busTime,
+    size_t* busTimeLength);
+static void detachSharedBuffer(Client_t* client);
+static Bus_t* acquireBus(const char* deviceName);
+static void releaseBus(Bus_t* bus);
+static Device_t* findDeviceWithInode(ino_t inode);
 static void closeAllHandlesOwnedByClient(le_msg_SessionRef_t owner);
 static void clientSessionClosedHandler(le_msg_SessionRef_t clientSession, void* context);
+static void flashSessionClosedHandler(le_msg_SessionRef_t clientSession, void* context);
+static void configureBackend(void);
+static void loadProfiles(void);
+static le_result_t loadProfile(le_cfg_IteratorRef_t it, Profile_t* profile);
+static void prepareProfile(spiWorker_Job_t* job);
+static void completeProfile(spiWorker_Job_t* job);
+static Profile_t* findProfile(const char* name);
+static void configureTrace(void);
+static void dumpTraceSignalHandler(int sigNum);
 
 static struct
 {
     // Memory pool for allocating devices
     le_mem_PoolRef_t devicePool;
-    // A map of safe references to device objects
+    // Devices opened by at least one client
+    le_dls_List_t devices;
+    // Memory pool for allocating client handles
+    le_mem_PoolRef_t clientPool;
+    // A map of safe references to client handles
     le_ref_MapRef_t deviceHandleRefMap;
+    // Memory pool for allocating requests whose reply waits for the worker
+    le_mem_PoolRef_t requestPool;
+    // Memory pool for allocating asynchronous requests
+    le_mem_PoolRef_t asyncRequestPool;
+    // Memory pool for allocating buses
+    le_mem_PoolRef_t busPool;
+    // Buses with at least one open device
+    le_dls_List_t buses;
+    // Memory pool for allocating sampling subscriptions
+    le_mem_PoolRef_t subscriptionPool;
+    // A map of safe references to sampling subscriptions
+    le_ref_MapRef_t samplerRefMap;
+    // Memory pool for allocating captures
+    le_mem_PoolRef_t capturePool;
+    // A map of safe references to captures
+    le_ref_MapRef_t captureRefMap;
+    // Memory pool for allocating micro-sequence programs
+    le_mem_PoolRef_t programPool;
+    // A map of safe references to micro-sequence programs
+    le_ref_MapRef_t programRefMap;
+    // Memory pool for allocating flash handles
+    le_mem_PoolRef_t flashPool;
+    // A map of safe references to flash handles
+    le_ref_MapRef_t flashRefMap;
+    // Statistics of closed handles and of handles before they were last reset
+    spiStats_t retiredStats;
+    // Deepest queue of any closed handle
+    size_t retiredPeakQueueDepth;
+    // Memory pool for allocating device profiles
+    le_mem_PoolRef_t profilePool;
+    // Device profiles read from the configuration tree
+    le_dls_List_t profiles;
 } g;
 
 //--------------------------------------------------------------------------------------------------
@@ -32,22 +551,104 @@ static struct
  *      - LE_BAD_PARAMETER if the device name string is bad
  *      - LE_NOT_FOUND if the SPI device file could not be found
  *      - LE_NOT_PERMITTED if the SPI device file can't be opened for read/write
- *      - LE_DUPLICATE if the given device file is already opened by another spiService client
+ *      - LE_BUSY if another process is using the device through the library directly
  *      - LE_FAULT for non-specific failures
+ *
+ * @note
+ *      Several clients may open the same device.  Their requests are scheduled by priority and
+ *      weighted fair share (see spi_SetScheduling) and each client's configuration is applied
+ *      whenever the device switches between clients.
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spi_Open
+void spi_Open
 (
-    const char* deviceName,        ///< [in] Name of the device file.  Do not include the "/dev/"
+    spi_ServerCmdRef_t cmdRef,     ///< Call to reply to
+    const char* deviceName         ///< [in] Name of the device file.  Do not include the "/dev/"
                                    ///  prefix.
-    spi_DeviceHandleRef_t* handle  ///< [out] Handle for passing to related functions in order to
-                                   ///  access the SPI device
+)
+{
+    spi_DeviceHandleRef_t handle = NULL;
+    Client_t* client;
+    const le_result_t result = openClient(deviceName, spi_GetClientSessionRef(), &client);
+    if (result == LE_OK)
+    {
+        handle = le_ref_CreateRef(g.deviceHandleRefMap, client);
+        client->traceTag = (uint32_t)(uintptr_t)handle;
+    }
+    spi_OpenRespond(cmdRef, result, handle);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens the device of a profile from the service's configuration.  The device was opened,
+ * configured and initialized when the service started, and the new handle starts with the
+ * profile's configuration, so it can transfer without calling spi_Configure.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_FOUND if there is no such profile
+ *      - LE_BUSY if the profile's device is still being prepared
+ *      - LE_UNAVAILABLE if the profile's device couldn't be opened, configured or initialized
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_OpenProfile
+(
+    spi_ServerCmdRef_t cmdRef,     ///< Call to reply to
+    const char* profileName        ///< [in] Name of the profile
+)
+{
+    const Profile_t* profile = findProfile(profileName);
+    if (profile == NULL)
+    {
+        spi_OpenProfileRespond(cmdRef, LE_NOT_FOUND, NULL);
+        return;
+    }
+    if (profile->result != LE_OK)
+    {
+        spi_OpenProfileRespond(
+            cmdRef, (profile->result == LE_BUSY) ? LE_BUSY : LE_UNAVAILABLE, NULL);
+        return;
+    }
+
+    Client_t* client;
+    if (openClient(profile->deviceName, spi_GetClientSessionRef(), &client) != LE_OK)
+    {
+        spi_OpenProfileRespond(cmdRef, LE_UNAVAILABLE, NULL);
+        return;
+    }
+    // The profile's handle has no requests left, so its configuration is stable.  It is already
+    // applied to the device, so the first transfer of the new handle costs no ioctls.
+    client->config = profile->client->config;
+    client->goodConfig = profile->client->goodConfig;
+    client->emulatedSettings = profile->client->emulatedSettings;
+    spi_DeviceHandleRef_t handle = le_ref_CreateRef(g.deviceHandleRefMap, client);
+    client->traceTag = (uint32_t)(uintptr_t)handle;
+    spi_OpenProfileRespond(cmdRef, LE_OK, handle);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens a device for a new client handle.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the device name string is bad
+ *      - LE_NOT_FOUND if the SPI device file could not be found
+ *      - LE_NOT_PERMITTED if the SPI device file can't be opened for read/write
+ *      - LE_BUSY if another process is using the device through the library directly
+ *      - LE_FAULT for non-specific failures
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t openClient
+(
+    const char* deviceName,        ///< Name of the device file without the "/dev/" prefix
+    le_msg_SessionRef_t session,   ///< Session which owns the handle
+    Client_t** clientPtr           ///< [out] The new handle
 )
 {
     le_result_t result = LE_OK;
-    *handle = NULL;
 
-    char devicePath[256];
+    char devicePath[DEVICE_PATH_BYTES];
     const int snprintfResult = snprintf(devicePath, sizeof(devicePath), "/dev/%s", deviceName);
     if (snprintfResult > (sizeof(devicePath) - 1))
     {
@@ -63,7 +664,7 @@ le_result_t spi_Open
     }
 
     struct stat deviceFileStat;
-    const int statResult = stat(devicePath, &deviceFileStat);
+    const int statResult = spiLib_Stat(devicePath, &deviceFileStat);
     if (statResult != 0)
     {
         if (errno == ENOENT)
@@ -80,48 +681,125 @@ le_result_t spi_Open
         }
         goto resultKnown;
     }
-    Device_t const* foundDevice = findDeviceWithInode(deviceFileStat.st_ino);
-    if (foundDevice != NULL)
+    Device_t* device = findDeviceWithInode(deviceFileStat.st_ino);
+    if (device == NULL)
     {
-        LE_ERROR(
-            "Device file \"%s\" has already been opened by a client with id (%p)",
-            devicePath,
-            foundDevice->owningSession);
-        result = LE_DUPLICATE;
-        goto resultKnown;
+        result = openDevice(devicePath, deviceName, deviceFileStat.st_ino, &device);
+        if (result != LE_OK)
+        {
+            goto resultKnown;
+        }
     }
+    device->numClients++;
+
+    Client_t* client = le_mem_ForceAlloc(g.clientPool);
+    client->device = device;
+    client->owningSession = session;
+    client->config.valid = false;
+    client->goodConfig.valid = false;
+    client->configureFailures = 0;
+    client->emulatedSettings = 0;
+    client->sharedBuffer = NULL;
+    client->sharedBufferSize = 0;
+    client->ioctlsAvoided = 0;
+    spiWorker_InitFlow(&client->flow, MAX_QUEUED_REQUESTS);
+    client->subscriptions = (le_dls_List_t)LE_DLS_LIST_INIT;
+    client->captures = (le_dls_List_t)LE_DLS_LIST_INIT;
+    spiStats_Reset(&client->stats);
+    spiRegmap_Init(&client->regmap, &client->device->registerCache);
+    spiFrame_Init(&client->frame);
+    client->programs = (le_dls_List_t)LE_DLS_LIST_INIT;
+    client->pollBackoff.spinUsecs = SPI_DEFAULT_POLL_SPIN_USECS;
+    client->pollBackoff.minSleepUsecs = SPI_DEFAULT_POLL_MIN_SLEEP_USECS;
+    client->pollBackoff.maxSleepUsecs = SPI_DEFAULT_POLL_MAX_SLEEP_USECS;
+    client->burstTimer = NULL;
+    client->burstExpired = false;
+    client->traceTag = 0;
+    client->closing = false;
+    *clientPtr = client;
+
+resultKnown:
+    return result;
+}
 
-    const int openResult = open(devicePath, O_RDWR);
-    if (openResult < 0)
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens a device file which no client has open yet.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_FOUND if the SPI device file could not be found
+ *      - LE_NOT_PERMITTED if the SPI device file can't be opened for read/write
+ *      - LE_BUSY if another process is using the device through the library directly
+ *      - LE_FAULT for non-specific failures
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t openDevice
+(
+    const char* devicePath,   ///< Path of the device file
+    const char* deviceName,   ///< Name of the device file without the "/dev/" prefix
+    ino_t inode,              ///< Inode of the device file
+    Device_t** devicePtr      ///< [out] The opened device, with no clients
+)
+{
+    // A process driving the device through the library directly has it to itself.  The lock is
+    // held by a descriptor of its own, so that recovery can replace the transfer descriptor
+    // without dropping it.
+    const int lockFd = spiLib_Open(devicePath, O_RDWR);
+    if (lockFd < 0)
     {
         if (errno == ENOENT)
         {
-            result = LE_NOT_FOUND;
+            return LE_NOT_FOUND;
         }
         else if (errno == EACCES)
         {
-            result = LE_NOT_PERMITTED;
-        }
-        else
-        {
-            result = LE_FAULT;
+            return LE_NOT_PERMITTED;
         }
-        goto resultKnown;
+        return LE_FAULT;
     }
 
-    Device_t* newDevice = le_mem_ForceAlloc(g.devicePool);
-    newDevice->fd = openResult;
-    newDevice->inode = deviceFileStat.st_ino;
-    newDevice->owningSession = spi_GetClientSessionRef();
-    *handle = le_ref_CreateRef(g.deviceHandleRefMap, newDevice);
+    const le_result_t lockResult = spiLib_Lock(lockFd);
+    if (lockResult != LE_OK)
+    {
+        LE_ERROR("%s is in use by another process", devicePath);
+        spiLib_Close(lockFd);
+        return lockResult;
+    }
 
-resultKnown:
-    return result;
+    const int fd = spiLib_Open(devicePath, O_RDWR);
+    if (fd < 0)
+    {
+        LE_ERROR("Couldn't open %s: (%m)", devicePath);
+        spiLib_Close(lockFd);
+        return LE_FAULT;
+    }
+
+    Device_t* device = le_mem_ForceAlloc(g.devicePool);
+    device->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+    LE_ASSERT_OK(le_utf8_Copy(device->path, devicePath, sizeof(device->path), NULL));
+    device->fd = fd;
+    device->lockFd = lockFd;
+    device->inode = inode;
+    device->maxMessageSize = spiLib_GetMaxMessageSize();
+    // Probed before any request can use the device, so that the mode changes made while probing
+    // can't disturb a transfer
+    device->widthModes = spiLib_ProbeModes(fd, SPI_SPI_WIDTHS);
+    device->config.valid = false;
+    spiRegmap_InitCache(&device->registerCache);
+    spiNor_InitState(&device->norState);
+    device->bus = acquireBus(deviceName);
+    device->numClients = 0;
+    le_dls_Queue(&g.devices, &device->link);
+
+    *devicePtr = device;
+    return LE_OK;
 }
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Closes the device associated with the given handle and frees the associated resources.
+ * Closes the given handle and frees the associated resources.  The device file is closed once no
+ * client has it open.
  *
  * @note
  *      Once a handle is closed, it is not permitted to use it for future SPI access without first
@@ -130,44 +808,141 @@ resultKnown:
 //--------------------------------------------------------------------------------------------------
 void spi_Close
 (
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
     spi_DeviceHandleRef_t handle  ///< Handle to close
 )
 {
-    Device_t* device = le_ref_Lookup(g.deviceHandleRefMap, handle);
-    if (device == NULL)
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
     {
         LE_KILL_CLIENT("Failed to lookup device from handle!");
         return;
     }
 
-    if (!isDeviceOwnedByCaller(device))
+    if (!isClientOwnedByCaller(client))
     {
         LE_KILL_CLIENT("Cannot close handle as it is not owned by the caller");
         return;
     }
 
+    closeHandle(handle, client, cmdRef);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Closes a spi handle.  The reply, if any, is sent once the handle's queued requests are done.
+ */
+//--------------------------------------------------------------------------------------------------
+static void closeHandle
+(
+    spi_DeviceHandleRef_t handle, ///< Handle to close
+    Client_t* client,             ///< Client of the handle
+    void* cmdRef                  ///< Call to reply to, or NULL if the client has disconnected
+)
+{
     // Remove the handle from the map so it can't be used again
     le_ref_DeleteRef(g.deviceHandleRefMap, handle);
+    closeClient(newRequest(client, cmdRef, respondClose));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Closes a handle once its queued requests are done.  Any samplers, captures, programs and shared
+ * buffer of the handle go with it.  The request's respond function is called once the handle is
+ * closed, and must free it with releaseClient.
+ */
+//--------------------------------------------------------------------------------------------------
+static void closeClient
+(
+    Request_t* request  ///< Request on the handle to close
+)
+{
+    Client_t* client = request->client;
+    client->closing = true;
 
-    int closeResult = close(device->fd);
-    if (closeResult != 0)
+    le_dls_Link_t* link;
+    while ((link = le_dls_Peek(&client->subscriptions)) != NULL)
     {
-        LE_WARN("Couldn't close the fd cleanly: (%m)");
+        deleteSubscription(CONTAINER_OF(link, Subscription_t, link), NULL);
+    }
+    while ((link = le_dls_Peek(&client->captures)) != NULL)
+    {
+        deleteCapture(CONTAINER_OF(link, Capture_t, link), NULL);
+    }
+    while ((link = le_dls_Peek(&client->programs)) != NULL)
+    {
+        deleteProgram(CONTAINER_OF(link, Program_t, link), NULL);
+    }
+    detachSharedBuffer(client);
+
+    // Closing on the worker lets requests which are still queued finish first
+    runHousekeepingOnWorker(request, closeOperation, NULL);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a handle closed by closeClient, and closes its device if no other handle has it open.
+ * Called by the respond function of the request which closed the handle.
+ */
+//--------------------------------------------------------------------------------------------------
+static void releaseClient
+(
+    Client_t* client
+)
+{
+    Device_t* device = client->device;
+    spiStats_Add(&g.retiredStats, &client->stats);
+    const size_t peakQueueDepth = spiWorker_GetPeakQueueDepth(device->bus->worker, &client->flow);
+    if (peakQueueDepth > g.retiredPeakQueueDepth)
+    {
+        g.retiredPeakQueueDepth = peakQueueDepth;
+    }
+    le_mem_Release(client);
+
+    device->numClients--;
+    if (device->numClients == 0)
+    {
+        if (spiLib_Close(device->fd) != 0)
+        {
+            LE_WARN("Couldn't close the fd cleanly: (%m)");
+        }
+        if (spiLib_Close(device->lockFd) != 0)
+        {
+            LE_WARN("Couldn't close the lock fd cleanly: (%m)");
+        }
+        le_dls_Remove(&g.devices, &device->link);
+        releaseBus(device->bus);
+        le_mem_Release(device);
     }
-    le_mem_Release(device);
 }
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Configures an SPI device
+ * Configures an SPI device for this handle.  Only the settings which differ from the
+ * configuration currently applied to the device are written, so repeating a configuration costs
+ * no ioctls.  The configuration is reapplied automatically if another client has changed it.
  *
  * @note
  *      This function should be called before any of the Read/Write functions in order to ensure
- *      that the SPI bus configuration is in a known state.
+ *      that the SPI bus configuration is in a known state.  To change the speed or word size of
+ *      individual transfers, set them on the segments of spi_Transaction instead.
+ *
+ * @return
+ *      - LE_OK on success, including when another handle's burst defers applying the
+ *        configuration until the handle's next transfer
+ *      - LE_UNSUPPORTED if the mode has dual or quad bits which the controller doesn't support
+ *      - LE_FAULT if the driver rejected a setting
+ *
+ * @note
+ *      On failure the handle keeps its last configuration which applied without error, and
+ *      spi_GetConfigureFailures tells which settings failed.  Bits per word and LSB first which
+ *      the controller rejects are done in software rather than failing, as reported by
+ *      spi_GetEmulatedSettings.
  */
 //--------------------------------------------------------------------------------------------------
 void spi_Configure
 (
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
     spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to configure
     int mode,                     ///<
     uint8_t bits,                 ///<
@@ -175,205 +950,4680 @@ void spi_Configure
     int msb                       ///<
 )
 {
-    Device_t* device = le_ref_Lookup(g.deviceHandleRefMap, handle);
-    if (device == NULL)
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
     {
         LE_KILL_CLIENT("Failed to lookup device from handle!");
         return;
     }
 
-    if (!isDeviceOwnedByCaller(device))
+    if (!isClientOwnedByCaller(client))
     {
         LE_KILL_CLIENT("Cannot assign handle to configure as it is not owned by the caller");
+        return;
+    }
+
+    if ((mode & ~(0xFF | SPI_SPI_WIDTHS)) != 0)
+    {
+        LE_KILL_CLIENT("Invalid SPI mode 0x%x", mode);
+        return;
     }
 
-    spiLib_Configure(device->fd, mode, bits, speed, msb);
+    Request_t* request = newResultRequest(client, cmdRef, spi_ConfigureRespond);
+    request->params.configure =
+        (ConfigureArgs_t){ .mode = mode, .bits = bits, .speed = speed, .msb = msb };
+    runHousekeepingOnWorker(request, configureOperation, &request->params.configure);
 }
 
 
 //--------------------------------------------------------------------------------------------------
 /**
- * SPI Half Duplex Write followed by Half Duplex Read
+ * Gets the settings which failed to apply since the handle was last configured.  A setting can
+ * fail when spi_Configure is called, or later if the configuration was deferred by another
+ * handle's burst.
  *
  * @return
- *      LE_OK on success or LE_FAULT on failure.
+ *      Any of SPI_CONFIG_MODE, SPI_CONFIG_BITS, SPI_CONFIG_SPEED and SPI_CONFIG_LSB_FIRST.
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spi_WriteReadHD
+void spi_GetConfigureFailures
 (
-    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write-read on
-    const uint8_t* writeData,     ///< Tx command/address being sent to slave
-    size_t writeDataLength,       ///< Number of bytes in tx message
-    uint8_t* readData,            ///< Rx response from slave
-    size_t* readDataLength        ///< Number of bytes in rx message
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle to query
 )
 {
-    Device_t* device = le_ref_Lookup(g.deviceHandleRefMap, handle);
-    if (device == NULL)
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
     {
         LE_KILL_CLIENT("Failed to lookup device from handle!");
-        return LE_FAULT;
+        return;
     }
 
-    if (!isDeviceOwnedByCaller(device))
+    if (!isClientOwnedByCaller(client))
     {
-        LE_KILL_CLIENT("Cannot assign handle to read as it is not owned by the caller");
-        return LE_FAULT;
+        LE_KILL_CLIENT("Cannot query handle as it is not owned by the caller");
+        return;
     }
 
-    return spiLib_WriteReadHD(
-        device->fd,
-        writeData,
-        writeDataLength,
-        readData,
-        readDataLength) == LE_OK ? LE_OK : LE_FAULT;
+    spi_GetConfigureFailuresRespond(cmdRef, client->configureFailures);
 }
 
 
 //--------------------------------------------------------------------------------------------------
 /**
- * SPI Write for Half Duplex Communication
+ * Gets the settings of the handle's configuration which the controller rejected and which are
+ * done in software instead.
  *
  * @return
- *      LE_OK on success or LE_FAULT on failure.
+ *      Any of SPI_CONFIG_BITS and SPI_CONFIG_LSB_FIRST.
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spi_WriteHD
+void spi_GetEmulatedSettings
 (
-    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write on
-    const uint8_t* writeData,     ///< Command/address being sent to slave
-    size_t writeDataLength        ///< Number of bytes in tx message
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle to query
 )
 {
-    Device_t* device = le_ref_Lookup(g.deviceHandleRefMap, handle);
-    if (device == NULL)
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
     {
         LE_KILL_CLIENT("Failed to lookup device from handle!");
-        return LE_FAULT;
+        return;
     }
 
-    if (!isDeviceOwnedByCaller(device))
+    if (!isClientOwnedByCaller(client))
     {
-        LE_KILL_CLIENT("Cannot assign handle to write  as it is not owned by the caller");
+        LE_KILL_CLIENT("Cannot query handle as it is not owned by the caller");
+        return;
     }
 
-    return spiLib_WriteHD(device->fd, writeData, writeDataLength) == LE_OK ? LE_OK : LE_FAULT;
+    spi_GetEmulatedSettingsRespond(cmdRef, client->emulatedSettings);
 }
 
 
-
 //--------------------------------------------------------------------------------------------------
 /**
- * Simultaneous SPI Write and  Read for full duplex communication
+ * Gets the dual and quad modes which the controller of a handle's device supports.  Callers
+ * should only configure the modes returned, and use single line transfers otherwise.
  *
  * @return
- *      LE_OK on success or LE_FAULT on failure.
+ *      The supported modes out of SPI_TX_DUAL, SPI_TX_QUAD, SPI_RX_DUAL and SPI_RX_QUAD.
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spi_WriteReadFD
+void spi_GetSupportedWidths
 (
-    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write-read on
-    const uint8_t* writeData,     ///< Tx command/address being sent to slave
-    size_t writeDataLength,       ///< Number of bytes in tx message
-    uint8_t* readData,            ///< Rx response from slave
-    size_t *readDataLength        ///< Number of bytes in rx message
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle to query
 )
 {
-    Device_t* device = le_ref_Lookup(g.deviceHandleRefMap, handle);
-    if (device == NULL)
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
     {
         LE_KILL_CLIENT("Failed to lookup device from handle!");
-        return LE_FAULT;
-    }
-
-    if (!isDeviceOwnedByCaller(device))
-    {
-        LE_KILL_CLIENT("Cannot assign handle to read as it is not owned by the caller");
-        return LE_FAULT;
+        return;
     }
 
-    if(*readDataLength < writeDataLength)
+    if (!isClientOwnedByCaller(client))
     {
-        LE_KILL_CLIENT("readData length cannot be less than writeData length");
+        LE_KILL_CLIENT("Cannot query handle as it is not owned by the caller");
+        return;
     }
 
-    return spiLib_WriteReadFD(
-        device->fd,
-        writeData,
-        readData,
-        writeDataLength) == LE_OK ? LE_OK : LE_FAULT;
+    spi_GetSupportedWidthsRespond(cmdRef, client->device->widthModes);
 }
 
+
 //--------------------------------------------------------------------------------------------------
 /**
- * SPI Read for Half Duplex Communication
+ * Sets the priority and weight of a handle.  Requests of handles with a higher priority are
+ * performed before those of any other handle on the same bus; handles of equal priority share the
+ * bus in proportion to their weights.
  *
  * @return
- *      LE_OK on success or LE_FAULT on failure.
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the priority is above SPI_MAX_PRIORITY or the weight is zero
  */
 //--------------------------------------------------------------------------------------------------
-le_result_t spi_ReadHD
+void spi_SetScheduling
 (
-    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write on
-    uint8_t* readData,      ///< Command/address being sent to slave
-    size_t* readDataLength        ///< Number of bytes in tx message
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle to change
+    uint8_t priority,             ///< 0 to SPI_MAX_PRIORITY
+    uint32_t weight               ///< Relative share of the bus
 )
 {
-    Device_t* device = le_ref_Lookup(g.deviceHandleRefMap, handle);
-    if (device == NULL)
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
     {
         LE_KILL_CLIENT("Failed to lookup device from handle!");
-        return LE_FAULT;
+        return;
     }
 
-    if (!isDeviceOwnedByCaller(device))
+    if (!isClientOwnedByCaller(client))
     {
-        LE_KILL_CLIENT("Cannot assign handle to write  as it is not owned by the caller");
+        LE_KILL_CLIENT("Cannot schedule handle as it is not owned by the caller");
+        return;
     }
 
-    return spiLib_ReadHD(device->fd, readData, readDataLength) == LE_OK ? LE_OK : LE_FAULT;
-}
+    if (priority > SPI_MAX_PRIORITY || weight == 0)
+    {
+        spi_SetSchedulingRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    spiWorker_SetFlowScheduling(client->device->bus->worker, &client->flow, priority, weight);
+    spi_SetSchedulingRespond(cmdRef, LE_OK);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the number of configuration ioctls that spi_Configure has skipped for this handle because
+ * the requested setting was already applied.
+ *
+ * @return
+ *      The number of ioctls avoided.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_GetIoctlsAvoided
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle to query
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot query handle as it is not owned by the caller");
+        return;
+    }
+
+    spi_GetIoctlsAvoidedRespond(cmdRef, client->ioctlsAvoided);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the performance statistics of a handle since it was opened or its statistics were reset.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_GetStats
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle to query
+    size_t countersLength,        ///< Number of counters to return
+    size_t queueWaitLength,       ///< Number of queue wait histogram buckets to return
+    size_t busTimeLength          ///< Number of bus time histogram buckets to return
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot query handle as it is not owned by the caller");
+        return;
+    }
+
+    uint64_t counters[SPI_STAT_COUNTERS];
+    uint64_t queueWait[SPISTATS_HISTOGRAM_BUCKETS];
+    uint64_t busTime[SPISTATS_HISTOGRAM_BUCKETS];
+    exportStats(
+        &client->stats,
+        spiWorker_GetPeakQueueDepth(client->device->bus->worker, &client->flow),
+        counters,
+        &countersLength,
+        queueWait,
+        &queueWaitLength,
+        busTime,
+        &busTimeLength);
+    spi_GetStatsRespond(
+        cmdRef, counters, countersLength, queueWait, queueWaitLength, busTime, busTimeLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Zeroes the performance statistics of a handle.  The service wide statistics keep the values.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_ResetStats
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle to reset
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot reset handle as it is not owned by the caller");
+        return;
+    }
+
+    spiWorker_Ref_t worker = client->device->bus->worker;
+    const size_t peakQueueDepth = spiWorker_GetPeakQueueDepth(worker, &client->flow);
+    if (peakQueueDepth > g.retiredPeakQueueDepth)
+    {
+        g.retiredPeakQueueDepth = peakQueueDepth;
+    }
+    spiStats_Add(&g.retiredStats, &client->stats);
+    spiStats_Reset(&client->stats);
+    spiWorker_ResetPeakQueueDepth(worker, &client->flow);
+    spi_ResetStatsRespond(cmdRef);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the performance statistics of all handles, open or closed, since the service started.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_GetServiceStats
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    size_t countersLength,        ///< Number of counters to return
+    size_t queueWaitLength,       ///< Number of queue wait histogram buckets to return
+    size_t busTimeLength          ///< Number of bus time histogram buckets to return
+)
+{
+    spiStats_t total = g.retiredStats;
+    size_t peakQueueDepth = g.retiredPeakQueueDepth;
+
+    le_ref_IterRef_t it = le_ref_GetIterator(g.deviceHandleRefMap);
+    while (le_ref_NextNode(it) == LE_OK)
+    {
+        Client_t* client = le_ref_GetValue(it);
+        LE_ASSERT(client != NULL);
+        spiStats_Add(&total, &client->stats);
+        const size_t clientPeak =
+            spiWorker_GetPeakQueueDepth(client->device->bus->worker, &client->flow);
+        if (clientPeak > peakQueueDepth)
+        {
+            peakQueueDepth = clientPeak;
+        }
+    }
+
+    uint64_t counters[SPI_STAT_COUNTERS];
+    uint64_t queueWait[SPISTATS_HISTOGRAM_BUCKETS];
+    uint64_t busTime[SPISTATS_HISTOGRAM_BUCKETS];
+    exportStats(
+        &total,
+        peakQueueDepth,
+        counters,
+        &countersLength,
+        queueWait,
+        &queueWaitLength,
+        busTime,
+        &busTimeLength);
+    spi_GetServiceStatsRespond(
+        cmdRef, counters, countersLength, queueWait, queueWaitLength, busTime, busTimeLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts or stops recording every message sent to any device in the bus trace.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if payloadBytes is above SPI_BUS_TRACE_MAX_PAYLOAD
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SetBusTrace
+(
+    spi_ServerCmdRef_t cmdRef,  ///< Call to reply to
+    bool enable,                ///< true to record messages
+    uint8_t payloadBytes        ///< Bytes of each direction of the payload to keep
+)
+{
+    spi_SetBusTraceRespond(cmdRef, spiLib_SetBusTrace(enable, payloadBytes));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes the bus trace records made since the last export to a file in pcap format.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if the file couldn't be written
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_ExportBusTrace
+(
+    spi_ServerCmdRef_t cmdRef,  ///< Call to reply to
+    int trace                   ///< File to write, which is closed
+)
+{
+    const le_result_t result = spiLib_ExportBusTrace(trace);
+    close(trace);
+    spi_ExportBusTraceRespond(cmdRef, result);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * SPI Half Duplex Write followed by Half Duplex Read
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the handle has framing and the data received isn't whole frames
+ *      - LE_FORMAT_ERROR if frames of the data received still failed their CRC after every retry
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_WriteReadHD
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write-read on
+    const uint8_t* writeData,     ///< Tx command/address being sent to slave
+    size_t writeDataLength,       ///< Number of bytes in tx message
+    size_t readDataLength         ///< Number of bytes in rx message
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to read as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newRequest(client, cmdRef, respondWriteReadHD);
+    memcpy(request->writeData, writeData, writeDataLength);
+    request->readDataLength = readDataLength;
+    request->params.transfer = (TransferArgs_t)
+    {
+        .writeData = request->writeData,
+        .writeDataLength = writeDataLength,
+        .readData = request->readData,
+        .readDataLength = &request->readDataLength
+    };
+    runOnWorker(
+        request, writeReadHDOperation, &request->params.transfer, writeDataLength + readDataLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * SPI Write for Half Duplex Communication
+ *
+ * @return
+ *      LE_OK on success or LE_FAULT on failure.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_WriteHD
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write on
+    const uint8_t* writeData,     ///< Command/address being sent to slave
+    size_t writeDataLength        ///< Number of bytes in tx message
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to write  as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_WriteHDRespond);
+    memcpy(request->writeData, writeData, writeDataLength);
+    request->params.transfer =
+        (TransferArgs_t){ .writeData = request->writeData, .writeDataLength = writeDataLength };
+    runOnWorker(request, writeHDOperation, &request->params.transfer, writeDataLength);
+}
+
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Simultaneous SPI Write and  Read for full duplex communication
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the handle has framing and the data received isn't whole frames
+ *      - LE_FORMAT_ERROR if frames of the data received still failed their CRC after every retry
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_WriteReadFD
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write-read on
+    const uint8_t* writeData,     ///< Tx command/address being sent to slave
+    size_t writeDataLength,       ///< Number of bytes in tx message
+    size_t readDataLength         ///< Number of bytes in rx message
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to read as it is not owned by the caller");
+        return;
+    }
+
+    if(readDataLength < writeDataLength)
+    {
+        LE_KILL_CLIENT("readData length cannot be less than writeData length");
+        return;
+    }
+
+    Request_t* request = newRequest(client, cmdRef, respondWriteReadFD);
+    memcpy(request->writeData, writeData, writeDataLength);
+    request->readDataLength = writeDataLength;
+    request->params.transfer = (TransferArgs_t)
+    {
+        .writeData = request->writeData,
+        .writeDataLength = writeDataLength,
+        .readData = request->readData,
+        .readDataLength = &request->readDataLength
+    };
+    runOnWorker(request, writeReadFDOperation, &request->params.transfer, writeDataLength);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * SPI Read for Half Duplex Communication
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the handle has framing and the data received isn't whole frames
+ *      - LE_FORMAT_ERROR if frames of the data received still failed their CRC after every retry
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_ReadHD
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the write on
+    size_t readDataLength         ///< Number of bytes in tx message
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to write  as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newRequest(client, cmdRef, respondReadHD);
+    request->readDataLength = readDataLength;
+    request->params.transfer = (TransferArgs_t)
+    {
+        .readData = request->readData,
+        .readDataLength = &request->readDataLength
+    };
+    runOnWorker(request, readHDOperation, &request->params.transfer, readDataLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a sequence of segments as a single SPI message so that a complete register access
+ * pattern costs one IPC round trip and one ioctl.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the segment descriptors don't match the supplied buffers
+ *      - LE_OUT_OF_RANGE if the message is larger than the SPI driver accepts
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_Transaction
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the transaction on
+    const uint32_t* segments,     ///< Segment descriptors as documented in spi.api
+    size_t segmentsLength,        ///< Number of words in segments
+    const uint8_t* writeData,     ///< Tx data for all transmitting segments
+    size_t writeDataLength,       ///< Number of bytes in writeData
+    size_t readDataLength         ///< Capacity of readData
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to transaction as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newRequest(client, cmdRef, respondTransaction);
+    memcpy(request->writeData, writeData, writeDataLength);
+    size_t numSegments;
+    size_t txLength = writeDataLength;
+    request->readDataLength = readDataLength;
+    request->result = parseSegments(
+        segments,
+        segmentsLength,
+        request->writeData,
+        &txLength,
+        request->readData,
+        &request->readDataLength,
+        request->segments,
+        &numSegments);
+    if (request->result == LE_OK && txLength != writeDataLength)
+    {
+        LE_ERROR("Segments transmit %zu bytes but %zu were supplied", txLength, writeDataLength);
+        request->result = LE_BAD_PARAMETER;
+    }
+    if (request->result != LE_OK)
+    {
+        finishRequest(request);
+        return;
+    }
+
+    request->params.transaction =
+        (TransactionArgs_t){ .segments = request->segments, .numSegments = numSegments };
+    runOnWorker(
+        request,
+        transactionOperation,
+        &request->params.transaction,
+        segmentBytes(request->segments, numSegments));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Maps a shared memory region supplied by the client so that SharedTransaction can use it as the
+ * source and destination of transfers.  Any previously attached buffer is detached first.  The
+ * region must be sealed against shrinking, or the client could truncate it and fault the worker
+ * thread in the middle of a transfer.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the region isn't sealed with F_SEAL_SHRINK or is smaller than the
+ *        requested size
+ *      - LE_FAULT if the region could not be mapped
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_AttachSharedBuffer
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle to attach the buffer to
+    int buffer,                   ///< File descriptor of the shared memory region
+    uint32_t size                 ///< Number of bytes of the region to map
+)
+{
+    le_result_t result = LE_OK;
+
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        goto closeBuffer;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot attach buffer to handle as it is not owned by the caller");
+        goto closeBuffer;
+    }
+
+    detachSharedBuffer(client);
+
+    const int seals = fcntl(buffer, F_GET_SEALS);
+    if (seals < 0 || (seals & F_SEAL_SHRINK) == 0)
+    {
+        LE_ERROR("Shared buffer must be a memfd sealed with F_SEAL_SHRINK");
+        result = LE_BAD_PARAMETER;
+        goto done;
+    }
+
+    struct stat bufferStat;
+    if (fstat(buffer, &bufferStat) != 0)
+    {
+        LE_ERROR("Couldn't stat shared buffer: (%m)");
+        result = LE_FAULT;
+        goto done;
+    }
+    if (size == 0 || bufferStat.st_size < size)
+    {
+        LE_ERROR(
+            "Shared buffer of %jd bytes can't provide %u bytes",
+            (intmax_t)bufferStat.st_size,
+            size);
+        result = LE_BAD_PARAMETER;
+        goto done;
+    }
+
+    void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer, 0);
+    if (mapping == MAP_FAILED)
+    {
+        LE_ERROR("Couldn't map shared buffer: (%m)");
+        result = LE_FAULT;
+        goto done;
+    }
+    client->sharedBuffer = mapping;
+    client->sharedBufferSize = size;
+
+done:
+    spi_AttachSharedBufferRespond(cmdRef, result);
+
+closeBuffer:
+    // The mapping keeps the region alive, so the descriptor is no longer needed
+    if (buffer >= 0)
+    {
+        close(buffer);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Unmaps the shared buffer attached to the given handle, if any.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_DetachSharedBuffer
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle to detach the buffer from
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot detach buffer from handle as it is not owned by the caller");
+        return;
+    }
+
+    // Requests which use the buffer can't be queued after this, so there's no need to wait for it
+    // to be unmapped
+    detachSharedBuffer(client);
+    spi_DetachSharedBufferRespond(cmdRef);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a transaction whose tx and rx data live in the attached shared buffer.  The kernel
+ * transfers directly to and from the shared pages so no payload is copied over IPC.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_POSSIBLE if no shared buffer is attached
+ *      - LE_BAD_PARAMETER if the segments don't fit in the shared buffer
+ *      - LE_OUT_OF_RANGE if the message is larger than the SPI driver accepts; use
+ *        spi_SharedStream for long transfers
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SharedTransaction
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the transaction on
+    const uint32_t* segments,     ///< Segment descriptors as documented in spi.api
+    size_t segmentsLength,        ///< Number of words in segments
+    uint32_t writeOffset,         ///< Offset in the shared buffer of the tx data
+    uint32_t readOffset           ///< Offset in the shared buffer for the rx data
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to transaction as it is not owned by the caller");
+        return;
+    }
+
+    if (client->sharedBuffer == NULL)
+    {
+        LE_ERROR("No shared buffer is attached");
+        spi_SharedTransactionRespond(cmdRef, LE_NOT_POSSIBLE);
+        return;
+    }
+    if (writeOffset > client->sharedBufferSize || readOffset > client->sharedBufferSize)
+    {
+        LE_ERROR("Offsets (%u, %u) are outside the shared buffer", writeOffset, readOffset);
+        spi_SharedTransactionRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_SharedTransactionRespond);
+    size_t numSegments;
+    size_t txLength = client->sharedBufferSize - writeOffset;
+    size_t rxLength = client->sharedBufferSize - readOffset;
+    request->result = parseSegments(
+        segments,
+        segmentsLength,
+        &client->sharedBuffer[writeOffset],
+        &txLength,
+        &client->sharedBuffer[readOffset],
+        &rxLength,
+        request->segments,
+        &numSegments);
+    if (request->result != LE_OK)
+    {
+        finishRequest(request);
+        return;
+    }
+
+    request->params.transaction =
+        (TransactionArgs_t){ .segments = request->segments, .numSegments = numSegments };
+    runOnWorker(
+        request,
+        transactionOperation,
+        &request->params.transaction,
+        segmentBytes(request->segments, numSegments));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Transfers an arbitrary amount of data between the device and the attached shared buffer.  The
+ * transfer is split into messages no larger than the driver accepts and performed back to back in
+ * the service so no per-chunk client round trips are needed.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_POSSIBLE if no shared buffer is attached
+ *      - LE_BAD_PARAMETER if the direction is invalid or the data doesn't fit in the shared buffer
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SharedStream
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to stream on
+    uint32_t direction,           ///< SPI_SEGMENT_TX, SPI_SEGMENT_RX or SPI_SEGMENT_FD
+    uint32_t writeOffset,         ///< Offset in the shared buffer of the tx data
+    uint32_t readOffset,          ///< Offset in the shared buffer for the rx data
+    uint32_t length,              ///< Number of bytes to transfer
+    bool holdCs                   ///< Keep chip select asserted for the whole stream
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to stream as it is not owned by the caller");
+        return;
+    }
+
+    if (client->sharedBuffer == NULL)
+    {
+        LE_ERROR("No shared buffer is attached");
+        spi_SharedStreamRespond(cmdRef, LE_NOT_POSSIBLE);
+        return;
+    }
+
+    const bool transmits = (direction & SPI_SEGMENT_TX) != 0;
+    const bool receives = (direction & SPI_SEGMENT_RX) != 0;
+    if ((direction & ~SPI_SEGMENT_FD) != 0 || (!transmits && !receives))
+    {
+        LE_ERROR("Invalid stream direction (0x%x)", direction);
+        spi_SharedStreamRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+    if ((transmits && (writeOffset > client->sharedBufferSize ||
+                       length > client->sharedBufferSize - writeOffset)) ||
+        (receives && (readOffset > client->sharedBufferSize ||
+                      length > client->sharedBufferSize - readOffset)))
+    {
+        LE_ERROR("Stream of %u bytes doesn't fit in the shared buffer", length);
+        spi_SharedStreamRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_SharedStreamRespond);
+    request->params.stream = (StreamArgs_t)
+    {
+        .writeData = transmits ? &client->sharedBuffer[writeOffset] : NULL,
+        .readData = receives ? &client->sharedBuffer[readOffset] : NULL,
+        .length = length,
+        .holdCs = holdCs
+    };
+    runOnWorker(request, streamOperation, &request->params.stream, length);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts a burst, giving the handle the bus to itself until the burst ends.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BUSY if a burst is already in progress on the bus
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_BeginBurst
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle for the SPI master to start the burst on
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to burst as it is not owned by the caller");
+        return;
+    }
+
+    runOnWorker(
+        newResultRequest(client, cmdRef, spi_BeginBurstRespond), beginBurstOperation, NULL, 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Transfers data within a burst, leaving chip select asserted afterwards.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the direction is invalid or the buffers don't match it
+ *      - LE_NOT_PERMITTED if the handle has no burst in progress
+ *      - LE_TIMEOUT if the burst was ended for being idle
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_BurstAppend
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle with a burst in progress
+    uint32_t direction,           ///< SPI_SEGMENT_TX, SPI_SEGMENT_RX or SPI_SEGMENT_FD
+    const uint8_t* writeData,     ///< Tx data
+    size_t writeDataLength,       ///< Number of bytes in writeData
+    size_t readDataLength         ///< Capacity of readData
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to burst as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newRequest(client, cmdRef, respondBurstAppend);
+    StreamArgs_t* args = &request->params.stream;
+    *args = (StreamArgs_t){ .holdCs = true };
+    switch (direction)
+    {
+        case SPI_SEGMENT_TX:
+            args->writeData = request->writeData;
+            args->length = writeDataLength;
+            break;
+
+        case SPI_SEGMENT_RX:
+            args->readData = request->readData;
+            args->length = readDataLength;
+            break;
+
+        case SPI_SEGMENT_FD:
+            if (readDataLength < writeDataLength)
+            {
+                LE_ERROR("Read buffer is smaller than the write data");
+                request->result = LE_BAD_PARAMETER;
+                finishRequest(request);
+                return;
+            }
+            args->writeData = request->writeData;
+            args->readData = request->readData;
+            args->length = writeDataLength;
+            break;
+
+        default:
+            LE_ERROR("Invalid burst direction (0x%x)", direction);
+            request->result = LE_BAD_PARAMETER;
+            finishRequest(request);
+            return;
+    }
+
+    memcpy(request->writeData, writeData, writeDataLength);
+    request->readDataLength = (args->readData != NULL) ? args->length : 0;
+    runOnWorker(request, burstAppendOperation, args, args->length);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Transfers data between the device and the attached shared buffer within a burst, leaving chip
+ * select asserted afterwards.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_POSSIBLE if no shared buffer is attached
+ *      - LE_BAD_PARAMETER if the direction is invalid or the data doesn't fit in the shared buffer
+ *      - LE_NOT_PERMITTED if the handle has no burst in progress
+ *      - LE_TIMEOUT if the burst was ended for being idle
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SharedBurstAppend
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle with a burst in progress
+    uint32_t direction,           ///< SPI_SEGMENT_TX, SPI_SEGMENT_RX or SPI_SEGMENT_FD
+    uint32_t writeOffset,         ///< Offset in the shared buffer of the tx data
+    uint32_t readOffset,          ///< Offset in the shared buffer for the rx data
+    uint32_t length               ///< Number of bytes to transfer
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to burst as it is not owned by the caller");
+        return;
+    }
+
+    if (client->sharedBuffer == NULL)
+    {
+        LE_ERROR("No shared buffer is attached");
+        spi_SharedBurstAppendRespond(cmdRef, LE_NOT_POSSIBLE);
+        return;
+    }
+
+    const bool transmits = (direction & SPI_SEGMENT_TX) != 0;
+    const bool receives = (direction & SPI_SEGMENT_RX) != 0;
+    if ((direction & ~SPI_SEGMENT_FD) != 0 || (!transmits && !receives))
+    {
+        LE_ERROR("Invalid burst direction (0x%x)", direction);
+        spi_SharedBurstAppendRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+    if ((transmits && (writeOffset > client->sharedBufferSize ||
+                       length > client->sharedBufferSize - writeOffset)) ||
+        (receives && (readOffset > client->sharedBufferSize ||
+                      length > client->sharedBufferSize - readOffset)))
+    {
+        LE_ERROR("Burst of %u bytes doesn't fit in the shared buffer", length);
+        spi_SharedBurstAppendRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_SharedBurstAppendRespond);
+    request->params.stream = (StreamArgs_t)
+    {
+        .writeData = transmits ? &client->sharedBuffer[writeOffset] : NULL,
+        .readData = receives ? &client->sharedBuffer[readOffset] : NULL,
+        .length = length,
+        .holdCs = true
+    };
+    runOnWorker(request, burstAppendOperation, &request->params.stream, length);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Ends a burst, releasing chip select and the bus.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_PERMITTED if the handle has no burst in progress
+ *      - LE_TIMEOUT if the burst was already ended for being idle
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_EndBurst
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle with a burst in progress
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to burst as it is not owned by the caller");
+        return;
+    }
+
+    runOnWorker(
+        newResultRequest(client, cmdRef, spi_EndBurstRespond), endBurstOperation, NULL, 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Queues a transaction to be performed by the worker thread of the device's bus.  The handler is
+ * called with the result and the received data once the transaction has been performed.
+ * Transactions on a handle are performed in the order they are queued, together with the handle's
+ * other calls.
+ *
+ * @return
+ *      - LE_OK if the transaction was queued
+ *      - LE_BAD_PARAMETER if the segment descriptors don't match the supplied buffers
+ *      - LE_BUSY if the handle already has the maximum number of queued transactions
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_TransactionAsync
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the transaction on
+    const uint32_t* segments,     ///< Segment descriptors as documented in spi.api
+    size_t segmentsLength,        ///< Number of words in segments
+    const uint8_t* writeData,     ///< Tx data for all transmitting segments
+    size_t writeDataLength,       ///< Number of bytes in writeData
+    spi_TransactionCompleteHandlerFunc_t handler, ///< Called when the transaction is complete
+    void* context                 ///< Passed to the handler
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to transaction as it is not owned by the caller");
+        return;
+    }
+
+    AsyncRequest_t* request = le_mem_ForceAlloc(g.asyncRequestPool);
+    memcpy(request->writeData, writeData, writeDataLength);
+
+    size_t txLength = writeDataLength;
+    request->readDataLength = sizeof(request->readData);
+    const le_result_t parseResult = parseSegments(
+        segments,
+        segmentsLength,
+        request->writeData,
+        &txLength,
+        request->readData,
+        &request->readDataLength,
+        request->segments,
+        &request->numSegments);
+    if (parseResult != LE_OK || txLength != writeDataLength)
+    {
+        le_mem_Release(request);
+        spi_TransactionAsyncRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    request->handle = handle;
+    request->handler = handler;
+    request->sharedHandler = NULL;
+    request->context = context;
+    spi_TransactionAsyncRespond(cmdRef,
+        submitAsync(client, request, segmentBytes(request->segments, request->numSegments)));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Queues a transaction on the attached shared buffer to be performed by the worker thread of
+ * the device's bus.  The shared buffer regions used must not be modified until the handler is
+ * called.
+ *
+ * @return
+ *      - LE_OK if the transaction was queued
+ *      - LE_NOT_POSSIBLE if no shared buffer is attached
+ *      - LE_BAD_PARAMETER if the segments don't fit in the shared buffer
+ *      - LE_BUSY if the handle already has the maximum number of queued transactions
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SharedTransactionAsync
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master to perform the transaction on
+    const uint32_t* segments,     ///< Segment descriptors as documented in spi.api
+    size_t segmentsLength,        ///< Number of words in segments
+    uint32_t writeOffset,         ///< Offset in the shared buffer of the tx data
+    uint32_t readOffset,          ///< Offset in the shared buffer for the rx data
+    spi_SharedTransactionCompleteHandlerFunc_t handler, ///< Called when the transaction is done
+    void* context                 ///< Passed to the handler
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to transaction as it is not owned by the caller");
+        return;
+    }
+
+    if (client->sharedBuffer == NULL)
+    {
+        LE_ERROR("No shared buffer is attached");
+        spi_SharedTransactionAsyncRespond(cmdRef, LE_NOT_POSSIBLE);
+        return;
+    }
+    if (writeOffset > client->sharedBufferSize || readOffset > client->sharedBufferSize)
+    {
+        LE_ERROR("Offsets (%u, %u) are outside the shared buffer", writeOffset, readOffset);
+        spi_SharedTransactionAsyncRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    AsyncRequest_t* request = le_mem_ForceAlloc(g.asyncRequestPool);
+    size_t txLength = client->sharedBufferSize - writeOffset;
+    request->readDataLength = client->sharedBufferSize - readOffset;
+    const le_result_t parseResult = parseSegments(
+        segments,
+        segmentsLength,
+        &client->sharedBuffer[writeOffset],
+        &txLength,
+        &client->sharedBuffer[readOffset],
+        &request->readDataLength,
+        request->segments,
+        &request->numSegments);
+    if (parseResult != LE_OK)
+    {
+        le_mem_Release(request);
+        spi_SharedTransactionAsyncRespond(cmdRef, parseResult);
+        return;
+    }
+
+    request->readDataLength = 0;
+    request->handle = handle;
+    request->handler = NULL;
+    request->sharedHandler = handler;
+    request->context = context;
+    spi_SharedTransactionAsyncRespond(cmdRef,
+        submitAsync(client, request, segmentBytes(request->segments, request->numSegments)));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets how the attempts of a handle's polls are spaced out.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if minSleepUsecs is 0 or greater than maxSleepUsecs
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SetPollBackoff
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle to change
+    uint32_t spinUsecs,           ///< Time to poll without sleeping
+    uint32_t minSleepUsecs,       ///< First sleep after the spin
+    uint32_t maxSleepUsecs        ///< Longest sleep
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot change handle as it is not owned by the caller");
+        return;
+    }
+
+    if (minSleepUsecs == 0 || minSleepUsecs > maxSleepUsecs)
+    {
+        spi_SetPollBackoffRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_SetPollBackoffRespond);
+    request->params.backoff.spinUsecs = spinUsecs;
+    request->params.backoff.minSleepUsecs = minSleepUsecs;
+    request->params.backoff.maxSleepUsecs = maxSleepUsecs;
+    runHousekeepingOnWorker(request, setPollBackoffOperation, &request->params.backoff);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Polls a status byte inside the service until the device is ready.
+ *
+ * @return
+ *      - LE_OK once the device is ready
+ *      - LE_TIMEOUT if it didn't become ready in time
+ *      - LE_OUT_OF_RANGE if the timeout is over SPI_MAX_POLL_TIMEOUT_USECS
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_PollUntil
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master of the device
+    const uint8_t* command,       ///< Command which makes the device return its status
+    size_t commandLength,         ///< Number of bytes in command
+    uint8_t mask,                 ///< Status bits to compare
+    uint8_t expected,             ///< Value of the masked status bits when ready
+    uint32_t timeoutUsecs         ///< Time to keep polling for
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to poll as it is not owned by the caller");
+        return;
+    }
+
+    if (timeoutUsecs > SPI_MAX_POLL_TIMEOUT_USECS)
+    {
+        spi_PollUntilRespond(cmdRef, LE_OUT_OF_RANGE, 0, 0);
+        return;
+    }
+
+    Request_t* request = newRequest(client, cmdRef, respondPollUntil);
+    memcpy(request->writeData, command, commandLength);
+    request->status = 0;
+    request->elapsedUsecs = 0;
+    request->params.poll = (PollArgs_t)
+    {
+        .command = request->writeData,
+        .commandLength = commandLength,
+        .mask = mask,
+        .expected = expected,
+        .timeoutUsecs = timeoutUsecs,
+        .status = &request->status,
+        .elapsedUsecs = &request->elapsedUsecs
+    };
+    runOnWorker(request, pollOperation, &request->params.poll, commandLength + 1);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Describes how the registers of a handle's device are addressed and whether they are cached.
+ * Any cached values are discarded.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the address width is unsupported, a flag doesn't fit in the command
+ *        or a range is malformed
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SetRegisterMap
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_DeviceHandleRef_t handle,     ///< Handle for the SPI master of the device
+    uint8_t addressBytes,             ///< Bytes of address in each command
+    uint32_t readFlag,                ///< ORed into the command of reads
+    uint32_t writeFlag,               ///< ORed into the command of writes
+    const uint32_t* volatileRanges,   ///< Pairs of first and last addresses never to cache
+    size_t volatileRangesLength,      ///< Number of words in volatileRanges
+    bool cache                        ///< Cache the registers outside the volatile ranges
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to register map as it is not owned by the caller");
+        return;
+    }
+
+    if ((volatileRangesLength % 2) != 0)
+    {
+        LE_ERROR("Volatile ranges must be pairs of addresses");
+        spi_SetRegisterMapRespond(cmdRef, LE_BAD_PARAMETER);
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_SetRegisterMapRespond);
+    RegisterMapArgs_t* args = &request->params.registerMap;
+    *args = (RegisterMapArgs_t)
+    {
+        .addressBytes = addressBytes,
+        .readFlag = readFlag,
+        .writeFlag = writeFlag,
+        .numVolatileRanges = volatileRangesLength / 2,
+        .cache = cache
+    };
+    for (size_t i = 0; i < args->numVolatileRanges; i++)
+    {
+        args->volatileRanges[i].first = volatileRanges[2 * i];
+        args->volatileRanges[i].last = volatileRanges[(2 * i) + 1];
+    }
+    runHousekeepingOnWorker(request, setRegisterMapOperation, args);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads consecutive registers, from the cache if they are all cached.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the registers go beyond the largest address of the register map
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_ReadRegisters
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master of the device
+    uint32_t address,             ///< Address of the first register
+    size_t dataLength             ///< Number of registers to read
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to register read as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newRequest(client, cmdRef, respondReadRegisters);
+    request->readDataLength = dataLength;
+    request->params.registers =
+        (RegistersArgs_t){ .address = address, .data = request->readData, .length = dataLength };
+    runOnWorker(request, readRegistersOperation, &request->params.registers, dataLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes consecutive registers.  The write goes to the device and updates the cache.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the registers go beyond the largest address of the register map
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_WriteRegisters
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master of the device
+    uint32_t address,             ///< Address of the first register
+    const uint8_t* data,          ///< Values to write
+    size_t dataLength             ///< Number of registers to write
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to register write as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_WriteRegistersRespond);
+    memcpy(request->writeData, data, dataLength);
+    request->params.registers =
+        (RegistersArgs_t){ .address = address, .data = request->writeData, .length = dataLength };
+    runOnWorker(request, writeRegistersOperation, &request->params.registers, dataLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Changes the bits of a register selected by a mask, with the read and the write back to back on
+ * the bus.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the register is beyond the largest address of the register map
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_UpdateBits
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master of the device
+    uint32_t address,             ///< Address of the register
+    uint8_t mask,                 ///< Bits to change
+    uint8_t value                 ///< New values of the bits in mask
+)
+{
+    updateBits(cmdRef, spi_UpdateBitsRespond, handle, address, mask, value);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets bits of a register, with the read and the write back to back on the bus.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the register is beyond the largest address of the register map
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SetBits
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master of the device
+    uint32_t address,             ///< Address of the register
+    uint8_t bits                  ///< Bits to set
+)
+{
+    updateBits(cmdRef, spi_SetBitsRespond, handle, address, bits, bits);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Clears bits of a register, with the read and the write back to back on the bus.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the register is beyond the largest address of the register map
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_ClearBits
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master of the device
+    uint32_t address,             ///< Address of the register
+    uint8_t bits                  ///< Bits to clear
+)
+{
+    updateBits(cmdRef, spi_ClearBitsRespond, handle, address, bits, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Discards all register values cached for a handle's device.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_InvalidateRegisterCache
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle for the SPI master of the device
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot invalidate handle as it is not owned by the caller");
+        return;
+    }
+
+    runHousekeepingOnWorker(
+        newRequest(client, cmdRef, respondInvalidateRegisterCache),
+        invalidateRegisterCacheOperation,
+        NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the register cache counters of a handle.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_GetRegisterCacheStats
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle  ///< Handle to query
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot query handle as it is not owned by the caller");
+        return;
+    }
+
+    // The counters are the handle's own and only read with atomic loads, so unlike the cached
+    // values, which belong to the device and are only touched by the worker, they can be read here
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t savedUsecs;
+    spiRegmap_GetCacheStats(&client->regmap, &hits, &misses, &savedUsecs);
+    spi_GetRegisterCacheStatsRespond(cmdRef, hits, misses, savedUsecs);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sets how the device frames the data it sends, so that the service checks the CRC of every
+ * frame received by spi_ReadHD, spi_WriteReadHD and spi_WriteReadFD, and repeats transfers whose
+ * frames fail instead of the client making another round trip.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the width isn't 0, 8, 16 or 32, a flag is unknown, a frame doesn't
+ *        have room for its CRC or there are more than SPI_FRAME_MAX_RETRIES retries
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_SetFraming
+(
+    spi_ServerCmdRef_t cmdRef,    ///< Call to reply to
+    spi_DeviceHandleRef_t handle, ///< Handle for the SPI master of the device
+    uint8_t crcWidth,             ///< 8, 16 or 32 bits, or 0 to stop checking received data
+    uint32_t polynomial,          ///< CRC polynomial, MSB first without its top bit
+    uint32_t init,                ///< CRC register before the first byte
+    uint32_t xorOut,              ///< XORed into the CRC after the last byte
+    uint32_t flags,               ///< SPI_FRAME_ flags
+    uint32_t frameLength,         ///< Bytes of each frame including its CRC, or 0 for one frame
+    uint32_t skipLength,          ///< Bytes at the start of the received data which aren't framed
+    uint8_t retries               ///< Times to repeat a transfer whose frames fail their check
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to framing as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, spi_SetFramingRespond);
+    request->params.framing = (FramingArgs_t)
+    {
+        .crcWidth = crcWidth,
+        .polynomial = polynomial,
+        .init = init,
+        .xorOut = xorOut,
+        .flags = flags,
+        .frameLength = frameLength,
+        .skipLength = skipLength,
+        .retries = retries
+    };
+    runHousekeepingOnWorker(request, setFramingOperation, &request->params.framing);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts performing a transaction periodically from a timer on the worker thread of the device's
+ * bus.  The bytes received by each transaction are buffered until read with spi_ReadSamples, so a
+ * client can collect many samples with a single call.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the segments are malformed or receive no data or more than
+ *        SPI_MAX_SAMPLE_SIZE bytes
+ *      - LE_OUT_OF_RANGE if the period is below SPI_MIN_SAMPLE_PERIOD_USECS or the capacity is
+ *        zero or the samples don't fit in the sample buffer
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_StartSampling
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_DeviceHandleRef_t handle,     ///< Handle for the SPI master to sample
+    const uint32_t* segments,         ///< Segment descriptors as documented in spi.api
+    size_t segmentsLength,            ///< Number of words in segments
+    const uint8_t* writeData,         ///< Tx data for all transmitting segments
+    size_t writeDataLength,           ///< Number of bytes in writeData
+    uint32_t periodUsecs,             ///< Time between samples
+    uint32_t capacity                 ///< Number of samples to buffer
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to sampling as it is not owned by the caller");
+        return;
+    }
+
+    if (periodUsecs < SPI_MIN_SAMPLE_PERIOD_USECS)
+    {
+        LE_ERROR("Sample period of %u usecs is too short", periodUsecs);
+        spi_StartSamplingRespond(cmdRef, LE_OUT_OF_RANGE, NULL);
+        return;
+    }
+
+    Subscription_t* subscription = le_mem_ForceAlloc(g.subscriptionPool);
+    memcpy(subscription->writeData, writeData, writeDataLength);
+    size_t txLength = writeDataLength;
+    size_t rxLength = sizeof(subscription->readData);
+    const le_result_t parseResult = parseSegments(
+        segments,
+        segmentsLength,
+        subscription->writeData,
+        &txLength,
+        subscription->readData,
+        &rxLength,
+        subscription->segments,
+        &subscription->numSegments);
+    if (parseResult != LE_OK)
+    {
+        le_mem_Release(subscription);
+        spi_StartSamplingRespond(cmdRef, parseResult, NULL);
+        return;
+    }
+    if (txLength != writeDataLength || rxLength == 0)
+    {
+        LE_ERROR("Sampling transaction must use all of the write data and receive data");
+        le_mem_Release(subscription);
+        spi_StartSamplingRespond(cmdRef, LE_BAD_PARAMETER, NULL);
+        return;
+    }
+    if (capacity == 0 ||
+        capacity > SPI_MAX_BUFFERED_SAMPLES ||
+        capacity * rxLength > SPI_SAMPLE_BUFFER_BYTES)
+    {
+        LE_ERROR("Can't buffer %u samples of %zu bytes", capacity, rxLength);
+        le_mem_Release(subscription);
+        spi_StartSamplingRespond(cmdRef, LE_OUT_OF_RANGE, NULL);
+        return;
+    }
+
+    subscription->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+    subscription->client = client;
+    subscription->periodUsecs = periodUsecs;
+    subscription->sampleSize = rxLength;
+    subscription->sampler = spiSampler_Create(rxLength, capacity, takeSample, subscription);
+    subscription->ref = le_ref_CreateRef(g.samplerRefMap, subscription);
+    le_dls_Queue(&client->subscriptions, &subscription->link);
+
+    runHousekeepingOnWorker(newRequest(client, NULL, NULL), startSamplingOperation, subscription);
+    spi_StartSamplingRespond(cmdRef, LE_OK, subscription->ref);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Removes buffered samples, oldest first.  As many samples are returned as fit in both readData
+ * and timestamps.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_ReadSamples
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_SamplerHandleRef_t sampler,   ///< Sampler to read
+    size_t timestampsLength,          ///< Capacity of timestamps
+    size_t readDataLength             ///< Capacity of readData
+)
+{
+    Subscription_t* subscription = le_ref_Lookup(g.samplerRefMap, sampler);
+    if (subscription == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup sampler from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(subscription->client))
+    {
+        LE_KILL_CLIENT("Cannot read sampler as it is not owned by the caller");
+        return;
+    }
+
+    size_t maxSamples = readDataLength / subscription->sampleSize;
+    if (timestampsLength < maxSamples)
+    {
+        maxSamples = timestampsLength;
+    }
+
+    uint64_t timestamps[SPI_MAX_SAMPLES_PER_READ];
+    uint8_t readData[SPI_MAX_READ_SIZE];
+    uint32_t dropped;
+    uint32_t failed;
+    const size_t numSamples = spiSampler_Read(
+        subscription->sampler, timestamps, readData, maxSamples, &dropped, &failed);
+    spi_ReadSamplesRespond(
+        cmdRef,
+        timestamps,
+        numSamples,
+        readData,
+        numSamples * subscription->sampleSize,
+        dropped,
+        failed);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops sampling and discards any samples which haven't been read.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_StopSampling
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_SamplerHandleRef_t sampler    ///< Sampler to stop
+)
+{
+    Subscription_t* subscription = le_ref_Lookup(g.samplerRefMap, sampler);
+    if (subscription == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup sampler from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(subscription->client))
+    {
+        LE_KILL_CLIENT("Cannot stop sampler as it is not owned by the caller");
+        return;
+    }
+
+    deleteSubscription(subscription, cmdRef);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts performing a transaction periodically from a timer on the worker thread of the device's
+ * bus, storing the bytes received in a ring of records in a client supplied file.  The records go
+ * straight from the driver into the mapped file, so the client only polls the file.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the segments are malformed or receive no data, or the file is smaller
+ *        than size
+ *      - LE_OUT_OF_RANGE if the period is below SPI_MIN_SAMPLE_PERIOD_USECS or size leaves no room
+ *        for a record
+ *      - LE_FAULT if the file could not be mapped
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_StartCapture
+(
+    spi_ServerCmdRef_t cmdRef,          ///< Call to reply to
+    spi_DeviceHandleRef_t handle,       ///< Handle for the SPI master to capture from
+    const uint32_t* segments,           ///< Segment descriptors as documented in spi.api
+    size_t segmentsLength,              ///< Number of words in segments
+    const uint8_t* writeData,           ///< Tx data for all transmitting segments
+    size_t writeDataLength,             ///< Number of bytes in writeData
+    uint32_t periodUsecs,               ///< Time between records
+    int ring,                           ///< File descriptor of the file to store records in
+    uint32_t size                       ///< Number of bytes of the file to use
+)
+{
+    le_result_t result = LE_OK;
+    spi_CaptureHandleRef_t captureRef = NULL;
+
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        goto closeRing;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to capture as it is not owned by the caller");
+        goto closeRing;
+    }
+
+    if (periodUsecs < SPI_MIN_SAMPLE_PERIOD_USECS)
+    {
+        LE_ERROR("Capture period of %u usecs is too short", periodUsecs);
+        result = LE_OUT_OF_RANGE;
+        goto done;
+    }
+
+    Capture_t* capture = le_mem_ForceAlloc(g.capturePool);
+    memcpy(capture->writeData, writeData, writeDataLength);
+    size_t txLength = writeDataLength;
+    size_t rxLength = sizeof(capture->readData);
+    result = parseSegments(
+        segments,
+        segmentsLength,
+        capture->writeData,
+        &txLength,
+        capture->readData,
+        &rxLength,
+        capture->segments,
+        &capture->numSegments);
+    if (result == LE_OK && (txLength != writeDataLength || rxLength == 0))
+    {
+        LE_ERROR("Capture transaction must use all of the write data and receive data");
+        result = LE_BAD_PARAMETER;
+    }
+    if (result == LE_OK)
+    {
+        result = spiCapture_Create(
+            ring, size, rxLength, takeCaptureRecord, capture, &capture->capture);
+    }
+    if (result != LE_OK)
+    {
+        le_mem_Release(capture);
+        goto done;
+    }
+
+    capture->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+    capture->client = client;
+    capture->periodUsecs = periodUsecs;
+    capture->ref = le_ref_CreateRef(g.captureRefMap, capture);
+    le_dls_Queue(&client->captures, &capture->link);
+
+    runHousekeepingOnWorker(newRequest(client, NULL, NULL), startCaptureOperation, capture);
+    captureRef = capture->ref;
+
+done:
+    spi_StartCaptureRespond(cmdRef, result, captureRef);
+
+closeRing:
+    // The mapping keeps the file alive, so the descriptor is no longer needed
+    if (ring >= 0)
+    {
+        close(ring);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the number of records a capture has stored and lost so far.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_GetCaptureStatus
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_CaptureHandleRef_t handle     ///< Capture to query
+)
+{
+    Capture_t* capture = le_ref_Lookup(g.captureRefMap, handle);
+    if (capture == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup capture from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(capture->client))
+    {
+        LE_KILL_CLIENT("Cannot query capture as it is not owned by the caller");
+        return;
+    }
+
+    uint64_t records;
+    uint64_t dropped;
+    uint64_t overruns;
+    uint64_t failed;
+    spiCapture_GetStatus(capture->capture, &records, &dropped, &overruns, &failed);
+    spi_GetCaptureStatusRespond(cmdRef, records, dropped, overruns, failed);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops a capture and unmaps its file.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_StopCapture
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_CaptureHandleRef_t handle     ///< Capture to stop
+)
+{
+    Capture_t* capture = le_ref_Lookup(g.captureRefMap, handle);
+    if (capture == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup capture from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(capture->client))
+    {
+        LE_KILL_CLIENT("Cannot stop capture as it is not owned by the caller");
+        return;
+    }
+
+    deleteCapture(capture, cmdRef);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Validates a micro-sequence program and stores it for the handle.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the program is malformed
+ *      - LE_NO_MEMORY if the handle already has SPI_MAX_PROGRAMS programs
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_LoadProgram
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_DeviceHandleRef_t handle,     ///< Handle for the SPI master the program runs on
+    const uint32_t* code,             ///< Instructions as documented in spi.api
+    size_t codeLength,                ///< Number of words in code
+    const uint8_t* data,              ///< Bytes transmitted by the instructions
+    size_t dataLength                 ///< Number of bytes in data
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to program as it is not owned by the caller");
+        return;
+    }
+
+    // Programs are large, so one client mustn't be able to grow the pool without bound
+    if (le_dls_NumLinks(&client->programs) >= SPI_MAX_PROGRAMS)
+    {
+        LE_ERROR("Handle already has %d programs", SPI_MAX_PROGRAMS);
+        spi_LoadProgramRespond(cmdRef, LE_NO_MEMORY, NULL);
+        return;
+    }
+
+    Program_t* newProgram = le_mem_ForceAlloc(g.programPool);
+    const le_result_t result =
+        spiProgram_Load(&newProgram->program, code, codeLength, data, dataLength);
+    if (result != LE_OK)
+    {
+        le_mem_Release(newProgram);
+        spi_LoadProgramRespond(cmdRef, result, NULL);
+        return;
+    }
+
+    newProgram->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+    newProgram->client = client;
+    newProgram->ref = le_ref_CreateRef(g.programRefMap, newProgram);
+    le_dls_Queue(&client->programs, &newProgram->link);
+
+    spi_LoadProgramRespond(cmdRef, LE_OK, newProgram->ref);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs a micro-sequence program on the worker thread of its device's bus.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OVERFLOW if the program received more than fits in the output
+ *      - LE_TIMEOUT if a poll ran out of attempts or the program ran for too many steps or too
+ *        long
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_RunProgram
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_ProgramHandleRef_t program,   ///< Program to run
+    size_t outputLength               ///< Capacity of output
+)
+{
+    Program_t* programPtr = le_ref_Lookup(g.programRefMap, program);
+    if (programPtr == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup program from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(programPtr->client))
+    {
+        LE_KILL_CLIENT("Cannot run program as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newRequest(programPtr->client, cmdRef, respondRunProgram);
+    request->readDataLength = outputLength;
+    request->params.runProgram = (RunProgramArgs_t)
+    {
+        .program = &programPtr->program,
+        .output = request->readData,
+        .outputLength = &request->readDataLength
+    };
+    runOnWorker(
+        request,
+        runProgramOperation,
+        &request->params.runProgram,
+        spiProgram_GetCost(&programPtr->program));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Deletes a micro-sequence program.
+ */
+//--------------------------------------------------------------------------------------------------
+void spi_DeleteProgram
+(
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    spi_ProgramHandleRef_t program    ///< Program to delete
+)
+{
+    Program_t* programPtr = le_ref_Lookup(g.programRefMap, program);
+    if (programPtr == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup program from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(programPtr->client))
+    {
+        LE_KILL_CLIENT("Cannot delete program as it is not owned by the caller");
+        return;
+    }
+
+    deleteProgram(programPtr, cmdRef);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Opens a flash chip on an SPI device and probes it.  The handle has a client of its own on the
+ * device, so it is scheduled and configured independently of any spi handle on the same device.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_NOT_FOUND if the SPI device file could not be found
+ *      - LE_NOT_PERMITTED if the SPI device file can't be opened for read/write
+ *      - LE_BUSY if another process is using the device through the library directly, or
+ *        another handle has a burst in progress on the bus
+ *      - LE_UNSUPPORTED if no usable flash chip answers
+ *      - LE_FAULT if the device can't be configured, or for non-specific failures
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFlash_Open
+(
+    spiFlash_ServerCmdRef_t cmdRef, ///< Call to reply to
+    const char* deviceName,        ///< [in] Name of the device file without the "/dev/" prefix
+    uint32_t speed                 ///< [in] Clock speed in Hz
+)
+{
+    Client_t* client;
+    const le_result_t result = openClient(deviceName, spiFlash_GetClientSessionRef(), &client);
+    if (result != LE_OK)
+    {
+        spiFlash_OpenRespond(cmdRef, result, NULL);
+        return;
+    }
+
+    // The reference exists from the start so that closing the session finds the flash while it
+    // is still being probed
+    Flash_t* flash = le_mem_ForceAlloc(g.flashPool);
+    flash->client = client;
+    flash->ref = le_ref_CreateRef(g.flashRefMap, flash);
+
+    // Multi-line reads need the device configured for them, and the chip decides whether to use
+    // them
+    Request_t* request = newRequest(client, cmdRef, respondFlashConfigured);
+    request->context = flash;
+    request->params.configure = (ConfigureArgs_t)
+    {
+        .mode = SPI_SPI_MODE_0 |
+                (client->device->widthModes & (SPI_SPI_RX_DUAL | SPI_SPI_RX_QUAD)),
+        .bits = 8,
+        .speed = speed,
+        .msb = 0
+    };
+    runHousekeepingOnWorker(request, configureOperation, &request->params.configure);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Closes a flash handle.  A program or erase still in progress carries on in the chip.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFlash_Close
+(
+    spiFlash_ServerCmdRef_t cmdRef, ///< Call to reply to
+    spiFlash_HandleRef_t handle   ///< Handle to close
+)
+{
+    Flash_t* flash = lookupFlash(handle);
+    if (flash == NULL)
+    {
+        return;
+    }
+
+    closeFlash(flash, cmdRef);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the geometry of a flash chip found when it was opened.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFlash_GetInfo
+(
+    spiFlash_ServerCmdRef_t cmdRef, ///< Call to reply to
+    spiFlash_HandleRef_t handle,  ///< Handle to query
+    size_t jedecIdLength          ///< Capacity of jedecId
+)
+{
+    Flash_t* flash = lookupFlash(handle);
+    if (flash == NULL)
+    {
+        return;
+    }
+
+    // Fixed since the chip was probed, so safe to read from this thread
+    uint8_t id[SPINOR_JEDEC_ID_BYTES];
+    spiNor_GetJedecId(&flash->nor, id);
+    spiFlash_GetInfoRespond(
+        cmdRef,
+        id,
+        (jedecIdLength < sizeof(id)) ? jedecIdLength : sizeof(id),
+        spiNor_GetSize(&flash->nor),
+        spiNor_GetPageSize(&flash->nor),
+        spiNor_GetEraseSize(&flash->nor),
+        spiNor_GetReadWidth(&flash->nor));
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads from a flash chip.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the data runs past the end of the chip
+ *      - LE_TIMEOUT if the chip stayed busy with an earlier program or erase
+ *      - LE_BUSY if another handle has a burst in progress on the bus
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFlash_Read
+(
+    spiFlash_ServerCmdRef_t cmdRef, ///< Call to reply to
+    spiFlash_HandleRef_t handle,  ///< Handle to read with
+    uint32_t address,             ///< Address of the first byte to read
+    size_t dataLength             ///< Bytes to read
+)
+{
+    Flash_t* flash = lookupFlash(handle);
+    if (flash == NULL)
+    {
+        return;
+    }
+
+    Request_t* request = newRequest(flash->client, cmdRef, respondFlashRead);
+    request->readDataLength = dataLength;
+    request->params.flash = (FlashArgs_t)
+    {
+        .flash = flash,
+        .address = address,
+        .readData = request->readData,
+        .length = dataLength
+    };
+    runOnWorker(request, flashReadOperation, &request->params.flash, dataLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Programs data into erased flash.  Returns once the last page has been started.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_OUT_OF_RANGE if the data runs past the end of the chip
+ *      - LE_TIMEOUT if the chip stayed busy
+ *      - LE_BUSY if another handle has a burst in progress on the bus
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFlash_Program
+(
+    spiFlash_ServerCmdRef_t cmdRef, ///< Call to reply to
+    spiFlash_HandleRef_t handle,  ///< Handle to program with
+    uint32_t address,             ///< Address of the first byte to program
+    const uint8_t* data,          ///< Data to program
+    size_t dataLength             ///< Number of bytes in data
+)
+{
+    Flash_t* flash = lookupFlash(handle);
+    if (flash == NULL)
+    {
+        return;
+    }
+
+    Request_t* request = newRequest(flash->client, cmdRef, respondFlashProgram);
+    memcpy(request->writeData, data, dataLength);
+    request->params.flash = (FlashArgs_t)
+    {
+        .flash = flash,
+        .address = address,
+        .writeData = request->writeData,
+        .length = dataLength
+    };
+    runOnWorker(request, flashProgramOperation, &request->params.flash, dataLength);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Erases a range of a flash chip with the largest erase blocks which fit.  Each block is erased
+ * by a request of its own, so other handles on the bus are served between blocks.  Returns once
+ * the last block has been started.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the range isn't aligned to the smallest erase block
+ *      - LE_OUT_OF_RANGE if the range runs past the end of the chip
+ *      - LE_TIMEOUT if the chip stayed busy
+ *      - LE_BUSY if another handle has a burst in progress on the bus
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFlash_Erase
+(
+    spiFlash_ServerCmdRef_t cmdRef, ///< Call to reply to
+    spiFlash_HandleRef_t handle,  ///< Handle to erase with
+    uint32_t address,             ///< Start of the range
+    uint32_t length               ///< Bytes to erase
+)
+{
+    Flash_t* flash = lookupFlash(handle);
+    if (flash == NULL)
+    {
+        return;
+    }
+
+    if (length == 0)
+    {
+        spiFlash_EraseRespond(cmdRef, LE_OK);
+        return;
+    }
+
+    Request_t* request = newRequest(flash->client, cmdRef, respondFlashErase);
+    request->params.flash = (FlashArgs_t){ .flash = flash, .address = address, .length = length };
+    runOnWorker(request, flashEraseOperation, &request->params.flash, 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Waits for the last program or erase on a flash chip to finish.
+ *
+ * @return
+ *      - LE_OK once the chip is idle
+ *      - LE_TIMEOUT if the chip stayed busy
+ *      - LE_BUSY if another handle has a burst in progress on the bus
+ *      - LE_FAULT on failure
+ */
+//--------------------------------------------------------------------------------------------------
+void spiFlash_Sync
+(
+    spiFlash_ServerCmdRef_t cmdRef, ///< Call to reply to
+    spiFlash_HandleRef_t handle   ///< Handle to wait on
+)
+{
+    Flash_t* flash = lookupFlash(handle);
+    if (flash == NULL)
+    {
+        return;
+    }
+
+    Request_t* request = newRequest(flash->client, cmdRef, respondFlashSync);
+    request->params.flash = (FlashArgs_t){ .flash = flash };
+    runOnWorker(request, flashSyncOperation, &request->params.flash, 0);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Converts the segment descriptors received over IPC into library segments pointing into the
+ * supplied transmit and receive buffers.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if the descriptors are malformed or don't match the buffer sizes
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t parseSegments
+(
+    const uint32_t* descriptors,   ///< Segment descriptors as documented in spi.api
+    size_t descriptorsLength,      ///< Number of words in descriptors
+    const uint8_t* writeData,      ///< Tx data for all transmitting segments
+    size_t* writeDataLength,       ///< Bytes available in writeData on input, bytes to transmit
+                                   ///  on output
+    uint8_t* readData,             ///< Rx buffer for all receiving segments
+    size_t* readDataLength,        ///< Capacity of readData on input, bytes to receive on output
+    spiLib_Segment_t* segments,    ///< [out] Array of at least SPI_MAX_SEGMENTS segments
+    size_t* numSegments            ///< [out] Number of segments filled in
+)
+{
+    if (descriptorsLength == 0 || (descriptorsLength % SPI_SEGMENT_WORDS) != 0)
+    {
+        LE_ERROR("Segment descriptor array has invalid length (%zu)", descriptorsLength);
+        return LE_BAD_PARAMETER;
+    }
+
+    size_t txOffset = 0;
+    size_t rxOffset = 0;
+    *numSegments = descriptorsLength / SPI_SEGMENT_WORDS;
+    for (size_t i = 0; i < *numSegments; i++)
+    {
+        const uint32_t* d = &descriptors[i * SPI_SEGMENT_WORDS];
+        const uint32_t flags = d[0];
+        const uint32_t length = d[1];
+        const bool transmits = (flags & SPI_SEGMENT_TX) != 0;
+        const bool receives = (flags & SPI_SEGMENT_RX) != 0;
+        const uint8_t txNbits = segmentNbits(flags, SPI_SEGMENT_TX_DUAL, SPI_SEGMENT_TX_QUAD);
+        const uint8_t rxNbits = segmentNbits(flags, SPI_SEGMENT_RX_DUAL, SPI_SEGMENT_RX_QUAD);
+
+        if ((flags & ~SEGMENT_KNOWN_FLAGS) != 0)
+        {
+            LE_ERROR("Segment %zu has unknown flags (0x%x)", i, flags & ~SEGMENT_KNOWN_FLAGS);
+            return LE_BAD_PARAMETER;
+        }
+        if (!transmits && !receives && length != 0)
+        {
+            LE_ERROR("Segment %zu has a length but neither transmits nor receives", i);
+            return LE_BAD_PARAMETER;
+        }
+        // Multiple data lines carry one direction at a time
+        if (txNbits == 0 || rxNbits == 0 ||
+            (txNbits > 1 && (!transmits || receives)) ||
+            (rxNbits > 1 && (!receives || transmits)))
+        {
+            LE_ERROR("Segment %zu has invalid dual or quad flags (0x%x)", i, flags);
+            return LE_BAD_PARAMETER;
+        }
+        if (d[3] > UINT16_MAX)
+        {
+            LE_ERROR("Segment %zu delay of %u usecs is too long", i, d[3]);
+            return LE_BAD_PARAMETER;
+        }
+        if (transmits && length > *writeDataLength - txOffset)
+        {
+            LE_ERROR("Segment %zu overruns the write data", i);
+            return LE_BAD_PARAMETER;
+        }
+        if (receives && length > *readDataLength - rxOffset)
+        {
+            LE_ERROR("Segment %zu overruns the read buffer", i);
+            return LE_BAD_PARAMETER;
+        }
+
+        segments[i].txBuf = transmits ? &writeData[txOffset] : NULL;
+        segments[i].rxBuf = receives ? &readData[rxOffset] : NULL;
+        segments[i].length = length;
+        segments[i].speedHz = d[2];
+        segments[i].delayUsecs = d[3];
+        segments[i].bitsPerWord = (flags >> SPI_SEGMENT_BITS_SHIFT) & 0xFF;
+        segments[i].txNbits = txNbits;
+        segments[i].rxNbits = rxNbits;
+        segments[i].csChange = (flags & SPI_SEGMENT_CS_CHANGE) != 0;
+
+        txOffset += transmits ? length : 0;
+        rxOffset += receives ? length : 0;
+    }
+
+    *writeDataLength = txOffset;
+    *readDataLength = rxOffset;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the number of data lines one direction of a segment uses from its descriptor flags.
+ *
+ * @return
+ *      1, 2 or 4, or 0 if both the dual and the quad flag are set.
+ */
+//--------------------------------------------------------------------------------------------------
+static uint8_t segmentNbits
+(
+    uint32_t flags,         ///< Flags word of the segment descriptor
+    uint32_t dualFlag,      ///< SPI_SEGMENT_TX_DUAL or SPI_SEGMENT_RX_DUAL
+    uint32_t quadFlag       ///< SPI_SEGMENT_TX_QUAD or SPI_SEGMENT_RX_QUAD
+)
+{
+    const bool dual = (flags & dualFlag) != 0;
+    const bool quad = (flags & quadFlag) != 0;
+    if (dual && quad)
+    {
+        return 0;
+    }
+    return quad ? 4 : (dual ? 2 : 1);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Looks up a flash handle of the current client, killing the client if it isn't one.
+ *
+ * @return
+ *      The flash or NULL if the client was killed.
+ */
+//--------------------------------------------------------------------------------------------------
+static Flash_t* lookupFlash
+(
+    spiFlash_HandleRef_t handle
+)
+{
+    Flash_t* flash = le_ref_Lookup(g.flashRefMap, handle);
+    if (flash == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup flash from handle!");
+        return NULL;
+    }
+
+    if (flash->client->owningSession != spiFlash_GetClientSessionRef())
+    {
+        LE_KILL_CLIENT("Cannot use flash handle as it is not owned by the caller");
+        return NULL;
+    }
+    return flash;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Queues a flash operation again if the chip was still busy with a program or erase when its poll
+ * ran out, so that the requests of other handles on the bus are served while the chip finishes.
+ *
+ * @return
+ *      True if the request was queued again.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool retryFlashOperation
+(
+    Request_t* request,
+    Operation_t operation,  ///< Operation which returned LE_WOULD_BLOCK
+    size_t cost             ///< Number of bytes the operation still has to transfer
+)
+{
+    if (request->result != LE_WOULD_BLOCK)
+    {
+        return false;
+    }
+    if (request->client->closing)
+    {
+        request->result = LE_FAULT;
+        return false;
+    }
+    runOnWorker(request, operation, &request->params.flash, cost);
+    return true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Closes a flash handle and its client.  The flash is freed once the requests queued on it have
+ * completed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void closeFlash
+(
+    Flash_t* flash,
+    spiFlash_ServerCmdRef_t cmdRef  ///< Call to reply to once closed, or NULL
+)
+{
+    le_ref_DeleteRef(g.flashRefMap, flash->ref);
+    Request_t* request = newRequest(flash->client, cmdRef, respondFlashClose);
+    request->context = flash;
+    closeClient(request);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks if the given handle is owned by the current client.
+ *
+ * @return
+ *      true if the handle is owned by the current client or false otherwise.
+ */
+//--------------------------------------------------------------------------------------------------
+static bool isClientOwnedByCaller
+(
+    const Client_t* client  ///< Handle to check the ownership of
+)
+{
+    return client->owningSession == spi_GetClientSessionRef();
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Allocates a request on a handle.
+ *
+ * @return
+ *      The request, to be passed to runOnWorker, runHousekeepingOnWorker or finishRequest.
+ */
+//--------------------------------------------------------------------------------------------------
+static Request_t* newRequest
+(
+    Client_t* client,         ///< Handle to operate on
+    void* cmdRef,             ///< Call to reply to, or NULL
+    Respond_t respond         ///< Sends the reply once the request is done, or NULL
+)
+{
+    Request_t* request = le_mem_ForceAlloc(g.requestPool);
+    request->client = client;
+    request->result = LE_FAULT;
+    request->queued = false;
+    request->respond = respond;
+    request->respondResult = NULL;
+    request->cmdRef = cmdRef;
+    request->context = NULL;
+    request->readDataLength = 0;
+    return request;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Allocates a request on a handle for a spi call whose only output is its result.
+ *
+ * @return
+ *      The request.
+ */
+//--------------------------------------------------------------------------------------------------
+static Request_t* newResultRequest
+(
+    Client_t* client,                 ///< Handle to operate on
+    spi_ServerCmdRef_t cmdRef,        ///< Call to reply to
+    ResultRespond_t respondResult     ///< The call's respond function
+)
+{
+    Request_t* request = newRequest(client, cmdRef, respondWithResult);
+    request->respondResult = respondResult;
+    return request;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Queues an operation on the worker thread of a device's bus.  The request is finished on this
+ * thread once the operation has been performed.  During another handle's burst the operation isn't
+ * queued and the request finishes with LE_BUSY, as waiting for the burst would hold up the
+ * handle's other requests until the burst timed out.
+ */
+//--------------------------------------------------------------------------------------------------
+static void runOnWorker
+(
+    Request_t* request,       ///< Request to perform the operation for
+    Operation_t operation,    ///< Operation to perform
+    void* args,               ///< Arguments for the operation
+    size_t cost               ///< Number of bytes the operation transfers
+)
+{
+    Client_t* client = request->client;
+    const spiWorker_Flow_t* reservation = spiWorker_GetReservation(client->device->bus->worker);
+    if (reservation != NULL && reservation != &client->flow)
+    {
+        // Finished from the event loop, since this may be called by a respond function
+        request->result = LE_BUSY;
+        request->readDataLength = 0;
+        request->queued = true;
+        le_event_QueueFunction(completeRefusedRequest, request, NULL);
+        return;
+    }
+
+    submitRequest(request, operation, args, cost + REQUEST_OVERHEAD_COST, true);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Queues an operation which doesn't use the bus on the worker thread of a device's bus.  Unlike
+ * runOnWorker, this isn't held back by another handle's burst.
+ */
+//--------------------------------------------------------------------------------------------------
+static void runHousekeepingOnWorker
+(
+    Request_t* request,       ///< Request to perform the operation for
+    Operation_t operation,    ///< Operation to perform
+    void* args                ///< Arguments for the operation
+)
+{
+    submitRequest(request, operation, args, REQUEST_OVERHEAD_COST, false);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Queues a request on its handle's flow.
+ */
+//--------------------------------------------------------------------------------------------------
+static void submitRequest
+(
+    Request_t* request,       ///< Request to queue
+    Operation_t operation,    ///< Operation to perform
+    void* args,               ///< Arguments for the operation
+    size_t cost,              ///< Relative bus time of the request
+    bool usesBus              ///< The operation uses the bus
+)
+{
+    Client_t* client = request->client;
+    request->operation = operation;
+    request->args = args;
+    request->result = LE_FAULT;
+    request->submitUsecs = spiStats_NowUsecs();
+    request->usesBus = usesBus;
+    request->queued = true;
+    spiWorker_Post(
+        client->device->bus->worker,
+        &client->flow,
+        &request->job,
+        cost,
+        runRequest,
+        completeRequest,
+        usesBus);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks a handle and queues a read-modify-write of one of its registers.
+ */
+//--------------------------------------------------------------------------------------------------
+static void updateBits
+(
+    spi_ServerCmdRef_t cmdRef,
+    ResultRespond_t respondResult,
+    spi_DeviceHandleRef_t handle,
+    uint32_t address,
+    uint8_t mask,
+    uint8_t value
+)
+{
+    Client_t* client = le_ref_Lookup(g.deviceHandleRefMap, handle);
+    if (client == NULL)
+    {
+        LE_KILL_CLIENT("Failed to lookup device from handle!");
+        return;
+    }
+
+    if (!isClientOwnedByCaller(client))
+    {
+        LE_KILL_CLIENT("Cannot assign handle to register update as it is not owned by the caller");
+        return;
+    }
+
+    Request_t* request = newResultRequest(client, cmdRef, respondResult);
+    request->params.updateBits =
+        (UpdateBitsArgs_t){ .address = address, .mask = mask, .value = value };
+    runOnWorker(request, updateBitsOperation, &request->params.updateBits, 2);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Worker thread side of submitRequest.  While the handle has a burst in progress, requests which
+ * use the bus other than those of the burst finish with LE_BUSY, as their messages would release
+ * chip select in the middle of the burst.
+ */
+//--------------------------------------------------------------------------------------------------
+static void runRequest
+(
+    spiWorker_Job_t* job
+)
+{
+    Request_t* request = CONTAINER_OF(job, Request_t, job);
+    const uint64_t startUsecs = spiStats_NowUsecs();
+    spiLib_SetTraceTag(request->client->traceTag, request->submitUsecs);
+    if (request->usesBus &&
+        request->client->burstTimer != NULL &&
+        request->operation != beginBurstOperation &&
+        request->operation != burstAppendOperation &&
+        request->operation != endBurstOperation)
+    {
+        LE_ERROR("Handle has a burst in progress");
+        request->result = LE_BUSY;
+    }
+    else
+    {
+        request->result = request->operation(request->client, request->args);
+    }
+    if (request->usesBus && request->result == LE_FAULT)
+    {
+        recoverDevice(request->client);
+    }
+    spiLib_SetTraceTag(0, 0);
+    spiStats_RecordRequest(
+        &request->client->stats,
+        startUsecs - request->submitUsecs,
+        spiStats_NowUsecs() - startUsecs);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Completes a request on the thread which queued it, once its operation has been performed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void completeRequest
+(
+    spiWorker_Job_t* job
+)
+{
+    Request_t* request = CONTAINER_OF(job, Request_t, job);
+    request->queued = false;
+    finishRequest(request);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Completes a request which runOnWorker refused.
+ */
+//--------------------------------------------------------------------------------------------------
+static void completeRefusedRequest
+(
+    void* param1,   ///< Request_t
+    void* param2
+)
+{
+    Request_t* request = param1;
+    completeRequest(&request->job);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Sends the reply of a request and frees it, unless the respond function queued it again to
+ * continue with another operation.
+ */
+//--------------------------------------------------------------------------------------------------
+static void finishRequest
+(
+    Request_t* request
+)
+{
+    if (request->respond != NULL)
+    {
+        request->respond(request);
+    }
+    if (!request->queued)
+    {
+        le_mem_Release(request);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the number of bytes of a request's readData to return to the client.
+ *
+ * @return
+ *      The bytes received, or 0 if the transfer failed.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t receivedLength
+(
+    const Request_t* request
+)
+{
+    // Frames which failed their CRC are still returned, for the client to inspect
+    return (request->result == LE_OK || request->result == LE_FORMAT_ERROR) ?
+        request->readDataLength : 0;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to a spi call whose only output is its result.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondWithResult
+(
+    Request_t* request
+)
+{
+    request->respondResult(request->cmdRef, request->result);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a closed spi handle and replies to spi_Close.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondClose
+(
+    Request_t* request
+)
+{
+    releaseClient(request->client);
+    if (request->cmdRef != NULL)
+    {
+        spi_CloseRespond(request->cmdRef);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_WriteReadHD.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondWriteReadHD
+(
+    Request_t* request
+)
+{
+    spi_WriteReadHDRespond(
+        request->cmdRef, request->result, request->readData, receivedLength(request));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_WriteReadFD.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondWriteReadFD
+(
+    Request_t* request
+)
+{
+    spi_WriteReadFDRespond(
+        request->cmdRef, request->result, request->readData, receivedLength(request));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_ReadHD.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondReadHD
+(
+    Request_t* request
+)
+{
+    spi_ReadHDRespond(
+        request->cmdRef, request->result, request->readData, receivedLength(request));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_Transaction.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondTransaction
+(
+    Request_t* request
+)
+{
+    spi_TransactionRespond(
+        request->cmdRef, request->result, request->readData, receivedLength(request));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_BurstAppend.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondBurstAppend
+(
+    Request_t* request
+)
+{
+    spi_BurstAppendRespond(
+        request->cmdRef, request->result, request->readData, receivedLength(request));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_PollUntil.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondPollUntil
+(
+    Request_t* request
+)
+{
+    spi_PollUntilRespond(
+        request->cmdRef, request->result, request->status, request->elapsedUsecs);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_ReadRegisters.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondReadRegisters
+(
+    Request_t* request
+)
+{
+    spi_ReadRegistersRespond(
+        request->cmdRef, request->result, request->readData, receivedLength(request));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_InvalidateRegisterCache once the cached values have been discarded.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondInvalidateRegisterCache
+(
+    Request_t* request
+)
+{
+    spi_InvalidateRegisterCacheRespond(request->cmdRef);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a stopped sampler and replies to spi_StopSampling.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondStopSampling
+(
+    Request_t* request
+)
+{
+    Subscription_t* subscription = request->context;
+    spiSampler_Delete(subscription->sampler);
+    le_mem_Release(subscription);
+    if (request->cmdRef != NULL)
+    {
+        spi_StopSamplingRespond(request->cmdRef);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a stopped capture and replies to spi_StopCapture.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondStopCapture
+(
+    Request_t* request
+)
+{
+    Capture_t* capture = request->context;
+    spiCapture_Delete(capture->capture);
+    le_mem_Release(capture);
+    if (request->cmdRef != NULL)
+    {
+        spi_StopCaptureRespond(request->cmdRef);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spi_RunProgram.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondRunProgram
+(
+    Request_t* request
+)
+{
+    // The program reports what it received even when it fails part way
+    spi_RunProgramRespond(
+        request->cmdRef, request->result, request->readData, request->readDataLength);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a deleted program, which no queued request can still be running, and replies to
+ * spi_DeleteProgram.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondDeleteProgram
+(
+    Request_t* request
+)
+{
+    le_mem_Release(request->context);
+    if (request->cmdRef != NULL)
+    {
+        spi_DeleteProgramRespond(request->cmdRef);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Goes on from configuring a flash handle to probing its chip.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondFlashConfigured
+(
+    Request_t* request
+)
+{
+    Flash_t* flash = request->context;
+    if (request->result != LE_OK || request->client->closing)
+    {
+        respondFlashProbed(request);
+        return;
+    }
+
+    request->respond = respondFlashProbed;
+    request->params.flash = (FlashArgs_t){ .flash = flash };
+    runOnWorker(request, flashProbeOperation, &request->params.flash, 0);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spiFlash_Open once its chip has been probed, closing the handle if that failed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondFlashProbed
+(
+    Request_t* request
+)
+{
+    Flash_t* flash = request->context;
+    Client_t* client = request->client;
+    if (retryFlashOperation(request, flashProbeOperation, 0))
+    {
+        return;
+    }
+
+    // The session may have closed while the flash was being opened, and closed the handle
+    if (request->result == LE_OK && !client->closing)
+    {
+        client->traceTag = (uint32_t)(uintptr_t)flash->ref;
+        spiFlash_OpenRespond(request->cmdRef, LE_OK, flash->ref);
+        return;
+    }
+
+    if (!client->closing)
+    {
+        closeFlash(flash, NULL);
+    }
+    spiFlash_OpenRespond(
+        request->cmdRef, (request->result == LE_OK) ? LE_FAULT : request->result, NULL);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Frees a closed flash handle and replies to spiFlash_Close.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondFlashClose
+(
+    Request_t* request
+)
+{
+    releaseClient(request->client);
+    le_mem_Release(request->context);
+    if (request->cmdRef != NULL)
+    {
+        spiFlash_CloseRespond(request->cmdRef);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spiFlash_Read.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondFlashRead
+(
+    Request_t* request
+)
+{
+    if (retryFlashOperation(request, flashReadOperation, request->params.flash.length))
+    {
+        return;
+    }
+    spiFlash_ReadRespond(
+        request->cmdRef, request->result, request->readData, receivedLength(request));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spiFlash_Program.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondFlashProgram
+(
+    Request_t* request
+)
+{
+    FlashArgs_t* args = &request->params.flash;
+    if (request->result == LE_WOULD_BLOCK)
+    {
+        args->address += args->programmedLength;
+        args->writeData += args->programmedLength;
+        args->length -= args->programmedLength;
+    }
+    if (retryFlashOperation(request, flashProgramOperation, args->length))
+    {
+        return;
+    }
+    spiFlash_ProgramRespond(request->cmdRef, request->result);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Goes on to erase the next block of a range, or replies to spiFlash_Erase once the last block has
+ * been started.  Each block is a request of its own, so other handles on the bus are served
+ * between blocks.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondFlashErase
+(
+    Request_t* request
+)
+{
+    FlashArgs_t* args = &request->params.flash;
+    if (retryFlashOperation(request, flashEraseOperation, 0))
+    {
+        return;
+    }
+    if (request->result == LE_OK)
+    {
+        args->address += args->erasedLength;
+        args->length -= args->erasedLength;
+        if (args->length > 0)
+        {
+            if (!request->client->closing)
+            {
+                runOnWorker(request, flashEraseOperation, args, 0);
+                return;
+            }
+            request->result = LE_FAULT;
+        }
+    }
+    spiFlash_EraseRespond(request->cmdRef, request->result);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replies to spiFlash_Sync.
+ */
+//--------------------------------------------------------------------------------------------------
+static void respondFlashSync
+(
+    Request_t* request
+)
+{
+    if (retryFlashOperation(request, flashSyncOperation, 0))
+    {
+        return;
+    }
+    spiFlash_SyncRespond(request->cmdRef, request->result);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records a new configuration for the handle and applies it to the device.
+ *
+ * @return
+ *      - LE_OK on success or if the configuration is deferred
+ *      - LE_FAULT if a setting failed, leaving the last good configuration in place
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t configureOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< ConfigureArgs_t
+)
+{
+    const ConfigureArgs_t* args = argsPtr;
+
+    const uint32_t unsupported = args->mode & SPI_SPI_WIDTHS & ~client->device->widthModes;
+    if (unsupported != 0)
+    {
+        LE_ERROR("Controller doesn't support modes 0x%x", unsupported);
+        client->configureFailures = SPI_CONFIG_MODE;
+        return LE_UNSUPPORTED;
+    }
+
+    client->config.valid = true;
+    client->config.mode = args->mode;
+    client->config.bits = args->bits;
+    client->config.speed = args->speed;
+    client->config.msb = args->msb;
+    client->configureFailures = 0;
+    // During another handle's burst the configuration is left to be applied before the next
+    // transfer
+    const spiWorker_Flow_t* reservation = spiWorker_GetReservation(client->device->bus->worker);
+    if (reservation == NULL || reservation == &client->flow)
+    {
+        return applyConfig(client);
+    }
+
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a half duplex write followed by a half duplex read.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t writeReadHDOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< TransferArgs_t
+)
+{
+    TransferArgs_t* args = argsPtr;
+    if (spiFrame_CheckLayout(&client->frame, *args->readDataLength) != LE_OK)
+    {
+        return LE_BAD_PARAMETER;
+    }
+    applyConfig(client);
+    le_result_t result;
+    uint32_t attempts = 0;
+    do
+    {
+        result = spiLib_WriteReadHD(
+            client->device->fd,
+            args->writeData,
+            args->writeDataLength,
+            args->readData,
+            args->readDataLength) == LE_OK ? LE_OK : LE_FAULT;
+        spiStats_CountTransfer(
+            &client->stats,
+            SPISTATS_WRITE_READ_HD,
+            args->writeDataLength,
+            *args->readDataLength,
+            result);
+    } while (spiFrame_CheckReceived(
+        &client->frame,
+        &client->stats,
+        args->readData,
+        *args->readDataLength,
+        &attempts,
+        &result));
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a half duplex write.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t writeHDOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< TransferArgs_t
+)
+{
+    TransferArgs_t* args = argsPtr;
+    applyConfig(client);
+    const le_result_t result = spiLib_WriteHD(
+        client->device->fd, args->writeData, args->writeDataLength) == LE_OK ? LE_OK : LE_FAULT;
+    spiStats_CountTransfer(&client->stats, SPISTATS_WRITE_HD, args->writeDataLength, 0, result);
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a full duplex write and read.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t writeReadFDOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< TransferArgs_t
+)
+{
+    TransferArgs_t* args = argsPtr;
+    if (spiFrame_CheckLayout(&client->frame, args->writeDataLength) != LE_OK)
+    {
+        return LE_BAD_PARAMETER;
+    }
+    applyConfig(client);
+    le_result_t result;
+    uint32_t attempts = 0;
+    do
+    {
+        result = spiLib_WriteReadFD(
+            client->device->fd,
+            args->writeData,
+            args->readData,
+            args->writeDataLength) == LE_OK ? LE_OK : LE_FAULT;
+        spiStats_CountTransfer(
+            &client->stats,
+            SPISTATS_WRITE_READ_FD,
+            args->writeDataLength,
+            args->writeDataLength,
+            result);
+    } while (spiFrame_CheckReceived(
+        &client->frame,
+        &client->stats,
+        args->readData,
+        args->writeDataLength,
+        &attempts,
+        &result));
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a half duplex read.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t readHDOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< TransferArgs_t
+)
+{
+    TransferArgs_t* args = argsPtr;
+    if (spiFrame_CheckLayout(&client->frame, *args->readDataLength) != LE_OK)
+    {
+        return LE_BAD_PARAMETER;
+    }
+    applyConfig(client);
+    le_result_t result;
+    uint32_t attempts = 0;
+    do
+    {
+        result = spiLib_ReadHD(
+            client->device->fd, args->readData, args->readDataLength) == LE_OK ? LE_OK : LE_FAULT;
+        spiStats_CountTransfer(&client->stats, SPISTATS_READ_HD, 0, *args->readDataLength, result);
+    } while (spiFrame_CheckReceived(
+        &client->frame,
+        &client->stats,
+        args->readData,
+        *args->readDataLength,
+        &attempts,
+        &result));
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a list of segments as a single message.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t transactionOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< TransactionArgs_t
+)
+{
+    TransactionArgs_t* args = argsPtr;
+    applyConfig(client);
+    const le_result_t result =
+        transferResult(spiLib_Transfer(client->device->fd, args->segments, args->numSegments));
+    countSegments(client, SPISTATS_TRANSACTION, args->segments, args->numSegments, result);
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Streams data in chunks the driver accepts.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t streamOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< StreamArgs_t
+)
+{
+    StreamArgs_t* args = argsPtr;
+    applyConfig(client);
+    const le_result_t result = transferResult(spiLib_Stream(
+        client->device->fd,
+        args->writeData,
+        args->readData,
+        args->length,
+        client->device->maxMessageSize,
+        args->holdCs));
+    spiStats_CountTransfer(
+        &client->stats,
+        SPISTATS_STREAM,
+        (args->writeData != NULL) ? args->length : 0,
+        (args->readData != NULL) ? args->length : 0,
+        result);
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reserves the bus for a burst and starts its idle timer.  Nothing is transferred until the first
+ * append.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t beginBurstOperation
+(
+    Client_t* client,
+    void* args
+)
+{
+    if (client->burstTimer != NULL)
+    {
+        LE_ERROR("Handle already has a burst in progress");
+        return LE_BUSY;
+    }
+
+    applyConfig(client);
+    spiWorker_Reserve(client->device->bus->worker, &client->flow);
+    client->burstExpired = false;
+
+    // The timer runs on this thread, like everything else which touches the bus
+    client->burstTimer = le_timer_Create("SPI burst");
+    LE_ASSERT_OK(le_timer_SetMsInterval(client->burstTimer, SPI_BURST_IDLE_TIMEOUT_MS));
+    LE_ASSERT_OK(le_timer_SetContextPtr(client->burstTimer, client));
+    LE_ASSERT_OK(le_timer_SetHandler(client->burstTimer, burstIdleTimerExpired));
+    LE_ASSERT_OK(le_timer_Start(client->burstTimer));
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Transfers data within a burst.  Every message ends with cs_change set, which leaves chip select
+ * asserted until the next message.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t burstAppendOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< StreamArgs_t
+)
+{
+    StreamArgs_t* args = argsPtr;
+    const le_result_t burstResult = checkBurst(client);
+    if (burstResult != LE_OK)
+    {
+        return burstResult;
+    }
+    le_timer_Restart(client->burstTimer);
+
+    le_result_t result = LE_OK;
+    size_t offset = 0;
+    while (result == LE_OK && offset < args->length)
+    {
+        const size_t chunkSize = (args->length - offset < client->device->maxMessageSize) ?
+                                 (args->length - offset) : client->device->maxMessageSize;
+        const spiLib_Segment_t segment =
+        {
+            .txBuf = (args->writeData != NULL) ? &args->writeData[offset] : NULL,
+            .rxBuf = (args->readData != NULL) ? &args->readData[offset] : NULL,
+            .length = chunkSize,
+            .csChange = true
+        };
+        result = transferResult(spiLib_Transfer(client->device->fd, &segment, 1));
+        offset += chunkSize;
+    }
+    spiStats_CountTransfer(
+        &client->stats,
+        SPISTATS_BURST,
+        (args->writeData != NULL) ? args->length : 0,
+        (args->readData != NULL) ? args->length : 0,
+        result);
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Ends a burst at the client's request.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t endBurstOperation
+(
+    Client_t* client,
+    void* args
+)
+{
+    const le_result_t burstResult = checkBurst(client);
+    if (burstResult != LE_OK)
+    {
+        return burstResult;
+    }
+    return endBurst(client);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Checks that a handle has a burst in progress.  Reports a burst ended for being idle once.
+ *
+ * @return
+ *      - LE_OK if a burst is in progress
+ *      - LE_TIMEOUT if the burst was ended for being idle since it was last used
+ *      - LE_NOT_PERMITTED otherwise
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t checkBurst
+(
+    Client_t* client
+)
+{
+    if (client->burstTimer != NULL)
+    {
+        return LE_OK;
+    }
+    if (client->burstExpired)
+    {
+        client->burstExpired = false;
+        return LE_TIMEOUT;
+    }
+    LE_ERROR("Handle has no burst in progress");
+    return LE_NOT_PERMITTED;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Releases chip select and the bus at the end of a burst.  Called on the worker thread.
+ *
+ * @return
+ *      The result of the message releasing chip select.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t endBurst
+(
+    Client_t* client
+)
+{
+    le_timer_Delete(client->burstTimer);
+    client->burstTimer = NULL;
+
+    // A message ending without cs_change releases chip select, and needn't transfer anything
+    const spiLib_Segment_t release = { .length = 0 };
+    const le_result_t result = transferResult(spiLib_Transfer(client->device->fd, &release, 1));
+    spiWorker_Unreserve(client->device->bus->worker);
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Ends a burst which has seen no request for too long, so that a client which has gone quiet
+ * can't keep the bus from everyone else.
+ */
+//--------------------------------------------------------------------------------------------------
+static void burstIdleTimerExpired
+(
+    le_timer_Ref_t timer
+)
+{
+    Client_t* client = le_timer_GetContextPtr(timer);
+    LE_WARN("Ending burst idle for %d ms", SPI_BURST_IDLE_TIMEOUT_MS);
+    endBurst(client);
+    client->burstExpired = true;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Unmaps a detached shared buffer once all requests which may use it have been performed.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t unmapSharedBufferOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< SharedBufferArgs_t
+)
+{
+    const SharedBufferArgs_t* args = argsPtr;
+    if (munmap(args->mapping, args->size) != 0)
+    {
+        LE_WARN("Couldn't unmap the shared buffer cleanly: (%m)");
+    }
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Ends the handle's burst, if any, once all requests queued by it have been performed, and stops
+ * its register map using the device's cache.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t closeOperation
+(
+    Client_t* client,
+    void* args
+)
+{
+    if (client->burstTimer != NULL)
+    {
+        endBurst(client);
+    }
+    spiRegmap_Release(&client->regmap);
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Does nothing, so that the request completes once the requests queued before it have.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t barrierOperation
+(
+    Client_t* client,
+    void* args
+)
+{
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Changes how the attempts of the handle's polls are spaced out.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t setPollBackoffOperation
+(
+    Client_t* client,
+    void* args      ///< spiLib_Backoff_t
+)
+{
+    client->pollBackoff = *(const spiLib_Backoff_t*)args;
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Polls a status byte with the handle's backoff.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t pollOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< PollArgs_t
+)
+{
+    PollArgs_t* args = argsPtr;
+    applyConfig(client);
+    uint32_t attempts;
+    const le_result_t result = spiLib_PollUntil(
+        client->device->fd,
+        args->command,
+        args->commandLength,
+        args->mask,
+        args->expected,
+        args->timeoutUsecs,
+        &client->pollBackoff,
+        args->status,
+        args->elapsedUsecs,
+        &attempts);
+    spiStats_RecordPoll(
+        &client->stats, attempts, args->commandLength, *args->elapsedUsecs, result);
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replaces the register map of a handle.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t setRegisterMapOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< RegisterMapArgs_t
+)
+{
+    const RegisterMapArgs_t* args = argsPtr;
+    return spiRegmap_Configure(
+        &client->regmap,
+        args->addressBytes,
+        args->readFlag,
+        args->writeFlag,
+        args->volatileRanges,
+        args->numVolatileRanges,
+        args->cache);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads registers through the handle's register map.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t readRegistersOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< RegistersArgs_t
+)
+{
+    RegistersArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiRegmap_Read(
+        &client->regmap,
+        client->device->fd,
+        &client->stats,
+        args->address,
+        args->data,
+        args->length);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes registers through the handle's register map.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t writeRegistersOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< RegistersArgs_t
+)
+{
+    RegistersArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiRegmap_Write(
+        &client->regmap,
+        client->device->fd,
+        &client->stats,
+        args->address,
+        args->data,
+        args->length);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Updates bits of a register through the handle's register map.  Running on the worker thread is
+ * what keeps other transfers off the bus between the read and the write.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t updateBitsOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< UpdateBitsArgs_t
+)
+{
+    const UpdateBitsArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiRegmap_UpdateBits(
+        &client->regmap,
+        client->device->fd,
+        &client->stats,
+        args->address,
+        args->mask,
+        args->value);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Discards the handle's cached register values.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t invalidateRegisterCacheOperation
+(
+    Client_t* client,
+    void* args
+)
+{
+    spiRegmap_Invalidate(&client->regmap);
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Replaces the framing of a handle.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t setFramingOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< FramingArgs_t
+)
+{
+    const FramingArgs_t* args = argsPtr;
+    return spiFrame_Configure(
+        &client->frame,
+        args->crcWidth,
+        args->polynomial,
+        args->init,
+        args->xorOut,
+        args->flags,
+        args->frameLength,
+        args->skipLength,
+        args->retries);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts the timer of a sampling subscription on the worker thread, where the samples are taken.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t startSamplingOperation
+(
+    Client_t* client,
+    void* args      ///< Subscription_t
+)
+{
+    Subscription_t* subscription = args;
+    spiSampler_Start(subscription->sampler, subscription->periodUsecs);
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops the timer of a sampling subscription.  Once this has run, no further samples are taken.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t stopSamplingOperation
+(
+    Client_t* client,
+    void* args      ///< Subscription_t
+)
+{
+    Subscription_t* subscription = args;
+    spiSampler_Stop(subscription->sampler);
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts the timer of a capture on the worker thread, where the records are taken.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t startCaptureOperation
+(
+    Client_t* client,
+    void* args      ///< Capture_t
+)
+{
+    Capture_t* capture = args;
+    spiCapture_Start(capture->capture, capture->periodUsecs);
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops the timer of a capture.  Once this has run, no further records are taken.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t stopCaptureOperation
+(
+    Client_t* client,
+    void* args      ///< Capture_t
+)
+{
+    Capture_t* capture = args;
+    spiCapture_Stop(capture->capture);
+    return LE_OK;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Runs a program.  Nothing else uses the bus until the program ends.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t runProgramOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< RunProgramArgs_t
+)
+{
+    RunProgramArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiProgram_Run(
+        args->program,
+        client->device->fd,
+        &client->stats,
+        args->output,
+        args->outputLength);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Probes a flash chip.  Multi-line reads are only used if the handle is configured for them.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t flashProbeOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< FlashArgs_t
+)
+{
+    FlashArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiNor_Probe(
+        &args->flash->nor,
+        &client->device->norState,
+        client->device->fd,
+        &client->stats,
+        client->config.mode & (SPI_SPI_RX_DUAL | SPI_SPI_RX_QUAD));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads from a flash chip.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t flashReadOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< FlashArgs_t
+)
+{
+    FlashArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiNor_Read(
+        &args->flash->nor,
+        client->device->fd,
+        client->device->maxMessageSize,
+        &client->stats,
+        args->address,
+        args->readData,
+        args->length);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Programs a flash chip.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t flashProgramOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< FlashArgs_t
+)
+{
+    FlashArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiNor_Program(
+        &args->flash->nor,
+        client->device->fd,
+        client->device->maxMessageSize,
+        &client->stats,
+        args->address,
+        args->writeData,
+        args->length,
+        &args->programmedLength);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Starts erasing the next block of a range of a flash chip.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t flashEraseOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< FlashArgs_t
+)
+{
+    FlashArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiNor_EraseNext(
+        &args->flash->nor,
+        client->device->fd,
+        &client->stats,
+        args->address,
+        args->length,
+        &args->erasedLength);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Waits for a flash chip to finish its last program or erase.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t flashSyncOperation
+(
+    Client_t* client,
+    void* argsPtr   ///< FlashArgs_t
+)
+{
+    FlashArgs_t* args = argsPtr;
+    applyConfig(client);
+    return spiNor_WaitReady(&args->flash->nor, client->device->fd, &client->stats);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a subscription's transaction.  Called from the sampler's timer on the worker thread.
+ *
+ * @return
+ *      LE_OK if the transaction succeeded.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t takeSample
+(
+    void* context,  ///< Subscription_t
+    uint8_t* sample ///< [out] Bytes received
+)
+{
+    Subscription_t* subscription = context;
+    // Samples would break into the chip select assertion of a burst
+    if (spiWorker_GetReservation(subscription->client->device->bus->worker) != NULL)
+    {
+        return LE_BUSY;
+    }
+    // Samples aren't queued, so their records have no enqueue time
+    spiLib_SetTraceTag(subscription->client->traceTag, 0);
+    applyConfig(subscription->client);
+    const le_result_t result = spiLib_Transfer(
+        subscription->client->device->fd, subscription->segments, subscription->numSegments);
+    spiLib_SetTraceTag(0, 0);
+    countSegments(
+        subscription->client,
+        SPISTATS_SAMPLE,
+        subscription->segments,
+        subscription->numSegments,
+        result);
+    if (result == LE_OK)
+    {
+        memcpy(sample, subscription->readData, subscription->sampleSize);
+    }
+    else if (result == LE_FAULT)
+    {
+        recoverDevice(subscription->client);
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs a capture's transaction, receiving straight into a slot of the capture file.  Called
+ * from the capture's timer on the worker thread.
+ *
+ * @return
+ *      LE_OK if the transaction succeeded.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t takeCaptureRecord
+(
+    void* context,  ///< Capture_t
+    uint8_t* data   ///< [out] Slot to receive the bytes into
+)
+{
+    Capture_t* capture = context;
+    // Records would break into the chip select assertion of a burst
+    if (spiWorker_GetReservation(capture->client->device->bus->worker) != NULL)
+    {
+        return LE_BUSY;
+    }
+
+    // The segments were parsed against readData, so move their rx buffers into the slot
+    spiLib_Segment_t segments[SPI_MAX_SEGMENTS];
+    for (size_t i = 0; i < capture->numSegments; i++)
+    {
+        segments[i] = capture->segments[i];
+        if (segments[i].rxBuf != NULL)
+        {
+            segments[i].rxBuf = &data[segments[i].rxBuf - capture->readData];
+        }
+    }
+
+    spiLib_SetTraceTag(capture->client->traceTag, 0);
+    applyConfig(capture->client);
+    const le_result_t result =
+        spiLib_Transfer(capture->client->device->fd, segments, capture->numSegments);
+    spiLib_SetTraceTag(0, 0);
+    countSegments(capture->client, SPISTATS_CAPTURE, segments, capture->numSegments, result);
+    if (result == LE_FAULT)
+    {
+        recoverDevice(capture->client);
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops a sampling subscription.  It is freed once the sampler has stopped on the worker.
+ */
+//--------------------------------------------------------------------------------------------------
+static void deleteSubscription
+(
+    Subscription_t* subscription,
+    spi_ServerCmdRef_t cmdRef   ///< Call to reply to once stopped, or NULL
+)
+{
+    Client_t* client = subscription->client;
+    le_ref_DeleteRef(g.samplerRefMap, subscription->ref);
+    le_dls_Remove(&client->subscriptions, &subscription->link);
+
+    Request_t* request = newRequest(client, cmdRef, respondStopSampling);
+    request->context = subscription;
+    runHousekeepingOnWorker(request, stopSamplingOperation, subscription);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops a capture.  It is freed once the capture has stopped on the worker.
+ */
+//--------------------------------------------------------------------------------------------------
+static void deleteCapture
+(
+    Capture_t* capture,
+    spi_ServerCmdRef_t cmdRef   ///< Call to reply to once stopped, or NULL
+)
+{
+    Client_t* client = capture->client;
+    le_ref_DeleteRef(g.captureRefMap, capture->ref);
+    le_dls_Remove(&client->captures, &capture->link);
+
+    Request_t* request = newRequest(client, cmdRef, respondStopCapture);
+    request->context = capture;
+    runHousekeepingOnWorker(request, stopCaptureOperation, capture);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Deletes a program.  It is freed once the runs of it already queued have been performed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void deleteProgram
+(
+    Program_t* program,
+    spi_ServerCmdRef_t cmdRef   ///< Call to reply to once deleted, or NULL
+)
+{
+    le_ref_DeleteRef(g.programRefMap, program->ref);
+    le_dls_Remove(&program->client->programs, &program->link);
+
+    // Runs of the program may still be queued, so it is freed behind them
+    Request_t* request = newRequest(program->client, cmdRef, respondDeleteProgram);
+    request->context = program;
+    runHousekeepingOnWorker(request, barrierOperation, NULL);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Queues an asynchronous request to the worker thread of a device's bus.  The request is
+ * released if it can't be queued.
+ *
+ * @return
+ *      - LE_OK if the request was queued
+ *      - LE_BUSY if the handle's queue is full
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t submitAsync
+(
+    Client_t* client,
+    AsyncRequest_t* request,
+    size_t cost               ///< Number of bytes the request transfers
+)
+{
+    request->client = client;
+    request->result = LE_FAULT;
+    request->submitUsecs = spiStats_NowUsecs();
+
+    const le_result_t result = spiWorker_Submit(
+        client->device->bus->worker,
+        &client->flow,
+        &request->job,
+        cost + REQUEST_OVERHEAD_COST,
+        runAsyncRequest,
+        completeAsyncRequest);
+    if (result != LE_OK)
+    {
+        LE_WARN("Request queue of handle on bus %s is full", client->device->bus->name);
+        le_mem_Release(request);
+    }
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs an asynchronous transaction on the worker thread.  Like runRequest, this fails with
+ * LE_BUSY while the handle has a burst in progress.
+ */
+//--------------------------------------------------------------------------------------------------
+static void runAsyncRequest
+(
+    spiWorker_Job_t* job
+)
+{
+    AsyncRequest_t* request = CONTAINER_OF(job, AsyncRequest_t, job);
+    Client_t* client = request->client;
+    const uint64_t startUsecs = spiStats_NowUsecs();
+    spiLib_SetTraceTag(client->traceTag, request->submitUsecs);
+    if (client->burstTimer != NULL)
+    {
+        LE_ERROR("Handle has a burst in progress");
+        request->result = LE_BUSY;
+    }
+    else
+    {
+        applyConfig(client);
+        request->result = transferResult(
+            spiLib_Transfer(client->device->fd, request->segments, request->numSegments));
+        countSegments(
+            client, SPISTATS_ASYNC, request->segments, request->numSegments, request->result);
+        if (request->result == LE_FAULT)
+        {
+            recoverDevice(client);
+        }
+    }
+    spiLib_SetTraceTag(0, 0);
+    spiStats_RecordRequest(
+        &client->stats, startUsecs - request->submitUsecs, spiStats_NowUsecs() - startUsecs);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reports the outcome of an asynchronous transaction to the client.  Runs on the main thread.
+ */
+//--------------------------------------------------------------------------------------------------
+static void completeAsyncRequest
+(
+    spiWorker_Job_t* job
+)
+{
+    AsyncRequest_t* request = CONTAINER_OF(job, AsyncRequest_t, job);
+
+    // The client may have closed the handle or disconnected while the request was queued
+    if (le_ref_Lookup(g.deviceHandleRefMap, request->handle) != NULL)
+    {
+        if (request->handler != NULL)
+        {
+            request->handler(
+                request->result,
+                request->readData,
+                (request->result == LE_OK) ? request->readDataLength : 0,
+                request->context);
+        }
+        else
+        {
+            request->sharedHandler(request->result, request->context);
+        }
+    }
+
+    le_mem_Release(request);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Applies the handle's configuration to its device.  Must be called on the worker thread before
+ * every transfer, since another client of the device may have changed its configuration.  If any
+ * setting fails, the handle goes back to its last configuration which applied without error, and
+ * the failed settings are recorded for spi_GetConfigureFailures.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_FAULT if a setting failed
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t applyConfig
+(
+    Client_t* client
+)
+{
+    if (!client->config.valid)
+    {
+        return LE_OK;
+    }
+
+    Device_t* device = client->device;
+    const uint32_t failed =
+        spiLib_ApplyConfig(device->fd, &device->config, &client->config, &client->ioctlsAvoided);
+    if (failed == 0)
+    {
+        client->goodConfig = client->config;
+        client->emulatedSettings = device->config.emulated;
+        return LE_OK;
+    }
+
+    LE_ERROR("Configuration settings 0x%x failed, restoring the last good configuration", failed);
+    client->configureFailures |= failed;
+    client->config = client->goodConfig;
+    if (client->config.valid &&
+        spiLib_ApplyConfig(
+            device->fd, &device->config, &client->config, &client->ioctlsAvoided) != 0)
+    {
+        LE_ERROR("Couldn't restore the last good configuration");
+    }
+    return LE_FAULT;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reopens the device file of a handle whose transfer failed and reapplies the configuration the
+ * device had, so that a fault in the driver costs the device one reopen instead of a restart of
+ * the service followed by every client reopening and reconfiguring its handles.  Only faults of
+ * the device or driver (EIO, ENODEV or ETIMEDOUT) lead to a reopen; a message the driver rejected,
+ * such as with EINVAL or EMSGSIZE, would fail the same way on a new descriptor.  Must be called on
+ * the worker thread.
+ */
+//--------------------------------------------------------------------------------------------------
+static void recoverDevice
+(
+    Client_t* client    ///< Handle whose transfer failed
+)
+{
+    const int error = spiLib_GetMessageErrno();
+    if (error != EIO && error != ENODEV && error != ETIMEDOUT)
+    {
+        return;
+    }
+
+    Device_t* device = client->device;
+    const uint64_t startUsecs = spiStats_NowUsecs();
+
+    // Keep the old descriptor until the new one is open, so a failed reopen changes nothing.  The
+    // device's lock is held by lockFd, so no other process can take the device in between.
+    const int fd = spiLib_Open(device->path, O_RDWR);
+    if (fd < 0)
+    {
+        LE_ERROR("Couldn't reopen %s: (%m)", device->path);
+        spiStats_RecordRecovery(&client->stats, 0, LE_FAULT);
+        return;
+    }
+    if (spiLib_Close(device->fd) != 0)
+    {
+        LE_WARN("Couldn't close the fd cleanly: (%m)");
+    }
+    device->fd = fd;
+
+    // Write every setting, including any software word format, on the new descriptor.  A failed
+    // setting leaves the configuration invalid, so the next request writes everything again.
+    le_result_t result = LE_OK;
+    if (device->config.valid)
+    {
+        spiLib_Config_t applied = { .valid = false };
+        if (spiLib_ApplyConfig(fd, &applied, &device->config, &client->ioctlsAvoided) != 0)
+        {
+            result = LE_FAULT;
+        }
+        device->config = applied;
+    }
 
+    const uint64_t recoveryUsecs = spiStats_NowUsecs() - startUsecs;
+    spiStats_RecordRecovery(&client->stats, recoveryUsecs, result);
+    LE_INFO("Reopened %s in %" PRIu64 " usecs", device->path, recoveryUsecs);
+}
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Checks if the given handle is owned by the current client.
+ * Counts the bytes moved by a list of segments, for scheduling.
  *
  * @return
- *      true if the handle is owned by the current client or false otherwise.
+ *      The total length of the segments.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t segmentBytes
+(
+    const spiLib_Segment_t* segments,
+    size_t numSegments
+)
+{
+    size_t bytes = 0;
+    for (size_t i = 0; i < numSegments; i++)
+    {
+        bytes += segments[i].length;
+    }
+    return bytes;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Counts a transfer made of segments in a handle's statistics.
+ */
+//--------------------------------------------------------------------------------------------------
+static void countSegments
+(
+    Client_t* client,
+    spiStats_TransferType_t type,
+    const spiLib_Segment_t* segments,
+    size_t numSegments,
+    le_result_t result
+)
+{
+    size_t txBytes = 0;
+    size_t rxBytes = 0;
+    for (size_t i = 0; i < numSegments; i++)
+    {
+        txBytes += (segments[i].txBuf != NULL) ? segments[i].length : 0;
+        rxBytes += (segments[i].rxBuf != NULL) ? segments[i].length : 0;
+    }
+    spiStats_CountTransfer(&client->stats, type, txBytes, rxBytes, result);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Copies statistics into the arrays returned by the stats API.
+ */
+//--------------------------------------------------------------------------------------------------
+static void exportStats
+(
+    const spiStats_t* stats,
+    size_t peakQueueDepth,
+    uint64_t* counters,
+    size_t* countersLength,
+    uint64_t* queueWait,
+    size_t* queueWaitLength,
+    uint64_t* busTime,
+    size_t* busTimeLength
+)
+{
+    // Snapshot the counters, which the worker thread may be updating
+    spiStats_t snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    spiStats_Add(&snapshot, stats);
+
+    uint64_t all[SPI_STAT_COUNTERS];
+    all[SPI_STAT_WRITE_READ_HD] = snapshot.transfers[SPISTATS_WRITE_READ_HD];
+    all[SPI_STAT_WRITE_HD] = snapshot.transfers[SPISTATS_WRITE_HD];
+    all[SPI_STAT_WRITE_READ_FD] = snapshot.transfers[SPISTATS_WRITE_READ_FD];
+    all[SPI_STAT_READ_HD] = snapshot.transfers[SPISTATS_READ_HD];
+    all[SPI_STAT_TRANSACTION] = snapshot.transfers[SPISTATS_TRANSACTION];
+    all[SPI_STAT_STREAM] = snapshot.transfers[SPISTATS_STREAM];
+    all[SPI_STAT_ASYNC] = snapshot.transfers[SPISTATS_ASYNC];
+    all[SPI_STAT_SAMPLE] = snapshot.transfers[SPISTATS_SAMPLE];
+    all[SPI_STAT_TX_BYTES] = snapshot.txBytes;
+    all[SPI_STAT_RX_BYTES] = snapshot.rxBytes;
+    all[SPI_STAT_FAILURES] = snapshot.failures;
+    all[SPI_STAT_QUEUE_WAIT_USECS] = snapshot.queueWaitUsecs;
+    all[SPI_STAT_BUS_USECS] = snapshot.busUsecs;
+    all[SPI_STAT_PEAK_QUEUE_DEPTH] = peakQueueDepth;
+    all[SPI_STAT_POLL] = snapshot.transfers[SPISTATS_POLL];
+    all[SPI_STAT_POLLS_READY] = snapshot.pollsReady;
+    all[SPI_STAT_POLLS_TIMED_OUT] = snapshot.pollsTimedOut;
+    all[SPI_STAT_POLL_READY_USECS] = snapshot.pollReadyUsecs;
+    all[SPI_STAT_BURST] = snapshot.transfers[SPISTATS_BURST];
+    all[SPI_STAT_CAPTURE] = snapshot.transfers[SPISTATS_CAPTURE];
+    all[SPI_STAT_RECOVERIES] = snapshot.recoveries;
+    all[SPI_STAT_RECOVERY_USECS] = snapshot.recoveryUsecs;
+    all[SPI_STAT_CRC_ERRORS] = snapshot.crcErrors;
+    all[SPI_STAT_CRC_RETRIES] = snapshot.crcRetries;
+    all[SPI_STAT_CRC_FAILURES] = snapshot.crcFailures;
+
+    *countersLength = (*countersLength < SPI_STAT_COUNTERS) ? *countersLength : SPI_STAT_COUNTERS;
+    memcpy(counters, all, *countersLength * sizeof(all[0]));
+
+    *queueWaitLength = (*queueWaitLength < SPISTATS_HISTOGRAM_BUCKETS) ?
+                       *queueWaitLength : SPISTATS_HISTOGRAM_BUCKETS;
+    memcpy(queueWait, snapshot.queueWaitHistogram, *queueWaitLength * sizeof(queueWait[0]));
+
+    *busTimeLength = (*busTimeLength < SPISTATS_HISTOGRAM_BUCKETS) ?
+                     *busTimeLength : SPISTATS_HISTOGRAM_BUCKETS;
+    memcpy(busTime, snapshot.busTimeHistogram, *busTimeLength * sizeof(busTime[0]));
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Maps a spiLibrary result onto the results reported to clients.  Failures the client can act on
+ * are passed through and anything else is reported as LE_FAULT.
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t transferResult
+(
+    le_result_t libResult
+)
+{
+    switch (libResult)
+    {
+        case LE_OK:
+        case LE_BAD_PARAMETER:
+        case LE_OUT_OF_RANGE:
+            return libResult;
+
+        default:
+            return LE_FAULT;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Detaches the shared buffer of a handle, if there is one.  The buffer is unmapped on the worker
+ * once the requests queued before the detach have been performed.
+ */
+//--------------------------------------------------------------------------------------------------
+static void detachSharedBuffer
+(
+    Client_t* client
+)
+{
+    if (client->sharedBuffer != NULL)
+    {
+        Request_t* request = newRequest(client, NULL, NULL);
+        request->params.sharedBuffer = (SharedBufferArgs_t)
+        {
+            .mapping = client->sharedBuffer,
+            .size = client->sharedBufferSize
+        };
+        runHousekeepingOnWorker(request, unmapSharedBufferOperation, &request->params.sharedBuffer);
+        client->sharedBuffer = NULL;
+        client->sharedBufferSize = 0;
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the bus a device is attached to, starting a worker thread for the bus if it has no other
+ * open devices.  spidev device files are named spidev<bus>.<chip select>; any other device file is
+ * treated as being alone on its bus.
+ *
+ * @return
+ *      The bus, which must be released with releaseBus when the device is closed.
+ */
+//--------------------------------------------------------------------------------------------------
+static Bus_t* acquireBus
+(
+    const char* deviceName
+)
+{
+    char busName[BUS_NAME_BYTES];
+    if (le_utf8_Copy(busName, deviceName, sizeof(busName), NULL) != LE_OK)
+    {
+        LE_WARN("Bus name of %s truncated", deviceName);
+    }
+    char* chipSelect = strrchr(busName, '.');
+    if (strncmp(busName, "spidev", strlen("spidev")) == 0 && chipSelect != NULL)
+    {
+        *chipSelect = '\0';
+    }
+
+    le_dls_Link_t* link = le_dls_Peek(&g.buses);
+    while (link != NULL)
+    {
+        Bus_t* bus = CONTAINER_OF(link, Bus_t, link);
+        if (strcmp(bus->name, busName) == 0)
+        {
+            bus->numDevices++;
+            return bus;
+        }
+        link = le_dls_PeekNext(&g.buses, link);
+    }
+
+    Bus_t* bus = le_mem_ForceAlloc(g.busPool);
+    bus->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+    memcpy(bus->name, busName, sizeof(bus->name));
+    bus->worker = spiWorker_Create(busName);
+    bus->numDevices = 1;
+    le_dls_Queue(&g.buses, &bus->link);
+    return bus;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Releases a bus acquired with acquireBus, stopping its worker thread if no devices remain open
+ * on it.
  */
 //--------------------------------------------------------------------------------------------------
-static bool isDeviceOwnedByCaller
+static void releaseBus
 (
-    const Device_t* device  ///< Device to check the ownership of
+    Bus_t* bus
 )
 {
-    return device->owningSession == spi_GetClientSessionRef();
+    LE_ASSERT(bus->numDevices > 0);
+    bus->numDevices--;
+    if (bus->numDevices == 0)
+    {
+        le_dls_Remove(&g.buses, &bus->link);
+        spiWorker_Destroy(bus->worker);
+        le_mem_Release(bus);
+    }
 }
 
 //--------------------------------------------------------------------------------------------------
 /**
- * Searches for a device which contains the given inode value. It is assumed that there will be
- * either 0 or 1 device containing the given inode.
+ * Searches for an open device which contains the given inode value. It is assumed that there will
+ * be either 0 or 1 device containing the given inode.
  *
  * @return
- *      Handle with the given inode or NULL if a matching handle was not found.
+ *      Device with the given inode or NULL if a matching device was not found.
  */
 //--------------------------------------------------------------------------------------------------
-static Device_t const* findDeviceWithInode
+static Device_t* findDeviceWithInode
 (
     ino_t inode
 )
 {
-    le_ref_IterRef_t it = le_ref_GetIterator(g.deviceHandleRefMap);
-    while (le_ref_NextNode(it) == LE_OK)
+    le_dls_Link_t* link = le_dls_Peek(&g.devices);
+    while (link != NULL)
     {
-        Device_t const* device = le_ref_GetValue(it);
-        LE_ASSERT(device != NULL);
+        Device_t* device = CONTAINER_OF(link, Device_t, link);
         if (device->inode == inode)
         {
             return device;
         }
+        link = le_dls_PeekNext(&g.devices, link);
     }
 
     return NULL;
@@ -397,17 +5647,17 @@ static void closeAllHandlesOwnedByClient
     bool finished = le_ref_NextNode(it) != LE_OK;
     while (!finished)
     {
-        Device_t const* device = le_ref_GetValue(it);
-        LE_ASSERT(device != NULL);
-        // In order to prevent invalidating the iterator, we store the reference of the device we
-        // want to close and advance the iterator before calling spi_Close which will remove the
+        Client_t* client = le_ref_GetValue(it);
+        LE_ASSERT(client != NULL);
+        // In order to prevent invalidating the iterator, we store the reference of the handle we
+        // want to close and advance the iterator before calling closeHandle which will remove the
         // reference from the hashmap.
         spi_DeviceHandleRef_t toClose =
-            (device->owningSession == owner) ? ((void*)le_ref_GetSafeRef(it)) : NULL;
+            (client->owningSession == owner) ? ((void*)le_ref_GetSafeRef(it)) : NULL;
         finished = le_ref_NextNode(it) != LE_OK;
         if (toClose != NULL)
         {
-            spi_Close(toClose);
+            closeHandle(toClose, client, NULL);
         }
     }
 }
@@ -426,14 +5676,361 @@ static void clientSessionClosedHandler
     closeAllHandlesOwnedByClient(clientSession);
 }
 
+//--------------------------------------------------------------------------------------------------
+/**
+ * A handler for flash client disconnects which closes all of the client's flash handles.
+ */
+//--------------------------------------------------------------------------------------------------
+static void flashSessionClosedHandler
+(
+    le_msg_SessionRef_t clientSession,
+    void* context
+)
+{
+    le_ref_IterRef_t it = le_ref_GetIterator(g.flashRefMap);
+    bool finished = le_ref_NextNode(it) != LE_OK;
+    while (!finished)
+    {
+        Flash_t* flash = le_ref_GetValue(it);
+        // Advance before closing, which removes the handle from the map
+        finished = le_ref_NextNode(it) != LE_OK;
+        if (flash->client->owningSession == clientSession)
+        {
+            closeFlash(flash, NULL);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Selects the backend used to reach devices from the SPI_BACKEND environment variable: "spidev"
+ * for the kernel driver or "sim" for the in-process simulator, which serves /dev/sim* devices.
+ */
+//--------------------------------------------------------------------------------------------------
+static void configureBackend
+(
+    void
+)
+{
+    const char* backend = getenv("SPI_BACKEND");
+    if (backend == NULL || strcmp(backend, "spidev") == 0)
+    {
+        spiLib_SetBackend(&spiLib_SpidevBackend);
+    }
+    else if (strcmp(backend, "sim") == 0)
+    {
+        spiLib_SetBackend(&spiLib_SimBackend);
+    }
+    else
+    {
+        LE_WARN("Unknown SPI_BACKEND \"%s\", using spidev", backend);
+        spiLib_SetBackend(&spiLib_SpidevBackend);
+    }
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads the device profiles under "profiles" in the service's configuration tree, opens their
+ * devices and queues the configuration and init sequence of each to its bus worker.  The devices
+ * of different buses are thus prepared in parallel, once the service's event loop is running.
+ *
+ * A profile is a node named after the profile, holding the device name without the "/dev/"
+ * prefix in "device", the configuration in "mode", "bits", "speed" and "msb" as for
+ * spi_Configure, and optionally an init sequence of up to PROFILE_MAX_INIT_WRITES half duplex
+ * writes, each a string of hex bytes in a child of "init", written in order.
+ */
+//--------------------------------------------------------------------------------------------------
+static void loadProfiles
+(
+    void
+)
+{
+    le_cfg_IteratorRef_t it = le_cfg_CreateReadTxn("profiles");
+    for (le_result_t result = le_cfg_GoToFirstChild(it);
+         result == LE_OK;
+         result = le_cfg_GoToNextSibling(it))
+    {
+        Profile_t* profile = le_mem_ForceAlloc(g.profilePool);
+        profile->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+        profile->client = NULL;
+        if (le_cfg_GetNodeName(it, "", profile->name, sizeof(profile->name)) != LE_OK ||
+            findProfile(profile->name) != NULL)
+        {
+            LE_ERROR("Skipping profile with a bad or duplicate name");
+            le_mem_Release(profile);
+            continue;
+        }
+
+        profile->result = loadProfile(it, profile);
+        if (profile->result == LE_OK)
+        {
+            profile->result = openClient(profile->deviceName, NULL, &profile->client);
+        }
+        if (profile->result == LE_OK)
+        {
+            profile->result = LE_BUSY;
+            Client_t* client = profile->client;
+            if (spiWorker_Submit(
+                    client->device->bus->worker,
+                    &client->flow,
+                    &profile->job,
+                    REQUEST_OVERHEAD_COST,
+                    prepareProfile,
+                    completeProfile) != LE_OK)
+            {
+                profile->result = LE_FAULT;
+            }
+        }
+        if (profile->result != LE_BUSY)
+        {
+            LE_ERROR(
+                "Profile %s is unavailable (%s)", profile->name, LE_RESULT_TXT(profile->result));
+        }
+        le_dls_Queue(&g.profiles, &profile->link);
+    }
+    le_cfg_CancelTxn(it);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reads the settings of a profile from its node of the configuration tree.
+ *
+ * @return
+ *      - LE_OK on success
+ *      - LE_BAD_PARAMETER if a setting is missing or invalid
+ */
+//--------------------------------------------------------------------------------------------------
+static le_result_t loadProfile
+(
+    le_cfg_IteratorRef_t it,  ///< Iterator on the profile's node
+    Profile_t* profile        ///< [out] Profile to fill in
+)
+{
+    if (le_cfg_GetString(it, "device", profile->deviceName, sizeof(profile->deviceName), "") !=
+            LE_OK ||
+        profile->deviceName[0] == '\0' ||
+        !le_cfg_NodeExists(it, "speed"))
+    {
+        LE_ERROR("Profile %s needs a device and a speed", profile->name);
+        return LE_BAD_PARAMETER;
+    }
+    profile->config.mode = le_cfg_GetInt(it, "mode", SPI_SPI_MODE_0);
+    profile->config.bits = le_cfg_GetInt(it, "bits", 8);
+    profile->config.speed = le_cfg_GetInt(it, "speed", 0);
+    // As for spi_Configure, false selects MSB first words
+    profile->config.msb = le_cfg_GetBool(it, "msb", false);
+    if ((profile->config.mode & ~(0xFF | SPI_SPI_WIDTHS)) != 0)
+    {
+        LE_ERROR("Invalid SPI mode 0x%x in profile %s", profile->config.mode, profile->name);
+        return LE_BAD_PARAMETER;
+    }
+
+    // The init sequence has its own transaction so that the iterator stays on the profile
+    char initPath[PROFILE_NAME_BYTES + sizeof("profiles//init")];
+    snprintf(initPath, sizeof(initPath), "profiles/%s/init", profile->name);
+    le_cfg_IteratorRef_t initIt = le_cfg_CreateReadTxn(initPath);
+    le_result_t result = LE_OK;
+    profile->numInitWrites = 0;
+    for (le_result_t found = le_cfg_GoToFirstChild(initIt);
+         found == LE_OK && result == LE_OK;
+         found = le_cfg_GoToNextSibling(initIt))
+    {
+        const size_t i = profile->numInitWrites;
+        char hex[2 * SPI_MAX_WRITE_SIZE + 1];
+        int32_t length = -1;
+        if (i < PROFILE_MAX_INIT_WRITES &&
+            le_cfg_GetString(initIt, "", hex, sizeof(hex), "") == LE_OK)
+        {
+            length = le_hex_StringToBinary(
+                hex, strlen(hex), profile->initData[i], sizeof(profile->initData[i]));
+        }
+        if (length <= 0)
+        {
+            LE_ERROR("Invalid init sequence in profile %s", profile->name);
+            result = LE_BAD_PARAMETER;
+        }
+        else
+        {
+            profile->initLengths[i] = length;
+            profile->numInitWrites++;
+        }
+    }
+    le_cfg_CancelTxn(initIt);
+    return result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Configures the device of a profile and writes its init sequence.  Runs on the bus worker.
+ */
+//--------------------------------------------------------------------------------------------------
+static void prepareProfile
+(
+    spiWorker_Job_t* job
+)
+{
+    Profile_t* profile = CONTAINER_OF(job, Profile_t, job);
+    Client_t* client = profile->client;
+
+    le_result_t result = configureOperation(client, &profile->config);
+    for (size_t i = 0; i < profile->numInitWrites && result == LE_OK; i++)
+    {
+        TransferArgs_t args =
+        {
+            .writeData = profile->initData[i],
+            .writeDataLength = profile->initLengths[i]
+        };
+        result = writeHDOperation(client, &args);
+    }
+    profile->prepareResult = result;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Reports the outcome of preparing a profile's device, and closes the device if it failed.  Runs
+ * on the main thread.
+ */
+//--------------------------------------------------------------------------------------------------
+static void completeProfile
+(
+    spiWorker_Job_t* job
+)
+{
+    Profile_t* profile = CONTAINER_OF(job, Profile_t, job);
+    profile->result = profile->prepareResult;
+    if (profile->result == LE_OK)
+    {
+        LE_INFO("Profile %s is ready on %s", profile->name, profile->deviceName);
+        return;
+    }
+
+    LE_ERROR("Couldn't prepare profile %s (%s)", profile->name, LE_RESULT_TXT(profile->result));
+    closeClient(newRequest(profile->client, NULL, respondClose));
+    profile->client = NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Finds a device profile by name.
+ *
+ * @return
+ *      The profile, or NULL if there is none with the given name.
+ */
+//--------------------------------------------------------------------------------------------------
+static Profile_t* findProfile
+(
+    const char* name
+)
+{
+    le_dls_Link_t* link = le_dls_Peek(&g.profiles);
+    while (link != NULL)
+    {
+        Profile_t* profile = CONTAINER_OF(link, Profile_t, link);
+        if (strcmp(profile->name, name) == 0)
+        {
+            return profile;
+        }
+        link = le_dls_PeekNext(&g.profiles, link);
+    }
+    return NULL;
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Applies the trace settings given in the SPI_TRACE_LEVEL, SPI_TRACE_CAPTURE and SPI_BUS_TRACE
+ * environment variables and arranges for SIGUSR1 to dump the captured trace.
+ */
+//--------------------------------------------------------------------------------------------------
+static void configureTrace
+(
+    void
+)
+{
+    const char* level = getenv("SPI_TRACE_LEVEL");
+    if (level == NULL || strcmp(level, "off") == 0)
+    {
+        spiLib_SetTraceLevel(SPILIB_TRACE_OFF);
+    }
+    else if (strcmp(level, "summary") == 0)
+    {
+        spiLib_SetTraceLevel(SPILIB_TRACE_SUMMARY);
+    }
+    else if (strcmp(level, "payload") == 0)
+    {
+        spiLib_SetTraceLevel(SPILIB_TRACE_PAYLOAD);
+    }
+    else
+    {
+        LE_WARN("Unknown SPI_TRACE_LEVEL \"%s\", tracing disabled", level);
+        spiLib_SetTraceLevel(SPILIB_TRACE_OFF);
+    }
+
+    const char* capture = getenv("SPI_TRACE_CAPTURE");
+    spiLib_SetTraceCapture(capture != NULL && strcmp(capture, "1") == 0);
+
+    const char* busTrace = getenv("SPI_BUS_TRACE");
+    if (busTrace != NULL && strcmp(busTrace, "off") != 0)
+    {
+        char* end;
+        const unsigned long payloadBytes = strtoul(busTrace, &end, 10);
+        if (end == busTrace || *end != '\0' || payloadBytes > SPI_BUS_TRACE_MAX_PAYLOAD ||
+            spiLib_SetBusTrace(true, payloadBytes) != LE_OK)
+        {
+            LE_WARN("Invalid SPI_BUS_TRACE \"%s\", bus trace disabled", busTrace);
+        }
+    }
+
+    le_sig_Block(SIGUSR1);
+    le_sig_SetEventHandler(SIGUSR1, dumpTraceSignalHandler);
+}
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Writes the captured transfer trace to the log when SIGUSR1 is received.
+ */
+//--------------------------------------------------------------------------------------------------
+static void dumpTraceSignalHandler
+(
+    int sigNum
+)
+{
+    spiLib_DumpTrace();
+}
+
 COMPONENT_INIT
 {
     LE_DEBUG("spiServiceComponent initializing");
 
     g.devicePool = le_mem_CreatePool("SPI Pool", sizeof(Device_t));
+    g.devices = (le_dls_List_t)LE_DLS_LIST_INIT;
+    g.clientPool = le_mem_CreatePool("SPI Clients", sizeof(Client_t));
     const size_t maxExpectedDevice = 8;
     g.deviceHandleRefMap = le_ref_CreateMap("SPI handles", maxExpectedDevice);
+    g.requestPool = le_mem_CreatePool("SPI Requests", sizeof(Request_t));
+    g.asyncRequestPool = le_mem_CreatePool("SPI Async Requests", sizeof(AsyncRequest_t));
+    g.busPool = le_mem_CreatePool("SPI Buses", sizeof(Bus_t));
+    g.buses = (le_dls_List_t)LE_DLS_LIST_INIT;
+    g.subscriptionPool = le_mem_CreatePool("SPI Subscriptions", sizeof(Subscription_t));
+    g.samplerRefMap = le_ref_CreateMap("SPI samplers", maxExpectedDevice);
+    g.capturePool = le_mem_CreatePool("SPI Captures", sizeof(Capture_t));
+    g.captureRefMap = le_ref_CreateMap("SPI captures", maxExpectedDevice);
+    g.programPool = le_mem_CreatePool("SPI Programs", sizeof(Program_t));
+    g.programRefMap = le_ref_CreateMap("SPI programs", maxExpectedDevice);
+    g.flashPool = le_mem_CreatePool("SPI Flashes", sizeof(Flash_t));
+    g.flashRefMap = le_ref_CreateMap("SPI flashes", maxExpectedDevice);
+
+    spiWorker_Init();
+    spiSampler_Init();
+    spiCapture_Init();
+
+    configureBackend();
+    g.profilePool = le_mem_CreatePool("SPI Profiles", sizeof(Profile_t));
+    g.profiles = (le_dls_List_t)LE_DLS_LIST_INIT;
+    loadProfiles();
 
     // Register a handler to be notified when clients disconnect
     le_msg_AddServiceCloseHandler(spi_GetServiceRef(), clientSessionClosedHandler, NULL);
+    le_msg_AddServiceCloseHandler(spiFlash_GetServiceRef(), flashSessionClosedHandler, NULL);
+
+    configureTrace();
 }
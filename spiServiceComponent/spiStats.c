@@ -0,0 +1,261 @@
+#include "legato.h"
+#include "spiStats.h"
+
+// Counters are only ever written by one thread at a time, so relaxed ordering is enough to keep
+// readers from seeing torn values
+#define STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define STAT_CLEAR(counter) __atomic_store_n(&(counter), 0, __ATOMIC_RELAXED)
+
+
+static size_t histogramBucket(uint64_t usecs);
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Zeroes all of the counters.  Updates made concurrently by the worker thread may be lost.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiStats_Reset
+(
+    spiStats_t* stats   ///< Counters to reset
+)
+{
+    for (size_t i = 0; i < SPISTATS_NUM_TRANSFER_TYPES; i++)
+    {
+        STAT_CLEAR(stats->transfers[i]);
+    }
+    STAT_CLEAR(stats->txBytes);
+    STAT_CLEAR(stats->rxBytes);
+    STAT_CLEAR(stats->failures);
+    STAT_CLEAR(stats->queueWaitUsecs);
+    STAT_CLEAR(stats->busUsecs);
+    STAT_CLEAR(stats->pollsReady);
+    STAT_CLEAR(stats->pollsTimedOut);
+    STAT_CLEAR(stats->pollReadyUsecs);
+    STAT_CLEAR(stats->recoveries);
+    STAT_CLEAR(stats->recoveryUsecs);
+    STAT_CLEAR(stats->crcErrors);
+    STAT_CLEAR(stats->crcRetries);
+    STAT_CLEAR(stats->crcFailures);
+    for (size_t i = 0; i < SPISTATS_HISTOGRAM_BUCKETS; i++)
+    {
+        STAT_CLEAR(stats->queueWaitHistogram[i]);
+        STAT_CLEAR(stats->busTimeHistogram[i]);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Counts a transfer and the bytes it moved.  Bytes are only counted for successful transfers.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiStats_CountTransfer
+(
+    spiStats_t* stats,              ///< Counters to update
+    spiStats_TransferType_t type,   ///< Kind of transfer
+    size_t txBytes,                 ///< Bytes transmitted
+    size_t rxBytes,                 ///< Bytes received
+    le_result_t result              ///< Outcome of the transfer
+)
+{
+    STAT_ADD(stats->transfers[type], 1);
+    if (result == LE_OK)
+    {
+        STAT_ADD(stats->txBytes, txBytes);
+        STAT_ADD(stats->rxBytes, rxBytes);
+    }
+    else
+    {
+        STAT_ADD(stats->failures, 1);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records how long a request waited for the bus and how long it took once started.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiStats_RecordRequest
+(
+    spiStats_t* stats,          ///< Counters to update
+    uint64_t queueWaitUsecs,    ///< Time from submission until the request was started
+    uint64_t busUsecs           ///< Time the request took to perform
+)
+{
+    STAT_ADD(stats->queueWaitUsecs, queueWaitUsecs);
+    STAT_ADD(stats->busUsecs, busUsecs);
+    STAT_ADD(stats->queueWaitHistogram[histogramBucket(queueWaitUsecs)], 1);
+    STAT_ADD(stats->busTimeHistogram[histogramBucket(busUsecs)], 1);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Counts a poll: each attempt as a transfer, and the outcome with the time the device took to
+ * become ready.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiStats_RecordPoll
+(
+    spiStats_t* stats,          ///< Counters to update
+    uint32_t attempts,          ///< Number of attempts made
+    size_t commandLength,       ///< Bytes transmitted by each attempt
+    uint32_t elapsedUsecs,      ///< Time from the first attempt until the last finished
+    le_result_t result          ///< Outcome of the poll
+)
+{
+    STAT_ADD(stats->transfers[SPISTATS_POLL], attempts);
+    // Every attempt but the last succeeded
+    const uint32_t completedAttempts = (result == LE_FAULT) ? (attempts - 1) : attempts;
+    STAT_ADD(stats->txBytes, completedAttempts * commandLength);
+    STAT_ADD(stats->rxBytes, completedAttempts);
+    switch (result)
+    {
+        case LE_OK:
+            STAT_ADD(stats->pollsReady, 1);
+            STAT_ADD(stats->pollReadyUsecs, elapsedUsecs);
+            break;
+
+        case LE_TIMEOUT:
+            STAT_ADD(stats->pollsTimedOut, 1);
+            break;
+
+        default:
+            STAT_ADD(stats->failures, 1);
+            break;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records the reopening of a device after a failed transfer.  A reopen which fails counts as a
+ * failure.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiStats_RecordRecovery
+(
+    spiStats_t* stats,          ///< Counters to update
+    uint64_t usecs,             ///< Time taken to reopen and reconfigure the device
+    le_result_t result          ///< Outcome of the recovery
+)
+{
+    if (result == LE_OK)
+    {
+        STAT_ADD(stats->recoveries, 1);
+        STAT_ADD(stats->recoveryUsecs, usecs);
+    }
+    else
+    {
+        STAT_ADD(stats->failures, 1);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Records the check of the frames received by a transfer.  Transfers with bad frames count as
+ * retried or, if they won't be repeated, as failed.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiStats_RecordFrameCheck
+(
+    spiStats_t* stats,          ///< Counters to update
+    size_t badFrames,           ///< Frames which failed their CRC
+    bool retry                  ///< The transfer will be repeated
+)
+{
+    if (badFrames == 0)
+    {
+        return;
+    }
+    STAT_ADD(stats->crcErrors, badFrames);
+    if (retry)
+    {
+        STAT_ADD(stats->crcRetries, 1);
+    }
+    else
+    {
+        STAT_ADD(stats->crcFailures, 1);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Adds a snapshot of one set of counters to another.  The total must not be updated concurrently.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiStats_Add
+(
+    spiStats_t* total,          ///< Counters to add to
+    const spiStats_t* stats     ///< Counters to add
+)
+{
+    for (size_t i = 0; i < SPISTATS_NUM_TRANSFER_TYPES; i++)
+    {
+        total->transfers[i] += STAT_LOAD(stats->transfers[i]);
+    }
+    total->txBytes += STAT_LOAD(stats->txBytes);
+    total->rxBytes += STAT_LOAD(stats->rxBytes);
+    total->failures += STAT_LOAD(stats->failures);
+    total->queueWaitUsecs += STAT_LOAD(stats->queueWaitUsecs);
+    total->busUsecs += STAT_LOAD(stats->busUsecs);
+    total->pollsReady += STAT_LOAD(stats->pollsReady);
+    total->pollsTimedOut += STAT_LOAD(stats->pollsTimedOut);
+    total->pollReadyUsecs += STAT_LOAD(stats->pollReadyUsecs);
+    total->recoveries += STAT_LOAD(stats->recoveries);
+    total->recoveryUsecs += STAT_LOAD(stats->recoveryUsecs);
+    total->crcErrors += STAT_LOAD(stats->crcErrors);
+    total->crcRetries += STAT_LOAD(stats->crcRetries);
+    total->crcFailures += STAT_LOAD(stats->crcFailures);
+    for (size_t i = 0; i < SPISTATS_HISTOGRAM_BUCKETS; i++)
+    {
+        total->queueWaitHistogram[i] += STAT_LOAD(stats->queueWaitHistogram[i]);
+        total->busTimeHistogram[i] += STAT_LOAD(stats->busTimeHistogram[i]);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the monotonic time used to measure requests.
+ *
+ * @return
+ *      Microseconds since an arbitrary point in the past.
+ */
+//--------------------------------------------------------------------------------------------------
+uint64_t spiStats_NowUsecs
+(
+    void
+)
+{
+    const le_clk_Time_t now = le_clk_GetRelativeTime();
+    return ((uint64_t)now.sec * 1000000) + now.usec;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the histogram bucket counting a time.
+ *
+ * @return
+ *      The bucket index.
+ */
+//--------------------------------------------------------------------------------------------------
+static size_t histogramBucket
+(
+    uint64_t usecs
+)
+{
+    if (usecs == 0)
+    {
+        return 0;
+    }
+    // Number of significant bits, so 1 usec is bucket 1, 2-3 usecs bucket 2 and so on
+    const size_t bucket = 64 - __builtin_clzll(usecs);
+    return (bucket < SPISTATS_HISTOGRAM_BUCKETS) ? bucket : (SPISTATS_HISTOGRAM_BUCKETS - 1);
+}
@@ -0,0 +1,76 @@
+#ifndef SPI_STATS_H
+#define SPI_STATS_H
+
+#include "legato.h"
+
+// Number of buckets in a latency histogram.  Bucket 0 counts times under 1 usec and bucket i
+// times from 2^(i-1) up to 2^i usecs; the last bucket also counts all longer times.
+#define SPISTATS_HISTOGRAM_BUCKETS 24
+
+// Kinds of transfer counted separately
+typedef enum
+{
+    SPISTATS_WRITE_READ_HD,
+    SPISTATS_WRITE_HD,
+    SPISTATS_WRITE_READ_FD,
+    SPISTATS_READ_HD,
+    SPISTATS_TRANSACTION,
+    SPISTATS_STREAM,
+    SPISTATS_ASYNC,
+    SPISTATS_SAMPLE,
+    SPISTATS_POLL,             ///< Counts each attempt of a poll
+    SPISTATS_BURST,            ///< Counts each append to a burst
+    SPISTATS_CAPTURE,
+    SPISTATS_NUM_TRANSFER_TYPES
+} spiStats_TransferType_t;
+
+// Performance counters of one handle.  Counters are updated with relaxed atomic operations, so
+// the worker thread never takes a lock to update them and other threads can read them at any
+// time.  All fields are private to spiStats.c.
+typedef struct
+{
+    uint64_t transfers[SPISTATS_NUM_TRANSFER_TYPES];
+    uint64_t txBytes;
+    uint64_t rxBytes;
+    uint64_t failures;              ///< Transfers which failed in the driver
+    uint64_t queueWaitUsecs;        ///< Total time requests waited for the bus
+    uint64_t busUsecs;              ///< Total time requests took once started
+    uint64_t pollsReady;            ///< Polls which saw the device become ready
+    uint64_t pollsTimedOut;
+    uint64_t pollReadyUsecs;        ///< Total time ready polls took
+    uint64_t recoveries;            ///< Devices reopened after a failed transfer
+    uint64_t recoveryUsecs;         ///< Total time reopening and reconfiguring took
+    uint64_t crcErrors;             ///< Received frames which failed their CRC
+    uint64_t crcRetries;            ///< Transfers repeated because frames failed their CRC
+    uint64_t crcFailures;           ///< Transfers whose frames still failed after every retry
+    uint64_t queueWaitHistogram[SPISTATS_HISTOGRAM_BUCKETS];
+    uint64_t busTimeHistogram[SPISTATS_HISTOGRAM_BUCKETS];
+} spiStats_t;
+
+void spiStats_Reset(spiStats_t* stats);
+
+void spiStats_CountTransfer(
+    spiStats_t* stats,
+    spiStats_TransferType_t type,
+    size_t txBytes,
+    size_t rxBytes,
+    le_result_t result);
+
+void spiStats_RecordRequest(spiStats_t* stats, uint64_t queueWaitUsecs, uint64_t busUsecs);
+
+void spiStats_RecordPoll(
+    spiStats_t* stats,
+    uint32_t attempts,
+    size_t commandLength,
+    uint32_t elapsedUsecs,
+    le_result_t result);
+
+void spiStats_RecordRecovery(spiStats_t* stats, uint64_t usecs, le_result_t result);
+
+void spiStats_RecordFrameCheck(spiStats_t* stats, size_t badFrames, bool retry);
+
+void spiStats_Add(spiStats_t* total, const spiStats_t* stats);
+
+uint64_t spiStats_NowUsecs(void);
+
+#endif  // SPI_STATS_H
@@ -0,0 +1,511 @@
+#include "legato.h"
+#include "spiWorker.h"
+
+// Virtual time charged per byte of cost to a flow of weight 1
+#define VIRTUAL_TIME_PER_COST 1024
+
+// A thread which performs the jobs submitted to it one at a time, choosing between the flows
+// with queued jobs by priority and weighted fair share
+typedef struct spiWorker
+{
+    le_thread_Ref_t thread;
+    // Protects the flows, their queues and the virtual time
+    le_mutex_Ref_t mutex;
+    // Flows with at least one job waiting to be performed
+    le_dls_List_t activeFlows;
+    // Start tag of the job most recently started
+    uint64_t virtualTime;
+    // Flow which has the bus to itself, or NULL
+    spiWorker_Flow_t* reservedFlow;
+    // Calls of processQueue which found only jobs held back by the reservation
+    size_t deferredRuns;
+    // Posted by the worker thread once it is ready to accept jobs
+    le_sem_Ref_t started;
+} Worker_t;
+
+
+static void* workerMain(void* context);
+static void processQueue(void* param1, void* param2);
+static void completeJob(void* param1, void* param2);
+static void exitWorker(void* param1, void* param2);
+static void enqueueJob(Worker_t* worker, spiWorker_Flow_t* flow, spiWorker_Job_t* job, size_t cost);
+static spiWorker_Job_t* dequeueJob(Worker_t* worker);
+
+static struct
+{
+    // Memory pool for allocating workers
+    le_mem_PoolRef_t workerPool;
+} g;
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Creates a worker and starts its thread.
+ *
+ * @return
+ *      The new worker.
+ */
+//--------------------------------------------------------------------------------------------------
+spiWorker_Ref_t spiWorker_Create
+(
+    const char* name      ///< Name for the worker thread
+)
+{
+    Worker_t* worker = le_mem_ForceAlloc(g.workerPool);
+    worker->mutex = le_mutex_CreateNonRecursive(name);
+    worker->activeFlows = (le_dls_List_t)LE_DLS_LIST_INIT;
+    worker->virtualTime = 0;
+    worker->reservedFlow = NULL;
+    worker->deferredRuns = 0;
+    worker->started = le_sem_Create(name, 0);
+
+    worker->thread = le_thread_Create(name, workerMain, worker);
+    le_thread_SetJoinable(worker->thread);
+    le_thread_Start(worker->thread);
+    le_sem_Wait(worker->started);
+
+    return worker;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Stops a worker once all of the jobs already submitted to it have been performed and frees it.
+ *
+ * @note
+ *      Completion functions of jobs may still be pending on the submitting thread when this
+ *      returns.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_Destroy
+(
+    spiWorker_Ref_t worker  ///< Worker to destroy
+)
+{
+    // Functions queued to the worker run in order, so every job submitted before this point is
+    // processed before the thread exits.
+    le_event_QueueFunctionToThread(worker->thread, exitWorker, NULL, NULL);
+    le_thread_Join(worker->thread, NULL);
+
+    LE_ASSERT(le_dls_IsEmpty(&worker->activeFlows));
+    le_sem_Delete(worker->started);
+    le_mutex_Delete(worker->mutex);
+    le_mem_Release(worker);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes a flow with the default priority and weight.  A flow must have no queued jobs when
+ * it is freed, which is guaranteed once the last job submitted on it has been completed.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_InitFlow
+(
+    spiWorker_Flow_t* flow,   ///< Flow to initialize
+    size_t maxQueuedJobs      ///< Maximum number of asynchronous jobs that may be outstanding
+)
+{
+    flow->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+    flow->jobs = (le_dls_List_t)LE_DLS_LIST_INIT;
+    flow->asyncJobs = 0;
+    flow->maxAsyncJobs = maxQueuedJobs;
+    flow->queuedJobs = 0;
+    flow->peakQueuedJobs = 0;
+    flow->priority = SPIWORKER_DEFAULT_PRIORITY;
+    flow->weight = SPIWORKER_DEFAULT_WEIGHT;
+    flow->lastFinishTag = 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Changes the priority and weight of a flow.  Jobs already queued keep their place.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_SetFlowScheduling
+(
+    spiWorker_Ref_t worker,   ///< Worker the flow submits to
+    spiWorker_Flow_t* flow,   ///< Flow to change
+    uint8_t priority,         ///< SPIWORKER_MIN_PRIORITY to SPIWORKER_MAX_PRIORITY
+    uint32_t weight           ///< Relative share of the worker; must be non-zero
+)
+{
+    LE_ASSERT(priority <= SPIWORKER_MAX_PRIORITY && weight > 0);
+
+    le_mutex_Lock(worker->mutex);
+    flow->priority = priority;
+    flow->weight = weight;
+    le_mutex_Unlock(worker->mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the largest number of jobs that have waited on a flow at once since the flow was
+ * initialized or the peak was last reset.
+ *
+ * @return
+ *      The peak queue depth.
+ */
+//--------------------------------------------------------------------------------------------------
+size_t spiWorker_GetPeakQueueDepth
+(
+    spiWorker_Ref_t worker,   ///< Worker the flow submits to
+    spiWorker_Flow_t* flow    ///< Flow to query
+)
+{
+    le_mutex_Lock(worker->mutex);
+    const size_t peak = flow->peakQueuedJobs;
+    le_mutex_Unlock(worker->mutex);
+    return peak;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Restarts tracking of a flow's peak queue depth from its current depth.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_ResetPeakQueueDepth
+(
+    spiWorker_Ref_t worker,   ///< Worker the flow submits to
+    spiWorker_Flow_t* flow    ///< Flow to reset
+)
+{
+    le_mutex_Lock(worker->mutex);
+    flow->peakQueuedJobs = flow->queuedJobs;
+    le_mutex_Unlock(worker->mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Submits a job to be performed asynchronously.  Once run has been called on the worker thread,
+ * complete is called on the submitting thread, which must be running an event loop.
+ *
+ * @return
+ *      - LE_OK if the job was queued
+ *      - LE_BUSY if the flow already has its maximum number of asynchronous jobs
+ */
+//--------------------------------------------------------------------------------------------------
+le_result_t spiWorker_Submit
+(
+    spiWorker_Ref_t worker,          ///< Worker to perform the job
+    spiWorker_Flow_t* flow,          ///< Flow to submit the job on
+    spiWorker_Job_t* job,            ///< Job to perform; must remain valid until complete is called
+    size_t cost,                     ///< Relative amount of bus time the job uses, e.g. in bytes
+    spiWorker_JobFunc_t run,         ///< Performs the job on the worker thread
+    spiWorker_JobFunc_t complete     ///< Called on the submitting thread after run
+)
+{
+    job->run = run;
+    job->complete = complete;
+    job->submitter = le_thread_GetCurrent();
+    job->limited = true;
+    job->usesBus = true;
+
+    le_mutex_Lock(worker->mutex);
+    if (flow->asyncJobs >= flow->maxAsyncJobs)
+    {
+        le_mutex_Unlock(worker->mutex);
+        return LE_BUSY;
+    }
+    flow->asyncJobs++;
+    enqueueJob(worker, flow, job, cost);
+    le_mutex_Unlock(worker->mutex);
+
+    le_event_QueueFunctionToThread(worker->thread, processQueue, worker, NULL);
+    return LE_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Submits a job on behalf of a caller which waits for its completion, e.g. a client whose reply is
+ * sent by complete.  Such jobs are not subject to the limit on asynchronous jobs, as a client
+ * thread only has one call outstanding at a time.  The job is queued behind any jobs already
+ * submitted on the same flow, so it also acts as a barrier for the flow.  Jobs which don't use the
+ * bus are not held back by a reservation, so housekeeping of any flow can still be done during one.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_Post
+(
+    spiWorker_Ref_t worker,          ///< Worker to perform the job
+    spiWorker_Flow_t* flow,          ///< Flow to submit the job on
+    spiWorker_Job_t* job,            ///< Job to perform; must remain valid until complete is called
+    size_t cost,                     ///< Relative amount of bus time the job uses, e.g. in bytes
+    spiWorker_JobFunc_t run,         ///< Performs the job on the worker thread
+    spiWorker_JobFunc_t complete,    ///< Called on the submitting thread after run
+    bool usesBus                     ///< False for housekeeping, which may run during a reservation
+)
+{
+    job->run = run;
+    job->complete = complete;
+    job->submitter = le_thread_GetCurrent();
+    job->limited = false;
+    job->usesBus = usesBus;
+
+    le_mutex_Lock(worker->mutex);
+    enqueueJob(worker, flow, job, cost);
+    le_mutex_Unlock(worker->mutex);
+
+    le_event_QueueFunctionToThread(worker->thread, processQueue, worker, NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gives a flow the bus to itself.  Until the reservation is released, jobs of other flows which
+ * use the bus are held back.  Must be called on the worker thread, by a job of the flow.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_Reserve
+(
+    spiWorker_Ref_t worker,   ///< Worker to reserve
+    spiWorker_Flow_t* flow    ///< Flow to reserve it for
+)
+{
+    le_mutex_Lock(worker->mutex);
+    LE_ASSERT(worker->reservedFlow == NULL);
+    worker->reservedFlow = flow;
+    le_mutex_Unlock(worker->mutex);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Releases a reservation and lets the jobs it held back run.  Must be called on the worker
+ * thread.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_Unreserve
+(
+    spiWorker_Ref_t worker    ///< Reserved worker
+)
+{
+    le_mutex_Lock(worker->mutex);
+    worker->reservedFlow = NULL;
+    const size_t deferredRuns = worker->deferredRuns;
+    worker->deferredRuns = 0;
+    le_mutex_Unlock(worker->mutex);
+
+    for (size_t i = 0; i < deferredRuns; i++)
+    {
+        le_event_QueueFunctionToThread(worker->thread, processQueue, worker, NULL);
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Gets the flow a worker is reserved for.  May be called from any thread.
+ *
+ * @return
+ *      The flow, or NULL if the worker isn't reserved.
+ */
+//--------------------------------------------------------------------------------------------------
+spiWorker_Flow_t* spiWorker_GetReservation
+(
+    spiWorker_Ref_t worker    ///< Worker to query
+)
+{
+    le_mutex_Lock(worker->mutex);
+    spiWorker_Flow_t* flow = worker->reservedFlow;
+    le_mutex_Unlock(worker->mutex);
+    return flow;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Main function of a worker thread.
+ */
+//--------------------------------------------------------------------------------------------------
+static void* workerMain
+(
+    void* context
+)
+{
+    Worker_t* worker = context;
+
+    le_sem_Post(worker->started);
+    le_event_RunLoop();
+
+    return NULL;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Adds a job to a flow's queue and assigns it its virtual start time.  Must be called with the
+ * worker's mutex held.
+ */
+//--------------------------------------------------------------------------------------------------
+static void enqueueJob
+(
+    Worker_t* worker,
+    spiWorker_Flow_t* flow,
+    spiWorker_Job_t* job,
+    size_t cost
+)
+{
+    // Start-time fair queuing: a job may start at the later of the current virtual time and the
+    // finish of the flow's previous job, and finishes after its cost scaled by the flow's weight.
+    job->startTag = (flow->lastFinishTag > worker->virtualTime) ?
+                    flow->lastFinishTag : worker->virtualTime;
+    flow->lastFinishTag = job->startTag + ((uint64_t)cost * VIRTUAL_TIME_PER_COST) / flow->weight;
+    job->flow = flow;
+    job->link = (le_dls_Link_t)LE_DLS_LINK_INIT;
+
+    if (le_dls_IsEmpty(&flow->jobs))
+    {
+        le_dls_Queue(&worker->activeFlows, &flow->link);
+    }
+    le_dls_Queue(&flow->jobs, &job->link);
+    flow->queuedJobs++;
+    if (flow->queuedJobs > flow->peakQueuedJobs)
+    {
+        flow->peakQueuedJobs = flow->queuedJobs;
+    }
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Removes the next job to perform from its flow.  That is the head job with the smallest start
+ * tag among the highest priority flows with queued jobs, leaving out jobs held back by a
+ * reservation.  Must be called with the worker's mutex held.
+ *
+ * @return
+ *      The job, or NULL if no jobs may run.
+ */
+//--------------------------------------------------------------------------------------------------
+static spiWorker_Job_t* dequeueJob
+(
+    Worker_t* worker
+)
+{
+    spiWorker_Flow_t* bestFlow = NULL;
+    spiWorker_Job_t* bestJob = NULL;
+
+    le_dls_Link_t* link = le_dls_Peek(&worker->activeFlows);
+    while (link != NULL)
+    {
+        spiWorker_Flow_t* flow = CONTAINER_OF(link, spiWorker_Flow_t, link);
+        spiWorker_Job_t* head = CONTAINER_OF(le_dls_Peek(&flow->jobs), spiWorker_Job_t, link);
+        const bool heldBack = worker->reservedFlow != NULL &&
+                              flow != worker->reservedFlow &&
+                              head->usesBus;
+        if (!heldBack &&
+            (bestFlow == NULL ||
+             flow->priority > bestFlow->priority ||
+             (flow->priority == bestFlow->priority && head->startTag < bestJob->startTag)))
+        {
+            bestFlow = flow;
+            bestJob = head;
+        }
+        link = le_dls_PeekNext(&worker->activeFlows, link);
+    }
+
+    if (bestFlow != NULL)
+    {
+        le_dls_Pop(&bestFlow->jobs);
+        bestFlow->queuedJobs--;
+        if (le_dls_IsEmpty(&bestFlow->jobs))
+        {
+            le_dls_Remove(&worker->activeFlows, &bestFlow->link);
+        }
+        if (bestJob->startTag > worker->virtualTime)
+        {
+            worker->virtualTime = bestJob->startTag;
+        }
+    }
+
+    return bestJob;
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Performs the next job chosen by the scheduler.  Queued once for every submitted job.  If every
+ * queued job is held back by a reservation, the call is counted and repeated when the
+ * reservation is released.
+ */
+//--------------------------------------------------------------------------------------------------
+static void processQueue
+(
+    void* param1,
+    void* param2
+)
+{
+    Worker_t* worker = param1;
+
+    le_mutex_Lock(worker->mutex);
+    spiWorker_Job_t* job = dequeueJob(worker);
+    if (job == NULL)
+    {
+        LE_ASSERT(worker->reservedFlow != NULL);
+        worker->deferredRuns++;
+    }
+    le_mutex_Unlock(worker->mutex);
+    if (job == NULL)
+    {
+        return;
+    }
+
+    job->run(job);
+
+    if (job->limited)
+    {
+        le_mutex_Lock(worker->mutex);
+        job->flow->asyncJobs--;
+        le_mutex_Unlock(worker->mutex);
+    }
+    le_event_QueueFunctionToThread(job->submitter, completeJob, job, NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Calls the completion function of a job on the thread which submitted it.
+ */
+//--------------------------------------------------------------------------------------------------
+static void completeJob
+(
+    void* param1,
+    void* param2
+)
+{
+    spiWorker_Job_t* job = param1;
+    job->complete(job);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Ends the worker thread it is queued to.
+ */
+//--------------------------------------------------------------------------------------------------
+static void exitWorker
+(
+    void* param1,
+    void* param2
+)
+{
+    le_thread_Exit(NULL);
+}
+
+
+//--------------------------------------------------------------------------------------------------
+/**
+ * Initializes the worker module.  Must be called before any worker is created.
+ */
+//--------------------------------------------------------------------------------------------------
+void spiWorker_Init
+(
+    void
+)
+{
+    g.workerPool = le_mem_CreatePool("SPI Workers", sizeof(Worker_t));
+}
@@ -0,0 +1,91 @@
+#ifndef SPI_WORKER_H
+#define SPI_WORKER_H
+
+#include "legato.h"
+
+// Lowest and highest flow priorities.  Jobs of higher priority flows are always performed first.
+#define SPIWORKER_MIN_PRIORITY 0
+#define SPIWORKER_MAX_PRIORITY 7
+#define SPIWORKER_DEFAULT_PRIORITY 3
+// Weight of a flow which hasn't been given one.  Flows of equal priority share the worker in
+// proportion to their weights.
+#define SPIWORKER_DEFAULT_WEIGHT 16
+
+typedef struct spiWorker* spiWorker_Ref_t;
+typedef struct spiWorker_Job spiWorker_Job_t;
+
+typedef void (*spiWorker_JobFunc_t)(spiWorker_Job_t* job);
+
+// A queue of jobs from one client.  A worker serves the flows that have jobs queued in strict
+// priority order and, between flows of the same priority, by start-time fair queuing weighted by
+// each flow's weight.  All fields are private to spiWorker.c.
+typedef struct
+{
+    le_dls_Link_t link;        ///< Link in the worker's list of flows with queued jobs
+    le_dls_List_t jobs;        ///< Jobs waiting to be performed, oldest first
+    size_t asyncJobs;          ///< Asynchronous jobs queued or running
+    size_t maxAsyncJobs;       ///< Limit on asyncJobs
+    size_t queuedJobs;         ///< Jobs waiting to be performed
+    size_t peakQueuedJobs;     ///< Largest value of queuedJobs since the last reset
+    uint8_t priority;
+    uint32_t weight;
+    uint64_t lastFinishTag;    ///< Virtual finish time of the most recently queued job
+} spiWorker_Flow_t;
+
+// A unit of work for a worker thread.  Jobs are embedded in larger request structures and
+// recovered with CONTAINER_OF.
+struct spiWorker_Job
+{
+    le_dls_Link_t link;             ///< Link in the flow's queue
+    spiWorker_JobFunc_t run;        ///< Performs the job on the worker thread
+    spiWorker_JobFunc_t complete;   ///< Called on the submitting thread after run; may release
+                                    ///  the job
+    le_thread_Ref_t submitter;      ///< Thread that submitted the job
+    bool limited;                   ///< Counts against the flow's limit on asynchronous jobs
+    bool usesBus;                   ///< Held back while another flow has the bus reserved
+    spiWorker_Flow_t* flow;         ///< Flow the job was submitted on
+    uint64_t startTag;              ///< Virtual time at which the job becomes eligible
+};
+
+spiWorker_Ref_t spiWorker_Create(const char* name);
+
+void spiWorker_Destroy(spiWorker_Ref_t worker);
+
+void spiWorker_InitFlow(spiWorker_Flow_t* flow, size_t maxQueuedJobs);
+
+void spiWorker_SetFlowScheduling(
+    spiWorker_Ref_t worker,
+    spiWorker_Flow_t* flow,
+    uint8_t priority,
+    uint32_t weight);
+
+size_t spiWorker_GetPeakQueueDepth(spiWorker_Ref_t worker, spiWorker_Flow_t* flow);
+
+void spiWorker_ResetPeakQueueDepth(spiWorker_Ref_t worker, spiWorker_Flow_t* flow);
+
+le_result_t spiWorker_Submit(
+    spiWorker_Ref_t worker,
+    spiWorker_Flow_t* flow,
+    spiWorker_Job_t* job,
+    size_t cost,
+    spiWorker_JobFunc_t run,
+    spiWorker_JobFunc_t complete);
+
+void spiWorker_Post(
+    spiWorker_Ref_t worker,
+    spiWorker_Flow_t* flow,
+    spiWorker_Job_t* job,
+    size_t cost,
+    spiWorker_JobFunc_t run,
+    spiWorker_JobFunc_t complete,
+    bool usesBus);
+
+void spiWorker_Reserve(spiWorker_Ref_t worker, spiWorker_Flow_t* flow);
+
+void spiWorker_Unreserve(spiWorker_Ref_t worker);
+
+spiWorker_Flow_t* spiWorker_GetReservation(spiWorker_Ref_t worker);
+
+void spiWorker_Init(void);
+
+#endif  // SPI_WORKER_H